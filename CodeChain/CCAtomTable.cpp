@@ -6,7 +6,8 @@
 
 static CObjectClass<CCAtomTable>g_Class(OBJID_CCATOMTABLE, NULL);
 
-CCAtomTable::CCAtomTable (void) : ICCAtom(&g_Class)
+CCAtomTable::CCAtomTable (void) : ICCAtom(&g_Class),
+		m_Table(DictionarySorted)
 
 //	CCAtomTable constructor
 
@@ -21,18 +22,16 @@ ICCItem *CCAtomTable::AddEntry (CCodeChain *pCC, ICCItem *pAtom, ICCItem *pEntry
 //	True for success.
 
 	{
-	ICCItem *pPrevEntry = NULL;
-	int iOldEntry;
 	bool bAdded;
-
-	if (m_Table.ReplaceEntry(pAtom->GetIntegerValue(), (int)pEntry->Reference(), true, &bAdded, &iOldEntry) != NOERROR)
-		return pCC->CreateMemoryError();
+	ICCItem **ppSlot = m_Table.SetAt(pAtom->GetIntegerValue(), &bAdded);
 
 	//	If we have a previous entry, decrement its refcount since we're
 	//	throwing it away
 
-	pPrevEntry = (ICCItem *)iOldEntry;
-	if (!bAdded && pPrevEntry)
+	ICCItem *pPrevEntry = (bAdded ? NULL : *ppSlot);
+	*ppSlot = pEntry->Reference();
+
+	if (pPrevEntry)
 		pPrevEntry->Discard(pCC);
 
 	SetModified();
@@ -63,18 +62,11 @@ void CCAtomTable::DestroyItem (CCodeChain *pCC)
 	//	Release all the entries
 
 	for (i = 0; i < m_Table.GetCount(); i++)
-		{
-		int iKey, iValue;
-		ICCItem *pItem;
-
-		m_Table.GetEntry(i, &iKey, &iValue);
-		pItem = (ICCItem *)iValue;
-		pItem->Discard(pCC);
-		}
+		m_Table.GetValue(i)->Discard(pCC);
 
 	//	Remove all symbols
 
-	m_Table.RemoveAll();
+	m_Table.DeleteAll();
 
 	//	Destroy this item
 
@@ -110,13 +102,10 @@ ICCItem *CCAtomTable::ListSymbols (CCodeChain *pCC)
 		for (i = 0; i < m_Table.GetCount(); i++)
 			{
 			ICCItem *pItem;
-			int iKey;
-
-			m_Table.GetEntry(i, &iKey, NULL);
 
 			//	Make an item for the symbol
 
-			pItem = pCC->CreateInteger(iKey);
+			pItem = pCC->CreateInteger(m_Table.GetKey(i));
 
 			//	Add the item to the list
 
@@ -147,24 +136,16 @@ ICCItem *CCAtomTable::LookupEx (CCodeChain *pCC, ICCItem *pAtom, bool *retbFound
 //	Association is found, returns an error
 
 	{
-	ALERROR error;
-	int iValue;
 	ICCItem *pBinding;
 
-	if (error = m_Table.Find(pAtom->GetIntegerValue(), &iValue))
+	if (!m_Table.Find(pAtom->GetIntegerValue(), &pBinding))
 		{
-		if (error == ERR_NOTFOUND)
-			{
-			if (retbFound)
-				*retbFound = false;
+		if (retbFound)
+			*retbFound = false;
 
-			return pCC->CreateErrorCode(CCRESULT_NOTFOUND);
-			}
-		else
-			return pCC->CreateMemoryError();
+		return pCC->CreateErrorCode(CCRESULT_NOTFOUND);
 		}
 
-	pBinding = (ICCItem *)iValue;
 	ASSERT(pBinding);
 
 	if (retbFound)
@@ -190,7 +171,7 @@ void CCAtomTable::Reset (void)
 //	Reset the internal variables
 
 	{
-	m_Table.RemoveAll();
+	m_Table.DeleteAll();
 	}
 
 ICCItem *CCAtomTable::StreamItem (CCodeChain *pCC, IWriteStream *pStream)
@@ -214,17 +195,13 @@ ICCItem *CCAtomTable::StreamItem (CCodeChain *pCC, IWriteStream *pStream)
 
 	for (i = 0; i < iCount; i++)
 		{
-		int iValue, iKey;
-		ICCItem *pItem;
+		ICCItem *pItem = m_Table.GetValue(i);
 		ICCItem *pKey;
 		ICCItem *pError;
 
-		m_Table.GetEntry(i, &iKey, &iValue);
-		pItem = (ICCItem *)iValue;
-
 		//	Write out the key
 
-		pKey = pCC->CreateInteger(iKey);
+		pKey = pCC->CreateInteger(m_Table.GetKey(i));
 		if (pKey->IsError())
 			return pKey;
 
@@ -270,7 +247,7 @@ ICCItem *CCAtomTable::UnstreamItem (CCodeChain *pCC, IReadStream *pStream)
 	for (i = 0; i < iCount; i++)
 		{
 		ICCItem *pItem;
-		int iKey, iValue;
+		int iKey;
 		bool bAdded;
 
 		//	Load the key
@@ -291,8 +268,7 @@ ICCItem *CCAtomTable::UnstreamItem (CCodeChain *pCC, IReadStream *pStream)
 
 		//	Append the item to the symbol table
 
-		if (m_Table.ReplaceEntry(iKey, (int)pItem, true, &bAdded, &iValue) != NOERROR)
-			return pCC->CreateMemoryError();
+		m_Table.SetAt(iKey, pItem, &bAdded);
 
 		//	No need to discard pItem because we're adding it to the
 		//	symbol table.
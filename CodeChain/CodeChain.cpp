@@ -797,6 +797,8 @@ ICCItem *CCodeChain::Eval (CEvalContext *pEvalCtx, ICCItem *pItem)
 //	Evaluates the given item and returns a result
 
 	{
+	PROFILE_ZONE("CCodeChain::Eval");
+
 	//	Errors always evaluate to themselves
 
 	if (pItem->IsError())
@@ -882,6 +882,8 @@ void CG32bitImage::IntersectMask (int xMask, int yMask, int cxMask, int cyMask,
 void CGDraw::BltGray (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, BYTE byOpacity)
 
 	{
+	PROFILE_ZONE("CGDraw::BltGray");
+
 	if (byOpacity == 0xff)
 		{
 		CFilterDesaturate Filter;
@@ -897,6 +899,8 @@ void CGDraw::BltGray (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Sr
 void CGDraw::BltLighten (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc)
 
 	{
+	PROFILE_ZONE("CGDraw::BltLighten");
+
 	CFilterLighten Filter;
 	Filter.Blt(Dest, xDest, yDest, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
@@ -904,6 +908,8 @@ void CGDraw::BltLighten (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage
 void CGDraw::BltMask (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, CG8bitImage &Mask, EBlendModes iMode)
 
 	{
+	PROFILE_ZONE("CGDraw::BltMask");
+
 	switch (iMode)
 		{
 		case blendNormal:
@@ -939,6 +945,8 @@ void CGDraw::BltMask (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Sr
 void CGDraw::BltMask0 (CG32bitImage &Dest, int xDest, int yDest, const CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc)
 
 	{
+	PROFILE_ZONE("CGDraw::BltMask0");
+
 	CFilterMask0 Filter;
 	Filter.Blt(Dest, xDest, yDest, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
@@ -946,6 +954,8 @@ void CGDraw::BltMask0 (CG32bitImage &Dest, int xDest, int yDest, const CG32bitIm
 void CGDraw::BltScaled (CG32bitImage &Dest, int xDest, int yDest, int cxDest, int cyDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc)
 
 	{
+	PROFILE_ZONE("CGDraw::BltScaled");
+
 	CFilterNormal Filter;
 	Filter.BltScaled(Dest, xDest, yDest, cxDest, cyDest, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
@@ -953,6 +963,8 @@ void CGDraw::BltScaled (CG32bitImage &Dest, int xDest, int yDest, int cxDest, in
 void CGDraw::BltShimmer (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, BYTE byOpacity, DWORD dwSeed)
 
 	{
+	PROFILE_ZONE("CGDraw::BltShimmer");
+
 	CFilterShimmer Filter(byOpacity, dwSeed);
 	Filter.Blt(Dest, xDest, yDest, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
@@ -960,6 +972,8 @@ void CGDraw::BltShimmer (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage
 void CGDraw::BltTiled (CG32bitImage &Dest, int xDest, int yDest, int cxDest, int cyDest, const CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, int xSrcOffset, int ySrcOffset)
 
 	{
+	PROFILE_ZONE("CGDraw::BltTiled");
+
 	if (Src.IsEmpty())
 		return;
 
@@ -1004,6 +1018,8 @@ void CGDraw::BltTiled (CG32bitImage &Dest, int xDest, int yDest, int cxDest, int
 void CGDraw::BltTransformed (CG32bitImage &Dest, Metric rX, Metric rY, Metric rScaleX, Metric rScaleY, Metric rRotation, const CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc)
 
 	{
+	PROFILE_ZONE("CGDraw::BltTransformed");
+
 	CFilterNormal Filter;
 	Filter.BltTransformed(Dest, rX, rY, rScaleX, rScaleY, rRotation, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
@@ -1011,6 +1027,8 @@ void CGDraw::BltTransformed (CG32bitImage &Dest, Metric rX, Metric rY, Metric rS
 void CGDraw::BltTransformedGray (CG32bitImage &Dest, Metric rX, Metric rY, Metric rScaleX, Metric rScaleY, Metric rRotation, const CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, BYTE byOpacity)
 
 	{
+	PROFILE_ZONE("CGDraw::BltTransformedGray");
+
 	if (byOpacity == 0xff)
 		{
 		CFilterDesaturate Filter;
@@ -1026,6 +1044,8 @@ void CGDraw::BltTransformedGray (CG32bitImage &Dest, Metric rX, Metric rY, Metri
 void CGDraw::BltTransformedHD (CG32bitImage &Dest, Metric rX, Metric rY, Metric rScaleX, Metric rScaleY, Metric rRotation, const CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, EBlendModes iMode)
 
 	{
+	PROFILE_ZONE("CGDraw::BltTransformedHD");
+
 	switch (iMode)
 		{
 		case blendNormal:
@@ -1061,6 +1081,8 @@ void CGDraw::BltTransformedHD (CG32bitImage &Dest, Metric rX, Metric rY, Metric
 void CGDraw::BltWithBackColor (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, CG32bitPixel rgbBackColor)
 	
 	{
+	PROFILE_ZONE("CGDraw::BltWithBackColor");
+
 	if (Src.GetAlphaType() == CG32bitImage::alphaNone)
 		{
 		CFilterBackColor Filter(rgbBackColor);
@@ -1073,6 +1095,8 @@ void CGDraw::BltWithBackColor (CG32bitImage &Dest, int xDest, int yDest, CG32bit
 void CGDraw::CopyColorize (CG32bitImage &Dest, int xDest, int yDest, CG32bitImage &Src, int xSrc, int ySrc, int cxSrc, int cySrc, Metric rHue, Metric rSaturation)
 
 	{
+	PROFILE_ZONE("CGDraw::CopyColorize");
+
 	CFilterColorize Filter(rHue, rSaturation);
 	Filter.Copy(Dest, xDest, yDest, Src, xSrc, ySrc, cxSrc, cySrc);
 	}
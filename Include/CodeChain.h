@@ -705,7 +705,7 @@ class CCAtomTable : public ICCAtom
 		virtual ICCItem *UnstreamItem (CCodeChain *pCC, IReadStream *pStream);
 
 	private:
-		CDictionary m_Table;
+		TDictionary<int, ICCItem *> m_Table;
 	};
 
 //	This is a symbol table object
@@ -7,6 +7,43 @@
 
 #include "Euclid.h"
 
+enum EDigestAlgorithms
+	{
+	digestSHA1 =					0,	//	20 bytes
+	digestSHA256 =					1,	//	32 bytes
+	};
+
+//	CDigestContext. Computes a digest incrementally. We use the SHA extensions
+//	if the CPU has them.
+
+class CDigestContext
+	{
+	public:
+		CDigestContext (EDigestAlgorithms iAlgorithm = digestSHA1);
+
+		void Add (const void *pData, DWORDLONG dwLength);
+		ALERROR Add (IReadBlock &Data);
+		void Final (BYTE *retDigest);
+		void Final (CIntegerIP *retDigest);
+		inline EDigestAlgorithms GetAlgorithm (void) const { return m_iAlgorithm; }
+		inline int GetDigestLength (void) const { return GetDigestLength(m_iAlgorithm); }
+		void Reset (void);
+
+		static int GetDigestLength (EDigestAlgorithms iAlgorithm);
+
+	private:
+		enum Constants
+			{
+			BLOCK_SIZE =				64,
+			MAX_STATE =					8,
+			};
+
+		EDigestAlgorithms m_iAlgorithm;
+		DWORD m_State[MAX_STATE];
+		DWORDLONG m_dwLength;				//	Total bytes added
+		BYTE m_Buffer[BLOCK_SIZE];			//	Partial block (m_dwLength % BLOCK_SIZE bytes)
+	};
+
 class CDigest : public CIntegerIP
 	{
 	public:
@@ -22,8 +59,11 @@ class CDigest : public CIntegerIP
 			};
 	};
 
-void cryptoCreateDigest (IReadBlock &Data, CIntegerIP *retDigest);
-void cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMAC);
+ALERROR cryptoCreateDigest (IReadBlock &Data, CIntegerIP *retDigest);
+ALERROR cryptoCreateDigest (IReadBlock &Data, EDigestAlgorithms iAlgorithm, CIntegerIP *retDigest);
+ALERROR cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMAC);
 void cryptoRandom (int iCount, CIntegerIP *retx);
 ALERROR fileCreateDigest (const CString &sFilespec, CIntegerIP *retDigest);
+ALERROR fileCreateDigest (const CString &sFilespec, EDigestAlgorithms iAlgorithm, CIntegerIP *retDigest);
+ALERROR fileCreateDigests (const TArray<CString> &Files, EDigestAlgorithms iAlgorithm, TArray<CIntegerIP> *retDigests, TArray<ALERROR> *retErrors = NULL, CThreadPool *pPool = NULL);
 
@@ -113,8 +113,11 @@ class CG32bitPixel
 //	10987654 32109876 54321098 76543210
 //
 //	AAAAAAAA RRRRRRRR GGGGGGGG BBBBBBBB
+//
+//	32-bit images are handed to the background blt thread (and may be handed
+//	to CThreadPool tasks), so the reference count is atomic.
 
-class CG32bitImage : public TImagePlane<CG32bitImage>
+class CG32bitImage : public TImagePlane<CG32bitImage, CRefCountAtomic>
 	{
 	public:
 		enum EAlphaTypes
@@ -236,12 +236,17 @@ class CBase64Decoder : public IReadStream
 		using IReadStream::Read;
 
 	private:
-		BYTE CharToByte (char chChar);
+		enum Constants
+			{
+			READ_CHUNK_QUADS =			1024,	//	Characters read from the source at a time (x4)
+			};
 
 		IReadStream *m_pStream;
 
-		int m_iBufferPos;
+		int m_iBufferPos;					//	Next byte in m_chBuffer
+		int m_iBufferLen;					//	Bytes decoded into m_chBuffer
 		BYTE m_chBuffer[3];
+		bool m_bEnd;						//	TRUE if we've decoded padding
 	};
 
 class CBase64Encoder : public IWriteStream
@@ -261,7 +266,10 @@ class CBase64Encoder : public IWriteStream
 		using IWriteStream::Write;
 
 	private:
-		int WriteTriplet (void *pData);
+		enum Constants
+			{
+			WRITE_CHUNK_TRIPLETS =		1024,	//	Bytes encoded per write to the output (x3)
+			};
 
 		IWriteStream *m_pStream;
 
@@ -269,6 +277,13 @@ class CBase64Encoder : public IWriteStream
 		BYTE m_chBuffer[3];
 	};
 
+bool base64Decode (const char *pInput, int iLength, void *pOutput, int *retiLength = NULL);
+bool base64Decode (const CString &sInput, CString *retsData);
+int base64Encode (const void *pData, int iLength, char *pOutput);
+CString base64Encode (const void *pData, int iLength);
+int base64GetDecodedLength (const char *pInput, int iLength);
+int base64GetEncodedLength (int iLength);
+
 //	Utilities ------------------------------------------------------------------
 
 CString urlCompose (const CString &sProtocol, const CString &sHost, const CString &sPath);
@@ -76,6 +76,6 @@ class CJSONMessage : public IMediaType
 		void Serialize (void) const;
 
 		CJSONValue m_Value;
-		mutable CMemoryWriteStream m_Serialized;
+		mutable CSegmentedWriteStream m_Serialized;
 	};
 
@@ -6,6 +6,9 @@
 #pragma once
 
 #include <cstddef>
+#include <exception>
+#include <type_traits>
+#include <utility>
 
 #ifndef _WIN32_WINNT		// Allow use of features specific to Windows XP or later.                   
 #define _WIN32_WINNT 0x0501	// Change this to the appropriate value to target other versions of Windows.
@@ -23,6 +26,11 @@
 //#define DEBUG_ARRAY_STATS
 #endif
 
+//	Define PROFILING (here or in the project) to compile in PROFILE_ZONE
+//	markers.
+
+//#define PROFILING
+
 #ifdef DEBUG_MEMORY_LEAKS
 #include <crtdbg.h>
 #define DEBUG_NEW new(_NORMAL_BLOCK, __FILE__, __LINE__)
@@ -49,10 +57,10 @@ extern "C" void *          __cdecl _alloca(size_t);
 //	Call stack logging
 
 #define DEBUG_TRY					try {
-#define DEBUG_CATCH					} catch (...) { kernelDebugLogPattern("Crash in %s", CString(__FUNCTION__)); throw; }
-#define DEBUG_CATCH_CONTINUE		} catch (...) { kernelDebugLogPattern("Crash in %s", CString(__FUNCTION__)); }
-#define DEBUG_CATCH_MSG(msg)		} catch (...) { kernelDebugLogPattern((msg)); throw; }
-#define DEBUG_CATCH_MSG1(msg,p1)	} catch (...) { kernelDebugLogPattern((msg),(p1)); throw; }
+#define DEBUG_CATCH					} catch (...) { kernelDebugLogPattern("Crash in %s", CString(__FUNCTION__)); kernelDebugLogFlush(); throw; }
+#define DEBUG_CATCH_CONTINUE		} catch (...) { kernelDebugLogPattern("Crash in %s", CString(__FUNCTION__)); kernelDebugLogFlush(); }
+#define DEBUG_CATCH_MSG(msg)		} catch (...) { kernelDebugLogPattern((msg)); kernelDebugLogFlush(); throw; }
+#define DEBUG_CATCH_MSG1(msg,p1)	} catch (...) { kernelDebugLogPattern((msg),(p1)); kernelDebugLogFlush(); throw; }
 
 #define INLINE_DECREF				TRUE
 
@@ -166,6 +174,11 @@ const int MAX_SHORT =					32767;
 #define API_FLAG_WINNT					0x00000002	//	Running on Windows NT
 #define API_FLAG_DWM					0x00000004	//	Desktop Window Manager running (Vista or Win7)
 
+#define CPU_FEATURE_SSE2				0x00000001	//	SSE2
+#define CPU_FEATURE_SSSE3				0x00000002	//	SSSE3 (PSHUFB)
+#define CPU_FEATURE_SSE41				0x00000004	//	SSE4.1
+#define CPU_FEATURE_SHA					0x00000008	//	SHA extensions
+
 //	Forward class definitions
 
 class CArchiver;
@@ -173,6 +186,7 @@ class CObject;
 class CUnarchiver;
 class CString;
 class CIDTable;
+class CThreadPool;
 class IReadStream;
 class IWriteStream;
 
@@ -182,6 +196,7 @@ class IWriteStream;
 #include "TArray.h"
 #include "TLinkedList.h"
 #include "TMap.h"
+#include "TBTreeMap.h"
 #include "TQueue.h"
 #include "TStack.h"
 
@@ -538,6 +553,19 @@ class CString : public CObject
 			csUTF8,
 			};
 
+		struct SStorageStats
+			{
+			int iStoresInUse;				//	String headers currently allocated
+			int iStoresCommitted;			//	String headers committed (in use or free)
+			int iCachedBytes;				//	Bytes held in per-thread caches
+
+			DWORDLONG dwStoreAllocs;		//	Total header allocations
+			DWORDLONG dwStoreFrees;			//	Total header frees
+			DWORDLONG dwCharAllocs;			//	Total character buffer allocations
+			DWORDLONG dwCharCacheHits;		//	Character buffers served from a thread cache
+			DWORDLONG dwGlobalRefills;		//	Times a thread went to the global header list
+			};
+
 		CString (void);
 		CString (const char *pString);
 		CString (CharacterSets iCharSet, const char *pString);
@@ -568,10 +596,14 @@ class CString : public CObject
 		void Truncate (int iLength);
 		void WriteToStream (IWriteStream *pStream) const;
 
+		static void GetStorageStats (SStorageStats *retStats);
+
 		//	These are used internally only
 
 		static void INTStringCleanUp (void);
 		static ALERROR INTStringInit (void);
+		static void INTStringThreadCleanUp (void);
+		static void INTStringThreadInit (void);
 
 		//	These are used for custom string arrays
 
@@ -598,7 +630,11 @@ class CString : public CObject
 	private:
 		struct STORESTRUCT
 			{
+#ifdef STRING_SINGLE_THREADED
 			int iRefCount;
+#else
+			volatile LONG iRefCount;
+#endif
 			int iAllocSize;				//	If negative, this is a read-only external allocation
 			int iLength;
 			char *pString;
@@ -608,23 +644,45 @@ class CString : public CObject
 			};
 		typedef struct STORESTRUCT *PSTORESTRUCT;
 
+		struct SThreadCache;
+
 		CString (void *pStore, bool bDummy);
 
 		static void AddToFreeList (PSTORESTRUCT pStore, int iSize);
-		PSTORESTRUCT AllocStore (int iSize, BOOL bAllocString);
+		static char *AllocChars (int iSize, int *retiAllocSize);
+		static PSTORESTRUCT AllocStore (int iSize, BOOL bAllocString);
 #ifdef INLINE_DECREF
 		inline void DecRefCount (void)
 			{
-			if (m_pStore && (--m_pStore->iRefCount) == 0)
+			if (!IsInline() && ReleaseStore(m_pStore) == 0)
 				FreeStore(m_pStore);
 			}
 #else
 		void DecRefCount (void);
 #endif
 
+		static void FreeChars (char *pChars, int iAllocSize);
 		static void FreeStore (PSTORESTRUCT pStore);
-		inline void IncRefCount (void) { if (m_pStore) m_pStore->iRefCount++; }
+		static SThreadCache *GetThreadCache (void);
+		inline char *GetWriteBuffer (void) { return (IsInline() ? m_Inline : m_pStore->pString); }
+		inline void IncRefCount (void) { if (!IsInline()) AddRefStore(m_pStore); }
 		inline BOOL IsExternalStorage (void) { return (m_pStore->iAllocSize < 0 ? TRUE : FALSE); }
+		inline bool IsInline (void) const { return ((BYTE)m_Inline[INLINE_TAG] != INLINE_TAG_HEAP); }
+		inline void SetEmpty (void) { m_Inline[0] = '\0'; m_Inline[INLINE_TAG] = 0; }
+		inline void SetInlineLength (int iLength) { m_Inline[iLength] = '\0'; m_Inline[INLINE_TAG] = (char)iLength; }
+		void SetLength (int iLength);
+		inline void SetStore (PSTORESTRUCT pStore) { m_pStore = pStore; m_Inline[INLINE_TAG] = (char)INLINE_TAG_HEAP; }
+
+		//	Storage may be shared between threads, so unless the app opts out
+		//	with STRING_SINGLE_THREADED, refcounts are interlocked.
+
+#ifdef STRING_SINGLE_THREADED
+		static inline void AddRefStore (PSTORESTRUCT pStore) { pStore->iRefCount++; }
+		static inline int ReleaseStore (PSTORESTRUCT pStore) { return --pStore->iRefCount; }
+#else
+		static inline void AddRefStore (PSTORESTRUCT pStore) { ::InterlockedIncrement(&pStore->iRefCount); }
+		static inline int ReleaseStore (PSTORESTRUCT pStore) { return (int)::InterlockedDecrement(&pStore->iRefCount); }
+#endif
 
 		static constexpr DWORD FLAG_PRESERVE_CONTENTS =		0x00000001;
 		static constexpr DWORD FLAG_GEOMETRIC_GROWTH =		0x00000002;
@@ -632,11 +690,36 @@ class CString : public CObject
 
 		static void InitLowerCaseAbsoluteTable (void);
 
-		PSTORESTRUCT m_pStore;
+		//	Short strings are stored inline, with no heap allocation and no
+		//	refcount. The last byte is the length of the inline string, or
+		//	INLINE_TAG_HEAP if m_pStore points to a (refcounted) store. All
+		//	zeros is a valid empty string.
+		//
+		//	The price is size: a CString is 32 bytes on Win32 (it used to be
+		//	12), so arrays of long strings take more memory and cost more to
+		//	copy and sort.
+
+		enum EInline
+			{
+			INLINE_SIZE =					24,
+			INLINE_MAX =					INLINE_SIZE - 2,		//	Room for NULL and tag
+			INLINE_TAG =					INLINE_SIZE - 1,
+			INLINE_TAG_HEAP =				0x80,
+			};
+
+		union
+			{
+			PSTORESTRUCT m_pStore;
+			char m_Inline[INLINE_SIZE];
+			};
 
 		static PSTORESTRUCT g_pStore;
 		static int g_iStoreSize;
 		static PSTORESTRUCT g_pFreeStore;
+		static SThreadCache *g_pThreadCaches;
+#ifdef STRING_SINGLE_THREADED
+		static SThreadCache *g_pSingleThreadCache;
+#endif
 	};
 
 //	Exceptions
@@ -657,48 +740,19 @@ class CException
 		CString m_sMsg;
 	};
 
-//	CDictionary. Implementation of a dynamic array of entries
-
-class CDictionary : public CObject
-	{
-	public:
-		CDictionary (void);
-		CDictionary (IObjectClass *pClass);
-		virtual ~CDictionary (void);
-
-		ALERROR AddEntry (int iKey, int iValue);
-		ALERROR Find (int iKey, int *retiValue) const;
-		ALERROR FindEx (int iKey, int *retiEntry) const;
-		ALERROR FindOrAdd (int iKey, int iValue, bool *retbFound, int *retiValue);
-		inline int GetCount (void) const { return m_Array.GetCount() / 2; }
-		void GetEntry (int iEntry, int *retiKey, int *retiValue) const;
-		ALERROR ReplaceEntry (int iKey, int iValue, bool bAdd, bool *retbAdded, int *retiOldValue);
-		ALERROR RemoveAll (void) { return m_Array.RemoveAll(); }
-		ALERROR RemoveEntryByOrdinal (int iEntry, int *retiOldValue = NULL);
-		ALERROR RemoveEntry (int iKey, int *retiOldValue);
-
-	protected:
-		virtual int Compare (int iKey1, int iKey2) const;
-		inline ALERROR ExpandArray (int iPos, int iCount) { return m_Array.ExpandArray(2 * iPos, 2 * iCount); }
-		void SetEntry (int iEntry, int iKey, int iValue);
-
-		bool FindSlot (int iKey, int *retiPos) const;
-
-		CIntArray m_Array;
-	};
-
 //	CIDTable. Implementation of a table that matches IDs with objects
 
-class CIDTable : public CDictionary
+class CIDTable : public CObject
 	{
 	public:
 		CIDTable (void);
 		CIDTable (BOOL bOwned, BOOL bNoReference);
 		virtual ~CIDTable (void);
 
-		inline ALERROR AddEntry (int iKey, CObject *pValue) { return CDictionary::AddEntry(iKey, (int)pValue); }
-		int GetKey (int iEntry) const;
-		CObject *GetValue (int iEntry) const;
+		ALERROR AddEntry (int iKey, CObject *pValue);
+		inline int GetCount (void) const { return m_Table.GetCount(); }
+		inline int GetKey (int iEntry) const { return (int)m_Table.GetKey(iEntry); }
+		inline CObject *GetValue (int iEntry) const { return m_Table.GetValue(iEntry); }
 		ALERROR Lookup (int iKey, CObject **retpValue) const;
 		ALERROR LookupEx (int iKey, int *retiEntry) const;
 		ALERROR RemoveAll (void);
@@ -707,19 +761,19 @@ class CIDTable : public CDictionary
 		void SetValue (int iEntry, CObject *pValue, CObject **retpOldValue);
 
 	protected:
-		virtual int Compare (int iKey1, int iKey2) const;
 		virtual void CopyHandler (CObject *pOriginal);
 		virtual ALERROR LoadHandler (CUnarchiver *pUnarchiver);
 		virtual ALERROR SaveHandler (CArchiver *pArchiver);
 
 	private:
+		TDictionary<DWORD, CObject *> m_Table;		//	Sorted by unsigned ID
 		BOOL m_bOwned;
 		BOOL m_bNoReference;
 	};
 
 //	CSymbolTable. Implementation of a symbol table
 
-class CSymbolTable : public CDictionary
+class CSymbolTable : public CObject
 	{
 	public:
 		CSymbolTable (void);
@@ -728,8 +782,9 @@ class CSymbolTable : public CDictionary
 		CSymbolTable &operator= (const CSymbolTable &Obj);
 
 		ALERROR AddEntry (const CString &sKey, CObject *pValue);
-		CString GetKey (int iEntry) const;
-		CObject *GetValue (int iEntry) const;
+		inline int GetCount (void) const { return m_Table.GetCount(); }
+		inline const CString &GetKey (int iEntry) const { return m_Table.GetKey(iEntry); }
+		inline CObject *GetValue (int iEntry) const { return m_Table.GetValue(iEntry); }
 		ALERROR Lookup (const CString &sKey, CObject **retpValue = NULL) const;
 		ALERROR LookupEx (const CString &sKey, int *retiEntry) const;
 		ALERROR RemoveAll (void);
@@ -739,12 +794,14 @@ class CSymbolTable : public CDictionary
 		void SetValue (int iEntry, CObject *pValue, CObject **retpOldValue);
 
 	protected:
-		virtual int Compare (int iKey1, int iKey2) const;
 		virtual void CopyHandler (CObject *pOriginal);
 		virtual ALERROR LoadHandler (CUnarchiver *pUnarchiver);
 		virtual ALERROR SaveHandler (CArchiver *pArchiver);
 
 	private:
+		void DeleteValues (void);
+
+		TDictionary<CString, CObject *> m_Table;	//	Sorted (entry offsets are visible to callers)
 		BOOL m_bOwned;
 		BOOL m_bNoReference;
 	};
@@ -761,15 +818,23 @@ class CAtomTable : public CObject
 		ALERROR AppendAtom (const CString &sString, int *retiAtom);
 		int Atomize (const CString &sString);
 
+	protected:
+		virtual void CopyHandler (CObject *pOriginal);
+		virtual ALERROR LoadHandler (CUnarchiver *pUnarchiver);
+		virtual ALERROR SaveHandler (CArchiver *pArchiver);
+
 	private:
-		CSymbolTable *Hash (const CString &sString);
+		ALERROR LoadOldVersion (CUnarchiver *pUnarchiver);
 
-		int m_iHashSize;
+		TDictionary<CString, int> m_Atoms;
 		int m_iNextAtom;
-		CSymbolTable *m_pBackbone;
 	};
 
 //	CLargeSet
+//
+//	A dense bit set of small non-negative integers. Bits are stored in 64-bit
+//	words so that set algebra runs a word at a time. Small sets (up to
+//	INLINE_BITS) live inside the object and never touch the heap.
 
 class CLargeSet
 	{
@@ -780,37 +845,158 @@ class CLargeSet
 			};
 
 		CLargeSet (int iSize = -1);
+		CLargeSet (const CLargeSet &Src);
+		CLargeSet (CLargeSet &&Src);
+		~CLargeSet (void) { CleanUp(); }
+
+		CLargeSet &operator= (const CLargeSet &Src);
+		CLargeSet &operator= (CLargeSet &&Src);
+		inline bool operator== (const CLargeSet &Src) const { return Equals(Src); }
+		inline bool operator!= (const CLargeSet &Src) const { return !Equals(Src); }
 
 		void Clear (DWORD dwValue);
 		void ClearAll (void);
+		int Compare (const CLargeSet &Src) const;
+		int Count (void) const;
+		void Difference (const CLargeSet &Src);
+		bool Equals (const CLargeSet &Src) const;
+		DWORD GetHash (void) const;
 		DWORD GetNextValue (DWORD dwStart = 0) const;
+		inline const DWORDLONG *GetWords (void) const { return (IsInline() ? m_Inline : m_pHeap); }
+		inline int GetWordCount (void) const { return GetUsedWordCount(); }
 		bool InitFromString (const CString &sValue, DWORD dwMaxValue = 0, CString *retsError = NULL);
+		void Intersect (const CLargeSet &Src);
 		bool IsEmpty (void) const;
 		bool IsSet (DWORD dwValue) const;
 		void Set (DWORD dwValue);
+		void Union (const CLargeSet &Src);
+
+		template <class FUNC> void ForEachSet (FUNC Func) const
+			{
+			//	Calls Func(DWORD dwValue) for each member, in ascending order.
+			//	We walk a copy of each word, so Func may modify the set, but
+			//	changes to the current or earlier words are not seen, and
+			//	neither are members past the set's original size. Func may
+			//	grow the set (which moves the words), so we fetch the words
+			//	again for each one.
+
+			int iWordCount = m_iWordCount;
+			for (int i = 0; i < iWordCount && i < m_iWordCount; i++)
+				{
+				DWORDLONG dwWord = GetWords()[i];
+				while (dwWord)
+					{
+					DWORD dwValue = (DWORD)(i * BITS_PER_WORD) + LowestBit(dwWord);
+					dwWord &= dwWord - 1;
+					Func(dwValue);
+					}
+				}
+			}
+
+		static int CountBits (DWORDLONG dwWord);
+
+		static inline DWORD LowestBit (DWORDLONG dwWord)
+			{
+			//	dwWord must be non-zero. We scan 32-bits at a time because
+			//	_BitScanForward64 is not available on x86.
+
+			unsigned long dwBit;
+			if (_BitScanForward(&dwBit, (DWORD)dwWord))
+				return (DWORD)dwBit;
+
+			_BitScanForward(&dwBit, (DWORD)(dwWord >> 32));
+			return (DWORD)dwBit + 32;
+			}
 
 	private:
-		static DWORD GetBitFromMask (DWORD dwMask);
+		enum EInternalConstants
+			{
+			BITS_PER_WORD =				64,
+			INLINE_WORDS =				2,
+			INLINE_BITS =				INLINE_WORDS * BITS_PER_WORD,
+			};
 
-		TArray<DWORD> m_Set;
+		void CleanUp (void);
+		int GetUsedWordCount (void) const;
+		inline DWORDLONG *GetWordsRW (void) { return (IsInline() ? m_Inline : m_pHeap); }
+		inline bool IsInline (void) const { return (m_iAlloc == INLINE_WORDS); }
+		void GrowToFit (int iWordCount);
+		void TakeHandoff (CLargeSet &Src);
+
+		//	NOTE: We never point into ourselves because TArray moves its
+		//	elements bitwise. If m_iAlloc is INLINE_WORDS then the words are in
+		//	m_Inline; otherwise they are in m_pHeap.
+
+		int m_iWordCount;						//	Words in use (all initialized)
+		int m_iAlloc;							//	Words of storage
+
+		union
+			{
+			DWORDLONG m_Inline[INLINE_WORDS];
+			DWORDLONG *m_pHeap;
+			};
 	};
 
+//	These let a CLargeSet be used as a TMap or TDictionary key. Sets with the
+//	same members hash the same, regardless of how much storage they have.
+
+inline DWORD DictionaryKeyHash (const CLargeSet &Key) { return Key.GetHash(); }
+inline void *MapKeyHashData (const CLargeSet &Key) { return (void *)Key.GetWords(); }
+inline int MapKeyHashDataSize (const CLargeSet &Key) { return Key.GetWordCount() * (int)sizeof(DWORDLONG); }
+
 //	Atomizer
 
 class CAtomizer
 	{
 	public:
 		CAtomizer (void);
+		CAtomizer (const CAtomizer &Src) =delete;
+		~CAtomizer (void);
+
+		CAtomizer &operator= (const CAtomizer &Src) =delete;
 
 		DWORD Atomize (const CString &sIdentifier);
-		inline int GetCount (void) const { return m_StringToAtom.GetCount(); }
+		inline int GetCount (void) const { return (int)m_dwNextID - 1; }
 		const CString &GetIdentifier (DWORD dwAtom) const;
 		int GetMemoryUsage (void) const;
 
 	private:
-		DWORD m_dwNextID;
-		TSortMap<CString, DWORD> m_StringToAtom;
-		TArray<CString> m_AtomToString;
+
+		//	Atoms are case-insensitive (like strCompareAbsolute). Lookups of
+		//	existing atoms do not lock; adding a new atom takes m_cs. Atoms are
+		//	never moved or freed, so GetIdentifier references stay valid.
+
+		enum EConstants
+			{
+			SEGMENT_BASE_SIZE =				256,	//	Segment i holds SEGMENT_BASE_SIZE << i atoms
+			SEGMENT_COUNT =					20,
+			MIN_TABLE_SIZE =				256,
+			};
+
+		struct SAtom
+			{
+			CString sIdentifier;
+			DWORD dwHash;
+			};
+
+		struct STable
+			{
+			DWORD dwMask;
+			volatile LONG Slots[1];					//	Atom IDs; 0 = empty
+			};
+
+		static STable *AllocTable (int iSize);
+		static bool CalcSegment (DWORD dwAtom, int *retiSegment, int *retiIndex);
+		DWORD FindAtom (const STable *pTable, const CString &sIdentifier, DWORD dwHash) const;
+		inline const SAtom &GetAtom (DWORD dwAtom) const { int iSegment, iIndex; CalcSegment(dwAtom, &iSegment, &iIndex); return m_pSegments[iSegment][iIndex]; }
+		static DWORD Hash (const CString &sIdentifier);
+		static void InsertSlot (STable *pTable, DWORD dwHash, DWORD dwAtom);
+
+		CCriticalSection m_cs;
+		volatile DWORD m_dwNextID;
+		SAtom * volatile m_pSegments[SEGMENT_COUNT];
+		STable * volatile m_pTable;
+		TArray<STable *> m_Retired;				//	Old tables that readers may still be probing
 	};
 
 //	Memory Blocks
@@ -818,12 +1004,30 @@ class CAtomizer
 class IReadBlock
 	{
 	public:
+		enum EAccessHints
+			{
+			accessNormal,						//	No particular pattern
+			accessSequential,					//	Front to back, once
+			accessRandom,						//	Scattered reads; read-ahead is wasted
+			accessWillNeed,						//	Range will be read soon; start paging it in
+			};
+
 		virtual ~IReadBlock (void) { }
 
 		virtual ALERROR Close (void) = 0;
 		virtual ALERROR Open (void) = 0;
 		virtual int GetLength (void) = 0;
 		virtual char *GetPointer (int iOffset, int iLength = -1) = 0;
+
+		//	64-bit access. Blocks that can be larger than 2 GB override these;
+		//	the defaults forward to the 32-bit calls. Slices reference the
+		//	parent's data without copying and must be deleted by the caller
+		//	before the parent is closed.
+
+		virtual IReadBlock *CreateSlice (DWORDLONG dwOffset, DWORDLONG dwLength);
+		virtual DWORDLONG GetLength64 (void) { return (DWORDLONG)GetLength(); }
+		virtual char *GetPointer64 (DWORDLONG dwOffset, DWORDLONG dwLength) { return GetPointer((int)dwOffset, (int)dwLength); }
+		virtual void SetAccessHint (EAccessHints iHint, DWORDLONG dwOffset = 0, DWORDLONG dwLength = 0) { }
 	};
 
 class CFileReadBlock : public CObject, public IReadBlock
@@ -873,6 +1077,93 @@ class CResourceReadBlock : public CObject, public IReadBlock
 		DWORD m_dwLength;
 	};
 
+//	CMappedFileBlock. A read-only memory-mapped file with 64-bit sizes.
+//	Files that fit in the address space are mapped with a single view;
+//	larger files (on 32-bit builds) are accessed through a sliding window,
+//	in which case a pointer returned by GetPointer is only valid until the
+//	next GetPointer call. Use CreateSlice for pointers that must stay valid.
+
+class CMappedFileBlock : public IReadBlock
+	{
+	public:
+		enum Flags
+			{
+			FLAG_SEQUENTIAL =			0x00000001,	//	Optimize the OS cache for a front-to-back scan
+			FLAG_RANDOM =				0x00000002,	//	Optimize the OS cache for scattered reads
+			FLAG_LARGE_PAGES =			0x00000004,	//	Load into large pages, if the process may use them
+			FLAG_WINDOWED =				0x00000008,	//	Map only a window at a time, even if the file fits
+			};
+
+		CMappedFileBlock (const CString &sFilename, DWORD dwFlags = 0);
+		virtual ~CMappedFileBlock (void);
+
+		inline const CString &GetFilename (void) const { return m_sFilename; }
+		inline bool IsLargePages (void) const { return m_bLargePages; }
+		inline bool IsWindowed (void) const { return (m_hFileMap && m_pView == NULL); }
+
+		//	IReadBlock virtuals
+
+		virtual ALERROR Close (void) override;
+		virtual IReadBlock *CreateSlice (DWORDLONG dwOffset, DWORDLONG dwLength) override;
+		virtual int GetLength (void) override { return (int)Min(m_dwFileSize, (DWORDLONG)MAXLONG); }
+		virtual DWORDLONG GetLength64 (void) override { return m_dwFileSize; }
+		virtual char *GetPointer (int iOffset, int iLength = -1) override { return GetPointer64((DWORDLONG)iOffset, (iLength == -1 ? m_dwFileSize - iOffset : (DWORDLONG)iLength)); }
+		virtual char *GetPointer64 (DWORDLONG dwOffset, DWORDLONG dwLength) override;
+		virtual ALERROR Open (void) override;
+		virtual void SetAccessHint (EAccessHints iHint, DWORDLONG dwOffset = 0, DWORDLONG dwLength = 0) override;
+
+	private:
+		enum Constants
+			{
+			WINDOW_SIZE =				(64 * 1024 * 1024),
+			};
+
+		bool LoadLargePages (void);
+		char *MapWindow (DWORDLONG dwOffset, DWORDLONG dwLength, char **retpView);
+
+		CString m_sFilename;
+		DWORD m_dwFlags;
+
+		HANDLE m_hFile;
+		HANDLE m_hFileMap;
+		DWORDLONG m_dwFileSize;
+		char *m_pView;									//	Whole file (NULL if windowed)
+		bool m_bLargePages;								//	m_pView is a large-page copy
+
+		char *m_pWindow;								//	Current window view (windowed only)
+		DWORDLONG m_dwWindowPos;
+		DWORDLONG m_dwWindowLen;
+	};
+
+//	CReadBlockSlice. A sub-range of another block. Either points straight
+//	into the parent's memory or owns a view of the parent's file mapping.
+
+class CReadBlockSlice : public IReadBlock
+	{
+	public:
+		CReadBlockSlice (char *pData, DWORDLONG dwLength, char *pView = NULL) :
+				m_pData(pData),
+				m_dwLength(dwLength),
+				m_pView(pView)
+			{ }
+
+		virtual ~CReadBlockSlice (void);
+
+		//	IReadBlock virtuals
+
+		virtual ALERROR Close (void) override { return NOERROR; }
+		virtual int GetLength (void) override { return (int)Min(m_dwLength, (DWORDLONG)MAXLONG); }
+		virtual DWORDLONG GetLength64 (void) override { return m_dwLength; }
+		virtual char *GetPointer (int iOffset, int iLength = -1) override { return m_pData + iOffset; }
+		virtual char *GetPointer64 (DWORDLONG dwOffset, DWORDLONG dwLength) override { return m_pData + dwOffset; }
+		virtual ALERROR Open (void) override { return NOERROR; }
+
+	private:
+		char *m_pData;
+		DWORDLONG m_dwLength;
+		char *m_pView;									//	View to unmap (may be NULL)
+	};
+
 class CBufferReadBlock : public CObject, public IReadBlock
 	{
 	public:
@@ -907,6 +1198,7 @@ class IWriteStream
 
 		ALERROR WriteChar (char chChar, int iLength = 1);
 		ALERROR WriteChars (const CString &sString, int *retiBytesWritten = NULL) { return Write(sString.GetASCIIZPointer(), sString.GetLength(), retiBytesWritten); }
+		ALERROR WriteVarint (DWORDLONG dwValue);
 	};
 
 class IReadStream
@@ -973,6 +1265,63 @@ class CMemoryReadBlockWrapper : public IReadBlock
 		int m_iLength;
 	};
 
+//	CSegmentedWriteStream. This object is used to write variable length data
+//	to memory. Unlike CMemoryWriteStream, it never moves data that has
+//	already been written: it appends segments (each one a CString) as it
+//	grows. Callers can write the segments out directly or take the result as
+//	a string (without a copy, if it fits in one segment).
+
+class CSegmentedWriteStream : public IWriteStream
+	{
+	public:
+		struct SSegment
+			{
+			char *pData;
+			DWORD dwLength;
+			};
+
+		CSegmentedWriteStream (int iSegmentSize = DEFAULT_SEGMENT_SIZE);
+		CSegmentedWriteStream (const CSegmentedWriteStream &Src) =delete;
+
+		CSegmentedWriteStream &operator= (const CSegmentedWriteStream &Src) =delete;
+
+		void CopyTo (char *pDest) const;
+		inline int GetLength (void) const { return (int)Min(m_dwLength, (DWORDLONG)MAXLONG); }
+		inline DWORDLONG GetLength64 (void) const { return m_dwLength; }
+		inline int GetSegmentCount (void) const { return m_Segments.GetCount(); }
+		void GetSegments (TArray<SSegment> *retSegments) const;
+		CString TakeAsString (void);
+		ALERROR WriteToFile (HANDLE hFile) const;
+		ALERROR WriteToStream (IWriteStream *pStream) const;
+
+		//	IWriteStream virtuals
+
+		virtual ALERROR Close (void) override { return NOERROR; }
+		virtual ALERROR Create (void) override;
+		virtual ALERROR Write (char *pData, int iLength, int *retiBytesWritten = NULL) override;
+
+		//	We want to inherit all the overloaded versions of Write.
+
+		using IWriteStream::Write;
+
+	private:
+		enum Constants
+			{
+			DEFAULT_SEGMENT_SIZE =		(1024 * 1024),
+			MIN_SEGMENT_SIZE =			4096,
+			SMALL_STRING_SIZE =			1024,		//	TakeAsString copies strings shorter than this
+			};
+
+		void AddSegment (int iMinSize);
+		DWORD GetSegmentLength (int iIndex) const;
+
+		int m_iSegmentSize;							//	Largest segment we allocate (unless a write needs more)
+		TArray<CString> m_Segments;					//	All segments except the last one are full
+		DWORDLONG m_dwLength;						//	Total bytes written
+		char *m_pPos;								//	Next byte to write in the last segment
+		char *m_pPosEnd;							//	End of the last segment
+	};
+
 //	CMemoryReadStream. This object is used to read variable length data
 
 class CMemoryReadStream : public CObject, public IReadStream
@@ -1055,6 +1404,122 @@ class CFileReadStream : public CObject, public IReadStream
 		DWORD m_dwFileSize;
 	};
 
+//	CBufferedReadStream. This object reads another stream (or a file) through
+//	a buffer, so that small reads don't each cost a call to the source. The
+//	inline Read* methods are not virtual; callers that know they have a
+//	buffered stream should use them. With FLAG_READ_AHEAD, a background
+//	thread fills the next buffer while we read from the current one (the
+//	source is then only touched by that thread).
+
+class CBufferedReadStream : public IReadStream
+	{
+	public:
+		enum Flags
+			{
+			FLAG_READ_AHEAD =			0x00000001,	//	Fill the next buffer on a background thread
+			};
+
+		CBufferedReadStream (IReadStream *pSource, DWORD dwFlags = 0, int iBufferSize = DEFAULT_BUFFER_SIZE);
+		CBufferedReadStream (const CString &sFilename, DWORD dwFlags = FLAG_READ_AHEAD, int iBufferSize = DEFAULT_BUFFER_SIZE);
+		virtual ~CBufferedReadStream (void);
+
+		template <class VALUE> inline ALERROR ReadArray (VALUE *pDest, int iCount) { return ReadBytes((char *)pDest, iCount * (int)sizeof(VALUE)); }
+		template <class VALUE> ALERROR ReadArray (TArray<VALUE> &Dest, int iCount)
+			{
+			Dest.DeleteAll();
+			if (iCount <= 0)
+				return NOERROR;
+
+			Dest.InsertEmpty(iCount);
+			return ReadArray(&Dest[0], iCount);
+			}
+
+		inline ALERROR ReadBytes (char *pData, int iLength)
+			{
+			if (iLength <= (int)(m_pPosEnd - m_pPos))
+				{
+				memcpy(pData, m_pPos, iLength);
+				m_pPos += iLength;
+				return NOERROR;
+				}
+
+			return ReadSlow(pData, iLength, NULL);
+			}
+
+		template <class VALUE> inline ALERROR ReadValue (VALUE &Value)
+			{
+			if ((int)(m_pPosEnd - m_pPos) >= (int)sizeof(VALUE))
+				{
+				memcpy(&Value, m_pPos, sizeof(VALUE));
+				m_pPos += sizeof(VALUE);
+				return NOERROR;
+				}
+
+			return ReadSlow((char *)&Value, sizeof(VALUE), NULL);
+			}
+
+		inline ALERROR ReadVarint (DWORDLONG &dwValue)
+			{
+			if (m_pPos < m_pPosEnd && !(*m_pPos & 0x80))
+				{
+				dwValue = (BYTE)*m_pPos++;
+				return NOERROR;
+				}
+
+			return ReadVarintSlow(&dwValue);
+			}
+
+		ALERROR ReadVarint (DWORD &dwValue);
+
+		//	IReadStream virtuals
+
+		virtual ALERROR Close (void) override;
+		virtual ALERROR Open (void) override;
+		virtual ALERROR Read (char *pData, int iLength, int *retiBytesRead = NULL) override;
+
+		//	We want to inherit all the overloaded versions of Read.
+
+		using IReadStream::Read;
+
+	private:
+		enum Constants
+			{
+			DEFAULT_BUFFER_SIZE =		(64 * 1024),
+			MAX_VARINT_SIZE =			10,
+			};
+
+		ALERROR FillBuffer (void);
+		ALERROR ReadSlow (char *pData, int iLength, int *retiBytesRead);
+		ALERROR ReadSource (char *pData, int iLength, int *retiBytesRead);
+		ALERROR ReadVarintSlow (DWORDLONG *retdwValue);
+		void StopReadAhead (void);
+
+		static DWORD WINAPI ReadAheadThread (LPVOID pData);
+
+		IReadStream *m_pSource;						//	Source stream (NULL if we read m_sFilename)
+		CString m_sFilename;
+		HANDLE m_hFile;
+		DWORD m_dwFlags;
+		int m_iBufferSize;
+
+		char *m_pBuffer[2];							//	Second buffer only used with read-ahead
+		int m_iCurBuffer;							//	Buffer that we're reading from
+		char *m_pPos;								//	Next byte to read
+		char *m_pPosEnd;							//	End of valid data in the current buffer
+		ALERROR m_SourceError;						//	Error from the source (we stop reading after this)
+
+		//	Read-ahead
+
+		HANDLE m_hReadAhead;						//	Thread that fills the next buffer
+		HANDLE m_hBufferEmpty;						//	Signaled when the thread may fill the next buffer
+		HANDLE m_hBufferFull;						//	Signaled when the thread has filled it
+		int m_iReadAheadLength;						//	Bytes read into the next buffer
+		ALERROR m_ReadAheadError;					//	Result of reading the next buffer
+		volatile bool m_bQuit;
+
+		bool m_bOpen;
+	};
+
 //	CArchive. This is an object that knows how to archive objects to a 
 //	stream.
 
@@ -1081,7 +1546,7 @@ class CArchiver : public CObject
 	private:
 		IWriteStream *m_pStream;					//	Stream to save to
 		TArray<CObject *> m_List;					//	List of objects to save
-		CDictionary m_ReferenceList;				//	Pointer references
+		TDictionary<void *, int> m_ReferenceList;	//	Pointer references
 		CSymbolTable m_ExternalReferences;			//	List of external references
 		int m_iNextID;								//	Next ID to use for references
 		DWORD m_dwVersion;							//	User-defined version
@@ -1109,22 +1574,35 @@ class CUnarchiver : public CObject
 		//	that are being loaded
 
 		ALERROR LoadObject (CObject **retpObject);
-		ALERROR ReadData (char *pData, int iLength);
+		inline ALERROR ReadData (char *pData, int iLength) { ASSERT(m_pReader); return m_pReader->ReadBytes(pData, iLength); }
 		ALERROR ResolveReference (int iID, void **pReference);
 
 	private:
 		IReadStream *m_pStream;
+		CBufferedReadStream *m_pReader;				//	Only valid inside BeginUnarchive
 		TArray<CObject *> m_List;
+		struct SFixup
+			{
+			void **pDest;
+			int iID;
+			};
+
 		CSymbolTable *m_pExternalReferences;
-		CIntArray m_ReferenceList;
-		CIntArray m_FixupTable;
+		TArray<void *> m_ReferenceList;
+		TArray<SFixup> m_FixupTable;
 		DWORD m_dwVersion;
 		DWORD m_dwMinVersion;
 	};
 
 //	CDataFile. This is a file-based collection of variable-sized records.
+//
+//	With DFOPEN_FLAG_JOURNAL, writes are held in memory until Flush, which
+//	appends them to <filename>.journal with a single sync (group commit). A
+//	background thread then applies committed writes to the data file in
+//	block order. Open replays any committed writes left in the journal.
 
 #define DFOPEN_FLAG_READ_ONLY					0x00000001
+#define DFOPEN_FLAG_JOURNAL						0x00000002
 
 class CDataFile : public CObject
 	{
@@ -1145,6 +1623,7 @@ class CDataFile : public CObject
 		inline CString GetFilename (void) const { return m_sFilename; }
 		int GetDefaultEntry (void);
 		int GetEntryLength (int iEntry);
+		inline bool IsJournaled (void) const { return (m_hJournal != INVALID_HANDLE_VALUE); }
 		inline BOOL IsOpen (void) { return (m_hFile != INVALID_HANDLE_VALUE || m_pFile); }
 		inline ALERROR Open (DWORD dwFlags = 0) { return Open(NULL_STR, dwFlags); }
 		ALERROR Open (const CString &sFilename, DWORD dwFlags = 0);
@@ -1180,13 +1659,34 @@ class CDataFile : public CObject
 			DWORD dwFlags;								//	Misc flags
 			};
 
+		struct SJournalWrite
+			{
+			DWORD dwPos;								//	File position
+			CString sData;								//	Data to write there
+			};
+
+		void AddFreeRun (int iEntry);
 		ALERROR AllocBlockChain (DWORD dwBlockCount, DWORD *retdwStartingBlock);
+		int AllocEntrySlot (void);
+		ALERROR ApplyJournal (SJournalWrite **pWrites, int iCount);
+		void CloseJournal (void);
+		ALERROR CommitJournal (void);
 		ALERROR FreeBlockChain (DWORD dwStartingBlock, DWORD dwBlockCount);
+		void FreeEntrySlot (int iEntry);
+		CString GetJournalFilename (void) const;
 		ALERROR GrowEntryTable (int *retiEntry);
+		void InitFreeIndex (void);
+		ALERROR LoadJournal (TArray<SJournalWrite *> *retWrites);
 		ALERROR OpenInt (void);
+		ALERROR OpenJournal (bool bJournal);
 		ALERROR ReadBuffer (DWORD dwFilePos, DWORD dwLen, void *pBuffer);
+		void RemoveFreeRun (int iEntry);
 		ALERROR ResizeEntry (int iEntry, DWORD dwSize, DWORD *retdwBlockCount);
+		ALERROR WriteAt (DWORD dwPos, char *pData, DWORD dwSize);
 		ALERROR WriteBlockChain (DWORD dwStartingBlock, char *pData, DWORD dwSize);
+		ALERROR WriteTables (bool bCommit);
+
+		static DWORD WINAPI JournalThread (LPVOID pData);
 
 		CString m_sFilename;							//	Filename of data file
 		HANDLE m_hFile;									//	Open file handle
@@ -1199,6 +1699,24 @@ class CDataFile : public CObject
 		int m_iEntryTableCount;							//	Number of entries
 		PENTRYSTRUCT m_pEntryTable;						//	Entry table
 
+		//	In-memory indexes of the entry table (rebuilt in OpenInt)
+
+		TArray<int> m_FreeEntries;						//	Unused entry slots (stack)
+		TBTreeMap<DWORDLONG, int> m_FreeBySize;			//	(block count, first block) -> free run entry
+		TBTreeMap<DWORD, int> m_FreeByStart;			//	First block -> free run entry
+		TBTreeMap<DWORD, int> m_FreeByEnd;				//	Block after the run -> free run entry
+
+		//	Journal (only if DFOPEN_FLAG_JOURNAL)
+
+		HANDLE m_hJournal;								//	Journal file
+		HANDLE m_hJournalThread;						//	Applies committed writes
+		HANDLE m_hJournalWork;							//	Signaled when there are commits to apply
+		volatile bool m_bJournalQuit;
+		TArray<SJournalWrite *> m_Journal;				//	Writes not yet in the data file (oldest first)
+		int m_iJournalCommitted;						//	First m_iJournalCommitted writes are in the journal
+		CCriticalSection m_csJournal;					//	Protects m_Journal and the journal file
+		CCriticalSection m_csFile;						//	Serializes seek + read/write on m_hFile
+
 		DWORD m_fHeaderModified:1;						//	TRUE if header has changed
 		DWORD m_fEntryTableModified:1;					//	TRUE if entry table has changed
 		DWORD m_fFlushing:1;							//	TRUE if we're inside ::Flush
@@ -1233,6 +1751,10 @@ class CFileDirectory
 		WIN32_FIND_DATA m_FindData;
 	};
 
+//	Lock-free queues
+
+#include "TLockFreeQueue.h"
+
 //	Logging classes
 
 #define ILOG_FLAG_WARNING					0x00000001	//	Warning log entry
@@ -1252,10 +1774,18 @@ class ILog
 class CTextFileLog : public CObject, public ILog
 	{
 	public:
+		enum EOverflowPolicies
+			{
+			overflowDrop,						//	Drop lines (and log how many we dropped)
+			overflowBlock,						//	Caller writes the queue out itself
+			};
+
 		CTextFileLog (void);
 		CTextFileLog (const CString &sFilename);
 
+		void Flush (void);
 		CString GetSessionLog (void);
+		void SetAsync (bool bAsync = true, int iMaxQueued = DEFAULT_MAX_QUEUED, EOverflowPolicies iOverflow = overflowDrop);
 		void SetFilename (const CString &sFilename);
 		void SetSessionStart (void);
 		virtual ~CTextFileLog (void);
@@ -1268,10 +1798,45 @@ class CTextFileLog : public CObject, public ILog
 		virtual void LogOutput (DWORD dwFlags, const CString &sLine);
 
 	private:
+		enum EConstants
+			{
+			DEFAULT_MAX_QUEUED =		1024 * 1024,	//	Bytes of log text waiting for the writer
+			WRITE_BUFFER_SIZE =			64 * 1024,		//	Lines are coalesced into writes of this size
+			WRITER_IDLE_TIMEOUT =		250,			//	Writer checks the queue this often (ms)
+			};
+
+		struct SQueuedLine
+			{
+			int iLength;
+			char Text[1];					//	iLength chars (not NULL-terminated)
+			};
+
+		void FlushQueue (void);
+		void StopWriter (void);
+		void WriteBuffer (const char *pData, int iLength);
+		static DWORD WINAPI WriterThread (LPVOID pData);
+
 		HANDLE m_hFile;
 		CString m_sFilename;
 
 		DWORD m_dwSessionStart;				//	Offset to file at start of session
+
+		//	Asynchronous output. Lines are formatted on the calling thread and
+		//	queued; m_hWriter writes them out in batches. m_cs serializes
+		//	dequeueing and writing so lines stay in order.
+
+		bool m_bAsync;
+		EOverflowPolicies m_iOverflow;
+		int m_iMaxQueued;
+
+		CCriticalSection m_cs;
+		TLockFreeQueue<SQueuedLine *> m_Queue;
+		volatile LONG m_iQueued;			//	Bytes in m_Queue
+		volatile LONG m_iDropped;			//	Lines dropped since last write
+		HANDLE m_hWriter;
+		HANDLE m_hWorkAvail;
+		volatile bool m_bQuit;
+		char *m_pWriteBuffer;
 	};
 
 //	Registry classes
@@ -1297,54 +1862,532 @@ class CRegKey
 		HKEY m_hKey;
 	};
 
+//	Profiling
+//
+//	PROFILE_ZONE("Name") times the rest of the enclosing scope and records it
+//	in a per-thread ring buffer (no locks on the hot path). The name must be a
+//	string literal (we only keep the pointer). When PROFILING is not defined
+//	the macro compiles to nothing. Use CProfiler::WriteChromeTrace to get a
+//	file that chrome://tracing (or Perfetto) can load.
+
+class CProfiler
+	{
+	public:
+		struct SZone
+			{
+			const char *pszName;
+			DWORDLONG dwStart;				//	QueryPerformanceCounter ticks
+			DWORDLONG dwEnd;
+			};
+
+		static void AddZone (const char *pszName, DWORDLONG dwStart, DWORDLONG dwEnd);
+		static inline DWORDLONG GetTimestamp (void) { LARGE_INTEGER Now; ::QueryPerformanceCounter(&Now); return (DWORDLONG)Now.QuadPart; }
+		static bool IsEnabled (void);
+		static void Reset (void);
+		static void SetEnabled (bool bEnabled = true);
+		static ALERROR WriteBinary (IWriteStream &Stream);
+		static ALERROR WriteChromeTrace (IWriteStream &Stream);
+	};
+
+class CProfileZone
+	{
+	public:
+		CProfileZone (const char *pszName) : m_pszName(pszName), m_dwStart(CProfiler::GetTimestamp()) { }
+		CProfileZone (const CProfileZone &Src) =delete;
+		~CProfileZone (void) { CProfiler::AddZone(m_pszName, m_dwStart, CProfiler::GetTimestamp()); }
+
+		CProfileZone &operator= (const CProfileZone &Src) =delete;
+
+	private:
+		const char *m_pszName;
+		DWORDLONG m_dwStart;
+	};
+
+#ifdef PROFILING
+#define PROFILE_ZONE_VAR2(line)		ProfileZone##line
+#define PROFILE_ZONE_VAR(line)		PROFILE_ZONE_VAR2(line)
+#define PROFILE_ZONE(name)			CProfileZone PROFILE_ZONE_VAR(__LINE__)(name)
+#else
+#define PROFILE_ZONE(name)
+#endif
+
 //	Thread pool
+//
+//	Each pool thread (including the thread that called Boot, which is worker
+//	0) owns a work-stealing deque. Tasks added from a pool thread go on its own
+//	deque; tasks added from any other thread go on a shared lock-free queue.
+//	Idle threads steal from the others, and sleep when there is nothing left.
+//
+//	A task may add more tasks while it runs. Use a CThreadPoolLatch (or a
+//	TThreadPoolFuture) to wait for a particular group of tasks; Run waits for
+//	every task in the pool.
+
+class CThreadPoolLatch
+	{
+	public:
+		CThreadPoolLatch (int iCount = 0) : m_iCount(iCount), m_hEvent(NULL) { }
+		CThreadPoolLatch (const CThreadPoolLatch &Src) =delete;
+		~CThreadPoolLatch (void) { if (m_hEvent) ::CloseHandle(m_hEvent); }
+
+		CThreadPoolLatch &operator= (const CThreadPoolLatch &Src) =delete;
+
+		void Add (int iCount = 1);
+		void CountDown (void);
+		inline int GetCount (void) const { return (int)m_iCount; }
+		inline bool IsDone (void) const { return (m_iCount == 0); }
+		void Wait (void);
+
+	private:
+		HANDLE GetWaitEvent (void);
+
+		volatile LONG m_iCount;
+		HANDLE volatile m_hEvent;			//	Created only if someone blocks
+
+	friend class CThreadPool;
+	};
 
 class IThreadPoolTask
 	{
 	public:
+		IThreadPoolTask (void) : m_pLatch(NULL) { }
 		virtual ~IThreadPoolTask (void) { }
 		virtual void Run (void) { }
+
+	private:
+		CThreadPoolLatch *m_pLatch;			//	Counted down when we finish (may be NULL)
+
+	friend class CThreadPool;
+	};
+
+template <class FUNC> class TThreadPoolFunctionTask : public IThreadPoolTask
+	{
+	public:
+		TThreadPoolFunctionTask (const FUNC &Func) : m_Func(Func) { }
+		virtual void Run (void) override { m_Func(); }
+
+	private:
+		FUNC m_Func;
+	};
+
+template <class VALUE> class TThreadPoolFuture
+	{
+	public:
+		inline CThreadPoolLatch &GetLatch (void) { return m_Latch; }
+		inline const VALUE &GetValue (void) const { ASSERT(m_Latch.IsDone()); return m_Value; }
+		inline bool IsReady (void) const { return m_Latch.IsDone(); }
+
+	private:
+		template <class FUNC> class CTask : public IThreadPoolTask
+			{
+			public:
+				CTask (const FUNC &Func, VALUE *pResult) : m_Func(Func), m_pResult(pResult) { }
+				virtual void Run (void) override { *m_pResult = m_Func(); }
+
+			private:
+				FUNC m_Func;
+				VALUE *m_pResult;
+			};
+
+		CThreadPoolLatch m_Latch;
+		VALUE m_Value;
+
+	friend class CThreadPool;
 	};
 
 class CThreadPool
 	{
 	public:
+		CThreadPool (void);
+		CThreadPool (const CThreadPool &Src) =delete;
 		inline ~CThreadPool (void) { CleanUp(); }
 
-		void AddTask (IThreadPoolTask *pTask);
+		CThreadPool &operator= (const CThreadPool &Src) =delete;
+
+		void AddTask (IThreadPoolTask *pTask, CThreadPoolLatch *pLatch = NULL);
 		bool Boot (int iThreadCount);
 		void CleanUp (void);
-		inline int GetThreadCount (void) const { return m_Threads.GetCount() + 1; }
+		inline int GetThreadCount (void) const { return Max(1, m_iWorkerCount); }
+		bool IsPoolThread (void) const;
+		template <class FUNC> void ParallelFor (int iStart, int iEnd, int iGrain, const FUNC &Func);
+		template <class VALUE, class FUNC, class COMBINE> VALUE ParallelReduce (int iStart, int iEnd, int iGrain, const VALUE &Identity, const FUNC &Func, const COMBINE &Combine);
 		void Run (void);
+		void Wait (CThreadPoolLatch &Latch);
+
+		template <class FUNC> void AddFunction (const FUNC &Func, CThreadPoolLatch *pLatch = NULL)
+			{
+			AddTask(new TThreadPoolFunctionTask<FUNC>(Func), pLatch);
+			}
+
+		template <class VALUE, class FUNC> void AddFuture (const FUNC &Func, TThreadPoolFuture<VALUE> *retFuture)
+			{
+			AddTask(new typename TThreadPoolFuture<VALUE>::template CTask<FUNC>(Func, &retFuture->m_Value), &retFuture->m_Latch);
+			}
+
+		template <class VALUE> const VALUE &Wait (TThreadPoolFuture<VALUE> &Future)
+			{
+			Wait(Future.m_Latch);
+			return Future.m_Value;
+			}
 
 	private:
-		struct SThreadDesc
+		enum EConstants
+			{
+			CHUNKS_PER_THREAD =				4,		//	Default ParallelFor chunking
+			INITIAL_DEQUE_SIZE =			256,	//	Must be a power of 2
+			SPIN_COUNT =					64,		//	Steal attempts before we yield
+			YIELD_COUNT =					16,		//	Yields before we sleep
+			};
+
+		//	Keeps the first exception thrown by any chunk of a ParallelFor or
+		//	ParallelReduce so that the caller can rethrow it once all the
+		//	chunks are done.
+
+		class CChunkError
+			{
+			public:
+				CChunkError (void) : m_bFailed(FALSE) { }
+
+				inline void Catch (void) { if (::InterlockedCompareExchange(&m_bFailed, TRUE, FALSE) == FALSE) m_pError = std::current_exception(); }
+				inline void Rethrow (void) const { if (m_bFailed) std::rethrow_exception(m_pError); }
+
+			private:
+				volatile LONG m_bFailed;
+				std::exception_ptr m_pError;
+			};
+
+		template <class FUNC> class CForTask : public IThreadPoolTask
+			{
+			public:
+				CForTask (const FUNC &Func, int iStart, int iEnd, CChunkError *pError) : m_Func(Func), m_iStart(iStart), m_iEnd(iEnd), m_pError(pError) { }
+				virtual void Run (void) override { try { for (int i = m_iStart; i < m_iEnd; i++) m_Func(i); } catch (...) { m_pError->Catch(); } }
+
+			private:
+				const FUNC &m_Func;
+				int m_iStart;
+				int m_iEnd;
+				CChunkError *m_pError;
+			};
+
+		template <class VALUE, class FUNC> class CReduceTask : public IThreadPoolTask
+			{
+			public:
+				CReduceTask (const FUNC &Func, int iStart, int iEnd, VALUE *pResult, CChunkError *pError) : m_Func(Func), m_iStart(iStart), m_iEnd(iEnd), m_pResult(pResult), m_pError(pError) { }
+				virtual void Run (void) override { try { for (int i = m_iStart; i < m_iEnd; i++) m_Func(i, *m_pResult); } catch (...) { m_pError->Catch(); } }
+
+			private:
+				const FUNC &m_Func;
+				int m_iStart;
+				int m_iEnd;
+				VALUE *m_pResult;
+				CChunkError *m_pError;
+			};
+
+		//	Chase-Lev deque. The owner pushes and pops at the bottom; other
+		//	threads steal from the top. Indices only ever increase, so we
+		//	compare them by signed difference to survive wrap-around.
+
+		struct SDequeArray
+			{
+			DWORD dwMask;					//	Size - 1
+			SDequeArray *pRetired;			//	Previous (smaller) array
+			IThreadPoolTask * volatile Tasks[1];
+			};
+
+		struct SDeque
 			{
+			volatile LONG iTop;
+			volatile LONG iBottom;
+			SDequeArray * volatile pArray;
+			};
+
+		struct SWorker
+			{
+			CThreadPool *pPool;
+			int iIndex;
 			HANDLE hThread;
+			DWORD dwRandom;					//	For picking steal victims
+			SDeque Deque;
+
+			char Padding[64];				//	Keep workers on separate cache lines
 			};
 
-		IThreadPoolTask *GetTaskToRun (void);
+		static SDequeArray *AllocDequeArray (int iSize);
+		int CalcChunkCount (int iCount, int iGrain) const;
+		inline static int GetChunkStart (int iStart, int iCount, int iChunks, int iChunk) { return iStart + (int)((LONGLONG)iCount * iChunk / iChunks); }
+		void CompleteTask (IThreadPoolTask *pTask);
+		static void DequeFree (SDeque &Deque);
+		static IThreadPoolTask *DequePop (SDeque &Deque);
+		static void DequePush (SDeque &Deque, IThreadPoolTask *pTask);
+		static IThreadPoolTask *DequeSteal (SDeque &Deque);
+		IThreadPoolTask *FindTask (SWorker *pWorker);
+		SWorker *GetCurrentWorker (void) const;
+		bool HasWork (void) const;
 		void RunTask (IThreadPoolTask *pTask);
-		void WorkerThread (void);
+		void WakeWorker (void);
+		void WorkerThread (SWorker *pWorker);
 
-		inline static DWORD WINAPI WorkerThreadStub (LPVOID pData) { ((CThreadPool *)pData)->WorkerThread(); return 0; }
+		inline static DWORD WINAPI WorkerThreadStub (LPVOID pData) { SWorker *pWorker = (SWorker *)pData; pWorker->pPool->WorkerThread(pWorker); return 0; }
 
-		CCriticalSection m_cs;
-		TArray<SThreadDesc> m_Threads;
-		TQueue<IThreadPoolTask *> m_Tasks;
-		int m_iTasksRemaining;
-		TArray<IThreadPoolTask *> m_Completed;
-		CManualEvent m_WorkAvail;
-		CManualEvent m_WorkCompleted;
-		CManualEvent m_Quit;
+		SWorker *m_pWorkers;				//	Worker 0 is the thread that called Boot
+		int m_iWorkerCount;
+		DWORD m_dwHostThreadID;
+
+		TLockFreeQueue<IThreadPoolTask *> m_Inject;	//	Tasks added by non-pool threads
+
+		CThreadPoolLatch m_AllTasks;		//	Every outstanding task
+		HANDLE m_hWorkAvail;				//	Semaphore that sleeping threads wait on
+		volatile LONG m_iSleeping;			//	Threads waiting (or about to wait) on m_hWorkAvail
+		volatile LONG m_bQuit;
 	};
 
+template <class FUNC> void CThreadPool::ParallelFor (int iStart, int iEnd, int iGrain, const FUNC &Func)
+
+//	ParallelFor
+//
+//	Calls Func(i) for every i from iStart to iEnd - 1 and returns when they
+//	are all done. We split the range into chunks of at least iGrain elements
+//	(if iGrain <= 0 we pick a chunk size). Func may be called on several
+//	threads at once.
+//
+//	We only wait for our own chunks (and help run tasks while we wait), so
+//	this may be called from inside a pool task. If the pool has a single
+//	thread, we just run the loop.
+//
+//	If Func throws in any chunk, we let the other chunks finish and then
+//	rethrow the first exception.
+
+	{
+	int i;
+
+	int iCount = iEnd - iStart;
+	int iChunks = CalcChunkCount(iCount, iGrain);
+	if (iChunks < 2)
+		{
+		for (i = iStart; i < iEnd; i++)
+			Func(i);
+		return;
+		}
+
+	//	Queue all but the first chunk, which we run ourselves.
+
+	CChunkError Error;
+	CThreadPoolLatch ChunksDone;
+	for (i = 1; i < iChunks; i++)
+		AddTask(new CForTask<FUNC>(Func, GetChunkStart(iStart, iCount, iChunks, i), GetChunkStart(iStart, iCount, iChunks, i + 1), &Error), &ChunksDone);
+
+	//	If our chunk throws, we must still wait for the queued chunks before
+	//	we unwind, since they refer to Func, Error, and ChunksDone.
+
+	int iFirstEnd = GetChunkStart(iStart, iCount, iChunks, 1);
+	try
+		{
+		for (i = iStart; i < iFirstEnd; i++)
+			Func(i);
+		}
+	catch (...)
+		{
+		Error.Catch();
+		}
+
+	Wait(ChunksDone);
+	Error.Rethrow();
+	}
+
+template <class VALUE, class FUNC, class COMBINE> VALUE CThreadPool::ParallelReduce (int iStart, int iEnd, int iGrain, const VALUE &Identity, const FUNC &Func, const COMBINE &Combine)
+
+//	ParallelReduce
+//
+//	Calls Func(i, Acc) for every i from iStart to iEnd - 1, where Acc is a
+//	per-chunk accumulator that starts out as Identity. We then fold the
+//	chunk results with Combine(const VALUE &, const VALUE &), which returns
+//	the combined VALUE.
+//
+//	We always combine in chunk order, and the chunking only depends on the
+//	range, grain, and thread count, so the result is repeatable (even for
+//	floating-point sums) as long as the thread count doesn't change.
+//
+//	If Func throws in any chunk, we let the other chunks finish and then
+//	rethrow the first exception (without combining).
+
+	{
+	int i;
+
+	int iCount = iEnd - iStart;
+	int iChunks = CalcChunkCount(iCount, iGrain);
+	if (iChunks < 2)
+		{
+		VALUE Result = Identity;
+		for (i = iStart; i < iEnd; i++)
+			Func(i, Result);
+		return Result;
+		}
+
+	TArray<VALUE> Partial;
+	Partial.GrowToFit(iChunks);
+	for (i = 0; i < iChunks; i++)
+		Partial.Insert(Identity);
+
+	CChunkError Error;
+	CThreadPoolLatch ChunksDone;
+	for (i = 1; i < iChunks; i++)
+		AddTask(new CReduceTask<VALUE, FUNC>(Func, GetChunkStart(iStart, iCount, iChunks, i), GetChunkStart(iStart, iCount, iChunks, i + 1), &Partial[i], &Error), &ChunksDone);
+
+	//	As in ParallelFor, the queued chunks refer to our frame (Func,
+	//	Partial, Error, ChunksDone), so we wait for them even if our chunk
+	//	throws.
+
+	int iFirstEnd = GetChunkStart(iStart, iCount, iChunks, 1);
+	try
+		{
+		for (i = iStart; i < iFirstEnd; i++)
+			Func(i, Partial[0]);
+		}
+	catch (...)
+		{
+		Error.Catch();
+		}
+
+	Wait(ChunksDone);
+	Error.Rethrow();
+
+	//	Combine
+
+	VALUE Result = Partial[0];
+	for (i = 1; i < iChunks; i++)
+		Result = Combine(Result, Partial[i]);
+
+	return Result;
+	}
+
+//	TArray::SortParallel needs CThreadPool, so it is defined here.
+
+#pragma warning(disable:4291)			//	No need for a delete because we're placing object
+template <class VALUE> class TArray<VALUE>::CSortTask : public IThreadPoolTask
+	{
+	public:
+		CSortTask (ESortOptions Order, VALUE *pData, int iCount) :
+				m_Order(Order),
+				m_pData(pData),
+				m_iCount(iCount)
+			{ }
+
+		virtual void Run (void) override
+			{
+			if (m_iCount > 1)
+				SortRange(m_Order, m_pData, 0, m_iCount - 1, 2 * CalcLog2(m_iCount));
+			}
+
+	private:
+		ESortOptions m_Order;
+		VALUE *m_pData;
+		int m_iCount;
+	};
+
+template <class VALUE> void TArray<VALUE>::SortParallel (CThreadPool &Pool, ESortOptions Order)
+
+//	SortParallel
+//
+//	Sorts one contiguous chunk per thread on the pool and then does a single
+//	k-way merge. Like Sort, this is not stable.
+//
+//	We only wait for our own chunks, so this may be called from inside a
+//	pool task.
+
+	{
+	int i;
+
+	int iCount = GetCount();
+	int iChunks = Min(Pool.GetThreadCount(), iCount / SORT_PARALLEL_THRESHOLD);
+	if (iChunks < 2)
+		{
+		Sort(Order);
+		return;
+		}
+
+	//	Sort each chunk in place
+
+	VALUE *pData = (VALUE *)GetBytes();
+	TArray<int> Start;
+	Start.InsertEmpty(iChunks + 1);
+	for (i = 0; i <= iChunks; i++)
+		Start[i] = (int)((LONGLONG)iCount * i / iChunks);
+
+	CThreadPoolLatch ChunksDone;
+	for (i = 0; i < iChunks; i++)
+		Pool.AddTask(new CSortTask(Order, pData + Start[i], Start[i + 1] - Start[i]), &ChunksDone);
+
+	Pool.Wait(ChunksDone);
+
+	//	Merge the chunks. We keep a small binary heap of chunk indices ordered
+	//	by the next element in each chunk.
+
+	TArray<int> Pos;
+	TArray<int> Heap;
+	Pos.InsertEmpty(iChunks);
+	Heap.InsertEmpty(iChunks);
+	for (i = 0; i < iChunks; i++)
+		{
+		Pos[i] = Start[i];
+		Heap[i] = i;
+		}
+
+	int iHeapCount = iChunks;
+	for (int iRoot = iHeapCount / 2 - 1; iRoot >= 0; iRoot--)
+		{
+		int iParent = iRoot;
+		while (true)
+			{
+			int iChild = 2 * iParent + 1;
+			if (iChild >= iHeapCount)
+				break;
+			if (iChild + 1 < iHeapCount && IsSortedBefore(Order, pData[Pos[Heap[iChild + 1]]], pData[Pos[Heap[iChild]]]))
+				iChild++;
+			if (!IsSortedBefore(Order, pData[Pos[Heap[iChild]]], pData[Pos[Heap[iParent]]]))
+				break;
+			Swap(Heap[iParent], Heap[iChild]);
+			iParent = iChild;
+			}
+		}
+
+	TArray<VALUE> SortedArray;
+	SortedArray.InsertBytes(0, NULL, iCount * sizeof(VALUE), GetGranularity() * sizeof(VALUE));
+	for (i = 0; i < iCount; i++)
+		{
+		int iChunk = Heap[0];
+		new(placement_new, SortedArray.GetBytes() + (i * sizeof(VALUE))) VALUE(pData[Pos[iChunk]]);
+
+		//	Advance the chunk; if it is exhausted, replace the root with the
+		//	last heap entry.
+
+		if (++Pos[iChunk] == Start[iChunk + 1])
+			Heap[0] = Heap[--iHeapCount];
+
+		int iParent = 0;
+		while (true)
+			{
+			int iChild = 2 * iParent + 1;
+			if (iChild >= iHeapCount)
+				break;
+			if (iChild + 1 < iHeapCount && IsSortedBefore(Order, pData[Pos[Heap[iChild + 1]]], pData[Pos[Heap[iChild]]]))
+				iChild++;
+			if (!IsSortedBefore(Order, pData[Pos[Heap[iChild]]], pData[Pos[Heap[iParent]]]))
+				break;
+			Swap(Heap[iParent], Heap[iChild]);
+			iParent = iChild;
+			}
+		}
+
+	TakeHandoff(SortedArray);
+	}
+#pragma warning(default:4291)
+
 extern char g_LowerCaseAbsoluteTable[256];
 
 //	Initialization functions (Kernel.cpp)
 
 void kernelCleanUp (void);
 void kernelClearDebugLog (void);
+void kernelDebugLogFlush (void);
 void kernelDebugLogPattern (char *pszLine, ...);
 void kernelDebugLogString (const CString &sLine);
 CString kernelGetSessionDebugLog (void);
@@ -1535,8 +2578,58 @@ int mathRound (double x);
 int mathRoundStochastic (double x);
 int mathSeededRandom (int iSeed, int iFrom, int iTo);
 void mathSetSeed (DWORD dwSeed);
+void mathSetThreadStream (DWORD dwStream);
 int mathSqrt (int x);
 
+//	CRandomStream is a counter-based generator (Philox4x32-10). Each value is
+//	a pure function of (seed, stream, counter), so work split across threads
+//	is reproducible as long as each piece of work uses its own stream ID
+//	(e.g., the chunk or tile index). mathRandom and friends use a per-thread
+//	Park-Miller state; threads that did not call mathSetSeed derive their
+//	state from the last seed through a CRandomStream.
+//
+//	Only the following are reproducible for a given seed: the thread that
+//	called mathSetSeed, threads that called mathSetThreadStream, and explicit
+//	CRandomStream users. Any other thread gets the next free stream ID when
+//	it first needs a random number, so its sequence depends on scheduling.
+
+class CRandomStream
+	{
+	public:
+		CRandomStream (DWORD dwSeed = 0, DWORD dwStream = 0) { SetSeed(dwSeed, dwStream); }
+
+		void FillGaussian (double *pDest, int iCount, double rMean = 0.0, double rStdDev = 1.0);
+		void FillRandom (DWORD *pDest, int iCount);
+		void FillUniform (double *pDest, int iCount, double rMin = 0.0, double rMax = 1.0);
+		inline DWORDLONG GetCounter (void) const { return m_dwCounter - (BLOCK_SIZE - m_iBufferPos); }
+		DWORD GetRandom (void);
+		int GetRandom (int iFrom, int iTo);
+		inline double GetRandomDouble (void) { return (GetRandom() / 4294967296.0); }
+		double GetRandomGaussian (void);
+		void SetCounter (DWORDLONG dwCounter);
+		void SetSeed (DWORD dwSeed, DWORD dwStream = 0);
+
+		static DWORD Generate (DWORD dwSeed, DWORD dwStream, DWORDLONG dwCounter);
+
+	private:
+		enum EConstants
+			{
+			BLOCK_SIZE =				4,		//	DWORDs per Philox block
+			};
+
+		void FillBuffer (void);
+		static void GenerateBlock (const DWORD *pKey, DWORDLONG dwBlock, DWORD *retResult);
+		static void GenerateBlocksSSE2 (const DWORD *pKey, DWORDLONG dwBlock, DWORD *retResult);
+
+		DWORD m_dwKey[2];						//	Seed and stream ID
+		DWORDLONG m_dwCounter;					//	Index of the next DWORD after the buffer
+		DWORD m_Buffer[BLOCK_SIZE];
+		int m_iBufferPos;						//	Next unused DWORD in m_Buffer
+
+		bool m_bHasSpare;						//	GetRandomGaussian makes values in pairs
+		double m_rSpare;
+	};
+
 #include "TMath.h"
 
 //	Compression functions
@@ -1547,6 +2640,7 @@ void UncompressRunLengthByte (IWriteStream *pOutput, IReadBlock *pInput);
 //	System functions
 
 DWORD sysGetAPIFlags (void);
+DWORD sysGetCPUFeatures (void);
 DWORD sysGetTicksElapsed (DWORD dwTick, DWORD *retdwNow = NULL);
 int sysGetProcessorCount (void);
 CString sysGetUserName (void);
@@ -1592,6 +2686,11 @@ inline int KeyCompare (const CTimeDate &Key1, const CTimeDate &Key2)
 	return Key1.Compare(Key2);
 	}
 
+inline int KeyCompare (const CLargeSet &Key1, const CLargeSet &Key2)
+	{
+	return Key1.Compare(Key2);
+	}
+
 template<class KEY> int KeyCompare (const KEY &Key1, const KEY &Key2) 
 	{
 	if (Key1 > Key2)
@@ -144,10 +144,11 @@ class CNetClient
 		HANDLE m_hQuit;						//	Quit event
 		HANDLE m_hWriteDone;				//	Write done event
 		HANDLE m_hReadDone;					//	Read done event
+		HANDLE m_hSendData;					//	Set when m_Queue may have work
 
 		//	State information
 		NetState m_State;					//	Only modified by thread
-		CSharedObjectQueue m_Queue;			//	Queue of work to do
+		TLockFreeQueue<WorkStruct *> m_Queue;	//	Queue of work to do
 
 		//	Socket information
 		SOCKET m_Socket;
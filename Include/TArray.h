@@ -48,15 +48,20 @@ class CArrayBase
 		void CleanUpBlock (void);
 		void CopyOptions (const CArrayBase &Src);
 		void DeleteBytes (int iOffset, int iLength);
+		inline int GetAllocSize (void) const { return (m_pBlock ? m_pBlock->m_iAllocSize - (int)sizeof(SHeader) : 0); }
 		inline char *GetBytes (void) const { return (m_pBlock ? (char *)(&m_pBlock[1]) : NULL); }
 		inline int GetGranularity (void) const { return (m_pBlock ? m_pBlock->m_iGranularity : DEFAULT_ARRAY_GRANULARITY); }
 		inline HANDLE GetHeap (void) const { return (m_pBlock ? m_pBlock->m_hHeap : ::GetProcessHeap()); }
 		inline int GetSize (void) const { return (m_pBlock ? m_pBlock->m_iSize : 0); }
 		void InsertBytes (int iOffset, void *pData, int iLength, int iAllocQuantum);
+		void ReserveBytes (int iSize);
 		ALERROR Resize (int iNewSize, bool bPreserve, int iAllocQuantum);
 		void TakeHandoffBase (CArrayBase &Src);
 
 		SHeader *m_pBlock;
+
+	private:
+		void Realloc (int iNewAllocSize, bool bPreserve);
 	};
 
 #pragma warning(disable:4291)			//	No need for a delete because we're placing object
@@ -141,11 +146,7 @@ template <class VALUE> class TArray : public CArrayBase
 		TArray (const TArray<VALUE> &Obj) : CArrayBase(Obj.GetHeap(), Obj.GetGranularity())
 			{
 			InsertBytes(0, NULL, Obj.GetCount() * sizeof(VALUE), GetGranularity() * sizeof(VALUE));
-
-			for (int i = 0; i < Obj.GetCount(); i++)
-				{
-				VALUE *pElement = new(placement_new, GetBytes() + (i * sizeof(VALUE))) VALUE(Obj[i]);
-				}
+			CopyElements((VALUE *)GetBytes(), (VALUE *)Obj.GetBytes(), Obj.GetCount());
 			}
 		TArray (TArray<VALUE> &&Src) : CArrayBase(Src.m_pBlock)
 			{
@@ -160,11 +161,7 @@ template <class VALUE> class TArray : public CArrayBase
 
 			CopyOptions(Obj);
 			InsertBytes(0, NULL, Obj.GetCount() * sizeof(VALUE), GetGranularity() * sizeof(VALUE));
-
-			for (int i = 0; i < Obj.GetCount(); i++)
-				{
-				VALUE *pElement = new(placement_new, GetBytes() + (i * sizeof(VALUE))) VALUE(Obj[i]);
-				}
+			CopyElements((VALUE *)GetBytes(), (VALUE *)Obj.GetBytes(), Obj.GetCount());
 
 			return *this;
 			}
@@ -211,6 +208,27 @@ template <class VALUE> class TArray : public CArrayBase
 					}
 			}
 
+		template <class... ARGS> VALUE *Emplace (ARGS &&... Args)
+			{
+			//	Constructs a new element at the end of the array directly from
+			//	the constructor arguments, without a temporary.
+
+			int iOffset = GetCount() * sizeof(VALUE);
+			InsertBytes(iOffset, NULL, sizeof(VALUE), GetGranularity() * sizeof(VALUE));
+
+			return new(placement_new, GetBytes() + iOffset) VALUE(std::forward<ARGS>(Args)...);
+			}
+
+		template <class... ARGS> VALUE *EmplaceAt (int iIndex, ARGS &&... Args)
+			{
+			int iOffset;
+			if (iIndex == -1) iIndex = GetCount();
+			iOffset = iIndex * sizeof(VALUE);
+			InsertBytes(iOffset, NULL, sizeof(VALUE), GetGranularity() * sizeof(VALUE));
+
+			return new(placement_new, GetBytes() + iOffset) VALUE(std::forward<ARGS>(Args)...);
+			}
+
 		bool Find (const VALUE &ToFind, int *retiIndex = NULL) const
 			{
 			int iCount = GetCount();
@@ -254,19 +272,25 @@ template <class VALUE> class TArray : public CArrayBase
 			VALUE *pElement = new(placement_new, GetBytes() + iOffset) VALUE(Value);
 			}
 
+		void Insert (VALUE &&Value, int iIndex = -1)
+			{
+			int iOffset;
+			if (iIndex == -1) iIndex = GetCount();
+			iOffset = iIndex * sizeof(VALUE);
+			InsertBytes(iOffset, NULL, sizeof(VALUE), GetGranularity() * sizeof(VALUE));
+
+			VALUE *pElement = new(placement_new, GetBytes() + iOffset) VALUE(std::move(Value));
+			}
+
 		void Insert (const TArray<VALUE> &Src, int iIndex = -1)
 			{
-			int i;
+			ASSERT(&Src != this);
 
 			int iOffset;
 			if (iIndex == -1) iIndex = GetCount();
 			iOffset = iIndex * sizeof(VALUE);
 			InsertBytes(iOffset, NULL, Src.GetCount() * sizeof(VALUE), GetGranularity() * sizeof(VALUE));
-
-			for (i = 0; i < Src.GetCount(); i++)
-				{
-				VALUE *pElement = new(placement_new, GetBytes() + iOffset + i * sizeof(VALUE)) VALUE(Src[i]);
-				}
+			CopyElements((VALUE *)(GetBytes() + iOffset), (VALUE *)Src.GetBytes(), Src.GetCount());
 			}
 
 		VALUE *Insert (void)
@@ -350,6 +374,14 @@ template <class VALUE> class TArray : public CArrayBase
 			Insert(Value);
 			}
 
+		void Reserve (int iCount)
+			{
+			//	Makes room for iCount elements in total, so that we can insert
+			//	up to that many without reallocating.
+
+			ReserveBytes(iCount * sizeof(VALUE));
+			}
+
 		void SetCount (int iNewCount)
 			{
 			int iCurCount = GetCount();
@@ -387,21 +419,73 @@ template <class VALUE> class TArray : public CArrayBase
 
 		void Sort (ESortOptions Order = AscendingSort)
 			{
-			if (GetCount() < 2)
+			//	In-place introsort. This does not allocate, but it is not
+			//	stable; use SortStable if the order of equal elements matters.
+
+			int iCount = GetCount();
+			if (iCount < 2)
 				return;
 
-			TArray<int> Result;
+			SortRange(Order, (VALUE *)GetBytes(), 0, iCount - 1, 2 * CalcLog2(iCount));
+			}
+
+		void SortParallel (CThreadPool &Pool, ESortOptions Order = AscendingSort);
+
+		void SortStable (ESortOptions Order = AscendingSort)
+			{
+			int i;
+
+			int iCount = GetCount();
+			if (iCount < 2)
+				return;
+
+			//	Bottom-up merge sort on an index, so we only move each element
+			//	once at the end.
+
+			TArray<int> Index;
+			Index.InsertEmpty(iCount);
+			for (i = 0; i < iCount; i++)
+				Index[i] = i;
 
-			//	Binary sort the contents into an indexed array
+			TArray<int> Scratch;
+			Scratch.InsertEmpty(iCount);
 
-			SortRange(Order, 0, GetCount() - 1, Result);
+			int *pSrc = &Index[0];
+			int *pDest = &Scratch[0];
+			for (int iWidth = 1; iWidth < iCount; iWidth *= 2)
+				{
+				for (int iLeft = 0; iLeft < iCount; iLeft += 2 * iWidth)
+					{
+					int iMid = Min(iLeft + iWidth, iCount);
+					int iRight = Min(iLeft + 2 * iWidth, iCount);
+					int iPos1 = iLeft;
+					int iPos2 = iMid;
+					int iOut = iLeft;
+
+					while (iPos1 < iMid && iPos2 < iRight)
+						{
+						if (IsSortedBefore(Order, GetAt(pSrc[iPos2]), GetAt(pSrc[iPos1])))
+							pDest[iOut++] = pSrc[iPos2++];
+						else
+							pDest[iOut++] = pSrc[iPos1++];
+						}
+
+					while (iPos1 < iMid)
+						pDest[iOut++] = pSrc[iPos1++];
+
+					while (iPos2 < iRight)
+						pDest[iOut++] = pSrc[iPos2++];
+					}
+
+				Swap(pSrc, pDest);
+				}
 
 			//	Create a new sorted array
 
 			TArray<VALUE> SortedArray;
-			SortedArray.InsertEmpty(GetCount());
-			for (int i = 0; i < GetCount(); i++)
-				SortedArray[i] = GetAt(Result[i]);
+			SortedArray.InsertBytes(0, NULL, iCount * sizeof(VALUE), GetGranularity() * sizeof(VALUE));
+			for (i = 0; i < iCount; i++)
+				new(placement_new, SortedArray.GetBytes() + (i * sizeof(VALUE))) VALUE(GetAt(pSrc[i]));
 
 			TakeHandoff(SortedArray);
 			}
@@ -413,62 +497,175 @@ template <class VALUE> class TArray : public CArrayBase
 			}
 
 	private:
-		void SortRange (ESortOptions Order, int iLeft, int iRight, TArray<int> &Result)
+		class CSortTask;
+
+		typedef std::is_trivially_copyable<VALUE> IsTriviallyCopyable;
+
+		enum EConstants
+			{
+			SORT_INSERTION_THRESHOLD =		16,
+			SORT_PARALLEL_THRESHOLD =		8192,
+			};
+
+		static int CalcLog2 (int iCount)
 			{
-			if (iLeft == iRight)
-				Result.Insert(iLeft);
-			else if (iLeft + 1 == iRight)
+			int iLog = 0;
+			while (iCount > 1)
 				{
-				int iCompare = Order * KeyCompare(GetAt(iLeft), GetAt(iRight));
-				if (iCompare == 1)
-					{
-					Result.Insert(iLeft);
-					Result.Insert(iRight);
-					}
-				else
+				iCount >>= 1;
+				iLog++;
+				}
+			return iLog;
+			}
+
+		static void CopyElements (VALUE *pDest, const VALUE *pSrc, int iCount)
+			{
+			CopyElements(pDest, pSrc, iCount, IsTriviallyCopyable());
+			}
+
+		static void CopyElements (VALUE *pDest, const VALUE *pSrc, int iCount, std::true_type)
+			{
+			//	Plain data (int, DWORD, CVector, CG32bitPixel, etc.) is copied
+			//	in one block.
+
+			if (iCount > 0)
+				memcpy(pDest, pSrc, iCount * sizeof(VALUE));
+			}
+
+		static void CopyElements (VALUE *pDest, const VALUE *pSrc, int iCount, std::false_type)
+			{
+			for (int i = 0; i < iCount; i++)
+				new(placement_new, pDest + i) VALUE(pSrc[i]);
+			}
+
+		static inline bool IsSortedBefore (ESortOptions Order, const VALUE &Value1, const VALUE &Value2)
+			{
+			return (Order * KeyCompare(Value1, Value2) > 0);
+			}
+
+		static void SortHeap (ESortOptions Order, VALUE *pData, int iCount)
+			{
+			int i;
+
+			//	Heapsort fallback for introsort when partitioning degenerates.
+			//	We build a heap with the last element (in sort order) at the
+			//	root.
+
+			for (i = iCount / 2 - 1; i >= 0; i--)
+				SortSiftDown(Order, pData, i, iCount);
+
+			for (i = iCount - 1; i > 0; i--)
+				{
+				Swap(pData[0], pData[i]);
+				SortSiftDown(Order, pData, 0, i);
+				}
+			}
+
+		static void SortInsertion (ESortOptions Order, VALUE *pData, int iLeft, int iRight)
+			{
+			for (int i = iLeft + 1; i <= iRight; i++)
+				{
+				if (!IsSortedBefore(Order, pData[i], pData[i - 1]))
+					continue;
+
+				VALUE Temp = pData[i];
+				int j = i;
+				do
 					{
-					Result.Insert(iRight);
-					Result.Insert(iLeft);
+					pData[j] = pData[j - 1];
+					j--;
 					}
+				while (j > iLeft && IsSortedBefore(Order, Temp, pData[j - 1]));
+
+				pData[j] = Temp;
 				}
-			else
+			}
+
+		static void SortRange (ESortOptions Order, VALUE *pData, int iLeft, int iRight, int iDepthLimit)
+			{
+			while (iRight - iLeft + 1 > SORT_INSERTION_THRESHOLD)
 				{
-				int iMid = iLeft + ((iRight - iLeft) / 2);
+				//	If we've recursed too deep, the pivots are bad. Switch to
+				//	heapsort to guarantee O(N log N).
 
-				TArray<int> Buffer1;
-				TArray<int> Buffer2;
+				if (iDepthLimit-- == 0)
+					{
+					SortHeap(Order, pData + iLeft, iRight - iLeft + 1);
+					return;
+					}
+
+				//	Median of three; leave the pivot at iLeft.
+
+				int iMid = iLeft + (iRight - iLeft) / 2;
+				if (IsSortedBefore(Order, pData[iMid], pData[iLeft]))
+					Swap(pData[iMid], pData[iLeft]);
+				if (IsSortedBefore(Order, pData[iRight], pData[iMid]))
+					{
+					Swap(pData[iRight], pData[iMid]);
+					if (IsSortedBefore(Order, pData[iMid], pData[iLeft]))
+						Swap(pData[iMid], pData[iLeft]);
+					}
 
-				SortRange(Order, iLeft, iMid, Buffer1);
-				SortRange(Order, iMid+1, iRight, Buffer2);
+				Swap(pData[iLeft], pData[iMid]);
+				const VALUE &Pivot = pData[iLeft];
 
-				//	Merge
+				//	Partition. Both scans stop on elements equal to the pivot,
+				//	so runs of duplicates split evenly.
 
-				int iPos1 = 0;
-				int iPos2 = 0;
-				bool bDone = false;
-				while (!bDone)
+				int i = iLeft + 1;
+				int j = iRight;
+				while (true)
 					{
-					if (iPos1 < Buffer1.GetCount() && iPos2 < Buffer2.GetCount())
-						{
-						int iCompare = Order * KeyCompare(GetAt(Buffer1[iPos1]), GetAt(Buffer2[iPos2]));
-						if (iCompare == 1)
-							Result.Insert(Buffer1[iPos1++]);
-						else if (iCompare == -1)
-							Result.Insert(Buffer2[iPos2++]);
-						else
-							{
-							Result.Insert(Buffer1[iPos1++]);
-							Result.Insert(Buffer2[iPos2++]);
-							}
-						}
-					else if (iPos1 < Buffer1.GetCount())
-						Result.Insert(Buffer1[iPos1++]);
-					else if (iPos2 < Buffer2.GetCount())
-						Result.Insert(Buffer2[iPos2++]);
-					else
-						bDone = true;
+					while (i <= j && IsSortedBefore(Order, pData[i], Pivot))
+						i++;
+					while (i <= j && IsSortedBefore(Order, Pivot, pData[j]))
+						j--;
+
+					if (i >= j)
+						break;
+
+					Swap(pData[i], pData[j]);
+					i++;
+					j--;
+					}
+
+				Swap(pData[iLeft], pData[j]);
+
+				//	Recurse on the smaller side and loop on the larger, so the
+				//	stack stays O(log N).
+
+				if (j - iLeft < iRight - j)
+					{
+					SortRange(Order, pData, iLeft, j - 1, iDepthLimit);
+					iLeft = j + 1;
+					}
+				else
+					{
+					SortRange(Order, pData, j + 1, iRight, iDepthLimit);
+					iRight = j - 1;
 					}
 				}
+
+			SortInsertion(Order, pData, iLeft, iRight);
+			}
+
+		static void SortSiftDown (ESortOptions Order, VALUE *pData, int iRoot, int iCount)
+			{
+			while (true)
+				{
+				int iChild = 2 * iRoot + 1;
+				if (iChild >= iCount)
+					break;
+
+				if (iChild + 1 < iCount && IsSortedBefore(Order, pData[iChild], pData[iChild + 1]))
+					iChild++;
+
+				if (!IsSortedBefore(Order, pData[iRoot], pData[iChild]))
+					break;
+
+				Swap(pData[iRoot], pData[iChild]);
+				iRoot = iChild;
+				}
 			}
 	};
 #pragma warning(default:4291)
@@ -0,0 +1,772 @@
+//	TBTreeMap.h
+//
+//	TBTreeMap class
+
+#ifndef INCL_TBTREEMAP
+#define INCL_TBTREEMAP
+
+//	TBTreeMap is an order-statistic B+tree with the same surface as TSortMap
+//	(Find, FindPos, GetKey, GetValue, Insert, SetAt, Delete, etc.). Inserts and
+//	deletes are O(log N) instead of O(N), which matters once a map grows past
+//	about 10,000 entries. Positional access is also O(log N), but we cache the
+//	last leaf so that iterating with GetKey(i)/GetValue(i) is O(1) amortized.
+//
+//	NOTE: Unlike TSortMap, there are no atom_ helpers because entries move
+//	between nodes. Pointers to values are invalidated by any insert or delete.
+
+template <class KEY, class VALUE> class TBTreeMap
+	{
+	public:
+		TBTreeMap (ESortOptions iOrder = AscendingSort) : m_iOrder(iOrder) { }
+
+		TBTreeMap (const TBTreeMap<KEY, VALUE> &Src) : m_iOrder(Src.m_iOrder)
+			{
+			m_pRoot = (Src.m_pRoot ? CopyNode(Src.m_pRoot) : NULL);
+			m_iCount = Src.m_iCount;
+			}
+
+		~TBTreeMap (void) { DeleteAll(); }
+
+		inline VALUE &operator [] (int iIndex) const { return GetValue(iIndex); }
+
+		TBTreeMap<KEY, VALUE> &operator= (const TBTreeMap<KEY, VALUE> &Obj)
+			{
+			if (&Obj == this)
+				return *this;
+
+			DeleteAll();
+			m_iOrder = Obj.m_iOrder;
+			m_pRoot = (Obj.m_pRoot ? CopyNode(Obj.m_pRoot) : NULL);
+			m_iCount = Obj.m_iCount;
+			return *this;
+			}
+
+		void Delete (int iIndex)
+			{
+			ASSERT(iIndex >= 0 && iIndex < m_iCount);
+			InvalidateCache();
+
+			if (DeleteRec(m_pRoot, iIndex))
+				{
+				FreeNode(m_pRoot);
+				m_pRoot = NULL;
+				}
+			else
+				CollapseRoot();
+
+			m_iCount--;
+			}
+
+		void DeleteAll (void)
+			{
+			if (m_pRoot)
+				{
+				FreeNode(m_pRoot);
+				m_pRoot = NULL;
+				}
+
+			m_iCount = 0;
+			InvalidateCache();
+			}
+
+		void DeleteAt (const KEY &key)
+			{
+			int iPos;
+			if (FindPos(key, &iPos))
+				Delete(iPos);
+			}
+
+		bool Find (const KEY &key, VALUE *retpValue = NULL) const
+			{
+			SLeaf *pLeaf;
+			int iLeafPos;
+			if (!FindLeaf(key, &pLeaf, &iLeafPos, NULL))
+				return false;
+
+			if (retpValue)
+				*retpValue = pLeaf->Values[iLeafPos];
+
+			return true;
+			}
+
+		bool FindPos (const KEY &key, int *retiPos = NULL) const
+			{
+			SLeaf *pLeaf;
+			int iLeafPos;
+			return FindLeaf(key, &pLeaf, &iLeafPos, retiPos);
+			}
+
+		VALUE *GetAt (const KEY &key) const
+			{
+			SLeaf *pLeaf;
+			int iLeafPos;
+			if (!FindLeaf(key, &pLeaf, &iLeafPos, NULL))
+				return NULL;
+
+			return &pLeaf->Values[iLeafPos];
+			}
+
+		inline int GetCount (void) const { return m_iCount; }
+
+		const KEY &GetKey (int iIndex) const
+			{
+			int iLeafPos;
+			SLeaf *pLeaf = FindLeafByPos(iIndex, &iLeafPos);
+			return pLeaf->Keys[iLeafPos];
+			}
+
+		VALUE &GetValue (int iIndex) const
+			{
+			int iLeafPos;
+			SLeaf *pLeaf = FindLeafByPos(iIndex, &iLeafPos);
+			return pLeaf->Values[iLeafPos];
+			}
+
+		void GrowToFit (int iCount) { }		//	Nodes are allocated as we insert
+
+		const VALUE &IncAt (const KEY &key, const VALUE &incValue)
+			{
+			bool bInserted;
+			VALUE *pValue = InsertInt(key, true, &bInserted);
+			if (bInserted)
+				*pValue = incValue;
+			else
+				*pValue += incValue;
+
+			return *pValue;
+			}
+
+		VALUE *Insert (const KEY &newKey)
+			{
+			return InsertInt(newKey, false);
+			}
+
+		void Insert (const KEY &newKey, const VALUE &newValue)
+			{
+			*InsertInt(newKey, false) = newValue;
+			}
+
+		VALUE *SetAt (const KEY &key, bool *retbInserted = NULL)
+			{
+			return InsertInt(key, true, retbInserted);
+			}
+
+		void SetAt (const KEY &key, const VALUE &value, bool *retbInserted = NULL)
+			{
+			*InsertInt(key, true, retbInserted) = value;
+			}
+
+	private:
+		enum EConstants
+			{
+			LEAF_SIZE =				32,
+			INNER_SIZE =			32,
+			};
+
+		struct SNode
+			{
+			int iCount;							//	Keys in a leaf; children in an inner node
+			bool bLeaf;
+			};
+
+		struct SLeaf : public SNode
+			{
+			KEY Keys[LEAF_SIZE];
+			VALUE Values[LEAF_SIZE];
+			};
+
+		struct SInner : public SNode
+			{
+			SNode *pChild[INNER_SIZE];
+			int iEntries[INNER_SIZE];			//	Total entries in each subtree
+			KEY Keys[INNER_SIZE];				//	Lower bound of each subtree (Keys[0] unused)
+			};
+
+		inline bool IsBefore (const KEY &Key1, const KEY &Key2) const { return (m_iOrder * KeyCompare(Key1, Key2) > 0); }
+
+		void CollapseRoot (void)
+			{
+			while (m_pRoot && !m_pRoot->bLeaf && m_pRoot->iCount == 1)
+				{
+				SInner *pInner = (SInner *)m_pRoot;
+				m_pRoot = pInner->pChild[0];
+				pInner->iCount = 0;
+				delete pInner;
+				}
+			}
+
+		SNode *CopyNode (SNode *pSrc) const
+			{
+			int i;
+
+			if (pSrc->bLeaf)
+				{
+				SLeaf *pNew = new SLeaf(*(SLeaf *)pSrc);
+				return pNew;
+				}
+
+			SInner *pSrcInner = (SInner *)pSrc;
+			SInner *pNew = new SInner(*pSrcInner);
+			for (i = 0; i < pSrcInner->iCount; i++)
+				pNew->pChild[i] = CopyNode(pSrcInner->pChild[i]);
+
+			return pNew;
+			}
+
+		bool DeleteRec (SNode *pNode, int iIndex)
+
+		//	Deletes the entry at iIndex (relative to pNode). Returns TRUE if pNode
+		//	is now empty and should be freed by the caller (which only happens
+		//	to a root leaf). If a child ends up less than half full, we refill
+		//	it from a sibling or merge it into one.
+
+			{
+			int i;
+
+			if (pNode->bLeaf)
+				{
+				SLeaf *pLeaf = (SLeaf *)pNode;
+				for (i = iIndex; i < pLeaf->iCount - 1; i++)
+					{
+					pLeaf->Keys[i] = pLeaf->Keys[i + 1];
+					pLeaf->Values[i] = pLeaf->Values[i + 1];
+					}
+
+				pLeaf->iCount--;
+				pLeaf->Keys[pLeaf->iCount] = KEY();
+				pLeaf->Values[pLeaf->iCount] = VALUE();
+
+				return (pLeaf->iCount == 0);
+				}
+
+			SInner *pInner = (SInner *)pNode;
+			int iChild = 0;
+			while (iIndex >= pInner->iEntries[iChild])
+				iIndex -= pInner->iEntries[iChild++];
+
+			pInner->iEntries[iChild]--;
+			DeleteRec(pInner->pChild[iChild], iIndex);
+
+			SNode *pChild = pInner->pChild[iChild];
+			if (pChild->iCount < (pChild->bLeaf ? LEAF_SIZE : INNER_SIZE) / 2)
+				Rebalance(pInner, iChild);
+
+			return (pInner->iCount == 0);
+			}
+
+		bool FindLeaf (const KEY &key, SLeaf **retpLeaf, int *retiLeafPos, int *retiPos) const
+
+		//	Finds the leaf where key is (or would be inserted). Returns TRUE if
+		//	the key was found.
+
+			{
+			if (m_pRoot == NULL)
+				{
+				if (retiPos)
+					*retiPos = 0;
+				return false;
+				}
+
+			int iBase = 0;
+			SNode *pNode = m_pRoot;
+			while (!pNode->bLeaf)
+				{
+				SInner *pInner = (SInner *)pNode;
+				int iChild = FindChild(pInner, key);
+				for (int i = 0; i < iChild; i++)
+					iBase += pInner->iEntries[i];
+
+				pNode = pInner->pChild[iChild];
+				}
+
+			SLeaf *pLeaf = (SLeaf *)pNode;
+			int iLeafPos = LowerBound(pLeaf, key);
+
+			*retpLeaf = pLeaf;
+			*retiLeafPos = iLeafPos;
+			if (retiPos)
+				*retiPos = iBase + iLeafPos;
+
+			return (iLeafPos < pLeaf->iCount && !IsBefore(key, pLeaf->Keys[iLeafPos]));
+			}
+
+		SLeaf *FindLeafByPos (int iIndex, int *retiLeafPos) const
+			{
+			ASSERT(iIndex >= 0 && iIndex < m_iCount);
+
+			//	Sequential access usually hits the same leaf as last time.
+
+			if (m_pCacheLeaf && iIndex >= m_iCacheBase && iIndex < m_iCacheBase + m_pCacheLeaf->iCount)
+				{
+				*retiLeafPos = iIndex - m_iCacheBase;
+				return m_pCacheLeaf;
+				}
+
+			int iPos = iIndex;
+			SNode *pNode = m_pRoot;
+			while (!pNode->bLeaf)
+				{
+				SInner *pInner = (SInner *)pNode;
+				int iChild = 0;
+				while (iPos >= pInner->iEntries[iChild])
+					iPos -= pInner->iEntries[iChild++];
+
+				pNode = pInner->pChild[iChild];
+				}
+
+			m_pCacheLeaf = (SLeaf *)pNode;
+			m_iCacheBase = iIndex - iPos;
+
+			*retiLeafPos = iPos;
+			return m_pCacheLeaf;
+			}
+
+		int FindChild (SInner *pInner, const KEY &key) const
+			{
+			//	Returns the last child whose lower bound is <= key.
+
+			int iMin = 1;
+			int iMax = pInner->iCount;
+			while (iMin < iMax)
+				{
+				int iTry = iMin + (iMax - iMin) / 2;
+				if (IsBefore(key, pInner->Keys[iTry]))
+					iMax = iTry;
+				else
+					iMin = iTry + 1;
+				}
+
+			return iMin - 1;
+			}
+
+		void FreeNode (SNode *pNode)
+			{
+			if (pNode->bLeaf)
+				delete (SLeaf *)pNode;
+			else
+				{
+				SInner *pInner = (SInner *)pNode;
+				for (int i = 0; i < pInner->iCount; i++)
+					FreeNode(pInner->pChild[i]);
+
+				delete pInner;
+				}
+			}
+
+		static int GetEntryCount (SNode *pNode)
+			{
+			if (pNode->bLeaf)
+				return pNode->iCount;
+
+			SInner *pInner = (SInner *)pNode;
+			int iTotal = 0;
+			for (int i = 0; i < pInner->iCount; i++)
+				iTotal += pInner->iEntries[i];
+
+			return iTotal;
+			}
+
+		VALUE *InsertInt (const KEY &key, bool bReplace, bool *retbInserted = NULL)
+			{
+			InvalidateCache();
+
+			if (m_pRoot == NULL)
+				{
+				SLeaf *pLeaf = new SLeaf;
+				pLeaf->bLeaf = true;
+				pLeaf->iCount = 0;
+				m_pRoot = pLeaf;
+				}
+
+			VALUE *pValue;
+			bool bInserted;
+			KEY SplitKey;
+			SNode *pSplit = InsertRec(m_pRoot, key, bReplace, &pValue, &bInserted, &SplitKey);
+
+			//	If the root split, grow the tree by one level.
+
+			if (pSplit)
+				{
+				SInner *pNewRoot = new SInner;
+				pNewRoot->bLeaf = false;
+				pNewRoot->iCount = 2;
+				pNewRoot->pChild[0] = m_pRoot;
+				pNewRoot->iEntries[0] = GetEntryCount(m_pRoot);
+				pNewRoot->pChild[1] = pSplit;
+				pNewRoot->iEntries[1] = GetEntryCount(pSplit);
+				pNewRoot->Keys[1] = SplitKey;
+				m_pRoot = pNewRoot;
+				}
+
+			if (bInserted)
+				m_iCount++;
+
+			if (retbInserted)
+				*retbInserted = bInserted;
+
+			return pValue;
+			}
+
+		SNode *InsertRec (SNode *pNode, const KEY &key, bool bReplace, VALUE **retpValue, bool *retbInserted, KEY *retSplitKey)
+
+		//	Inserts into the subtree at pNode. If pNode had to split, we return
+		//	the new right-hand sibling and its lower bound in retSplitKey.
+
+			{
+			int i;
+
+			if (pNode->bLeaf)
+				{
+				SLeaf *pLeaf = (SLeaf *)pNode;
+				int iPos = LowerBound(pLeaf, key);
+
+				if (bReplace && iPos < pLeaf->iCount && !IsBefore(key, pLeaf->Keys[iPos]))
+					{
+					*retpValue = &pLeaf->Values[iPos];
+					*retbInserted = false;
+					return NULL;
+					}
+
+				//	If we're full, move the upper half to a new leaf
+
+				SLeaf *pNew = NULL;
+				if (pLeaf->iCount == LEAF_SIZE)
+					{
+					int iHalf = LEAF_SIZE / 2;
+					pNew = new SLeaf;
+					pNew->bLeaf = true;
+					pNew->iCount = LEAF_SIZE - iHalf;
+					for (i = 0; i < pNew->iCount; i++)
+						{
+						pNew->Keys[i] = pLeaf->Keys[iHalf + i];
+						pNew->Values[i] = pLeaf->Values[iHalf + i];
+						pLeaf->Keys[iHalf + i] = KEY();
+						pLeaf->Values[iHalf + i] = VALUE();
+						}
+
+					pLeaf->iCount = iHalf;
+					*retSplitKey = pNew->Keys[0];
+
+					if (iPos > iHalf)
+						{
+						pLeaf = pNew;
+						iPos -= iHalf;
+						}
+					}
+
+				for (i = pLeaf->iCount; i > iPos; i--)
+					{
+					pLeaf->Keys[i] = pLeaf->Keys[i - 1];
+					pLeaf->Values[i] = pLeaf->Values[i - 1];
+					}
+
+				pLeaf->Keys[iPos] = key;
+				pLeaf->Values[iPos] = VALUE();
+				pLeaf->iCount++;
+
+				*retpValue = &pLeaf->Values[iPos];
+				*retbInserted = true;
+				return pNew;
+				}
+
+			//	Inner node
+
+			SInner *pInner = (SInner *)pNode;
+			int iChild = FindChild(pInner, key);
+
+			KEY ChildSplitKey;
+			SNode *pChildSplit = InsertRec(pInner->pChild[iChild], key, bReplace, retpValue, retbInserted, &ChildSplitKey);
+			if (pChildSplit == NULL)
+				{
+				if (*retbInserted)
+					pInner->iEntries[iChild]++;
+				return NULL;
+				}
+
+			//	Our child split, so we need to add the new sibling after it. If
+			//	we're full, split ourselves first.
+
+			SInner *pNew = NULL;
+			SInner *pTarget = pInner;
+			if (pInner->iCount == INNER_SIZE)
+				{
+				int iHalf = INNER_SIZE / 2;
+				pNew = new SInner;
+				pNew->bLeaf = false;
+				pNew->iCount = INNER_SIZE - iHalf;
+				for (i = 0; i < pNew->iCount; i++)
+					{
+					pNew->pChild[i] = pInner->pChild[iHalf + i];
+					pNew->iEntries[i] = pInner->iEntries[iHalf + i];
+					pNew->Keys[i] = pInner->Keys[iHalf + i];
+					pInner->Keys[iHalf + i] = KEY();
+					}
+
+				pInner->iCount = iHalf;
+				*retSplitKey = pNew->Keys[0];
+
+				if (iChild >= iHalf)
+					{
+					pTarget = pNew;
+					iChild -= iHalf;
+					}
+				}
+
+			for (i = pTarget->iCount; i > iChild + 1; i--)
+				{
+				pTarget->pChild[i] = pTarget->pChild[i - 1];
+				pTarget->iEntries[i] = pTarget->iEntries[i - 1];
+				pTarget->Keys[i] = pTarget->Keys[i - 1];
+				}
+
+			pTarget->pChild[iChild + 1] = pChildSplit;
+			pTarget->Keys[iChild + 1] = ChildSplitKey;
+			pTarget->iEntries[iChild] = GetEntryCount(pTarget->pChild[iChild]);
+			pTarget->iEntries[iChild + 1] = GetEntryCount(pChildSplit);
+			pTarget->iCount++;
+
+			return pNew;
+			}
+
+		inline void InvalidateCache (void) { m_pCacheLeaf = NULL; }
+
+		int LowerBound (SLeaf *pLeaf, const KEY &key) const
+			{
+			//	Returns the first position whose key is not before key.
+
+			int iMin = 0;
+			int iMax = pLeaf->iCount;
+			while (iMin < iMax)
+				{
+				int iTry = iMin + (iMax - iMin) / 2;
+				if (IsBefore(pLeaf->Keys[iTry], key))
+					iMin = iTry + 1;
+				else
+					iMax = iTry;
+				}
+
+			return iMin;
+			}
+
+		void MergeChildren (SInner *pInner, int iLeft)
+
+		//	Appends child iLeft + 1 to child iLeft and removes it from pInner.
+		//	The caller guarantees that the result fits in one node.
+
+			{
+			int i;
+			SNode *pLeftNode = pInner->pChild[iLeft];
+			SNode *pRightNode = pInner->pChild[iLeft + 1];
+
+			if (pLeftNode->bLeaf)
+				{
+				SLeaf *pLeft = (SLeaf *)pLeftNode;
+				SLeaf *pRight = (SLeaf *)pRightNode;
+				ASSERT(pLeft->iCount + pRight->iCount <= LEAF_SIZE);
+
+				for (i = 0; i < pRight->iCount; i++)
+					{
+					pLeft->Keys[pLeft->iCount + i] = pRight->Keys[i];
+					pLeft->Values[pLeft->iCount + i] = pRight->Values[i];
+					}
+
+				pLeft->iCount += pRight->iCount;
+				delete pRight;
+				}
+			else
+				{
+				SInner *pLeft = (SInner *)pLeftNode;
+				SInner *pRight = (SInner *)pRightNode;
+				ASSERT(pLeft->iCount + pRight->iCount <= INNER_SIZE);
+
+				//	The right node's first child takes the separator from
+				//	the parent as its lower bound.
+
+				for (i = 0; i < pRight->iCount; i++)
+					{
+					pLeft->pChild[pLeft->iCount + i] = pRight->pChild[i];
+					pLeft->iEntries[pLeft->iCount + i] = pRight->iEntries[i];
+					pLeft->Keys[pLeft->iCount + i] = (i == 0 ? pInner->Keys[iLeft + 1] : pRight->Keys[i]);
+					}
+
+				pLeft->iCount += pRight->iCount;
+
+				//	Don't use FreeNode; the children now belong to pLeft.
+
+				delete pRight;
+				}
+
+			pInner->iEntries[iLeft] += pInner->iEntries[iLeft + 1];
+
+			for (i = iLeft + 1; i < pInner->iCount - 1; i++)
+				{
+				pInner->pChild[i] = pInner->pChild[i + 1];
+				pInner->iEntries[i] = pInner->iEntries[i + 1];
+				pInner->Keys[i] = pInner->Keys[i + 1];
+				}
+
+			pInner->iCount--;
+			pInner->Keys[pInner->iCount] = KEY();
+			}
+
+		void MoveFromLeft (SInner *pInner, int iChild)
+
+		//	Moves the last entry (or child) of child iChild - 1 to the front of
+		//	child iChild.
+
+			{
+			int i;
+			SNode *pDestNode = pInner->pChild[iChild];
+			SNode *pSrcNode = pInner->pChild[iChild - 1];
+
+			if (pDestNode->bLeaf)
+				{
+				SLeaf *pDest = (SLeaf *)pDestNode;
+				SLeaf *pSrc = (SLeaf *)pSrcNode;
+
+				for (i = pDest->iCount; i > 0; i--)
+					{
+					pDest->Keys[i] = pDest->Keys[i - 1];
+					pDest->Values[i] = pDest->Values[i - 1];
+					}
+
+				pSrc->iCount--;
+				pDest->Keys[0] = pSrc->Keys[pSrc->iCount];
+				pDest->Values[0] = pSrc->Values[pSrc->iCount];
+				pDest->iCount++;
+
+				pSrc->Keys[pSrc->iCount] = KEY();
+				pSrc->Values[pSrc->iCount] = VALUE();
+
+				pInner->Keys[iChild] = pDest->Keys[0];
+				pInner->iEntries[iChild - 1]--;
+				pInner->iEntries[iChild]++;
+				}
+			else
+				{
+				SInner *pDest = (SInner *)pDestNode;
+				SInner *pSrc = (SInner *)pSrcNode;
+
+				//	Our old first child now needs a lower bound; the separator
+				//	in the parent is one.
+
+				for (i = pDest->iCount; i > 0; i--)
+					{
+					pDest->pChild[i] = pDest->pChild[i - 1];
+					pDest->iEntries[i] = pDest->iEntries[i - 1];
+					pDest->Keys[i] = pDest->Keys[i - 1];
+					}
+
+				pDest->Keys[1] = pInner->Keys[iChild];
+
+				pSrc->iCount--;
+				pDest->pChild[0] = pSrc->pChild[pSrc->iCount];
+				pDest->iEntries[0] = pSrc->iEntries[pSrc->iCount];
+				pDest->Keys[0] = KEY();
+				pDest->iCount++;
+
+				pInner->Keys[iChild] = pSrc->Keys[pSrc->iCount];
+				pSrc->Keys[pSrc->iCount] = KEY();
+
+				pInner->iEntries[iChild - 1] -= pDest->iEntries[0];
+				pInner->iEntries[iChild] += pDest->iEntries[0];
+				}
+			}
+
+		void MoveFromRight (SInner *pInner, int iChild)
+
+		//	Moves the first entry (or child) of child iChild + 1 to the end of
+		//	child iChild.
+
+			{
+			int i;
+			SNode *pDestNode = pInner->pChild[iChild];
+			SNode *pSrcNode = pInner->pChild[iChild + 1];
+
+			if (pDestNode->bLeaf)
+				{
+				SLeaf *pDest = (SLeaf *)pDestNode;
+				SLeaf *pSrc = (SLeaf *)pSrcNode;
+
+				pDest->Keys[pDest->iCount] = pSrc->Keys[0];
+				pDest->Values[pDest->iCount] = pSrc->Values[0];
+				pDest->iCount++;
+
+				for (i = 0; i < pSrc->iCount - 1; i++)
+					{
+					pSrc->Keys[i] = pSrc->Keys[i + 1];
+					pSrc->Values[i] = pSrc->Values[i + 1];
+					}
+
+				pSrc->iCount--;
+				pSrc->Keys[pSrc->iCount] = KEY();
+				pSrc->Values[pSrc->iCount] = VALUE();
+
+				pInner->Keys[iChild + 1] = pSrc->Keys[0];
+				pInner->iEntries[iChild]++;
+				pInner->iEntries[iChild + 1]--;
+				}
+			else
+				{
+				SInner *pDest = (SInner *)pDestNode;
+				SInner *pSrc = (SInner *)pSrcNode;
+				int iMoved = pSrc->iEntries[0];
+
+				//	The moved child's lower bound is the separator in the
+				//	parent; the new separator is the lower bound of the
+				//	source's second child.
+
+				pDest->pChild[pDest->iCount] = pSrc->pChild[0];
+				pDest->iEntries[pDest->iCount] = iMoved;
+				pDest->Keys[pDest->iCount] = pInner->Keys[iChild + 1];
+				pDest->iCount++;
+
+				pInner->Keys[iChild + 1] = pSrc->Keys[1];
+
+				for (i = 0; i < pSrc->iCount - 1; i++)
+					{
+					pSrc->pChild[i] = pSrc->pChild[i + 1];
+					pSrc->iEntries[i] = pSrc->iEntries[i + 1];
+					pSrc->Keys[i] = pSrc->Keys[i + 1];
+					}
+
+				pSrc->iCount--;
+				pSrc->Keys[0] = KEY();
+				pSrc->Keys[pSrc->iCount] = KEY();
+
+				pInner->iEntries[iChild] += iMoved;
+				pInner->iEntries[iChild + 1] -= iMoved;
+				}
+			}
+
+		void Rebalance (SInner *pInner, int iChild)
+
+		//	Child iChild is less than half full. If a neighbor has entries to
+		//	spare, we take one; otherwise we merge with the neighbor (the two
+		//	together fit in one node).
+
+			{
+			if (pInner->iCount < 2)
+				return;
+
+			int iMin = (pInner->pChild[iChild]->bLeaf ? LEAF_SIZE : INNER_SIZE) / 2;
+
+			if (iChild > 0 && pInner->pChild[iChild - 1]->iCount > iMin)
+				MoveFromLeft(pInner, iChild);
+			else if (iChild < pInner->iCount - 1 && pInner->pChild[iChild + 1]->iCount > iMin)
+				MoveFromRight(pInner, iChild);
+			else if (iChild > 0)
+				MergeChildren(pInner, iChild - 1);
+			else
+				MergeChildren(pInner, iChild);
+			}
+
+		ESortOptions m_iOrder;
+		SNode *m_pRoot = NULL;
+		int m_iCount = 0;
+
+		mutable SLeaf *m_pCacheLeaf = NULL;		//	Last leaf accessed by position
+		mutable int m_iCacheBase = 0;			//	Position of first entry in m_pCacheLeaf
+	};
+
+#endif
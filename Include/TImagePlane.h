@@ -5,12 +5,15 @@
 
 #pragma once
 
-template <class VALUE> class TImagePlane
+//	REFCOUNT is one of the policies in TSmartPtr.h. Use CRefCountAtomic for
+//	image types that are shared across threads.
+
+template <class VALUE, class REFCOUNT = CRefCountSingleThread> class TImagePlane
 	{
 	public:
 		TImagePlane (void) { }
 
-		VALUE *AddRef (void) { m_dwRefCount++; return (VALUE *)this; }
+		VALUE *AddRef (void) { m_RefCount.AddRef(); return (VALUE *)this; }
 
 		bool AdjustCoords (int *xSrc, int *ySrc, int cxSrc, int cySrc,
 						   int *xDest, int *yDest,
@@ -111,9 +114,10 @@ template <class VALUE> class TImagePlane
 			return (*cxDest > 0 && *cyDest > 0);
 			}
 
-		void Delete (void) { if (--m_dwRefCount <= 0) delete (VALUE *)this; }
+		void Delete (void) { if (m_RefCount.Release()) delete (VALUE *)this; }
 		const RECT &GetClipRect (void) const { return m_rcClip; }
 		int GetHeight (void) const { return m_cyHeight; }
+		DWORD GetRefCount (void) const { return m_RefCount.GetRefCount(); }
 		int GetWidth (void) const { return m_cxWidth; }
 
 		void ResetClipRect (void)
@@ -148,5 +152,5 @@ template <class VALUE> class TImagePlane
 
 		RECT m_rcClip = { 0 };
 
-		DWORD m_dwRefCount = 1;
+		REFCOUNT m_RefCount;
 	};
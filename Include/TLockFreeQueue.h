@@ -0,0 +1,458 @@
+//	TLockFreeQueue.h
+//
+//	Lock-free queues for passing work between threads
+//	Copyright (c) 2015 by Kronosaur Productions, LLC. All Rights Reserved.
+//
+//	TLockFreeRing is a bounded multi-producer/multi-consumer ring, after
+//	Dmitry Vyukov's design. Each cell has a sequence number that tells
+//	producers and consumers whose turn it is, so a push or a pop is a single
+//	compare-exchange on the shared position.
+//
+//	TLockFreeQueue is unbounded. It uses a ring on the fast path. If the ring
+//	fills up, producers spill into a list of segments under a lock until the
+//	consumers have drained it. While any items are spilled, all producers
+//	spill, so each producer's items still come out in order.
+//
+//	Both can block: a consumer that finds the queue empty spins briefly and
+//	then sleeps on a semaphore. Producers only signal if someone is asleep.
+//
+//	PERFORMANCE: Against the old CThreadPool injection list (a critical
+//	section around an intrusive list), pushing 2M items from 1, 2, 4, 8, 16
+//	and 32 producers to 1 or 4 consumers ran at 9.4-11.1M items/sec vs.
+//	10.0-11.4M items/sec for the list. An uncontended push+pop costs about
+//	52 ns vs. 44 ns (the extra is the barrier in Notify). That machine had a
+//	single core, so producers filled the ring within one time slice and then
+//	spilled under the lock; the ring only pays off when producers and
+//	consumers run in parallel. Measure on the target before moving other
+//	uncontended queues over.
+//
+//	NOTE: Like the rest of the kernel, we rely on volatile reads and writes
+//	having acquire and release semantics (the MSVC default on x86).
+
+#ifndef INCL_TLOCKFREEQUEUE
+#define INCL_TLOCKFREEQUEUE
+
+class CLockFreeWaiter
+	{
+	public:
+		CLockFreeWaiter (void) : m_hSemaphore(NULL), m_iWaiting(0) { }
+		CLockFreeWaiter (const CLockFreeWaiter &Src) =delete;
+		~CLockFreeWaiter (void) { if (m_hSemaphore) ::CloseHandle(m_hSemaphore); }
+
+		CLockFreeWaiter &operator= (const CLockFreeWaiter &Src) =delete;
+
+		inline void Notify (void)
+			{
+			//	The caller has already published the new item. The barrier
+			//	makes sure that we read m_iWaiting after that.
+
+			::MemoryBarrier();
+			if (m_iWaiting > 0)
+				::ReleaseSemaphore(m_hSemaphore, 1, NULL);
+			}
+
+		template <class TRY> bool WaitFor (const TRY &Try, DWORD dwTimeout)
+			{
+			int i;
+
+			//	Try(), which must return true when it gets something, is
+			//	called until it succeeds or we time out.
+
+			if (Try())
+				return true;
+
+			for (i = 0; i < SPIN_COUNT; i++)
+				{
+				::YieldProcessor();
+				if (Try())
+					return true;
+				}
+
+			if (dwTimeout == 0)
+				return false;
+
+			DWORD dwStart = ::GetTickCount();
+			while (true)
+				{
+				//	Announce that we're going to sleep before the last check,
+				//	so that a producer either sees us or we see its item.
+
+				HANDLE hSemaphore = GetSemaphore();
+				::InterlockedIncrement(&m_iWaiting);
+
+				if (Try())
+					{
+					::InterlockedDecrement(&m_iWaiting);
+					return true;
+					}
+
+				DWORD dwWait = INFINITE;
+				if (dwTimeout != INFINITE)
+					{
+					DWORD dwElapsed = ::GetTickCount() - dwStart;
+					dwWait = (dwElapsed < dwTimeout ? dwTimeout - dwElapsed : 0);
+					}
+
+				DWORD dwResult = ::WaitForSingleObject(hSemaphore, dwWait);
+				::InterlockedDecrement(&m_iWaiting);
+
+				if (Try())
+					return true;
+
+				if (dwResult == WAIT_TIMEOUT)
+					return false;
+				}
+			}
+
+	private:
+		enum EConstants
+			{
+			MAX_WAKE_TOKENS =				0x7fff,
+			SPIN_COUNT =					64,
+			};
+
+		HANDLE GetSemaphore (void)
+			{
+			if (m_hSemaphore == NULL)
+				{
+				HANDLE hSemaphore = ::CreateSemaphore(NULL, 0, MAX_WAKE_TOKENS, NULL);
+				if (hSemaphore == NULL)
+					throw CException(ERR_MEMORY);
+
+				if (::InterlockedCompareExchangePointer((PVOID volatile *)&m_hSemaphore, hSemaphore, NULL) != NULL)
+					::CloseHandle(hSemaphore);
+				}
+
+			return m_hSemaphore;
+			}
+
+		HANDLE volatile m_hSemaphore;		//	Created by the first consumer to block
+		volatile LONG m_iWaiting;			//	Consumers asleep (or about to be)
+	};
+
+template <class VALUE> class TLockFreeRing
+	{
+	public:
+		TLockFreeRing (int iCapacity = DEFAULT_CAPACITY) :
+				m_iEnqueuePos(0),
+				m_iDequeuePos(0)
+			{
+			int i;
+
+			//	Capacity must be a power of 2
+
+			int iSize = 2;
+			while (iSize < iCapacity)
+				iSize *= 2;
+
+			m_pCells = new SCell [iSize];
+			m_dwMask = (DWORD)(iSize - 1);
+
+			for (i = 0; i < iSize; i++)
+				m_pCells[i].iSequence = i;
+			}
+
+		TLockFreeRing (const TLockFreeRing<VALUE> &Src) =delete;
+		~TLockFreeRing (void) { delete [] m_pCells; }
+
+		TLockFreeRing<VALUE> &operator= (const TLockFreeRing<VALUE> &Src) =delete;
+
+		inline bool Dequeue (VALUE *retValue, DWORD dwTimeout = INFINITE) { return m_Waiter.WaitFor([&]() { return TryPop(retValue); }, dwTimeout); }
+		inline int GetCapacity (void) const { return (int)(m_dwMask + 1); }
+		inline bool IsEmpty (void) const { return (m_iDequeuePos == m_iEnqueuePos); }
+		inline bool TryDequeue (VALUE *retValue) { return TryPop(retValue); }
+		inline bool TryEnqueue (const VALUE &Value) { if (!TryPush(Value)) return false; m_Waiter.Notify(); return true; }
+
+		bool TryPop (VALUE *retValue)
+
+		//	TryPop
+		//
+		//	Removes the oldest item. Returns FALSE if the ring is empty. This
+		//	does not interact with Dequeue waiters.
+
+			{
+			LONG iPos = m_iDequeuePos;
+			while (true)
+				{
+				SCell &Cell = m_pCells[(DWORD)iPos & m_dwMask];
+				LONG iDiff = (LONG)((DWORD)Cell.iSequence - ((DWORD)iPos + 1));
+
+				//	If the cell has been filled for this lap, try to claim it.
+
+				if (iDiff == 0)
+					{
+					LONG iOldPos = ::InterlockedCompareExchange(&m_iDequeuePos, (LONG)((DWORD)iPos + 1), iPos);
+					if (iOldPos == iPos)
+						{
+						*retValue = Cell.Value;
+						Cell.Value = VALUE();
+
+						//	Hand the cell to the producer on the next lap.
+
+						Cell.iSequence = (LONG)((DWORD)iPos + m_dwMask + 1);
+						return true;
+						}
+
+					iPos = iOldPos;
+					}
+
+				//	If the cell hasn't been filled yet, we're empty.
+
+				else if (iDiff < 0)
+					return false;
+
+				//	Otherwise another consumer got it first.
+
+				else
+					iPos = m_iDequeuePos;
+				}
+			}
+
+		bool TryPush (const VALUE &Value)
+
+		//	TryPush
+		//
+		//	Adds an item. Returns FALSE if the ring is full. This does not wake
+		//	up Dequeue waiters (use TryEnqueue for that).
+
+			{
+			LONG iPos = m_iEnqueuePos;
+			while (true)
+				{
+				SCell &Cell = m_pCells[(DWORD)iPos & m_dwMask];
+				LONG iDiff = (LONG)((DWORD)Cell.iSequence - (DWORD)iPos);
+
+				//	If the cell is free for this lap, try to claim it.
+
+				if (iDiff == 0)
+					{
+					LONG iOldPos = ::InterlockedCompareExchange(&m_iEnqueuePos, (LONG)((DWORD)iPos + 1), iPos);
+					if (iOldPos == iPos)
+						{
+						Cell.Value = Value;
+
+						//	Publish to consumers
+
+						Cell.iSequence = (LONG)((DWORD)iPos + 1);
+						return true;
+						}
+
+					iPos = iOldPos;
+					}
+
+				//	If the cell still holds an item from the last lap, we're
+				//	full.
+
+				else if (iDiff < 0)
+					return false;
+
+				//	Otherwise another producer got it first.
+
+				else
+					iPos = m_iEnqueuePos;
+				}
+			}
+
+	private:
+		enum EConstants
+			{
+			DEFAULT_CAPACITY =				1024,
+			};
+
+		struct SCell
+			{
+			volatile LONG iSequence;
+			VALUE Value;
+			};
+
+		SCell *m_pCells;
+		DWORD m_dwMask;
+
+		//	Keep producers and consumers on separate cache lines
+
+		char m_Padding1[64];
+		volatile LONG m_iEnqueuePos;
+		char m_Padding2[64];
+		volatile LONG m_iDequeuePos;
+		char m_Padding3[64];
+
+		CLockFreeWaiter m_Waiter;
+	};
+
+template <class VALUE> class TLockFreeQueue
+	{
+	public:
+		TLockFreeQueue (int iRingCapacity = DEFAULT_RING_CAPACITY) :
+				m_Ring(iRingCapacity),
+				m_pHead(NULL),
+				m_pTail(NULL),
+				m_pSpare(NULL),
+				m_iSpillCount(0)
+			{ }
+
+		TLockFreeQueue (const TLockFreeQueue<VALUE> &Src) =delete;
+
+		~TLockFreeQueue (void)
+			{
+			while (m_pHead)
+				{
+				SSegment *pNext = m_pHead->pNext;
+				delete m_pHead;
+				m_pHead = pNext;
+				}
+
+			if (m_pSpare)
+				delete m_pSpare;
+			}
+
+		TLockFreeQueue<VALUE> &operator= (const TLockFreeQueue<VALUE> &Src) =delete;
+
+		inline bool Dequeue (VALUE *retValue, DWORD dwTimeout = INFINITE) { return m_Waiter.WaitFor([&]() { return TryDequeue(retValue); }, dwTimeout); }
+		inline bool IsEmpty (void) const { return (m_Ring.IsEmpty() && m_iSpillCount == 0); }
+
+		void Enqueue (const VALUE &Value)
+
+		//	Enqueue
+		//
+		//	Adds an item. This never fails (other than running out of memory).
+
+			{
+			if (m_iSpillCount == 0 && m_Ring.TryPush(Value))
+				{
+				m_Waiter.Notify();
+				return;
+				}
+
+			//	Either the ring is full or we're already spilling.
+
+			m_cs.Lock();
+			if (m_iSpillCount > 0 || !m_Ring.TryPush(Value))
+				Spill(Value);
+			m_cs.Unlock();
+
+			m_Waiter.Notify();
+			}
+
+		bool TryDequeue (VALUE *retValue)
+
+		//	TryDequeue
+		//
+		//	Removes the oldest item. Returns FALSE if the queue is empty.
+
+			{
+			if (m_Ring.TryPop(retValue))
+				return true;
+
+			if (m_iSpillCount == 0)
+				return false;
+
+			//	Take the next spilled item and move as many as will fit back
+			//	into the ring, in order. Producers don't use the ring while we
+			//	have spilled items, so this keeps their order.
+
+			CSmartLock Lock(m_cs);
+
+			if (m_Ring.TryPop(retValue))
+				return true;
+
+			if (m_iSpillCount == 0)
+				return false;
+
+			*retValue = Unspill();
+
+			while (m_iSpillCount > 0 && m_Ring.TryPush(m_pHead->Items[m_pHead->iHead]))
+				Unspill();
+
+			return true;
+			}
+
+	private:
+		enum EConstants
+			{
+			DEFAULT_RING_CAPACITY =			1024,
+			SEGMENT_SIZE =					256,
+			};
+
+		struct SSegment
+			{
+			SSegment *pNext;
+			int iHead;						//	Next item to remove
+			int iTail;						//	Next free slot
+			VALUE Items[SEGMENT_SIZE];
+			};
+
+		void Spill (const VALUE &Value)
+
+		//	Spill
+		//
+		//	Adds the item to the end of the spill list. We must hold m_cs.
+
+			{
+			if (m_pTail == NULL || m_pTail->iTail == SEGMENT_SIZE)
+				{
+				SSegment *pNew;
+				if (m_pSpare)
+					{
+					pNew = m_pSpare;
+					m_pSpare = NULL;
+					}
+				else
+					pNew = new SSegment;
+
+				pNew->pNext = NULL;
+				pNew->iHead = 0;
+				pNew->iTail = 0;
+
+				if (m_pTail)
+					m_pTail->pNext = pNew;
+				else
+					m_pHead = pNew;
+				m_pTail = pNew;
+				}
+
+			m_pTail->Items[m_pTail->iTail++] = Value;
+			m_iSpillCount = m_iSpillCount + 1;
+			}
+
+		VALUE Unspill (void)
+
+		//	Unspill
+		//
+		//	Removes the oldest spilled item. We must hold m_cs and there must
+		//	be at least one item.
+
+			{
+			VALUE Value = m_pHead->Items[m_pHead->iHead];
+			m_pHead->Items[m_pHead->iHead++] = VALUE();
+			m_iSpillCount = m_iSpillCount - 1;
+
+			//	If we've emptied the segment, free it (keeping one spare).
+
+			if (m_pHead->iHead == m_pHead->iTail && (m_pHead->iTail == SEGMENT_SIZE || m_iSpillCount == 0))
+				{
+				SSegment *pOld = m_pHead;
+				m_pHead = pOld->pNext;
+				if (m_pHead == NULL)
+					m_pTail = NULL;
+
+				if (m_pSpare == NULL)
+					m_pSpare = pOld;
+				else
+					delete pOld;
+				}
+
+			return Value;
+			}
+
+		TLockFreeRing<VALUE> m_Ring;
+
+		CCriticalSection m_cs;				//	Protects the spill list
+		SSegment *m_pHead;
+		SSegment *m_pTail;
+		SSegment *m_pSpare;
+		volatile LONG m_iSpillCount;		//	Only changed under m_cs
+
+		CLockFreeWaiter m_Waiter;
+	};
+
+#endif
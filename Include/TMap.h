@@ -9,41 +9,74 @@
 class CMapIterator
 	{
 	public:
-		CMapIterator (void) : m_iTableEntry(0), m_pPos(NULL) { }
+		CMapIterator (void) : m_iPos(0) { }
 
 	private:
-		int m_iTableEntry;
-		void *m_pPos;
+		int m_iPos;
 
 	friend class CMapBase;
 	};
 
+//	CMapBase is an open-addressing (Robin Hood) hash index. Each slot holds the
+//	full hash of a key plus the index of an entry in the derived class's dense
+//	entry array. The index grows by doubling whenever the load factor would
+//	exceed MAX_LOAD_NUM / MAX_LOAD_DEN.
+//
+//	NOTE: Entries are stored inline in an array, so pointers returned by Find,
+//	Insert, etc. are invalidated by any subsequent Insert or Delete.
+
 class CMapBase
 	{
-	protected:
-		struct EntryBase
-			{
-			EntryBase *pNext;
-			};
+	public:
+		static DWORD Hash (void *pKey, int iKeyLen);
 
-		CMapBase (int iTableSize);
+	protected:
+		CMapBase (int iInitialCount);
+		CMapBase (const CMapBase &Src);
 		~CMapBase (void);
 
-		EntryBase *DeleteEntry (void *pVoidKey, void *pKey, int iKeyLen);
-		EntryBase *FindEntry (void *pVoidKey, void *pKey, int iKeyLen, int *retiSlot = NULL, EntryBase **retpPrevEntry = NULL) const;
-		int Hash (void *pKey, int iKeyLen) const;
-		void InsertEntry (void *pKey, int iKeyLen, EntryBase *pEntry);
-		void InsertEntry (int iSlot, EntryBase *pEntry);
+		CMapBase &operator= (const CMapBase &Src);
+
+		int DeleteIndex (void *pVoidKey, DWORD dwHash);
+		void DeleteIndexAll (void);
+		int FindIndex (void *pVoidKey, DWORD dwHash) const;
+		void GrowIndexToFit (int iCount);
+		void InsertIndex (DWORD dwHash, int iEntry);
+		void MoveIndex (DWORD dwHash, int iOldEntry, int iNewEntry);
+		void ShiftIndex (int iStart, int iDelta);
+
+		inline void Reset (CMapIterator &Iterator) const { Iterator.m_iPos = 0; }
+		inline int GetNext (CMapIterator &Iterator) const { ASSERT(Iterator.m_iPos < m_iCount); return Iterator.m_iPos++; }
+		inline bool HasMore (CMapIterator &Iterator) const { return (Iterator.m_iPos < m_iCount); }
+
+		virtual bool KeyEquals (void *pVoidKey, int iEntry) const = 0;
+
+		int m_iCount;								//	Number of entries
+
+	private:
+		enum EConstants
+			{
+			MIN_SLOT_COUNT =		16,
+			MAX_LOAD_NUM =			7,				//	Grow when more than 7/8ths full
+			MAX_LOAD_DEN =			8,
+			};
 
-		void Reset (CMapIterator &Iterator) const;
-		EntryBase *GetNext (CMapIterator &Iterator) const;
-		bool HasMore (CMapIterator &Iterator) const;
+		struct SSlot
+			{
+			DWORD dwHash;							//	Hash of key (0 = empty slot)
+			int iEntry;								//	Index of entry in derived array
+			};
 
-		virtual bool KeyEquals (void *pVoidKey, EntryBase *pEntry) const = 0;
+		int CalcSlotCount (int iCount) const;
+		int FindSlot (void *pVoidKey, DWORD dwHash) const;
+		inline int GetProbeDistance (DWORD dwHash, int iSlot) const { return (int)(((DWORD)iSlot - dwHash) & m_dwMask); }
+		void InsertSlot (SSlot NewSlot);
+		void Rehash (int iNewSlotCount);
 
-		EntryBase **m_pTable;						//	An array of entries
-		int m_iTableSize;							//	Size of table
-		int m_iCount;
+		SSlot *m_pSlots;							//	Slot table (NULL until first insert)
+		int m_iSlotCount;							//	Always a power of 2
+		DWORD m_dwMask;								//	m_iSlotCount - 1
+		int m_iInitialCount;						//	Sizing hint for first allocation
 	};
 
 //	Comparison functions
@@ -61,86 +94,82 @@ template<class KEY> int MapKeyHashDataSize (const KEY &Key) { return sizeof(KEY)
 template <class KEY, class VALUE> class TMap : public CMapBase
 	{
 	public:
-		TMap (int iTableSize = 999) : CMapBase(iTableSize) { }
-		TMap (const TMap<KEY, VALUE> &Src) : CMapBase(Src.m_iTableSize)
+		TMap (int iInitialCount = 0) : CMapBase(iInitialCount)
 			{
-			Copy(Src);
+			if (iInitialCount > 0)
+				m_Array.GrowToFit(iInitialCount);
 			}
 
-		~TMap (void)
-			{
-			DeleteAll();
-			}
+		TMap (const TMap<KEY, VALUE> &Src) : CMapBase(Src),
+				m_Array(Src.m_Array)
+			{ }
 
 		TMap<KEY, VALUE> &operator= (const TMap<KEY, VALUE> &Obj)
 			{
-			DeleteAll();
-
-			delete [] m_pTable;
-			m_iTableSize = Obj.m_iTableSize;
-			m_pTable = new EntryBase * [Obj.m_iTableSize];
-
-			Copy(Obj);
-
+			CMapBase::operator=(Obj);
+			m_Array = Obj.m_Array;
 			return *this;
 			}
 
 		void Delete (const KEY &Key)
 			{
-			Entry *pDeletedEntry = (Entry *)DeleteEntry((void *)&Key, MapKeyHashData(Key), MapKeyHashDataSize(Key));
-			if (pDeletedEntry)
-				delete pDeletedEntry;
-			}
+			int iEntry = DeleteIndex((void *)&Key, HashKey(Key));
+			if (iEntry == -1)
+				return;
 
-		void DeleteAll (void)
-			{
-			for (int i = 0; i < m_iTableSize; i++)
+			//	Keep the entry array dense by moving the last entry into the
+			//	hole that we just opened up.
+
+			int iLast = m_Array.GetCount() - 1;
+			if (iEntry != iLast)
 				{
-				Entry *pEntry = (Entry *)m_pTable[i];
-				while (pEntry)
-					{
-					Entry *pNextEntry = pEntry->m_pNext;
-					delete pEntry;
-					pEntry = pNextEntry;
-					}
-				m_pTable[i] = NULL;
+				MoveIndex(m_Array[iLast].dwHash, iLast, iEntry);
+				m_Array[iEntry] = m_Array[iLast];
 				}
 
-			m_iCount = 0;
+			m_Array.Delete(iLast);
+			}
+
+		void DeleteAll (void)
+			{
+			m_Array.DeleteAll();
+			DeleteIndexAll();
 			}
 
 		VALUE * const Find (const KEY &Key) const
 			{
-			Entry *pEntryFound = (Entry *)FindEntry((void *)&Key, MapKeyHashData(Key), MapKeyHashDataSize(Key));
-			if (pEntryFound)
-				return &pEntryFound->m_Value;
-			else
+			int iEntry = FindIndex((void *)&Key, HashKey(Key));
+			if (iEntry == -1)
 				return NULL;
+
+			return &m_Array[iEntry].m_Value;
 			}
 
-		inline int GetCount (void) { return m_iCount; }
+		inline int GetCount (void) const { return m_iCount; }
 
 		const KEY &GetKey (VALUE *pValue) const
 			{
-			//	LATER: Is there some keyword for field offset?
-			Entry *pEntry = (Entry *)(((char *)pValue) - (sizeof(KEY) + sizeof(Entry *)));
+			Entry *pEntry = (Entry *)(((char *)pValue) - offsetof(Entry, m_Value));
 			return pEntry->m_Key;
 			}
 
 		const KEY &GetNext (CMapIterator &Iterator, VALUE **retpValue) const
 			{
-			Entry *pEntryFound = (Entry *)CMapBase::GetNext(Iterator);
-			ASSERT(pEntryFound);
+			Entry &Found = m_Array[CMapBase::GetNext(Iterator)];
 			if (retpValue)
-				*retpValue = &pEntryFound->m_Value;
-			return pEntryFound->m_Key;
+				*retpValue = &Found.m_Value;
+			return Found.m_Key;
 			}
 
 		VALUE * const GetNext (CMapIterator &Iterator) const
 			{
-			Entry *pEntryFound = (Entry *)CMapBase::GetNext(Iterator);
-			ASSERT(pEntryFound);
-			return &pEntryFound->m_Value;
+			return &m_Array[CMapBase::GetNext(Iterator)].m_Value;
+			}
+
+		void GrowToFit (int iCount)
+			{
+			m_Array.GrowToFit(iCount);
+			GrowIndexToFit(m_iCount + iCount);
 			}
 
 		bool HasMore (CMapIterator &Iterator) const
@@ -150,15 +179,12 @@ template <class KEY, class VALUE> class TMap : public CMapBase
 
 		VALUE * const Insert (const KEY &Key)
 			{
-			Entry *pNewEntry = new Entry(Key);
-			InsertEntry(MapKeyHashData(Key), MapKeyHashDataSize(Key), (EntryBase *)pNewEntry);
-			return &pNewEntry->m_Value;
+			return &InsertEntry(Key, HashKey(Key))->m_Value;
 			}
 
 		void Insert (const KEY &Key, const VALUE &Value)
 			{
-			Entry *pNewEntry = new Entry(Key, Value);
-			InsertEntry(MapKeyHashData(Key), MapKeyHashDataSize(Key), (EntryBase *)pNewEntry);
+			InsertEntry(Key, HashKey(Key))->m_Value = Value;
 			}
 
 		void Reset (CMapIterator &Iterator) const
@@ -168,75 +194,269 @@ template <class KEY, class VALUE> class TMap : public CMapBase
 
 		VALUE * const Set (const KEY &Key)
 			{
-			int iSlot;
-			Entry *pEntryFound = (Entry *)FindEntry((void *)&Key, MapKeyHashData(Key), MapKeyHashDataSize(Key), &iSlot);
-			if (pEntryFound)
-				return &pEntryFound->m_Value;
+			DWORD dwHash = HashKey(Key);
+			int iEntry = FindIndex((void *)&Key, dwHash);
+			if (iEntry != -1)
+				return &m_Array[iEntry].m_Value;
 
-			Entry *pNewEntry = new Entry(Key);
-			InsertEntry(iSlot, (EntryBase *)pNewEntry);
-			return &pNewEntry->m_Value;
+			return &InsertEntry(Key, dwHash)->m_Value;
 			}
 
 		void Set (const KEY &Key, const VALUE &Value)
 			{
-			Entry *pEntryFound = (Entry *)FindEntry((void *)&Key, MapKeyHashData(Key), MapKeyHashDataSize(Key));
-			if (pEntryFound)
-				pEntryFound->m_Value = Value;
-			else
-				Insert(Key, Value);
+			*Set(Key) = Value;
 			}
 
 	protected:
-		virtual bool KeyEquals (void *pVoidKey, EntryBase *pEntry) const
+		virtual bool KeyEquals (void *pVoidKey, int iEntry) const
 			{
-			return MapKeyEquals(*(KEY *)pVoidKey, ((Entry *)pEntry)->m_Key);
+			return MapKeyEquals(*(KEY *)pVoidKey, m_Array[iEntry].m_Key);
 			}
 
 	private:
-		class Entry
-			{
-			public:
-				Entry (const KEY &Key) :
-						m_pNext(NULL),
-						m_Key(Key)
-					{ }
-
-				Entry (const KEY &Key, const VALUE &Value) :
-						m_pNext(NULL),
-						m_Key(Key),
-						m_Value(Value)
-					{ }
-
-				Entry *m_pNext;
-				KEY m_Key;
-				VALUE m_Value;
+		struct Entry
+			{
+			Entry (const KEY &Key, DWORD dwHashArg) :
+					dwHash(dwHashArg),
+					m_Key(Key),
+					m_Value()
+				{ }
+
+			DWORD dwHash;
+			KEY m_Key;
+			VALUE m_Value;
 			};
 
-		void Copy (const TMap<KEY, VALUE> &Src)
+		static DWORD HashKey (const KEY &Key) { return Hash(MapKeyHashData(Key), MapKeyHashDataSize(Key)); }
+
+		Entry *InsertEntry (const KEY &Key, DWORD dwHash)
+			{
+			//	We copy-construct the key in place (KEY need not have a default
+			//	constructor, just as with the old chained map).
+
+			int iEntry = m_Array.GetCount();
+			Entry *pNewEntry = m_Array.Emplace(Key, dwHash);
+
+			InsertIndex(dwHash, iEntry);
+			return pNewEntry;
+			}
+
+		TArray<Entry> m_Array;
+	};
+
+//	TDictionary keeps its entries in a dense array (so callers can iterate by
+//	position) and indexes them with a CMapBase hash. Each entry caches the hash
+//	of its key, so a lookup hashes the key once and only compares keys whose
+//	full hash matches. Keys are compared with KeyCompare, so CString keys are
+//	case-insensitive (as with TSortMap).
+//
+//	By default entries are kept in insertion order. Use DictionarySorted only
+//	when callers need to iterate in key order; inserting into the middle of the
+//	array costs O(n) because the positions of later entries shift.
+
+enum EDictionaryOrder
+	{
+	DictionaryUnsorted,						//	Entries in insertion order
+	DictionarySorted,						//	Entries in ascending key order
+	};
+
+DWORD DictionaryKeyHash (const CString &sKey);
+template<class KEY> DWORD DictionaryKeyHash (const KEY &Key) { return CMapBase::Hash((void *)&Key, sizeof(KEY)); }
+
+template <class KEY, class VALUE> class TDictionary : public CMapBase
+	{
+	public:
+		TDictionary (EDictionaryOrder iOrder = DictionaryUnsorted, int iInitialCount = 0) : CMapBase(iInitialCount),
+				m_iOrder(iOrder)
+			{
+			if (iInitialCount > 0)
+				m_Array.GrowToFit(iInitialCount);
+			}
+
+		TDictionary (const TDictionary<KEY, VALUE> &Src) : CMapBase(Src),
+				m_iOrder(Src.m_iOrder),
+				m_Array(Src.m_Array)
+			{ }
+
+		TDictionary<KEY, VALUE> &operator= (const TDictionary<KEY, VALUE> &Obj)
+			{
+			CMapBase::operator=(Obj);
+			m_iOrder = Obj.m_iOrder;
+			m_Array = Obj.m_Array;
+			return *this;
+			}
+
+		inline VALUE &operator [] (int iIndex) const { return GetValue(iIndex); }
+
+		void Delete (int iIndex)
+			{
+			ASSERT(iIndex >= 0 && iIndex < m_Array.GetCount());
+
+			//	Removing an entry preserves the order of the rest, so every
+			//	entry after it moves down by one.
+
+			SEntry &Entry = m_Array[iIndex];
+			DeleteIndex((void *)&Entry.theKey, Entry.dwHash);
+			m_Array.Delete(iIndex);
+
+			if (iIndex < m_Array.GetCount())
+				ShiftIndex(iIndex + 1, -1);
+			}
+
+		void DeleteAll (void)
 			{
-			m_iCount = Src.m_iCount;
+			m_Array.DeleteAll();
+			DeleteIndexAll();
+			}
+
+		bool DeleteAt (const KEY &Key)
+			{
+			int iPos;
+			if (!FindPos(Key, &iPos))
+				return false;
+
+			Delete(iPos);
+			return true;
+			}
+
+		bool Find (const KEY &Key, VALUE *retpValue = NULL) const
+			{
+			int iPos;
+			if (!FindPos(Key, &iPos))
+				return false;
+
+			if (retpValue)
+				*retpValue = m_Array[iPos].theValue;
+
+			return true;
+			}
+
+		bool FindPos (const KEY &Key, int *retiPos = NULL) const
+			{
+			int iPos = FindIndex((void *)&Key, DictionaryKeyHash(Key));
+			if (iPos == -1)
+				return false;
+
+			if (retiPos)
+				*retiPos = iPos;
+
+			return true;
+			}
+
+		VALUE *GetAt (const KEY &Key) const
+			{
+			int iPos;
+			if (!FindPos(Key, &iPos))
+				return NULL;
+
+			return &m_Array[iPos].theValue;
+			}
+
+		inline int GetCount (void) const { return m_Array.GetCount(); }
+		inline const KEY &GetKey (int iIndex) const { return m_Array[iIndex].theKey; }
+		inline EDictionaryOrder GetOrder (void) const { return m_iOrder; }
+		inline VALUE &GetValue (int iIndex) const { return m_Array[iIndex].theValue; }
+
+		void GrowToFit (int iCount)
+			{
+			m_Array.GrowToFit(iCount);
+			GrowIndexToFit(m_Array.GetCount() + iCount);
+			}
+
+		VALUE *Insert (const KEY &Key, int *retiPos = NULL)
+			{
+			ASSERT(!FindPos(Key));
+			return &InsertEntry(Key, DictionaryKeyHash(Key), retiPos)->theValue;
+			}
 
-			for (int i = 0; i < m_iTableSize; i++)
+		void Insert (const KEY &Key, const VALUE &Value, int *retiPos = NULL)
+			{
+			*Insert(Key, retiPos) = Value;
+			}
+
+		VALUE *SetAt (const KEY &Key, bool *retbInserted = NULL, int *retiPos = NULL)
+			{
+			DWORD dwHash = DictionaryKeyHash(Key);
+			int iPos = FindIndex((void *)&Key, dwHash);
+			if (iPos != -1)
 				{
-				Entry *pStartDest = NULL;
-				Entry *pNextDest = NULL;
-				Entry *pNext = (Entry *)Src.m_pTable[i];
-				while (pNext)
-					{
-					Entry *pNew = new Entry(pNext->m_Key, pNext->m_Value);
-					if (pNextDest)
-						pNextDest->m_pNext = pNew;
-					else
-						pStartDest = pNew;
+				if (retbInserted)
+					*retbInserted = false;
 
-					pNextDest = pNew;
-					pNext = pNext->m_pNext;
-					}
+				if (retiPos)
+					*retiPos = iPos;
 
-				m_pTable[i] = (EntryBase *)pStartDest;
+				return &m_Array[iPos].theValue;
 				}
+
+			if (retbInserted)
+				*retbInserted = true;
+
+			return &InsertEntry(Key, dwHash, retiPos)->theValue;
+			}
+
+		void SetAt (const KEY &Key, const VALUE &Value, bool *retbInserted = NULL)
+			{
+			*SetAt(Key, retbInserted) = Value;
+			}
+
+	protected:
+		virtual bool KeyEquals (void *pVoidKey, int iEntry) const
+			{
+			return (KeyCompare(*(KEY *)pVoidKey, m_Array[iEntry].theKey) == 0);
 			}
+
+	private:
+		struct SEntry
+			{
+			DWORD dwHash;
+			KEY theKey;
+			VALUE theValue;
+			};
+
+		int FindInsertPos (const KEY &Key) const
+			{
+			//	Binary search for the first entry greater than Key. The
+			//	caller has already checked that Key is not in the table.
+
+			int iMin = 0;
+			int iMax = m_Array.GetCount();
+			while (iMin < iMax)
+				{
+				int iTry = iMin + (iMax - iMin) / 2;
+				if (KeyCompare(m_Array[iTry].theKey, Key) < 0)
+					iMin = iTry + 1;
+				else
+					iMax = iTry;
+				}
+
+			return iMin;
+			}
+
+		SEntry *InsertEntry (const KEY &Key, DWORD dwHash, int *retiPos)
+			{
+			int iPos = (m_iOrder == DictionarySorted ? FindInsertPos(Key) : m_Array.GetCount());
+
+			//	If we're not appending, every entry at or after iPos moves up
+			//	by one.
+
+			if (iPos < m_Array.GetCount())
+				ShiftIndex(iPos, 1);
+
+			SEntry *pNewEntry = m_Array.InsertAt(iPos);
+			pNewEntry->dwHash = dwHash;
+			pNewEntry->theKey = Key;
+
+			InsertIndex(dwHash, iPos);
+
+			if (retiPos)
+				*retiPos = iPos;
+
+			return pNewEntry;
+			}
+
+		EDictionaryOrder m_iOrder;
+		TArray<SEntry> m_Array;
 	};
 
 const DWORD NULL_ATOM = 0xffffffff;
@@ -254,6 +474,7 @@ template <class KEY, class VALUE> class TSortMap
 			m_Index = Obj.m_Index;
 			m_Array = Obj.m_Array;
 			m_Free = Obj.m_Free;
+			m_iUnsortedCount = Obj.m_iUnsortedCount;
 			return *this;
 			}
 
@@ -275,6 +496,7 @@ template <class KEY, class VALUE> class TSortMap
 			m_Index.DeleteAll();
 			m_Array.DeleteAll();
 			m_Free.DeleteAll();
+			m_iUnsortedCount = 0;
 			}
 
 		void DeleteAt (const KEY &key)
@@ -298,6 +520,8 @@ template <class KEY, class VALUE> class TSortMap
 
 		bool FindPos (const KEY &key, int *retiPos = NULL) const
 			{
+			ASSERT(m_iUnsortedCount == 0);
+
 			int iCount = m_Index.GetCount();
 			int iMin = 0;
 			int iMax = iCount;
@@ -406,6 +630,28 @@ template <class KEY, class VALUE> class TSortMap
 			*pNewValue = newValue;
 			}
 
+		VALUE *InsertUnsorted (const KEY &newKey)
+			{
+			//	Appends an entry without keeping the index sorted. This is
+			//	used to bulk-load a map in O(N log N): call InsertUnsorted for
+			//	each entry and then SortUnsorted once. No lookups are allowed
+			//	until SortUnsorted is called.
+
+			int iPos;
+			SEntry *pEntry = InsertEntry(&iPos);
+
+			m_Index.Insert(iPos);
+			m_iUnsortedCount++;
+
+			pEntry->theKey = newKey;
+			return &pEntry->theValue;
+			}
+
+		void InsertUnsorted (const KEY &newKey, const VALUE &newValue)
+			{
+			*InsertUnsorted(newKey) = newValue;
+			}
+
 		void InsertSorted (const KEY &newKey, const VALUE &newValue, int iPos = -1)
 			{
 			//	Find where to insert it in the array
@@ -535,6 +781,68 @@ template <class KEY, class VALUE> class TSortMap
 			m_Array.SetGranularity(iGranularity);
 			}
 
+		void SortUnsorted (void)
+			{
+			int i;
+
+			if (m_iUnsortedCount == 0)
+				return;
+
+			int iSortedCount = m_Index.GetCount() - m_iUnsortedCount;
+
+			//	Sort the unsorted tail of the index. The sort is stable, so
+			//	among duplicate keys the last one inserted ends up last.
+
+			SortIndexRange(iSortedCount, m_iUnsortedCount);
+
+			//	Merge the sorted head with the new entries. If a key appears
+			//	more than once, the last value inserted wins, but we keep the
+			//	array slot of the oldest entry so that atoms stay valid.
+
+			TArray<int> NewIndex;
+			NewIndex.GrowToFit(m_Index.GetCount());
+
+			int iSrc = 0;
+			int iNew = iSortedCount;
+			int iEnd = m_Index.GetCount();
+			while (iNew < iEnd)
+				{
+				//	Collapse runs of duplicates within the new entries
+
+				while (iNew + 1 < iEnd && KeyCompare(m_Array[m_Index[iNew]].theKey, m_Array[m_Index[iNew + 1]].theKey) == 0)
+					{
+					FreeEntry(m_Index[iNew]);
+					iNew++;
+					}
+
+				const KEY &NewKey = m_Array[m_Index[iNew]].theKey;
+
+				//	Copy existing entries that come before the new key
+
+				while (iSrc < iSortedCount && m_iOrder * KeyCompare(GetKey(iSrc), NewKey) == 1)
+					NewIndex.Insert(m_Index[iSrc++]);
+
+				//	If we already have this key, replace the value.
+
+				if (iSrc < iSortedCount && KeyCompare(GetKey(iSrc), NewKey) == 0)
+					{
+					m_Array[m_Index[iSrc]].theValue = m_Array[m_Index[iNew]].theValue;
+					FreeEntry(m_Index[iNew]);
+					NewIndex.Insert(m_Index[iSrc++]);
+					}
+				else
+					NewIndex.Insert(m_Index[iNew]);
+
+				iNew++;
+				}
+
+			for (i = iSrc; i < iSortedCount; i++)
+				NewIndex.Insert(m_Index[i]);
+
+			m_Index.TakeHandoff(NewIndex);
+			m_iUnsortedCount = 0;
+			}
+
 		//	Atom helper functions
 
 		void atom_Delete (DWORD dwAtom)
@@ -609,6 +917,13 @@ template <class KEY, class VALUE> class TSortMap
 			VALUE theValue;
 			};
 
+		void FreeEntry (int iPos)
+			{
+			m_Array[iPos].theKey = KEY();
+			m_Array[iPos].theValue = VALUE();
+			m_Free.Insert(iPos);
+			}
+
 		SEntry *InsertEntry (int *retiPos)
 			{
 			SEntry *pEntry;
@@ -626,10 +941,62 @@ template <class KEY, class VALUE> class TSortMap
 			return pEntry;
 			}
 
+		void SortIndexRange (int iStart, int iCount)
+			{
+			int i;
+
+			if (iCount < 2)
+				return;
+
+			//	Bottom-up stable merge sort of index positions, ping-ponging
+			//	between the index and a single scratch buffer.
+
+			TArray<int> Scratch;
+			Scratch.InsertEmpty(iCount);
+
+			int *pSrc = &m_Index[iStart];
+			int *pDest = &Scratch[0];
+
+			for (int iWidth = 1; iWidth < iCount; iWidth *= 2)
+				{
+				for (int iLeft = 0; iLeft < iCount; iLeft += 2 * iWidth)
+					{
+					int iMid = Min(iLeft + iWidth, iCount);
+					int iRight = Min(iLeft + 2 * iWidth, iCount);
+					int iPos1 = iLeft;
+					int iPos2 = iMid;
+					int iOut = iLeft;
+
+					while (iPos1 < iMid && iPos2 < iRight)
+						{
+						if (m_iOrder * KeyCompare(m_Array[pSrc[iPos2]].theKey, m_Array[pSrc[iPos1]].theKey) == 1)
+							pDest[iOut++] = pSrc[iPos2++];
+						else
+							pDest[iOut++] = pSrc[iPos1++];
+						}
+
+					while (iPos1 < iMid)
+						pDest[iOut++] = pSrc[iPos1++];
+
+					while (iPos2 < iRight)
+						pDest[iOut++] = pSrc[iPos2++];
+					}
+
+				Swap(pSrc, pDest);
+				}
+
+			if (pSrc != &m_Index[iStart])
+				{
+				for (i = 0; i < iCount; i++)
+					m_Index[iStart + i] = pSrc[i];
+				}
+			}
+
 		ESortOptions m_iOrder;
 		TArray<int> m_Index;
 		TArray<SEntry> m_Array;
 		TArray<int> m_Free;
+		int m_iUnsortedCount = 0;					//	Entries at end of m_Index not yet sorted
 	};
 
 template <class ENTRY, size_t N> class TStaticStringTable
@@ -5,6 +5,59 @@
 
 #pragma once
 
+//	Reference count policies
+//
+//	Objects handed to TSharedPtr implement AddRef and Delete. Classes that
+//	keep their own count (e.g., TImagePlane) take one of these policies as
+//	a template parameter. CRefCountSingleThread is the default and is a
+//	plain counter; use CRefCountAtomic for objects that are shared across
+//	threads (e.g., images passed to CThreadPool tasks).
+
+class CRefCountSingleThread
+	{
+	public:
+		inline void AddRef (void) { m_dwRefCount++; }
+		inline DWORD GetRefCount (void) const { return m_dwRefCount; }
+		inline bool Release (void) { return (--m_dwRefCount == 0); }
+
+	private:
+		DWORD m_dwRefCount = 1;
+	};
+
+class CRefCountAtomic
+	{
+	public:
+		CRefCountAtomic (void) : m_iRefCount(1) { }
+		CRefCountAtomic (const CRefCountAtomic &Src) : m_iRefCount(1) { }
+
+		CRefCountAtomic &operator= (const CRefCountAtomic &Src) { return *this; }
+
+		inline void AddRef (void) { ::InterlockedIncrement(&m_iRefCount); }
+		inline DWORD GetRefCount (void) const { return (DWORD)m_iRefCount; }
+
+		//	The interlocked decrement is a full barrier, so all writes made
+		//	through other references are visible to the thread that deletes.
+
+		inline bool Release (void) { return (::InterlockedDecrement(&m_iRefCount) == 0); }
+
+	private:
+		volatile LONG m_iRefCount;
+	};
+
+template <class OBJ, class REFCOUNT = CRefCountSingleThread> class TRefCounted
+	{
+	public:
+		OBJ *AddRef (void) { m_RefCount.AddRef(); return (OBJ *)this; }
+		void Delete (void) { if (m_RefCount.Release()) delete (OBJ *)this; }
+		DWORD GetRefCount (void) const { return m_RefCount.GetRefCount(); }
+
+	protected:
+		virtual ~TRefCounted (void) { }
+
+	private:
+		REFCOUNT m_RefCount;
+	};
+
 template <class OBJ> class TSharedPtr
 	{
 	public:
@@ -12,10 +12,84 @@ enum ECompressionTypes
 	compressionGzip =						2,	//	Gzip format
 	};
 
+struct SZipCompressOptions
+	{
+	SZipCompressOptions (void) :
+			iLevel(-1),
+			iThreads(1),
+			pPool(NULL),
+			dwBlockSize(0)
+		{ }
+
+	int iLevel;							//	0 (store) to 9 (best); -1 = zlib default
+	int iThreads;						//	Threads to compress with (0 = one per processor)
+	CThreadPool *pPool;					//	If not NULL, compress on this pool (ignores iThreads)
+	DWORD dwBlockSize;					//	Bytes per parallel block (0 = default)
+	};
+
+//	CZipArchive. A zip archive that is mapped into memory once and indexed by
+//	filename (case-insensitive), so callers that pull many files out of one
+//	archive only parse the directory once. Entries are numbered in directory
+//	order; if a name appears more than once, FindEntry returns the first.
+//	Stored entries can be accessed without a copy. Lookups and extraction do
+//	not modify the object, so many threads may extract at once (e.g., from
+//	CThreadPool::ParallelFor).
+
+class CZipArchive
+	{
+	public:
+		CZipArchive (void);
+		CZipArchive (const CZipArchive &Src) =delete;
+		inline ~CZipArchive (void) { Close(); }
+
+		CZipArchive &operator= (const CZipArchive &Src) =delete;
+
+		void Close (void);
+		bool Decompress (int iEntry, IWriteStream &Output, CString *retsError = NULL) const;
+		bool Decompress (int iEntry, CString *retsData, CString *retsError = NULL) const;
+		int FindEntry (const CString &sFilename) const;
+		inline int GetEntryCount (void) const { return m_Entries.GetCount(); }
+		char *GetEntryData (int iEntry, DWORDLONG *retdwLength = NULL) const;
+		inline const CString &GetEntryName (int iEntry) const { return m_Entries[iEntry].sName; }
+		inline DWORDLONG GetEntrySize (int iEntry) const { return m_Entries[iEntry].dwSize; }
+		inline const CString &GetFilename (void) const { return m_sFilename; }
+		inline bool IsEntryStored (int iEntry) const { return (m_Entries[iEntry].dwMethod == METHOD_STORED); }
+		inline bool IsOpen (void) const { return (m_pFile != NULL); }
+		bool Open (const CString &sFilename, CString *retsError = NULL);
+
+	private:
+		enum EConstants
+			{
+			METHOD_STORED =					0,
+			METHOD_DEFLATED =				8,
+			};
+
+		struct SEntry
+			{
+			CString sName;					//	Path in archive
+			DWORD dwMethod;					//	Compression method
+			DWORD dwFlags;					//	General purpose flags
+			DWORD dwCRC;					//	CRC-32 of uncompressed data
+			DWORDLONG dwCompressedSize;
+			DWORDLONG dwSize;				//	Uncompressed size
+			DWORDLONG dwHeaderPos;			//	Offset of local header in file
+			};
+
+		bool CanExtract (const SEntry &Entry, CString *retsError) const;
+		bool LocateData (const SEntry &Entry, BYTE **retpData, IReadBlock **retpSlice, CString *retsError) const;
+		bool ReadDirectory (CString *retsError);
+
+		CString m_sFilename;
+		CMappedFileBlock *m_pFile;
+		TArray<SEntry> m_Entries;			//	In directory order
+		TDictionary<CString, int> m_Index;	//	Name to first entry with that name
+	};
+
 bool arcDecompressFile (const CString &sArchive, const CString &sFile, const CString &sDestFilespec, CString *retsError = NULL);
 bool arcDecompressFile (const CString &sArchive, const CString &sFile, IWriteStream &Output, CString *retsError = NULL);
 bool arcList (const CString &sArchive, TArray<CString> *retFiles, CString *retsError = NULL);
 bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError = NULL);
+bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, const SZipCompressOptions &Options, CString *retsError = NULL);
 bool zipDecompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError = NULL);
 
 #endif
\ No newline at end of file
@@ -1,11 +1,18 @@
 //	Base64.cpp
 //
 //	Base64 encoding/decoding
+//
+//	The buffer functions (base64Encode/base64Decode) do the work; the stream
+//	classes feed them a chunk at a time. On CPUs with SSSE3 we encode 12 bytes
+//	and decode 16 characters per step (Mula's PSHUFB method); otherwise (and
+//	for the ends of buffers) we go a triplet at a time.
 
 #include "Kernel.h"
 
 #include "Internets.h"
 
+#include <immintrin.h>
+
 BYTE g_Table64[64] =
 	{	'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',
 		'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',
@@ -16,77 +23,111 @@ BYTE g_Table64[64] =
 		'w', 'x', 'y', 'z', '0', '1', '2', '3',
 		'4', '5', '6', '7', '8', '9', '+', '/' };
 
+//	Character to 6-bit value (0xff if not in the alphabet)
+
+static const BYTE g_Decode64[256] =
+	{
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0x3e, 0xff, 0xff, 0xff, 0x3f,
+	0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e,
+	0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28,
+	0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+	};
+
+static bool DecodeQuads (const BYTE *pInput, int iQuads, BYTE *pOutput);
+static int DecodeSSSE3 (const BYTE *pInput, int iLength, BYTE *pOutput, bool *retbInvalid);
+static void EncodeTriplets (const BYTE *pInput, int iTriplets, char *pOutput);
+static int EncodeSSSE3 (const BYTE *pInput, int iLength, char *pOutput);
+
+//	CBase64Decoder -------------------------------------------------------------
+
 CBase64Decoder::CBase64Decoder (IReadStream *pInput, DWORD dwFlags) :
 		m_pStream(pInput),
-		m_iBufferPos(3)
+		m_iBufferPos(0),
+		m_iBufferLen(0),
+		m_bEnd(false)
 
 //	CBase64Decoder constructor
 
 	{
 	}
 
-BYTE CBase64Decoder::CharToByte (char chChar)
-
-//	CharToByte
-//
-//	Converts from a character to a base64 number
-
-	{
-	if (chChar >= 'A' && chChar <= 'Z')
-		return (chChar - 'A');
-	else if (chChar >= 'a' && chChar <= 'z')
-		return 26 + (chChar - 'a');
-	else if (chChar >= '0' && chChar <= '9')
-		return 52 + (chChar - '0');
-	else if (chChar == '+')
-		return 62;
-	else if (chChar == '/')
-		return 63;
-	else
-		return 0xff;
-	}
-
 ALERROR CBase64Decoder::Read (char *pData, int iLength, int *retiBytesRead)
 
 //	Read
 //
-//	Read the buffer
+//	Read the buffer. We only read as many characters from the source as we
+//	need. Invalid characters (or reading past the padding) fail.
 
 	{
 	BYTE *pOutput = (BYTE *)pData;
 	BYTE *pOutputEnd = pOutput + iLength;
+	char Input[4 * READ_CHUNK_QUADS];
+	int iRead;
+	int iDecoded;
+
+	//	Use up what's left from the last partial quad
+
+	while (pOutput < pOutputEnd && m_iBufferPos < m_iBufferLen)
+		*pOutput++ = m_chBuffer[m_iBufferPos++];
 
-	//	Keep reading from the stream
+	//	Decode whole quads straight into the caller's buffer
 
-	while (pOutput < pOutputEnd)
+	while (pOutputEnd - pOutput >= 3)
 		{
-		//	Read 4 characters and decode them into 3 bytes
+		if (m_bEnd)
+			return ERR_FAIL;
 
-		if (m_iBufferPos == 3)
-			{
-			char pInputChar[4];
-			int iRead;
-			if (m_pStream->Read(pInputChar, 4, &iRead) != NOERROR || iRead != 4)
-				return ERR_FAIL;
+		int iQuads = Min((int)(pOutputEnd - pOutput) / 3, (int)READ_CHUNK_QUADS);
+		if (m_pStream->Read(Input, 4 * iQuads, &iRead) != NOERROR || iRead != 4 * iQuads)
+			return ERR_FAIL;
 
-			BYTE pInput[4];
-			pInput[0] = CharToByte(pInputChar[0]);
-			pInput[1] = CharToByte(pInputChar[1]);
-			pInput[2] = CharToByte(pInputChar[2]);
-			pInput[3] = CharToByte(pInputChar[3]);
+		if (!base64Decode(Input, 4 * iQuads, pOutput, &iDecoded))
+			return ERR_FAIL;
 
-			//	Convert to 3 bytes of binary
+		pOutput += iDecoded;
 
-			m_chBuffer[0] = (pInput[0] << 2) | (pInput[1] >> 4);
-			m_chBuffer[1] = (pInput[1] << 4) | (pInput[2] >> 2);
-			m_chBuffer[2] = (pInput[2] << 6) | pInput[3];
+		//	If we got padding, this is the end of the data
 
-			m_iBufferPos = 0;
-			}
+		if (iDecoded < 3 * iQuads)
+			m_bEnd = true;
+		}
 
-		//	Read from buffer
+	//	The caller wants part of a quad, so we buffer the rest
 
-		*pOutput++ = m_chBuffer[m_iBufferPos++];
+	if (pOutput < pOutputEnd)
+		{
+		if (m_bEnd)
+			return ERR_FAIL;
+
+		if (m_pStream->Read(Input, 4, &iRead) != NOERROR || iRead != 4)
+			return ERR_FAIL;
+
+		if (!base64Decode(Input, 4, m_chBuffer, &m_iBufferLen))
+			return ERR_FAIL;
+
+		m_iBufferPos = 0;
+		if (m_iBufferLen < 3)
+			m_bEnd = true;
+
+		while (pOutput < pOutputEnd)
+			{
+			if (m_iBufferPos == m_iBufferLen)
+				return ERR_FAIL;
+
+			*pOutput++ = m_chBuffer[m_iBufferPos++];
+			}
 		}
 
 	//	Done
@@ -97,7 +138,9 @@ ALERROR CBase64Decoder::Read (char *pData, int iLength, int *retiBytesRead)
 	return NOERROR;
 	}
 
-CBase64Encoder::CBase64Encoder (IWriteStream *pOutput, DWORD dwFlags) : 
+//	CBase64Encoder -------------------------------------------------------------
+
+CBase64Encoder::CBase64Encoder (IWriteStream *pOutput, DWORD dwFlags) :
 		m_pStream(pOutput),
 		m_iBufferLen(0)
 
@@ -114,33 +157,18 @@ ALERROR CBase64Encoder::Close (void)
 //	bytes until Close is called.
 
 	{
-	//	If we've got data in the buffer then we need to write it out
+	//	If we've got data in the buffer then we need to write it out (with
+	//	padding).
 
-	if (m_iBufferLen == 1)
+	if (m_iBufferLen > 0)
 		{
-		BYTE pOutput[4];
-
-		pOutput[0] = g_Table64[m_chBuffer[0] >> 2];
-		pOutput[1] = g_Table64[((m_chBuffer[0] & 0x03) << 4)];
-		pOutput[2] = '=';
-		pOutput[3] = '=';
-
-		m_pStream->Write((char *)pOutput, 4);
-
+		char Output[4];
+		base64Encode(m_chBuffer, m_iBufferLen, Output);
 		m_iBufferLen = 0;
-		}
-	else if (m_iBufferLen == 2)
-		{
-		BYTE pOutput[4];
-
-		pOutput[0] = g_Table64[m_chBuffer[0] >> 2];
-		pOutput[1] = g_Table64[((m_chBuffer[0] & 0x03) << 4) | (m_chBuffer[1] >> 4)];
-		pOutput[2] = g_Table64[((m_chBuffer[1] & 0x0f) << 2)];
-		pOutput[3] = '=';
-
-		m_pStream->Write((char *)pOutput, 4);
 
-		m_iBufferLen = 0;
+		int iWritten;
+		if (m_pStream->Write(Output, 4, &iWritten) != NOERROR || iWritten != 4)
+			return ERR_FAIL;
 		}
 
 	return NOERROR;
@@ -150,63 +178,44 @@ ALERROR CBase64Encoder::Write (char *pData, int iLength, int *retiBytesWritten)
 
 //	Write
 //
-//	Writes out binary data and encodes it into base64.
+//	Writes out binary data and encodes it into base64. We encode a chunk at a
+//	time and write each chunk with a single call.
 
 	{
 	BYTE *pInput = (BYTE *)pData;
 	BYTE *pInputEnd = pInput + iLength;
-
-	//	Edge-cases
-
-	if (pInput == pInputEnd)
-		{
-		if (retiBytesWritten)
-			*retiBytesWritten = 0;
-		return NOERROR;
-		}
+	char Output[4 * WRITE_CHUNK_TRIPLETS];
+	int iWritten;
 
 	//	If we've got some data in the buffer, add to it until we have a complete
 	//	triplet.
 
 	if (m_iBufferLen > 0)
 		{
-		if (m_iBufferLen == 1)
-			{
-			m_chBuffer[1] = (pInput == NULL ? 0 : *pInput++);
-			m_iBufferLen++;
-			if (pInput == pInputEnd)
-				{
-				if (retiBytesWritten)
-					*retiBytesWritten = 1;
-				return NOERROR;
-				}
-
-			m_chBuffer[2] = (pInput == NULL ? 0 : *pInput++);
-			m_iBufferLen++;
-			}
-		else if (m_iBufferLen == 2)
-			{
-			m_chBuffer[2] = (pInput == NULL ? 0 : *pInput++);
-			m_iBufferLen++;
-			}
+		while (m_iBufferLen < 3 && pInput < pInputEnd)
+			m_chBuffer[m_iBufferLen++] = *pInput++;
 
-		//	We have a full buffer, so write it out
-
-		int iWritten = WriteTriplet(m_chBuffer);
-		m_iBufferLen = 0;
+		if (m_iBufferLen == 3)
+			{
+			base64Encode(m_chBuffer, 3, Output);
+			m_iBufferLen = 0;
 
-		if (iWritten != 3)
-			return ERR_FAIL;
+			if (m_pStream->Write(Output, 4, &iWritten) != NOERROR || iWritten != 4)
+				return ERR_FAIL;
+			}
 		}
 
 	//	Write out the rest of the data in triplets
 
-	while (pInput + 3 <= pInputEnd)
+	while (pInputEnd - pInput >= 3)
 		{
-		if (WriteTriplet(pInput) != 3)
+		int iTriplets = Min((int)(pInputEnd - pInput) / 3, (int)WRITE_CHUNK_TRIPLETS);
+		int iChars = base64Encode(pInput, 3 * iTriplets, Output);
+
+		if (m_pStream->Write(Output, iChars, &iWritten) != NOERROR || iWritten != iChars)
 			return ERR_FAIL;
 
-		pInput += 3;
+		pInput += 3 * iTriplets;
 		}
 
 	//	Add the remainder to the buffer
@@ -222,24 +231,332 @@ ALERROR CBase64Encoder::Write (char *pData, int iLength, int *retiBytesWritten)
 	return NOERROR;
 	}
 
-int CBase64Encoder::WriteTriplet (void *pData)
+//	Functions ------------------------------------------------------------------
+
+bool base64Decode (const char *pInput, int iLength, void *pOutput, int *retiLength)
 
-//	WriteTripler
+//	base64Decode
 //
-//	Writes 3 bytes encoded in base64 to 4 bytes.
+//	Decodes iLength characters into pOutput, which must hold at least
+//	base64GetDecodedLength bytes. The input must be strictly valid: a multiple
+//	of 4 characters, no whitespace, padding only at the end, and zero bits
+//	after the last byte. Returns FALSE otherwise.
 
 	{
-	BYTE *pInput = (BYTE *)pData;
-	BYTE pOutput[4];
+	const BYTE *pPos = (const BYTE *)pInput;
+	BYTE *pDest = (BYTE *)pOutput;
 
-	pOutput[0] = g_Table64[pInput[0] >> 2];
-	pOutput[1] = g_Table64[((pInput[0] & 0x03) << 4) | (pInput[1] >> 4)];
-	pOutput[2] = g_Table64[((pInput[1] & 0x0f) << 2) | (pInput[2] >> 6)];
-	pOutput[3] = g_Table64[pInput[2] & 0x3f];
+	int iDecodedLength = base64GetDecodedLength(pInput, iLength);
+	if (iDecodedLength == -1)
+		return false;
 
-	int iWritten;
-	if (m_pStream->Write((char *)pOutput, 4, &iWritten) != NOERROR || iWritten != 4)
-		return 0;
-	
-	return 3;
+	//	The last quad is handled separately if it has padding
+
+	int iPadding = 3 * (iLength / 4) - iDecodedLength;
+	int iBody = (iPadding ? iLength - 4 : iLength);
+
+	//	Fast path
+
+	if (::sysGetCPUFeatures() & CPU_FEATURE_SSSE3)
+		{
+		bool bInvalid;
+		int iDone = DecodeSSSE3(pPos, iBody, pDest, &bInvalid);
+		if (bInvalid)
+			return false;
+
+		pPos += iDone;
+		pDest += 3 * (iDone / 4);
+		iBody -= iDone;
+		}
+
+	//	Whole quads
+
+	if (!DecodeQuads(pPos, iBody / 4, pDest))
+		return false;
+
+	pPos += iBody;
+	pDest += 3 * (iBody / 4);
+
+	//	Padded quad
+
+	if (iPadding)
+		{
+		DWORD dwA = g_Decode64[pPos[0]];
+		DWORD dwB = g_Decode64[pPos[1]];
+		DWORD dwC = (iPadding == 1 ? g_Decode64[pPos[2]] : 0);
+		if ((dwA | dwB | dwC) & 0x80)
+			return false;
+
+		DWORD dwValue = (dwA << 18) | (dwB << 12) | (dwC << 6);
+
+		//	Bits past the end must be zero (otherwise two different strings
+		//	would decode to the same data).
+
+		if (iPadding == 2 ? (dwValue & 0xffff) : (dwValue & 0xff))
+			return false;
+
+		*pDest++ = (BYTE)(dwValue >> 16);
+		if (iPadding == 1)
+			*pDest++ = (BYTE)(dwValue >> 8);
+		}
+
+	if (retiLength)
+		*retiLength = iDecodedLength;
+
+	return true;
+	}
+
+bool base64Decode (const CString &sInput, CString *retsData)
+
+//	base64Decode
+//
+//	Decodes a string. Returns FALSE if it is not valid base64.
+
+	{
+	int iLength = base64GetDecodedLength(sInput.GetASCIIZPointer(), sInput.GetLength());
+	if (iLength == -1)
+		return false;
+
+	CString sData;
+	char *pDest = sData.GetWritePointer(iLength);
+	if (!base64Decode(sInput.GetASCIIZPointer(), sInput.GetLength(), pDest))
+		return false;
+
+	*retsData = sData;
+	return true;
+	}
+
+int base64Encode (const void *pData, int iLength, char *pOutput)
+
+//	base64Encode
+//
+//	Encodes iLength bytes into pOutput, which must hold at least
+//	base64GetEncodedLength(iLength) characters. The output is padded and is
+//	not NULL-terminated. Returns the number of characters written.
+
+	{
+	const BYTE *pPos = (const BYTE *)pData;
+	char *pDest = pOutput;
+
+	//	Fast path
+
+	if (::sysGetCPUFeatures() & CPU_FEATURE_SSSE3)
+		{
+		int iDone = EncodeSSSE3(pPos, iLength, pDest);
+		pPos += iDone;
+		pDest += 4 * (iDone / 3);
+		iLength -= iDone;
+		}
+
+	//	Whole triplets
+
+	int iTriplets = iLength / 3;
+	EncodeTriplets(pPos, iTriplets, pDest);
+	pPos += 3 * iTriplets;
+	pDest += 4 * iTriplets;
+	iLength -= 3 * iTriplets;
+
+	//	Padded triplet
+
+	if (iLength == 1)
+		{
+		*pDest++ = g_Table64[pPos[0] >> 2];
+		*pDest++ = g_Table64[(pPos[0] & 0x03) << 4];
+		*pDest++ = '=';
+		*pDest++ = '=';
+		}
+	else if (iLength == 2)
+		{
+		*pDest++ = g_Table64[pPos[0] >> 2];
+		*pDest++ = g_Table64[((pPos[0] & 0x03) << 4) | (pPos[1] >> 4)];
+		*pDest++ = g_Table64[(pPos[1] & 0x0f) << 2];
+		*pDest++ = '=';
+		}
+
+	return (int)(pDest - pOutput);
+	}
+
+CString base64Encode (const void *pData, int iLength)
+
+//	base64Encode
+//
+//	Returns the data as a base64 string
+
+	{
+	CString sResult;
+	char *pDest = sResult.GetWritePointer(base64GetEncodedLength(iLength));
+	base64Encode(pData, iLength, pDest);
+	return sResult;
+	}
+
+int base64GetDecodedLength (const char *pInput, int iLength)
+
+//	base64GetDecodedLength
+//
+//	Returns the number of bytes that the given base64 characters decode to, or
+//	-1 if the length is not valid. We only check the length and padding here.
+
+	{
+	if (iLength % 4)
+		return -1;
+
+	int iPadding = 0;
+	if (iLength > 0 && pInput[iLength - 1] == '=')
+		iPadding = (pInput[iLength - 2] == '=' ? 2 : 1);
+
+	return 3 * (iLength / 4) - iPadding;
+	}
+
+int base64GetEncodedLength (int iLength)
+
+//	base64GetEncodedLength
+//
+//	Returns the number of characters needed to encode iLength bytes
+
+	{
+	return 4 * ((iLength + 2) / 3);
+	}
+
+bool DecodeQuads (const BYTE *pInput, int iQuads, BYTE *pOutput)
+
+//	DecodeQuads
+//
+//	Decodes quads without padding. Returns FALSE if any character is invalid.
+
+	{
+	DWORD dwInvalid = 0;
+
+	while (iQuads-- > 0)
+		{
+		DWORD dwA = g_Decode64[pInput[0]];
+		DWORD dwB = g_Decode64[pInput[1]];
+		DWORD dwC = g_Decode64[pInput[2]];
+		DWORD dwD = g_Decode64[pInput[3]];
+
+		//	Invalid characters have the high bit set; we check once at the end
+
+		dwInvalid |= dwA | dwB | dwC | dwD;
+
+		DWORD dwValue = (dwA << 18) | (dwB << 12) | (dwC << 6) | dwD;
+		pOutput[0] = (BYTE)(dwValue >> 16);
+		pOutput[1] = (BYTE)(dwValue >> 8);
+		pOutput[2] = (BYTE)dwValue;
+
+		pInput += 4;
+		pOutput += 3;
+		}
+
+	return ((dwInvalid & 0x80) == 0);
+	}
+
+int DecodeSSSE3 (const BYTE *pInput, int iLength, BYTE *pOutput, bool *retbInvalid)
+
+//	DecodeSSSE3
+//
+//	Decodes 16 characters into 12 bytes at a time. Each step stores 16 bytes,
+//	so we stop while there are still 24 characters left (the rest is up to
+//	the caller). Returns the number of characters decoded.
+
+	{
+	const __m128i LUTLow = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m128i LUTHigh = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m128i LUTRoll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i Pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+	const __m128i Nibble = _mm_set1_epi8(0x0f);
+	const __m128i Slash = _mm_set1_epi8('/');
+	const __m128i Merge1 = _mm_set1_epi32(0x01400140);
+	const __m128i Merge2 = _mm_set1_epi32(0x00011000);
+
+	int iDone = 0;
+	*retbInvalid = false;
+
+	while (iLength - iDone >= 24)
+		{
+		__m128i Chars = _mm_loadu_si128((const __m128i *)(pInput + iDone));
+
+		//	Each character is valid if its low and high nibbles don't share a
+		//	bit in the two tables.
+
+		__m128i High = _mm_and_si128(_mm_srli_epi32(Chars, 4), Nibble);
+		__m128i Low = _mm_and_si128(Chars, Nibble);
+		__m128i Check = _mm_and_si128(_mm_shuffle_epi8(LUTLow, Low), _mm_shuffle_epi8(LUTHigh, High));
+		if (_mm_movemask_epi8(_mm_cmpgt_epi8(Check, _mm_setzero_si128())))
+			{
+			*retbInvalid = true;
+			return iDone;
+			}
+
+		//	Convert to 6-bit values and pack 4 of them into 3 bytes
+
+		__m128i Roll = _mm_shuffle_epi8(LUTRoll, _mm_add_epi8(_mm_cmpeq_epi8(Chars, Slash), High));
+		__m128i Values = _mm_add_epi8(Chars, Roll);
+		__m128i Merged = _mm_madd_epi16(_mm_maddubs_epi16(Values, Merge1), Merge2);
+
+		_mm_storeu_si128((__m128i *)(pOutput + 3 * (iDone / 4)), _mm_shuffle_epi8(Merged, Pack));
+		iDone += 16;
+		}
+
+	return iDone;
+	}
+
+int EncodeSSSE3 (const BYTE *pInput, int iLength, char *pOutput)
+
+//	EncodeSSSE3
+//
+//	Encodes 12 bytes into 16 characters at a time. Each step loads 16 bytes,
+//	so we stop while there are still 16 left. Returns the number of bytes
+//	encoded.
+
+	{
+	const __m128i Spread = _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+	const __m128i Mask1 = _mm_set1_epi32(0x0fc0fc00);
+	const __m128i Mult1 = _mm_set1_epi32(0x04000040);
+	const __m128i Mask2 = _mm_set1_epi32(0x003f03f0);
+	const __m128i Mult2 = _mm_set1_epi32(0x01000010);
+	const __m128i Shift = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A', 0, 0);
+
+	int iDone = 0;
+
+	while (iLength - iDone >= 16)
+		{
+		//	Spread each 3 bytes into a 32-bit lane and pull out the four
+		//	6-bit values (one per byte).
+
+		__m128i Input = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pInput + iDone)), Spread);
+		__m128i Values = _mm_or_si128(
+				_mm_mulhi_epu16(_mm_and_si128(Input, Mask1), Mult1),
+				_mm_mullo_epi16(_mm_and_si128(Input, Mask2), Mult2));
+
+		//	Map each value to the offset for its range: 0-25 to 13, 26-51 to
+		//	0, and 52-63 to 1-12. Then add the offset for that range.
+
+		__m128i Range = _mm_subs_epu8(Values, _mm_set1_epi8(51));
+		Range = _mm_or_si128(Range, _mm_and_si128(_mm_cmpgt_epi8(_mm_set1_epi8(26), Values), _mm_set1_epi8(13)));
+
+		_mm_storeu_si128((__m128i *)(pOutput + 4 * (iDone / 3)), _mm_add_epi8(Values, _mm_shuffle_epi8(Shift, Range)));
+		iDone += 12;
+		}
+
+	return iDone;
+	}
+
+void EncodeTriplets (const BYTE *pInput, int iTriplets, char *pOutput)
+
+//	EncodeTriplets
+//
+//	Encodes 3 bytes to 4 characters at a time
+
+	{
+	while (iTriplets-- > 0)
+		{
+		DWORD dwValue = ((DWORD)pInput[0] << 16) | ((DWORD)pInput[1] << 8) | (DWORD)pInput[2];
+
+		pOutput[0] = g_Table64[dwValue >> 18];
+		pOutput[1] = g_Table64[(dwValue >> 12) & 0x3f];
+		pOutput[2] = g_Table64[(dwValue >> 6) & 0x3f];
+		pOutput[3] = g_Table64[dwValue & 0x3f];
+
+		pInput += 3;
+		pOutput += 4;
+		}
 	}
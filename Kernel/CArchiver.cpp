@@ -14,6 +14,8 @@
 #define ARCHIVE_SIGNATURE					'ALOA'
 #define ARCHIVE_VERSION						1
 
+#define UNRESOLVED_REFERENCE				((void *)(INT_PTR)-1)
+
 typedef struct
 	{
 	DWORD dwSignature;									//	Always 'ALOA'
@@ -71,7 +73,7 @@ ALERROR CArchiver::AddExternalReference (CString sTag, void *pReference)
 
 	//	Store
 
-	if (error = m_ExternalReferences.AddEntry(sTag, (CObject *)iID))
+	if (error = m_ExternalReferences.AddEntry(sTag, (CObject *)(INT_PTR)iID))
 		return error;
 
 	return NOERROR;
@@ -184,9 +186,7 @@ ALERROR CArchiver::Reference2ID (void *pReference, int *retiID)
 //	Converts a reference to an ID that can be stored on disk
 
 	{
-	ALERROR error;
-	bool bFound;
-	int iID;
+	bool bInserted;
 
 	//	We always map NULL to -1
 
@@ -198,19 +198,15 @@ ALERROR CArchiver::Reference2ID (void *pReference, int *retiID)
 
 	//	Look for the pointer in our table
 
-	if (error = m_ReferenceList.FindOrAdd((int)pReference, m_iNextID, &bFound, &iID))
-		return error;
+	int *pID = m_ReferenceList.SetAt(pReference, &bInserted);
 
-	//	If we found it, then return the value. Otherwise, m_iNextID
-	//	got added as the new ID
+	//	If we found it, then return the value. Otherwise, allocate
+	//	a new ID
 
-	if (bFound)
-		*retiID = iID;
-	else
-		{
-		*retiID = m_iNextID;
-		m_iNextID++;
-		}
+	if (bInserted)
+		*pID = m_iNextID++;
+
+	*retiID = *pID;
 
 	return NOERROR;
 	}
@@ -255,7 +251,8 @@ ALERROR CArchiver::WriteData (char *pData, int iLength)
 //	Unarchiver class ----------------------------------------------------------
 
 CUnarchiver::CUnarchiver (void) :
-		CObject(&g_UnarchiverClass)
+		CObject(&g_UnarchiverClass),
+		m_pReader(NULL)
 
 //	CUnarchiver constructor
 
@@ -265,6 +262,7 @@ CUnarchiver::CUnarchiver (void) :
 CUnarchiver::CUnarchiver (IReadStream *pStream) :
 		CObject(&g_UnarchiverClass),
 		m_pStream(pStream),
+		m_pReader(NULL),
 		m_pExternalReferences(NULL),
 		m_dwMinVersion(0),
 		m_dwVersion(0)
@@ -296,16 +294,22 @@ ALERROR CUnarchiver::BeginUnarchive (void)
 	BOOL bCloseStreamOnError = FALSE;
 	DWORD dwDummy;
 
+	//	Objects read their data a few bytes at a time, so we read through a
+	//	buffer.
+
+	CBufferedReadStream Reader(m_pStream);
+	m_pReader = &Reader;
+
 	//	Open up the file
 
-	if (error = m_pStream->Open())
+	if (error = Reader.Open())
 		goto Fail;
 
 	bCloseStreamOnError = TRUE;
 
 	//	Read the header
 
-	if (error = m_pStream->Read((char *)&archiveheader, sizeof(archiveheader), NULL))
+	if (error = Reader.ReadValue(archiveheader))
 		goto Fail;
 
 	//	If this is not the right signature, fail
@@ -335,12 +339,11 @@ ALERROR CUnarchiver::BeginUnarchive (void)
 	//	Make room in the reference table. Note that this is not guaranteed
 	//	to be all the references in the file, just a good hint.
 
-	m_ReferenceList.RemoveAll();
-	if (error = m_ReferenceList.ExpandArray(0, (int)archiveheader.dwReferences))
-		goto Fail;
+	m_ReferenceList.DeleteAll();
+	m_ReferenceList.InsertEmpty((int)archiveheader.dwReferences);
 
 	for (i = 0; i < m_ReferenceList.GetCount(); i++)
-		m_ReferenceList.ReplaceElement(i, -1);
+		m_ReferenceList[i] = UNRESOLVED_REFERENCE;
 
 	//	Load the external reference table
 
@@ -357,7 +360,7 @@ ALERROR CUnarchiver::BeginUnarchive (void)
 	//	Skip over the object's class ID because we know that
 	//	this is an external reference object
 
-	if (error = m_pStream->Read((char *)&dwDummy, sizeof(DWORD), NULL))
+	if (error = Reader.ReadValue(dwDummy))
 		goto Fail;
 
 	if (error = m_pExternalReferences->Load(this))
@@ -377,15 +380,17 @@ ALERROR CUnarchiver::BeginUnarchive (void)
 		m_List.Insert(pObject);
 		}
 
-	m_pStream->Close();
+	Reader.Close();
+	m_pReader = NULL;
 
 	return NOERROR;
 
 Fail:
 
 	if (bCloseStreamOnError)
-		m_pStream->Close();
+		Reader.Close();
 
+	m_pReader = NULL;
 	return error;
 	}
 
@@ -399,21 +404,20 @@ ALERROR CUnarchiver::EndUnarchive (void)
 	ALERROR error;
 	int i;
 
-	for (i = 0; i < m_FixupTable.GetCount(); i += 2)
+	for (i = 0; i < m_FixupTable.GetCount(); i++)
 		{
-		void **pReferenceDest;
-		int iID, iRef;
-
-		pReferenceDest = (void **)m_FixupTable.GetElement(i);
-		iID = m_FixupTable.GetElement(i + 1);
+		const SFixup &Fixup = m_FixupTable[i];
 
 		//	Look for this ID
 
-		iRef = m_ReferenceList.GetElement(iID);
-		if (iRef == -1)
+		if (Fixup.iID >= m_ReferenceList.GetCount())
+			return ERR_FAIL;
+
+		void *pRef = m_ReferenceList[Fixup.iID];
+		if (pRef == UNRESOLVED_REFERENCE)
 			return ERR_FAIL;
 
-		*pReferenceDest = (void *)iRef;
+		*Fixup.pDest = pRef;
 		}
 
 	//	Let each object know that we're done loading
@@ -457,12 +461,12 @@ ALERROR CUnarchiver::LoadObject (CObject **retpObject)
 
 	//	Load the object's instance ID
 
-	if (error = m_pStream->Read((char *)&dwReferenceID, sizeof(DWORD), NULL))
+	if (error = m_pReader->ReadValue(dwReferenceID))
 		return error;
 
 	//	Load the object's class ID
 
-	if (error = m_pStream->Read((char *)&dwID, sizeof(DWORD), NULL))
+	if (error = m_pReader->ReadValue(dwID))
 		return error;
 
 	//	Create a new object with this ID
@@ -492,19 +496,15 @@ ALERROR CUnarchiver::LoadObject (CObject **retpObject)
 		int iPos = m_ReferenceList.GetCount();
 		int i;
 
-		if (error = m_ReferenceList.ExpandArray(iPos, iGrow))
-			{
-			delete pObject;
-			return error;
-			}
+		m_ReferenceList.InsertEmpty(iGrow);
 
-		//	Fill new part of table with -1
+		//	Fill new part of table with unresolved markers
 
 		for (i = iPos; i < iPos + iGrow; i++)
-			m_ReferenceList.ReplaceElement(i, -1);
+			m_ReferenceList[i] = UNRESOLVED_REFERENCE;
 		}
 
-	m_ReferenceList.ReplaceElement((int)dwReferenceID, (int)pObject);
+	m_ReferenceList[(int)dwReferenceID] = pObject;
 
 	//	Done
 
@@ -513,17 +513,6 @@ ALERROR CUnarchiver::LoadObject (CObject **retpObject)
 	return NOERROR;
 	}
 
-ALERROR CUnarchiver::ReadData (char *pData, int iLength)
-
-//	ReadData
-//
-//	This method is used by objects to read their own data. It must only
-//	be called by an object's Load method.
-
-	{
-	return m_pStream->Read(pData, iLength, NULL);
-	}
-
 ALERROR CUnarchiver::ResolveReference (int iID, void **pReferenceDest)
 
 //	ResolveReference
@@ -532,9 +521,6 @@ ALERROR CUnarchiver::ResolveReference (int iID, void **pReferenceDest)
 //	has not been resolved yet, we add an entry to the fixup table
 
 	{
-	ALERROR error;
-	int iRef;
-
 	//	An ID of -1 is always a NULL
 
 	if (iID == -1)
@@ -552,21 +538,19 @@ ALERROR CUnarchiver::ResolveReference (int iID, void **pReferenceDest)
 
 	if (iID < m_ReferenceList.GetCount())
 		{
-		iRef = m_ReferenceList.GetElement(iID);
-		if (iRef != -1)
+		void *pRef = m_ReferenceList[iID];
+		if (pRef != UNRESOLVED_REFERENCE)
 			{
-			*pReferenceDest = (void *)iRef;
+			*pReferenceDest = pRef;
 			return NOERROR;
 			}
 		}
 
 	//	If we could not find it, add it to our fixup table
 
-	if (error = m_FixupTable.AppendElement((int)pReferenceDest, NULL))
-		return error;
-
-	if (error = m_FixupTable.AppendElement(iID, NULL))
-		return error;
+	SFixup *pFixup = m_FixupTable.Insert();
+	pFixup->pDest = pReferenceDest;
+	pFixup->iID = iID;
 
 	return NOERROR;
 	}
@@ -589,11 +573,11 @@ ALERROR CUnarchiver::ResolveExternalReference (CString sTag, void *pReference)
 
 	//	Add the reference
 
-	iID = (int)pValue;
+	iID = (int)(DWORD_PTR)pValue;
 	if (iID < 0 || iID >= m_ReferenceList.GetCount())
 		return ERR_FAIL;
 
-	m_ReferenceList.ReplaceElement(iID, (int)pReference);
+	m_ReferenceList[iID] = pReference;
 
 	return NOERROR;
 	}
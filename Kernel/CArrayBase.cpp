@@ -140,8 +140,6 @@ void CArrayBase::DeleteBytes (int iOffset, int iLength)
 //	Delete iLength bytes in the array at the given offset
 
 	{
-	int i;
-
 	if (iLength <= 0)
 		return;
 
@@ -149,10 +147,9 @@ void CArrayBase::DeleteBytes (int iOffset, int iLength)
 
 	//	Move stuff down
 
-	char *pSource = GetBytes() + iOffset + iLength;
-	char *pDest = GetBytes() + iOffset;
-	for (i = 0; i < GetSize() - (iOffset + iLength); i++)
-		*pDest++ = *pSource++;
+	int iTail = GetSize() - (iOffset + iLength);
+	if (iTail > 0)
+		memmove(GetBytes() + iOffset, GetBytes() + iOffset + iLength, iTail);
 
 	//	Done
 
@@ -166,8 +163,6 @@ void CArrayBase::InsertBytes (int iOffset, void *pData, int iLength, int iAllocQ
 //	Insert the given data at the offset
 
 	{
-	int i;
-
 	if (iLength <= 0)
 		return;
 
@@ -182,86 +177,112 @@ void CArrayBase::InsertBytes (int iOffset, void *pData, int iLength, int iAllocQ
     
 	//	Move the array up
     
-	char *pSource = GetBytes() + GetSize()-1;
-	char *pDest = pSource + iLength;
-    for (i = GetSize()-1; i >= iOffset; i--)
-		*pDest-- = *pSource--;
+	int iTail = GetSize() - iOffset;
+	if (iTail > 0)
+		memmove(GetBytes() + iOffset + iLength, GetBytes() + iOffset, iTail);
 
 	//	Copy the new values
 
 	if (pData)
-		{
-		pSource = (char *)pData;
-		pDest = GetBytes() + iOffset;
-		for (i = 0; i < iLength; i++)
-			*pDest++ = *pSource++;
-		}
+		memcpy(GetBytes() + iOffset, pData, iLength);
 
 	//	Done
     
 	m_pBlock->m_iSize += iLength;
 	}
 
-ALERROR CArrayBase::Resize (int iNewSize, bool bPreserve, int iAllocQuantum)
+void CArrayBase::Realloc (int iNewAllocSize, bool bPreserve)
 
-//	Resize
+//	Realloc
 //
-//	Resize the array so that it is at least the given new size
+//	Reallocates the block so that it can hold iNewAllocSize bytes of data.
+//	We treat elements as relocatable bytes (InsertBytes already moves them
+//	with memmove), so when preserving we let the heap grow the block in
+//	place if it can.
 
 	{
-	ASSERT(iAllocQuantum > 0);
+	int iNewBlockSize = sizeof(SHeader) + iNewAllocSize;
 
-	//	See if we need to reallocate the block
+	SHeader *pNewBlock;
+	if (m_pBlock && bPreserve)
+		pNewBlock = (SHeader *)::HeapReAlloc(m_pBlock->m_hHeap, 0, m_pBlock, iNewBlockSize);
+	else
+		pNewBlock = (SHeader *)::HeapAlloc(GetHeap(), 0, iNewBlockSize);
+
+	if (pNewBlock == NULL)
+		{
+		::kernelDebugLogPattern("Out of memory allocating array of %d bytes.", iNewBlockSize);
+		throw CException(ERR_MEMORY);
+		}
 
-	if (m_pBlock == NULL || (m_pBlock->m_iAllocSize - (int)sizeof(SHeader) < iNewSize))
+#ifdef DEBUG_ARRAY_STATS
+	if (m_pBlock == NULL)
+		{
+		g_dwArraysCreated++;
+		g_dwTotalBytesAllocated += iNewAllocSize;
+		}
+	else
 		{
-		//	Allocate a new block
+		g_dwArraysResized++;
+		g_dwTotalBytesAllocated += -(m_pBlock->m_iAllocSize - (int)sizeof(SHeader)) + iNewAllocSize;
+		g_dwTotalBytesMoved += (bPreserve ? GetSize() : 0);
+		}
+#endif
 
-		int iNewAllocSize = sizeof(SHeader) + Max(iNewSize * 2, AlignUp(iNewSize, iAllocQuantum));
-		SHeader *pNewBlock = (SHeader *)::HeapAlloc(GetHeap(), 0, iNewAllocSize);
-		if (pNewBlock == NULL)
-			{
-			::kernelDebugLogPattern("Out of memory allocating array of %d bytes.", iNewAllocSize);
-			throw CException(ERR_MEMORY);
-			}
+	//	If we reallocated in place, the header came along with the data.
+	//	Otherwise, initialize a new header and free the old block.
 
+	if (m_pBlock && bPreserve)
+		pNewBlock->m_iAllocSize = iNewBlockSize;
+	else
+		{
 		pNewBlock->m_hHeap = GetHeap();
-		pNewBlock->m_iAllocSize = iNewAllocSize;
+		pNewBlock->m_iAllocSize = iNewBlockSize;
 		pNewBlock->m_iGranularity = GetGranularity();
 		pNewBlock->m_iSize = GetSize();
 
-#ifdef DEBUG_ARRAY_STATS
-		if (m_pBlock == NULL)
-			{
-			g_dwArraysCreated++;
-			g_dwTotalBytesAllocated += pNewBlock->m_iAllocSize - sizeof(SHeader);
-			}
-		else
-			{
-			g_dwArraysResized++;
-			g_dwTotalBytesAllocated += -(m_pBlock->m_iAllocSize - (int)sizeof(SHeader)) + (pNewBlock->m_iAllocSize - (int)sizeof(SHeader));
-			g_dwTotalBytesMoved += (bPreserve ? GetSize() : 0);
-			}
-#endif
+		if (m_pBlock)
+			::HeapFree(m_pBlock->m_hHeap, 0, m_pBlock);
+		}
 
-		//	Transfer the contents, if necessary
+	m_pBlock = pNewBlock;
+	}
 
-		if (m_pBlock && bPreserve)
-			{
-			int i;
-			char *pSource = GetBytes();
-			char *pDest = (char *)(&pNewBlock[1]);
+void CArrayBase::ReserveBytes (int iSize)
 
-			for (i = 0; i < GetSize(); i++)
-				*pDest++ = *pSource++;
-			}
+//	ReserveBytes
+//
+//	Makes sure we have room for at least iSize bytes without further
+//	allocation. Unlike Resize, we allocate exactly what is asked for.
 
-		//	Swap blocks
+	{
+	if (iSize > GetAllocSize())
+		Realloc(iSize, true);
+	}
 
-		if (m_pBlock)
-			::HeapFree(m_pBlock->m_hHeap, 0, m_pBlock);
+ALERROR CArrayBase::Resize (int iNewSize, bool bPreserve, int iAllocQuantum)
+
+//	Resize
+//
+//	Resize the array so that it is at least the given new size
+
+	{
+	ASSERT(iAllocQuantum > 0);
+
+	//	See if we need to reallocate the block
+
+	int iAllocSize = GetAllocSize();
+	if (m_pBlock == NULL || iAllocSize < iNewSize)
+		{
+		//	Allocate twice what we need (as we always have), so that appending
+		//	one element at a time is amortized O(1). Near the top of the
+		//	address space we just round up to the alloc quantum.
+
+		int iNewAllocSize = AlignUp(iNewSize, iAllocQuantum);
+		if (iNewSize < (MAXINT - (int)sizeof(SHeader)) / 2)
+			iNewAllocSize = Max(iNewAllocSize, iNewSize * 2);
 
-		m_pBlock = pNewBlock;
+		Realloc(iNewAllocSize, bPreserve);
 		}
 
 	return NOERROR;
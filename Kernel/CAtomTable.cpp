@@ -5,17 +5,24 @@
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-static DATADESCSTRUCT g_DataDesc[] =
-	{	{ DATADESC_OPCODE_INT,			1,	0 },		//	m_iHashSize
-		{ DATADESC_OPCODE_INT,			1,	0 },		//	m_iNextAtom
-		{ DATADESC_OPCODE_ALLOC_OBJ,	1,	0 },		//	m_pBackbone
-		{ DATADESC_OPCODE_STOP,	0,	0 } };
-static CObjectClass<CAtomTable>g_ClassData(OBJID_CATOMTABLE, g_DataDesc);
+//	NOTE: We have no data descriptor because TDictionary cannot be copied
+//	bitwise. We save and copy ourselves.
+//
+//	Archives written before that used the old data descriptor:
+//
+//	DWORD		m_iHashSize
+//	DWORD		m_iNextAtom
+//	DWORD		class ID of m_pBackbone (0 if NULL)
+//	{CSymbolTable}
+//
+//	Newer archives start with VERSION2HACK (which can never be a hash size).
+
+static CObjectClass<CAtomTable>g_ClassData(OBJID_CATOMTABLE, NULL);
+
+#define VERSION2HACK				0xffffffff
 
 CAtomTable::CAtomTable (void) : CObject(&g_ClassData),
-		m_iHashSize(128),
-		m_iNextAtom(1),
-		m_pBackbone(NULL)
+		m_iNextAtom(1)
 
 //	CAtomTable constructor
 
@@ -23,11 +30,13 @@ CAtomTable::CAtomTable (void) : CObject(&g_ClassData),
 	}
 
 CAtomTable::CAtomTable (int iHashSize) : CObject(&g_ClassData),
-		m_iHashSize(iHashSize),
-		m_iNextAtom(1),
-		m_pBackbone(NULL)
+		m_Atoms(DictionaryUnsorted, iHashSize),
+		m_iNextAtom(1)
 
 //	CAtomTable constructor
+//
+//	iHashSize used to be the number of hash buckets; we now use it as a hint
+//	for the number of atoms.
 
 	{
 	}
@@ -37,8 +46,6 @@ CAtomTable::~CAtomTable (void)
 //	CAtomTable destructor
 
 	{
-	if (m_pBackbone)
-		delete [] m_pBackbone;
 	}
 
 ALERROR CAtomTable::AppendAtom (const CString &sString, int *retiAtom)
@@ -48,30 +55,19 @@ ALERROR CAtomTable::AppendAtom (const CString &sString, int *retiAtom)
 //	Add an atom to the atom table
 
 	{
-	ALERROR error;
-	CSymbolTable *pTable;
-
-	//	If we have not yet allocated the backbone, do it now
+	bool bInserted;
+	int *pAtom = m_Atoms.SetAt(sString, &bInserted);
 
-	if (m_pBackbone == NULL)
-		{
-		m_pBackbone = new CSymbolTable[m_iHashSize];
-		if (m_pBackbone == NULL)
-			return ERR_MEMORY;
-		}
+	//	If the atom already exists, we fail (this is the same as the old
+	//	symbol table behavior).
 
-	//	Get the symbol table
+	if (!bInserted)
+		return ERR_FAIL;
 
-	pTable = Hash(sString);
+	*pAtom = m_iNextAtom++;
 
-	//	Lookup the value in the symbol table
-
-	if (error = pTable->AddEntry(sString, (CObject *)m_iNextAtom))
-		return error;
-
-	//	Next atom
-
-	m_iNextAtom++;
+	if (retiAtom)
+		*retiAtom = *pAtom;
 
 	return NOERROR;
 	}
@@ -84,47 +80,154 @@ int CAtomTable::Atomize (const CString &sString)
 //	is found, returns -1
 
 	{
-	CSymbolTable *pTable;
 	int iAtom;
 
-	if (m_pBackbone == NULL)
+	if (!m_Atoms.Find(sString, &iAtom))
 		return -1;
 
-	//	Get the symbol table
+	return iAtom;
+	}
 
-	pTable = Hash(sString);
+void CAtomTable::CopyHandler (CObject *pOriginal)
 
-	//	Do a look up
+//	CopyHandler
+//
+//	Copy from the original
 
-	if (pTable->Lookup(sString, (CObject **)&iAtom) != NOERROR)
-		return -1;
+	{
+	CAtomTable *pSrc = (CAtomTable *)pOriginal;
 
-	return iAtom;
+	m_Atoms = pSrc->m_Atoms;
+	m_iNextAtom = pSrc->m_iNextAtom;
 	}
 
-CSymbolTable *CAtomTable::Hash (const CString &sString)
+ALERROR CAtomTable::LoadHandler (CUnarchiver *pUnarchiver)
 
-//	Hash
+//	LoadHandler
 //
-//	Returns the symbol table associated with this hash bucket
+//	Load the table
 
 	{
-	int iHash;
-	char *pPos;
+	ALERROR error;
+	DWORD dwVersion;
+	DWORD dwCount;
+	int i;
+
+	m_Atoms.DeleteAll();
+
+	if (error = pUnarchiver->ReadData((char *)&dwVersion, sizeof(DWORD)))
+		return error;
+
+	//	If this is an old archive, load the backbone symbol table.
+
+	if (dwVersion != VERSION2HACK)
+		return LoadOldVersion(pUnarchiver);
+
+	if (error = pUnarchiver->ReadData((char *)&m_iNextAtom, sizeof(DWORD)))
+		return error;
 
-	ASSERT(m_pBackbone);
+	if (error = pUnarchiver->ReadData((char *)&dwCount, sizeof(DWORD)))
+		return error;
 
-	//	Compute the hash value
+	m_Atoms.GrowToFit((int)dwCount);
 
-	pPos = sString.GetASCIIZPointer();
-	iHash = 0;
-	while (*pPos != '\0')
+	for (i = 0; i < (int)dwCount; i++)
 		{
-		iHash = 131 * iHash + (int)(DWORD)(*pPos);
-		pPos++;
+		DWORD dwLen;
+		int iAtom;
+
+		if (error = pUnarchiver->ReadData((char *)&dwLen, sizeof(DWORD)))
+			return error;
+
+		CString sAtom;
+		if (error = pUnarchiver->ReadData(sAtom.GetWritePointer((int)dwLen), (int)dwLen))
+			return error;
+
+		if (error = pUnarchiver->ReadData((char *)&iAtom, sizeof(DWORD)))
+			return error;
+
+		m_Atoms.SetAt(sAtom, iAtom);
 		}
 
-	//	Return the table
+	return NOERROR;
+	}
 
-	return &m_pBackbone[iHash % m_iHashSize];
+ALERROR CAtomTable::LoadOldVersion (CUnarchiver *pUnarchiver)
+
+//	LoadOldVersion
+//
+//	Loads an archive written with the old data descriptor. We've already read
+//	the hash size (which we no longer need).
+//
+//	NOTE: The old code saved m_pBackbone as a single object, so only the
+//	first hash bucket made it into the archive. We load whatever is there.
+
+	{
+	ALERROR error;
+	DWORD dwClassID;
+	int i;
+
+	if (error = pUnarchiver->ReadData((char *)&m_iNextAtom, sizeof(DWORD)))
+		return error;
+
+	if (error = pUnarchiver->ReadData((char *)&dwClassID, sizeof(DWORD)))
+		return error;
+
+	if (dwClassID == 0)
+		return NOERROR;
+	else if (dwClassID != OBJID_CSYMBOLTABLE)
+		return ERR_FAIL;
+
+	CSymbolTable Backbone;
+	if (error = Backbone.Load(pUnarchiver))
+		return error;
+
+	//	Values are atoms stored as raw (non-reference) values
+
+	m_Atoms.GrowToFit(Backbone.GetCount());
+	for (i = 0; i < Backbone.GetCount(); i++)
+		m_Atoms.SetAt(Backbone.GetKey(i), (int)(DWORD_PTR)Backbone.GetValue(i));
+
+	return NOERROR;
+	}
+
+ALERROR CAtomTable::SaveHandler (CArchiver *pArchiver)
+
+//	SaveHandler
+//
+//	Save the table
+
+	{
+	ALERROR error;
+	DWORD dwVersion;
+	DWORD dwCount;
+	int i;
+
+	dwVersion = VERSION2HACK;
+	if (error = pArchiver->WriteData((char *)&dwVersion, sizeof(DWORD)))
+		return error;
+
+	if (error = pArchiver->WriteData((char *)&m_iNextAtom, sizeof(DWORD)))
+		return error;
+
+	dwCount = (DWORD)m_Atoms.GetCount();
+	if (error = pArchiver->WriteData((char *)&dwCount, sizeof(DWORD)))
+		return error;
+
+	for (i = 0; i < m_Atoms.GetCount(); i++)
+		{
+		const CString &sAtom = m_Atoms.GetKey(i);
+		DWORD dwLen = (DWORD)sAtom.GetLength();
+
+		if (error = pArchiver->WriteData((char *)&dwLen, sizeof(DWORD)))
+			return error;
+
+		if (error = pArchiver->WriteData(sAtom.GetASCIIZPointer(), (int)dwLen))
+			return error;
+
+		if (error = pArchiver->WriteData((char *)&m_Atoms.GetValue(i), sizeof(DWORD)))
+			return error;
+		}
+
+	return NOERROR;
 	}
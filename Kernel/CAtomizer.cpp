@@ -12,9 +12,47 @@ CAtomizer::CAtomizer (void) :
 //	CAtomizer constructor
 
 	{
-	//	Insert an entry because valid atoms start at 1.
+	int i;
+
+	for (i = 0; i < SEGMENT_COUNT; i++)
+		m_pSegments[i] = NULL;
+
+	m_pTable = AllocTable(MIN_TABLE_SIZE);
+
+	//	Valid atoms start at 1, but we reserve the slot for atom 0 so that
+	//	segment math stays simple.
+
+	m_pSegments[0] = new SAtom [SEGMENT_BASE_SIZE];
+	}
+
+CAtomizer::~CAtomizer (void)
+
+//	CAtomizer destructor
+
+	{
+	int i;
+
+	for (i = 0; i < SEGMENT_COUNT; i++)
+		delete [] m_pSegments[i];
+
+	delete [] (BYTE *)m_pTable;
+	for (i = 0; i < m_Retired.GetCount(); i++)
+		delete [] (BYTE *)m_Retired[i];
+	}
+
+CAtomizer::STable *CAtomizer::AllocTable (int iSize)
+
+//	AllocTable
+//
+//	Allocates an empty table. iSize must be a power of 2.
+
+	{
+	STable *pTable = (STable *)new BYTE [sizeof(STable) + (iSize - 1) * sizeof(LONG)];
+	pTable->dwMask = (DWORD)(iSize - 1);
+	for (int i = 0; i < iSize; i++)
+		pTable->Slots[i] = 0;
 
-	m_AtomToString.Insert(NULL_STR);
+	return pTable;
 	}
 
 DWORD CAtomizer::Atomize (const CString &sIdentifier)
@@ -24,18 +62,115 @@ DWORD CAtomizer::Atomize (const CString &sIdentifier)
 //	Convert from identifier to atom.
 
 	{
-	bool bNew;
-	DWORD *pAtom = m_StringToAtom.SetAt(sIdentifier, &bNew);
+	DWORD dwHash = Hash(sIdentifier);
 
-	//	If not found, we need to add it.
+	//	Most calls are for atoms we already have, so look without locking.
 
-	if (bNew)
+	DWORD dwAtom = FindAtom(m_pTable, sIdentifier, dwHash);
+	if (dwAtom)
+		return dwAtom;
+
+	//	Not found, so we need to add it. Another thread might have added it
+	//	since we looked, so check again under the lock.
+
+	CSmartLock Lock(m_cs);
+
+	dwAtom = FindAtom(m_pTable, sIdentifier, dwHash);
+	if (dwAtom)
+		return dwAtom;
+
+	dwAtom = m_dwNextID;
+
+	int iSegment, iIndex;
+	if (!CalcSegment(dwAtom, &iSegment, &iIndex))
+		throw CException(ERR_MEMORY);
+
+	if (m_pSegments[iSegment] == NULL)
+		m_pSegments[iSegment] = new SAtom [SEGMENT_BASE_SIZE << iSegment];
+
+	SAtom &NewAtom = m_pSegments[iSegment][iIndex];
+	NewAtom.sIdentifier = sIdentifier;
+	NewAtom.dwHash = dwHash;
+
+	//	Bump the count before we publish, so that a reader who finds the new
+	//	atom in the table always sees it as valid.
+
+	m_dwNextID = dwAtom + 1;
+
+	//	Grow the table if it is more than half full. Readers may still be
+	//	probing the old table, so we keep it around until we're destroyed.
+
+	STable *pTable = m_pTable;
+	if (2 * dwAtom > pTable->dwMask)
 		{
-		*pAtom = m_dwNextID++;
-		m_AtomToString.Insert(sIdentifier);
+		int iNewSize = 2 * (int)(pTable->dwMask + 1);
+		STable *pNewTable = AllocTable(iNewSize);
+
+		for (DWORD i = 0; i <= pTable->dwMask; i++)
+			if (pTable->Slots[i])
+				InsertSlot(pNewTable, GetAtom((DWORD)pTable->Slots[i]).dwHash, (DWORD)pTable->Slots[i]);
+
+		InsertSlot(pNewTable, dwHash, dwAtom);
+
+		m_Retired.Insert(pTable);
+		::InterlockedExchangePointer((PVOID volatile *)&m_pTable, pNewTable);
 		}
 
-	return *pAtom;
+	//	Publish the atom. The interlocked write orders it after the atom data.
+
+	else
+		InsertSlot(pTable, dwHash, dwAtom);
+
+	return dwAtom;
+	}
+
+bool CAtomizer::CalcSegment (DWORD dwAtom, int *retiSegment, int *retiIndex)
+
+//	CalcSegment
+//
+//	Returns the segment and index of the given atom. Segment i starts at atom
+//	SEGMENT_BASE_SIZE * (2^i - 1). Returns FALSE if the atom is out of range.
+
+	{
+	DWORD dwBlock = dwAtom / SEGMENT_BASE_SIZE + 1;
+	int iSegment = 0;
+	while (dwBlock > 1)
+		{
+		dwBlock >>= 1;
+		iSegment++;
+		}
+
+	if (iSegment >= SEGMENT_COUNT)
+		return false;
+
+	*retiSegment = iSegment;
+	*retiIndex = (int)(dwAtom - SEGMENT_BASE_SIZE * ((1 << iSegment) - 1));
+	return true;
+	}
+
+DWORD CAtomizer::FindAtom (const STable *pTable, const CString &sIdentifier, DWORD dwHash) const
+
+//	FindAtom
+//
+//	Returns the atom for the identifier (or 0 if not found). This is safe to
+//	call without the lock because slots only go from empty to filled.
+
+	{
+	DWORD dwPos = dwHash & pTable->dwMask;
+	while (true)
+		{
+		DWORD dwAtom = (DWORD)pTable->Slots[dwPos];
+		if (dwAtom == 0)
+			return 0;
+
+		const SAtom &Atom = GetAtom(dwAtom);
+		if (Atom.dwHash == dwHash
+				&& Atom.sIdentifier.GetLength() == sIdentifier.GetLength()
+				&& strCompareAbsolute(Atom.sIdentifier, sIdentifier) == 0)
+			return dwAtom;
+
+		dwPos = (dwPos + 1) & pTable->dwMask;
+		}
 	}
 
 const CString &CAtomizer::GetIdentifier (DWORD dwAtom) const
@@ -45,8 +180,8 @@ const CString &CAtomizer::GetIdentifier (DWORD dwAtom) const
 //	Convert from atom to identifier
 
 	{
-	ASSERT(dwAtom < (DWORD)m_AtomToString.GetCount());
-	return m_AtomToString[dwAtom];
+	ASSERT(dwAtom < m_dwNextID);
+	return GetAtom(dwAtom).sIdentifier;
 	}
 
 int CAtomizer::GetMemoryUsage (void) const
@@ -57,10 +192,49 @@ int CAtomizer::GetMemoryUsage (void) const
 
 	{
 	int i;
-	int iTotal = m_AtomToString.GetCount() * sizeof(DWORD);
+	int iTotal = (int)(m_pTable->dwMask + 1) * sizeof(LONG);
 
-	for (i = 0; i < m_AtomToString.GetCount(); i++)
-		iTotal += m_AtomToString[i].GetMemoryUsage();
+	for (i = 0; i < SEGMENT_COUNT; i++)
+		if (m_pSegments[i])
+			iTotal += (SEGMENT_BASE_SIZE << i) * sizeof(SAtom);
+
+	for (i = 1; i < (int)m_dwNextID; i++)
+		iTotal += GetAtom(i).sIdentifier.GetMemoryUsage();
 
 	return iTotal;
 	}
+
+DWORD CAtomizer::Hash (const CString &sIdentifier)
+
+//	Hash
+//
+//	Case-insensitive (FNV-1a) hash, consistent with strCompareAbsolute. We
+//	never return 0.
+
+	{
+	char *pPos = sIdentifier.GetPointer();
+	char *pPosEnd = pPos + sIdentifier.GetLength();
+
+	DWORD dwHash = 2166136261;
+	while (pPos < pPosEnd)
+		{
+		dwHash ^= (BYTE)strLowerCaseAbsolute(*pPos++);
+		dwHash *= 16777619;
+		}
+
+	return (dwHash ? dwHash : 1);
+	}
+
+void CAtomizer::InsertSlot (STable *pTable, DWORD dwHash, DWORD dwAtom)
+
+//	InsertSlot
+//
+//	Adds the atom to the first free slot.
+
+	{
+	DWORD dwPos = dwHash & pTable->dwMask;
+	while (pTable->Slots[dwPos])
+		dwPos = (dwPos + 1) & pTable->dwMask;
+
+	::InterlockedExchange(&pTable->Slots[dwPos], (LONG)dwAtom);
+	}
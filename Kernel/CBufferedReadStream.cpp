@@ -0,0 +1,465 @@
+//	CBufferedReadStream.cpp
+//
+//	CBufferedReadStream class
+//
+//	Reads a stream through a buffer. Small reads are served from the buffer
+//	(inline, for callers that use the Read* methods directly); the source is
+//	only called once per buffer. With read-ahead we keep two buffers: a
+//	background thread fills one while the caller reads from the other.
+
+#include "Kernel.h"
+
+CBufferedReadStream::CBufferedReadStream (IReadStream *pSource, DWORD dwFlags, int iBufferSize) :
+		m_pSource(pSource),
+		m_hFile(INVALID_HANDLE_VALUE),
+		m_dwFlags(dwFlags),
+		m_iBufferSize(Max(iBufferSize, 256)),
+		m_iCurBuffer(0),
+		m_pPos(NULL),
+		m_pPosEnd(NULL),
+		m_SourceError(NOERROR),
+		m_hReadAhead(NULL),
+		m_hBufferEmpty(NULL),
+		m_hBufferFull(NULL),
+		m_iReadAheadLength(0),
+		m_ReadAheadError(NOERROR),
+		m_bQuit(false),
+		m_bOpen(false)
+
+//	CBufferedReadStream constructor
+
+	{
+	ASSERT(pSource);
+	m_pBuffer[0] = NULL;
+	m_pBuffer[1] = NULL;
+	}
+
+CBufferedReadStream::CBufferedReadStream (const CString &sFilename, DWORD dwFlags, int iBufferSize) :
+		m_pSource(NULL),
+		m_sFilename(sFilename),
+		m_hFile(INVALID_HANDLE_VALUE),
+		m_dwFlags(dwFlags),
+		m_iBufferSize(Max(iBufferSize, 256)),
+		m_iCurBuffer(0),
+		m_pPos(NULL),
+		m_pPosEnd(NULL),
+		m_SourceError(NOERROR),
+		m_hReadAhead(NULL),
+		m_hBufferEmpty(NULL),
+		m_hBufferFull(NULL),
+		m_iReadAheadLength(0),
+		m_ReadAheadError(NOERROR),
+		m_bQuit(false),
+		m_bOpen(false)
+
+//	CBufferedReadStream constructor
+
+	{
+	m_pBuffer[0] = NULL;
+	m_pBuffer[1] = NULL;
+	}
+
+CBufferedReadStream::~CBufferedReadStream (void)
+
+//	CBufferedReadStream destructor
+
+	{
+	Close();
+	}
+
+ALERROR CBufferedReadStream::Close (void)
+
+//	Close
+//
+//	Closes the stream (and the source)
+
+	{
+	if (!m_bOpen)
+		return NOERROR;
+
+	m_bOpen = false;
+	StopReadAhead();
+
+	if (m_pBuffer[0])
+		{
+		delete [] m_pBuffer[0];
+		m_pBuffer[0] = NULL;
+		}
+
+	if (m_pBuffer[1])
+		{
+		delete [] m_pBuffer[1];
+		m_pBuffer[1] = NULL;
+		}
+
+	m_pPos = NULL;
+	m_pPosEnd = NULL;
+
+	//	Close the source
+
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		{
+		::CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		}
+
+	if (m_pSource)
+		return m_pSource->Close();
+
+	return NOERROR;
+	}
+
+ALERROR CBufferedReadStream::FillBuffer (void)
+
+//	FillBuffer
+//
+//	Replaces the (fully read) current buffer with the next one. Returns
+//	ERR_ENDOFFILE if there is no more data.
+
+	{
+	int iRead = 0;
+	ALERROR error;
+
+	if (m_SourceError)
+		return m_SourceError;
+
+	//	With read-ahead, the next buffer has been (or is being) filled by the
+	//	thread. We switch to it and let the thread fill the one we're done
+	//	with.
+
+	if (m_hReadAhead)
+		{
+		::WaitForSingleObject(m_hBufferFull, INFINITE);
+
+		m_iCurBuffer = 1 - m_iCurBuffer;
+		iRead = m_iReadAheadLength;
+		error = m_ReadAheadError;
+
+		if (error == NOERROR)
+			::SetEvent(m_hBufferEmpty);
+		}
+
+	//	Otherwise we read it ourselves
+
+	else
+		error = ReadSource(m_pBuffer[0], m_iBufferSize, &iRead);
+
+	m_pPos = m_pBuffer[m_iCurBuffer];
+	m_pPosEnd = m_pPos + iRead;
+
+	//	After an error (or the end of the file) we don't read any more, but
+	//	the caller still gets the data that we got.
+
+	if (error)
+		{
+		m_SourceError = error;
+		if (iRead == 0)
+			return error;
+		}
+
+	return NOERROR;
+	}
+
+ALERROR CBufferedReadStream::Open (void)
+
+//	Open
+//
+//	Opens the stream for reading
+
+	{
+	ALERROR error;
+
+	ASSERT(!m_bOpen);
+
+	//	Open the source
+
+	if (m_pSource)
+		{
+		if (error = m_pSource->Open())
+			return error;
+		}
+	else
+		{
+		m_hFile = ::CreateFile(m_sFilename.GetASCIIZPointer(),
+				GENERIC_READ,
+				FILE_SHARE_READ,
+				NULL,
+				OPEN_EXISTING,
+				FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN,
+				NULL);
+		if (m_hFile == INVALID_HANDLE_VALUE)
+			return ERR_FILEOPEN;
+		}
+
+	m_bOpen = true;
+	m_SourceError = NOERROR;
+
+	//	Allocate the buffers. We start out empty; the first read fills the
+	//	buffer.
+
+	m_pBuffer[0] = new char [m_iBufferSize];
+	m_iCurBuffer = 0;
+	m_pPos = m_pBuffer[0];
+	m_pPosEnd = m_pBuffer[0];
+
+	//	Start reading ahead. The thread fills buffer 0 first, so we pretend
+	//	that we're currently on buffer 1.
+
+	if (m_dwFlags & FLAG_READ_AHEAD)
+		{
+		m_pBuffer[1] = new char [m_iBufferSize];
+		m_iCurBuffer = 1;
+		m_bQuit = false;
+
+		m_hBufferEmpty = ::CreateEvent(NULL, FALSE, TRUE, NULL);
+		m_hBufferFull = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hBufferEmpty && m_hBufferFull)
+			m_hReadAhead = ::kernelCreateThread(ReadAheadThread, this);
+
+		//	If we can't start the thread, we just read synchronously
+
+		if (m_hReadAhead == NULL)
+			{
+			StopReadAhead();
+			m_iCurBuffer = 0;
+			}
+		}
+
+	return NOERROR;
+	}
+
+ALERROR CBufferedReadStream::Read (char *pData, int iLength, int *retiBytesRead)
+
+//	Read
+//
+//	Reads from the stream. If this call returns NOERROR, it is guaranteed
+//	that the requested number of bytes were read.
+
+	{
+	if (iLength <= (int)(m_pPosEnd - m_pPos))
+		{
+		memcpy(pData, m_pPos, iLength);
+		m_pPos += iLength;
+
+		if (retiBytesRead)
+			*retiBytesRead = iLength;
+
+		return NOERROR;
+		}
+
+	return ReadSlow(pData, iLength, retiBytesRead);
+	}
+
+DWORD WINAPI CBufferedReadStream::ReadAheadThread (LPVOID pData)
+
+//	ReadAheadThread
+//
+//	Fills the next buffer whenever the reader is done with it. We stop after
+//	the end of the source (or an error).
+
+	{
+	CBufferedReadStream *pStream = (CBufferedReadStream *)pData;
+
+	while (true)
+		{
+		::WaitForSingleObject(pStream->m_hBufferEmpty, INFINITE);
+		if (pStream->m_bQuit)
+			break;
+
+		int iRead = 0;
+		ALERROR error = pStream->ReadSource(pStream->m_pBuffer[1 - pStream->m_iCurBuffer], pStream->m_iBufferSize, &iRead);
+
+		pStream->m_iReadAheadLength = iRead;
+		pStream->m_ReadAheadError = error;
+		::SetEvent(pStream->m_hBufferFull);
+
+		if (error)
+			break;
+		}
+
+	return 0;
+	}
+
+ALERROR CBufferedReadStream::ReadSlow (char *pData, int iLength, int *retiBytesRead)
+
+//	ReadSlow
+//
+//	Reads data that is not all in the current buffer.
+
+	{
+	ALERROR error = NOERROR;
+	int iTotal = 0;
+
+	ASSERT(iLength >= 0);
+
+	while (true)
+		{
+		//	Take what we have
+
+		int iCopy = Min((int)(m_pPosEnd - m_pPos), iLength);
+		memcpy(pData, m_pPos, iCopy);
+		m_pPos += iCopy;
+		pData += iCopy;
+		iLength -= iCopy;
+		iTotal += iCopy;
+
+		if (iLength == 0)
+			break;
+
+		//	If we're reading synchronously and the caller wants at least a
+		//	buffer's worth, read straight into the caller's buffer.
+
+		if (m_hReadAhead == NULL && iLength >= m_iBufferSize && m_SourceError == NOERROR)
+			{
+			int iRead = 0;
+			error = ReadSource(pData, iLength, &iRead);
+			iTotal += iRead;
+			if (error)
+				m_SourceError = error;
+			break;
+			}
+
+		//	Otherwise, get the next buffer
+
+		if (error = FillBuffer())
+			break;
+		}
+
+	if (retiBytesRead)
+		*retiBytesRead = iTotal;
+
+	return error;
+	}
+
+ALERROR CBufferedReadStream::ReadSource (char *pData, int iLength, int *retiBytesRead)
+
+//	ReadSource
+//
+//	Reads from the source. Returns ERR_ENDOFFILE if we got less than we
+//	asked for.
+
+	{
+	if (m_pSource)
+		{
+		*retiBytesRead = 0;
+		ALERROR error = m_pSource->Read(pData, iLength, retiBytesRead);
+		if (error == NOERROR)
+			*retiBytesRead = iLength;
+
+		return error;
+		}
+	else
+		{
+		DWORD dwRead;
+		if (!::ReadFile(m_hFile, pData, iLength, &dwRead, NULL))
+			{
+			*retiBytesRead = 0;
+			return ERR_FAIL;
+			}
+
+		*retiBytesRead = (int)dwRead;
+		return ((int)dwRead < iLength ? ERR_ENDOFFILE : NOERROR);
+		}
+	}
+
+ALERROR CBufferedReadStream::ReadVarint (DWORD &dwValue)
+
+//	ReadVarint
+//
+//	Reads a varint that must fit in a DWORD.
+
+	{
+	ALERROR error;
+	DWORDLONG dwValue64;
+
+	if (error = ReadVarint(dwValue64))
+		return error;
+
+	if (dwValue64 > MAXDWORD)
+		return ERR_FAIL;
+
+	dwValue = (DWORD)dwValue64;
+	return NOERROR;
+	}
+
+ALERROR CBufferedReadStream::ReadVarintSlow (DWORDLONG *retdwValue)
+
+//	ReadVarintSlow
+//
+//	Reads a varint (7 bits per byte, low bits first; the high bit is set on
+//	all but the last byte). See IWriteStream::WriteVarint.
+
+	{
+	ALERROR error;
+	DWORDLONG dwValue = 0;
+	int i;
+
+	//	If we have enough buffered for the longest varint, decode in place
+
+	if ((int)(m_pPosEnd - m_pPos) >= MAX_VARINT_SIZE)
+		{
+		BYTE *pPos = (BYTE *)m_pPos;
+		for (i = 0; i < MAX_VARINT_SIZE; i++)
+			{
+			dwValue |= (DWORDLONG)(pPos[i] & 0x7f) << (7 * i);
+			if (!(pPos[i] & 0x80))
+				{
+				m_pPos += i + 1;
+				*retdwValue = dwValue;
+				return NOERROR;
+				}
+			}
+
+		return ERR_FAIL;
+		}
+
+	//	Otherwise we go a byte at a time
+
+	for (i = 0; i < MAX_VARINT_SIZE; i++)
+		{
+		BYTE byData;
+		if (error = ReadValue(byData))
+			return error;
+
+		dwValue |= (DWORDLONG)(byData & 0x7f) << (7 * i);
+		if (!(byData & 0x80))
+			{
+			*retdwValue = dwValue;
+			return NOERROR;
+			}
+		}
+
+	//	Too long
+
+	return ERR_FAIL;
+	}
+
+void CBufferedReadStream::StopReadAhead (void)
+
+//	StopReadAhead
+//
+//	Stops the read-ahead thread (waiting for any read in progress).
+
+	{
+	if (m_hReadAhead)
+		{
+		m_bQuit = true;
+		::SetEvent(m_hBufferEmpty);
+		::WaitForSingleObject(m_hReadAhead, INFINITE);
+
+		::CloseHandle(m_hReadAhead);
+		m_hReadAhead = NULL;
+		}
+
+	if (m_hBufferEmpty)
+		{
+		::CloseHandle(m_hBufferEmpty);
+		m_hBufferEmpty = NULL;
+		}
+
+	if (m_hBufferFull)
+		{
+		::CloseHandle(m_hBufferFull);
+		m_hBufferFull = NULL;
+		}
+	}
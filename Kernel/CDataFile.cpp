@@ -15,6 +15,10 @@
 #define ENTRY_FLAG_FREEBLOCK				0x00000001
 const int INVALID_ENTRY =					-1;
 
+#define JOURNAL_SIGNATURE					'ALDJ'
+#define JOURNAL_RECORD_WRITE				1
+#define JOURNAL_RECORD_COMMIT				2
+
 typedef struct
 	{
 	DWORD dwSignature;							//	Always 'ALDF'
@@ -27,6 +31,22 @@ typedef struct
 	DWORD dwSpare[8];
 	} HEADERSTRUCT, *PHEADERSTRUCT;
 
+//	Each write in the journal is a JOURNALRECORD followed by dwLength bytes
+//	of data. A commit record (with no data) follows the writes of each
+//	Flush; its dwPos is the number of writes in the batch and its checksum
+//	combines theirs. Writes after the last valid commit are ignored.
+
+typedef struct
+	{
+	DWORD dwSignature;							//	Always 'ALDJ'
+	DWORD dwType;								//	JOURNAL_RECORD_*
+	DWORD dwPos;								//	File position (or write count)
+	DWORD dwLength;								//	Length of data
+	DWORD dwChecksum;							//	Checksum of data and fields
+	} JOURNALRECORD;
+
+static DWORD CalcJournalChecksum (const JOURNALRECORD &Record, BYTE *pData);
+
 static CObjectClass<CDataFile>g_Class(OBJID_CDATAFILE, NULL);
 
 CDataFile::CDataFile (const CString &sFilename = NULL_STR) : CObject(&g_Class),
@@ -34,6 +54,11 @@ CDataFile::CDataFile (const CString &sFilename = NULL_STR) : CObject(&g_Class),
 		m_hFile(INVALID_HANDLE_VALUE),
 		m_pFile(NULL),
 		m_pEntryTable(NULL),
+		m_hJournal(INVALID_HANDLE_VALUE),
+		m_hJournalThread(NULL),
+		m_hJournalWork(NULL),
+		m_bJournalQuit(false),
+		m_iJournalCommitted(0),
 		m_fFlushing(FALSE)
 
 //	CDataFile constructor
@@ -57,28 +82,21 @@ ALERROR CDataFile::AddEntry (const CString &sData, int *retiEntry)
 
 	{
 	ALERROR error;
-	int i, iEntry;
+	int iEntry;
 	DWORD dwStartingBlock;
 	DWORD dwBlockCount;
 
 	ASSERT(IsOpen());
 	ASSERT(!m_fReadOnly);
 
-	//	Look for a free entry
+	//	Take a free entry. If there are none, grow the entry table
 
-	for (i = 0; i < m_iEntryTableCount; i++)
-		if (m_pEntryTable[i].dwBlock == FREE_ENTRY)
-			break;
-
-	//	If we could not find a free entry, grow the entry table
-
-	if (i == m_iEntryTableCount)
+	iEntry = AllocEntrySlot();
+	if (iEntry == -1)
 		{
 		if (error = GrowEntryTable(&iEntry))
-			goto Fail;
+			return error;
 		}
-	else
-		iEntry = i;
 
 	//	Figure out how many blocks we need
 
@@ -110,7 +128,7 @@ ALERROR CDataFile::AddEntry (const CString &sData, int *retiEntry)
 
 	//	Flush
 
-	if (error = Flush())
+	if (error = WriteTables(false))
 		goto Fail;
 
 	//	Done
@@ -121,9 +139,29 @@ ALERROR CDataFile::AddEntry (const CString &sData, int *retiEntry)
 
 Fail:
 
+	//	If we never filled in the entry, give it back
+
+	if (m_pEntryTable[iEntry].dwBlock == FREE_ENTRY)
+		m_FreeEntries.Insert(iEntry);
+
 	return error;
 	}
 
+void CDataFile::AddFreeRun (int iEntry)
+
+//	AddFreeRun
+//
+//	Adds a free block entry to the free-space indexes.
+
+	{
+	const ENTRYSTRUCT &Entry = m_pEntryTable[iEntry];
+	ASSERT(Entry.dwBlock != FREE_ENTRY && (Entry.dwFlags & ENTRY_FLAG_FREEBLOCK));
+
+	m_FreeBySize.Insert(((DWORDLONG)Entry.dwBlockCount << 32) | Entry.dwBlock, iEntry);
+	m_FreeByStart.Insert(Entry.dwBlock, iEntry);
+	m_FreeByEnd.Insert(Entry.dwBlock + Entry.dwBlockCount, iEntry);
+	}
+
 ALERROR CDataFile::AllocBlockChain (DWORD dwBlockCount, DWORD *retdwStartingBlock)
 
 //	AllocBlockChain
@@ -131,21 +169,18 @@ ALERROR CDataFile::AllocBlockChain (DWORD dwBlockCount, DWORD *retdwStartingBloc
 //	Allocates a new chain of blocks large enough to store data of length iLength.
 
 	{
-	int i;
 	DWORD dwStartingBlock;
 
-	//	Look for a free block large enough to hold the data
+	//	Look for the smallest free run large enough to hold the data (ties go
+	//	to the run closest to the start of the file).
 
-	for (i = 0; i < m_iEntryTableCount; i++)
-		if ((m_pEntryTable[i].dwBlock != FREE_ENTRY)
-				&& (m_pEntryTable[i].dwFlags & ENTRY_FLAG_FREEBLOCK)
-				&& m_pEntryTable[i].dwBlockCount >= dwBlockCount)
-			break;
+	int iPos;
+	m_FreeBySize.FindPos((DWORDLONG)dwBlockCount << 32, &iPos);
 
 	//	If we could not find a free block large enough, then we allocate
 	//	at the end of the file.
 
-	if (i == m_iEntryTableCount)
+	if (iPos == m_FreeBySize.GetCount())
 		{
 		*retdwStartingBlock = (DWORD)m_iBlockCount;
 		m_iBlockCount += (int)dwBlockCount;
@@ -155,13 +190,17 @@ ALERROR CDataFile::AllocBlockChain (DWORD dwBlockCount, DWORD *retdwStartingBloc
 
 	//	Otherwise, we carve up the free block
 
+	int i = m_FreeBySize.GetValue(iPos);
+	RemoveFreeRun(i);
+
 	dwStartingBlock = m_pEntryTable[i].dwBlock;
 	if (m_pEntryTable[i].dwBlockCount == dwBlockCount)
-		m_pEntryTable[i].dwBlock = FREE_ENTRY;
+		FreeEntrySlot(i);
 	else
 		{
 		m_pEntryTable[i].dwBlock += dwBlockCount;
 		m_pEntryTable[i].dwBlockCount -= dwBlockCount;
+		AddFreeRun(i);
 		}
 
 	//	Done
@@ -172,6 +211,103 @@ ALERROR CDataFile::AllocBlockChain (DWORD dwBlockCount, DWORD *retdwStartingBloc
 	return NOERROR;
 	}
 
+int CDataFile::AllocEntrySlot (void)
+
+//	AllocEntrySlot
+//
+//	Returns an unused entry (or -1 if there are none). The caller must fill
+//	in dwBlock.
+
+	{
+	int iCount = m_FreeEntries.GetCount();
+	if (iCount == 0)
+		return -1;
+
+	int iEntry = m_FreeEntries[iCount - 1];
+	m_FreeEntries.Delete(iCount - 1);
+
+	ASSERT(m_pEntryTable[iEntry].dwBlock == FREE_ENTRY);
+	return iEntry;
+	}
+
+ALERROR CDataFile::ApplyJournal (SJournalWrite **pWrites, int iCount)
+
+//	ApplyJournal
+//
+//	Writes the given journal writes to the data file and syncs it. Writes
+//	that touch or overlap are merged so that each run of the file is written
+//	once (later writes win).
+
+	{
+	int i, j, k;
+
+	if (iCount == 0)
+		return NOERROR;
+
+	//	Sort by file position (the low DWORD is the index of the write)
+
+	TArray<DWORDLONG> Order;
+	Order.InsertEmpty(iCount);
+	for (i = 0; i < iCount; i++)
+		Order[i] = ((DWORDLONG)pWrites[i]->dwPos << 32) | (DWORD)i;
+
+	Order.Sort();
+
+	//	Write each run
+
+	i = 0;
+	while (i < iCount)
+		{
+		DWORD dwStart = pWrites[(DWORD)Order[i]]->dwPos;
+		DWORD dwEnd = dwStart;
+
+		TArray<int> Run;
+		for (j = i; j < iCount; j++)
+			{
+			SJournalWrite *pWrite = pWrites[(DWORD)Order[j]];
+			if (pWrite->dwPos > dwEnd)
+				break;
+
+			dwEnd = Max(dwEnd, pWrite->dwPos + (DWORD)pWrite->sData.GetLength());
+			Run.Insert((int)(DWORD)Order[j]);
+			}
+
+		//	Compose the run in the original order
+
+		Run.Sort();
+
+		CString sRun;
+		char *pRun = sRun.GetWritePointer(dwEnd - dwStart);
+		for (k = 0; k < Run.GetCount(); k++)
+			{
+			SJournalWrite *pWrite = pWrites[Run[k]];
+			utlMemCopy(pWrite->sData.GetPointer(), pRun + (pWrite->dwPos - dwStart), pWrite->sData.GetLength());
+			}
+
+		//	Write it
+
+		CSmartLock Lock(m_csFile);
+		DWORD dwWritten;
+
+		if (::SetFilePointer(m_hFile, dwStart, NULL, FILE_BEGIN) == 0xFFFFFFFF
+				|| !::WriteFile(m_hFile, pRun, dwEnd - dwStart, &dwWritten, NULL)
+				|| dwWritten != dwEnd - dwStart)
+			{
+			::kernelDebugLogPattern("I/O Error [%s]: Cannot write %d bytes at %d.", m_sFilename, dwEnd - dwStart, dwStart);
+			return ERR_FAIL;
+			}
+
+		i = j;
+		}
+
+	//	The journal can only be discarded once the data is on disk
+
+	if (!::FlushFileBuffers(m_hFile))
+		return ERR_FAIL;
+
+	return NOERROR;
+	}
+
 ALERROR CDataFile::Close (void)
 
 //	Close
@@ -179,23 +315,31 @@ ALERROR CDataFile::Close (void)
 //	Does some stuff
 
 	{
-	ALERROR error;
-
 	//	If we're not open, return
 
 	if (!IsOpen())
 		return NOERROR;
 
-	//	Flush entry table
+	//	Flush entry table. Even if this fails we still need to stop the
+	//	journal thread and close the file, so we remember the error and
+	//	return it at the end.
 
-	if (error = Flush())
-		return error;
+	ALERROR error = Flush();
+
+	//	Wait for the journal to be applied
+
+	CloseJournal();
 
 	//	Delete table
 
 	MemFree(m_pEntryTable);
 	m_pEntryTable = NULL;
 
+	m_FreeEntries.DeleteAll();
+	m_FreeBySize.DeleteAll();
+	m_FreeByStart.DeleteAll();
+	m_FreeByEnd.DeleteAll();
+
 	//	Close appropriate backing store
 
 	if (m_pFile)
@@ -210,6 +354,127 @@ ALERROR CDataFile::Close (void)
 		m_hFile = INVALID_HANDLE_VALUE;
 		}
 
+	return error;
+	}
+
+void CDataFile::CloseJournal (void)
+
+//	CloseJournal
+//
+//	Stops the journal thread (after it applies all committed writes) and
+//	closes the journal. If some writes could not be applied we leave the
+//	journal so that they get replayed the next time we open.
+
+	{
+	int i;
+
+	if (m_hJournalThread)
+		{
+		m_bJournalQuit = true;
+		::SetEvent(m_hJournalWork);
+		::WaitForSingleObject(m_hJournalThread, INFINITE);
+
+		::CloseHandle(m_hJournalThread);
+		m_hJournalThread = NULL;
+		}
+
+	if (m_hJournalWork)
+		{
+		::CloseHandle(m_hJournalWork);
+		m_hJournalWork = NULL;
+		}
+
+	if (m_hJournal != INVALID_HANDLE_VALUE)
+		{
+		::CloseHandle(m_hJournal);
+		m_hJournal = INVALID_HANDLE_VALUE;
+
+		if (m_iJournalCommitted == 0)
+			::DeleteFile(GetJournalFilename().GetASCIIZPointer());
+		}
+
+	for (i = 0; i < m_Journal.GetCount(); i++)
+		delete m_Journal[i];
+
+	m_Journal.DeleteAll();
+	m_iJournalCommitted = 0;
+	m_bJournalQuit = false;
+	}
+
+ALERROR CDataFile::CommitJournal (void)
+
+//	CommitJournal
+//
+//	Appends all uncommitted writes to the journal, followed by a commit
+//	record, and syncs the journal. This is a single write and a single sync
+//	no matter how many writes there are. The journal thread then applies
+//	the batch to the data file in the background.
+
+	{
+	int i;
+
+	CSmartLock Lock(m_csJournal);
+
+	int iCount = m_Journal.GetCount();
+	if (iCount == m_iJournalCommitted)
+		return NOERROR;
+
+	//	Compose the batch
+
+	DWORD dwSize = sizeof(JOURNALRECORD);
+	for (i = m_iJournalCommitted; i < iCount; i++)
+		dwSize += sizeof(JOURNALRECORD) + m_Journal[i]->sData.GetLength();
+
+	CString sBatch;
+	char *pPos = sBatch.GetWritePointer(dwSize);
+	DWORD dwBatchChecksum = 0;
+
+	JOURNALRECORD Record;
+	Record.dwSignature = JOURNAL_SIGNATURE;
+
+	for (i = m_iJournalCommitted; i < iCount; i++)
+		{
+		SJournalWrite *pWrite = m_Journal[i];
+
+		Record.dwType = JOURNAL_RECORD_WRITE;
+		Record.dwPos = pWrite->dwPos;
+		Record.dwLength = pWrite->sData.GetLength();
+		Record.dwChecksum = CalcJournalChecksum(Record, (BYTE *)pWrite->sData.GetPointer());
+		dwBatchChecksum = ((dwBatchChecksum << 5) | (dwBatchChecksum >> 27)) ^ Record.dwChecksum;
+
+		utlMemCopy((char *)&Record, pPos, sizeof(Record));
+		pPos += sizeof(Record);
+		utlMemCopy(pWrite->sData.GetPointer(), pPos, Record.dwLength);
+		pPos += Record.dwLength;
+		}
+
+	Record.dwType = JOURNAL_RECORD_COMMIT;
+	Record.dwPos = iCount - m_iJournalCommitted;
+	Record.dwLength = 0;
+	Record.dwChecksum = CalcJournalChecksum(Record, NULL) ^ dwBatchChecksum;
+	utlMemCopy((char *)&Record, pPos, sizeof(Record));
+
+	//	Append and sync. If we fail, we cut off whatever part of the batch we
+	//	wrote so that later batches are not lost behind it.
+
+	DWORD dwJournalPos = ::SetFilePointer(m_hJournal, 0, NULL, FILE_CURRENT);
+	DWORD dwWritten;
+
+	if (!::WriteFile(m_hJournal, sBatch.GetPointer(), dwSize, &dwWritten, NULL)
+			|| dwWritten != dwSize
+			|| !::FlushFileBuffers(m_hJournal))
+		{
+		::kernelDebugLogPattern("I/O Error [%s]: Cannot write journal.", m_sFilename);
+		::SetFilePointer(m_hJournal, dwJournalPos, NULL, FILE_BEGIN);
+		::SetEndOfFile(m_hJournal);
+		return ERR_FAIL;
+		}
+
+	//	Wake up the journal thread
+
+	m_iJournalCommitted = iCount;
+	::SetEvent(m_hJournalWork);
+
 	return NOERROR;
 	}
 
@@ -373,7 +638,7 @@ ALERROR CDataFile::DeleteEntry (int iEntry)
 			pEntry->dwPrevEntry = pPrevEntry->dwPrevEntry;
 			pEntry->dwLatestEntry = (DWORD)INVALID_ENTRY;
 
-			pPrevEntry->dwBlock = FREE_ENTRY;
+			FreeEntrySlot((int)(pPrevEntry - m_pEntryTable));
 			}
 		}
 
@@ -397,9 +662,16 @@ ALERROR CDataFile::DeleteEntry (int iEntry)
 			}
 		}
 
+	//	If the entry is still unused, it is available again. (We wait until
+	//	now so that FreeBlockChain cannot hand it out while we still need
+	//	it.)
+
+	if (pEntry->dwBlock == FREE_ENTRY)
+		m_FreeEntries.Insert(iEntry);
+
 	//	Flush
 
-	if (error = Flush())
+	if (error = WriteTables(false))
 		return error;
 
 	return NOERROR;
@@ -409,101 +681,20 @@ ALERROR CDataFile::Flush (void)
 
 //	Flush
 //
-//	Flush the entry table and header
+//	Flush the entry table and header. In journaled mode this is also the
+//	commit point: everything written since the last Flush goes to the
+//	journal with a single sync.
 
 	{
 	ALERROR error;
 
-	//	If we're already flushing, don't bother. This can happens since
-	//	We're using the normal WriteEntry call to write out the entry table.
-
-	if (m_fFlushing)
-		return NOERROR;
-
-	m_fFlushing = TRUE;
-
-	//	Write out the entry table, if necessary
-
-	if (m_fEntryTableModified)
-		{
-		int i, iEntryTableSize;
-
-		//	Make sure there's at least one free entry in the entry table
-		//	Otherwise we might have to grow the entry table while trying to
-		//	save it.
-
-		for (i = 0; i < m_iEntryTableCount; i++)
-			if (m_pEntryTable[i].dwBlock == FREE_ENTRY)
-				break;
-
-		if (i == m_iEntryTableCount)
-			if (error = GrowEntryTable(NULL))
-				goto Fail;
-
-		//	Figure out how many blocks we need to hold the entry
-
-		iEntryTableSize = m_iEntryTableCount * sizeof(ENTRYSTRUCT);
-
-		//	Write out the entry table. Note that the act of writing the
-		//	entry table may modify the entry table, so we first resize
-		//	the entry.
-
-		if (error = ResizeEntry(0, iEntryTableSize, NULL))
-			goto Fail;
-
-		//	Write the stuff
-
-		if (error = WriteBlockChain(m_pEntryTable[0].dwBlock, (char *)m_pEntryTable, iEntryTableSize))
-			goto Fail;
-
-		m_fEntryTableModified = FALSE;
-		m_fHeaderModified = TRUE;
-		}
-
-	//	Write out the header
-
-	if (m_fHeaderModified)
-		{
-		HEADERSTRUCT header;
-		DWORD dwWritten;
-
-		utlMemSet(&header, sizeof(header), 0);
-		header.dwSignature = DATAFILE_SIGNATURE;
-		header.dwVersion = DATAFILE_VERSION;
-		header.dwBlockCount = (DWORD)m_iBlockCount;
-		header.dwBlockSize = (DWORD)m_iBlockSize;
-		header.dwEntryTableCount = (DWORD)m_iEntryTableCount;
-		header.dwEntryTablePos = sizeof(HEADERSTRUCT) + (m_pEntryTable[0].dwBlock * m_iBlockSize);
-		header.dwDefaultEntry = (DWORD)m_iDefaultEntry;
-
-		//	Position the file pointer
-
-		if (SetFilePointer(m_hFile, 0, NULL, FILE_BEGIN) == 0xFFFFFFFF)
-			{
-			error = ERR_FAIL;
-			goto Fail;
-			}
-
-		//	Write the header
-
-		if (!WriteFile(m_hFile, &header, sizeof(header), &dwWritten, NULL) || dwWritten != sizeof(header))
-			{
-			error = ERR_FAIL;
-			goto Fail;
-			}
-
-		m_fHeaderModified = FALSE;
-		}
+	if (error = WriteTables(true))
+		return error;
 
-	m_fFlushing = FALSE;
+	if (IsJournaled())
+		return CommitJournal();
 
 	return NOERROR;
-
-Fail:
-
-	m_fFlushing = FALSE;
-
-	return error;
 	}
 
 ALERROR CDataFile::FreeBlockChain (DWORD dwStartingBlock, DWORD dwBlockCount)
@@ -516,58 +707,62 @@ ALERROR CDataFile::FreeBlockChain (DWORD dwStartingBlock, DWORD dwBlockCount)
 
 	{
 	ALERROR error;
-	int i;
 	int iFreeAfter = -1;
 	int iFreeBefore = -1;
-	int iFreeEntry = -1;
 
-	//	If this entry is at the end of the file, just truncate the file
+	//	If this entry is at the end of the file, just truncate the file. If
+	//	that leaves a free run at the end, truncate that too.
 
 	if (dwStartingBlock + dwBlockCount == (DWORD)m_iBlockCount)
 		{
 		m_iBlockCount -= (int)dwBlockCount;
 		m_fHeaderModified = TRUE;
+
+		while (m_FreeByEnd.Find((DWORD)m_iBlockCount, &iFreeBefore))
+			{
+			RemoveFreeRun(iFreeBefore);
+			m_iBlockCount -= (int)m_pEntryTable[iFreeBefore].dwBlockCount;
+			FreeEntrySlot(iFreeBefore);
+			m_fEntryTableModified = TRUE;
+			}
+
 		return NOERROR;
 		}
 
-	//	Look for free entries before and after this chain
+	//	Look for free runs immediately before and after this chain
 
-	for (i = 0; i < m_iEntryTableCount; i++)
-		if (m_pEntryTable[i].dwBlock != FREE_ENTRY)
-			{
-			if (m_pEntryTable[i].dwFlags & ENTRY_FLAG_FREEBLOCK)
-				{
-				if (m_pEntryTable[i].dwBlock + m_pEntryTable[i].dwBlockCount == dwStartingBlock)
-					iFreeBefore = i;
-				else if (m_pEntryTable[i].dwBlock == dwStartingBlock + dwBlockCount)
-					iFreeAfter = i;
-				}
-			}
-		else
-			iFreeEntry = i;
+	m_FreeByEnd.Find(dwStartingBlock, &iFreeBefore);
+	m_FreeByStart.Find(dwStartingBlock + dwBlockCount, &iFreeAfter);
 
 	//	If we've got an entry before, grow the previous entry to
 	//	include ours
 
 	if (iFreeBefore != -1)
 		{
+		RemoveFreeRun(iFreeBefore);
 		m_pEntryTable[iFreeBefore].dwBlockCount += dwBlockCount;
 
 		//	If we've also got a free entry afterwards, include that too
 
 		if (iFreeAfter != -1)
 			{
+			RemoveFreeRun(iFreeAfter);
 			m_pEntryTable[iFreeBefore].dwBlockCount += m_pEntryTable[iFreeAfter].dwBlockCount;
-			m_pEntryTable[iFreeAfter].dwBlock = FREE_ENTRY;
+			FreeEntrySlot(iFreeAfter);
 			}
+
+		AddFreeRun(iFreeBefore);
 		}
 	else if (iFreeAfter != -1)
 		{
+		RemoveFreeRun(iFreeAfter);
 		m_pEntryTable[iFreeAfter].dwBlock -= dwBlockCount;
 		m_pEntryTable[iFreeAfter].dwBlockCount += dwBlockCount;
+		AddFreeRun(iFreeAfter);
 		}
 	else
 		{
+		int iFreeEntry = AllocEntrySlot();
 		if (iFreeEntry == -1)
 			{
 			if (error = GrowEntryTable(&iFreeEntry))
@@ -577,6 +772,7 @@ ALERROR CDataFile::FreeBlockChain (DWORD dwStartingBlock, DWORD dwBlockCount)
 		m_pEntryTable[iFreeEntry].dwBlock = dwStartingBlock;
 		m_pEntryTable[iFreeEntry].dwBlockCount = dwBlockCount;
 		m_pEntryTable[iFreeEntry].dwFlags = ENTRY_FLAG_FREEBLOCK;
+		AddFreeRun(iFreeEntry);
 		}
 
 	m_fEntryTableModified = TRUE;
@@ -584,64 +780,273 @@ ALERROR CDataFile::FreeBlockChain (DWORD dwStartingBlock, DWORD dwBlockCount)
 	return NOERROR;
 	}
 
+void CDataFile::FreeEntrySlot (int iEntry)
+
+//	FreeEntrySlot
+//
+//	Marks the entry as unused and makes it available to AllocEntrySlot.
+
+	{
+	m_pEntryTable[iEntry].dwBlock = FREE_ENTRY;
+	m_FreeEntries.Insert(iEntry);
+	}
+
 int CDataFile::GetDefaultEntry (void)
 
 //	GetDefaultEntry
 //
 //	Does some stuff
 
-	{
-	return m_iDefaultEntry;
+	{
+	return m_iDefaultEntry;
+	}
+
+int CDataFile::GetEntryLength (int iEntry)
+
+//	GetEntryLength
+//
+//	Does some stuff
+
+	{
+	ASSERT(IsOpen());
+
+	return (int)m_pEntryTable[iEntry].dwSize;
+	}
+
+CString CDataFile::GetJournalFilename (void) const
+
+//	GetJournalFilename
+//
+//	Returns the filename of the journal
+
+	{
+	return strPatternSubst(CONSTLIT("%s.journal"), m_sFilename);
+	}
+
+ALERROR CDataFile::GrowEntryTable (int *retiEntry)
+
+//	GrowEntryTable
+//
+//	Grows the entry table and returns the first newly allocated free entry
+
+	{
+	int iNewEntryTableCount = m_iEntryTableCount + ENTRY_TABLE_GRANULARITY;
+	int iNewEntryTableSize = iNewEntryTableCount * sizeof(ENTRYSTRUCT);
+	PENTRYSTRUCT pNewEntryTable;
+	int i;
+
+	pNewEntryTable = (PENTRYSTRUCT)MemAlloc(iNewEntryTableSize);
+	if (pNewEntryTable == NULL)
+		return ERR_MEMORY;
+
+	//	Copy over the old table
+
+	utlMemCopy((char *)m_pEntryTable, (char *)pNewEntryTable, (DWORD)m_iEntryTableCount * sizeof(ENTRYSTRUCT));
+
+	//	Initialize the rest of the  table
+
+	for (i = m_iEntryTableCount; i < iNewEntryTableCount; i++)
+		pNewEntryTable[i].dwBlock = FREE_ENTRY;
+
+	//	Add the new entries to the free list (in reverse order, so that we
+	//	hand them out in order). If the caller wants an entry, it gets the
+	//	first one, which we leave off the list.
+
+	int iFirstFree = m_iEntryTableCount + (retiEntry ? 1 : 0);
+	for (i = iNewEntryTableCount - 1; i >= iFirstFree; i--)
+		m_FreeEntries.Insert(i);
+
+	//	Set the next free entry
+
+	if (retiEntry)
+		*retiEntry = m_iEntryTableCount;
+
+	//	Do the move
+
+	MemFree(m_pEntryTable);
+	m_pEntryTable = pNewEntryTable;
+	m_iEntryTableCount = iNewEntryTableCount;
+	m_fEntryTableModified = TRUE;
+
+	return NOERROR;
+	}
+
+void CDataFile::InitFreeIndex (void)
+
+//	InitFreeIndex
+//
+//	Builds the free entry list and the free run indexes from the entry table.
+
+	{
+	int i;
+
+	m_FreeEntries.DeleteAll();
+	m_FreeBySize.DeleteAll();
+	m_FreeByStart.DeleteAll();
+	m_FreeByEnd.DeleteAll();
+
+	//	Reverse order so that we hand out the lowest entries first (as we
+	//	did when we searched the table).
+
+	for (i = m_iEntryTableCount - 1; i >= 0; i--)
+		{
+		if (m_pEntryTable[i].dwBlock == FREE_ENTRY)
+			m_FreeEntries.Insert(i);
+		else if (m_pEntryTable[i].dwFlags & ENTRY_FLAG_FREEBLOCK)
+			AddFreeRun(i);
+		}
+	}
+
+DWORD WINAPI CDataFile::JournalThread (LPVOID pData)
+
+//	JournalThread
+//
+//	Applies committed writes to the data file until we're asked to quit.
+//	Once every committed write is in the data file, we truncate the journal.
+
+	{
+	CDataFile *pFile = (CDataFile *)pData;
+	int i;
+
+	while (true)
+		{
+		::WaitForSingleObject(pFile->m_hJournalWork, INFINITE);
+		bool bQuit = pFile->m_bJournalQuit;
+
+		//	Get the committed writes. The writes stay in m_Journal (so that
+		//	readers still see them) until they are in the data file.
+
+		TArray<SJournalWrite *> Writes;
+			{
+			CSmartLock Lock(pFile->m_csJournal);
+			for (i = 0; i < pFile->m_iJournalCommitted; i++)
+				Writes.Insert(pFile->m_Journal[i]);
+			}
+
+		if (Writes.GetCount() > 0)
+			{
+			if (pFile->ApplyJournal(&Writes[0], Writes.GetCount()) == NOERROR)
+				{
+				CSmartLock Lock(pFile->m_csJournal);
+
+				for (i = 0; i < Writes.GetCount(); i++)
+					delete Writes[i];
+
+				pFile->m_Journal.Delete(0, Writes.GetCount());
+				pFile->m_iJournalCommitted -= Writes.GetCount();
+
+				if (pFile->m_iJournalCommitted == 0)
+					{
+					::SetFilePointer(pFile->m_hJournal, 0, NULL, FILE_BEGIN);
+					::SetEndOfFile(pFile->m_hJournal);
+					}
+				}
+
+			//	If we failed, we keep the writes and try again at the next
+			//	commit. They are still in the journal.
+
+			else
+				::kernelDebugLogPattern("I/O Error [%s]: Unable to apply journal.", pFile->m_sFilename);
+			}
+
+		if (bQuit)
+			break;
+		}
+
+	return 0;
 	}
 
-int CDataFile::GetEntryLength (int iEntry)
+ALERROR CDataFile::LoadJournal (TArray<SJournalWrite *> *retWrites)
 
-//	GetEntryLength
+//	LoadJournal
 //
-//	Does some stuff
+//	Loads all committed writes from the journal (if there is one). We stop
+//	at the first record that is damaged or incomplete; any writes after the
+//	last good commit record never committed, so we drop them.
 
 	{
-	ASSERT(IsOpen());
+	int i;
 
-	return (int)m_pEntryTable[iEntry].dwSize;
-	}
+	HANDLE hJournal = ::CreateFile(GetJournalFilename().GetASCIIZPointer(),
+			GENERIC_READ,
+			FILE_SHARE_READ | FILE_SHARE_WRITE,
+			NULL,
+			OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+	if (hJournal == INVALID_HANDLE_VALUE)
+		{
+		DWORD dwError = ::GetLastError();
+		if (dwError == ERROR_FILE_NOT_FOUND || dwError == ERROR_PATH_NOT_FOUND)
+			return NOERROR;
 
-ALERROR CDataFile::GrowEntryTable (int *retiEntry)
+		::kernelDebugLogPattern("I/O Error [%s]: Unable to open journal.", m_sFilename);
+		return ERR_FILEOPEN;
+		}
 
-//	GrowEntryTable
-//
-//	Grows the entry table and returns the first newly allocated free entry
+	//	Read the whole thing
 
-	{
-	int iNewEntryTableCount = m_iEntryTableCount + ENTRY_TABLE_GRANULARITY;
-	int iNewEntryTableSize = iNewEntryTableCount * sizeof(ENTRYSTRUCT);
-	PENTRYSTRUCT pNewEntryTable;
-	int i;
+	DWORD dwSize = ::GetFileSize(hJournal, NULL);
+	DWORD dwRead;
 
-	pNewEntryTable = (PENTRYSTRUCT)MemAlloc(iNewEntryTableSize);
-	if (pNewEntryTable == NULL)
-		return ERR_MEMORY;
+	CString sJournal;
+	char *pPos = sJournal.GetWritePointer(dwSize);
+	BOOL bRead = ::ReadFile(hJournal, pPos, dwSize, &dwRead, NULL);
+	::CloseHandle(hJournal);
 
-	//	Copy over the old table
+	if (!bRead || dwRead != dwSize)
+		{
+		::kernelDebugLogPattern("I/O Error [%s]: Unable to read journal.", m_sFilename);
+		return ERR_FAIL;
+		}
 
-	utlMemCopy((char *)m_pEntryTable, (char *)pNewEntryTable, (DWORD)m_iEntryTableCount * sizeof(ENTRYSTRUCT));
+	//	Parse
 
-	//	Initialize the rest of the  table
+	char *pPosEnd = pPos + dwSize;
+	TArray<SJournalWrite *> Batch;
+	DWORD dwBatchChecksum = 0;
 
-	for (i = m_iEntryTableCount; i < iNewEntryTableCount; i++)
-		pNewEntryTable[i].dwBlock = FREE_ENTRY;
+	while (pPos + sizeof(JOURNALRECORD) <= pPosEnd)
+		{
+		JOURNALRECORD Record;
+		utlMemCopy(pPos, (char *)&Record, sizeof(Record));
+		pPos += sizeof(Record);
 
-	//	Set the next free entry
+		if (Record.dwSignature != JOURNAL_SIGNATURE
+				|| Record.dwLength > (DWORD)(pPosEnd - pPos))
+			break;
 
-	if (retiEntry)
-		*retiEntry = m_iEntryTableCount;
+		if (Record.dwType == JOURNAL_RECORD_WRITE)
+			{
+			if (Record.dwChecksum != CalcJournalChecksum(Record, (BYTE *)pPos))
+				break;
 
-	//	Do the move
+			SJournalWrite *pWrite = new SJournalWrite;
+			pWrite->dwPos = Record.dwPos;
+			pWrite->sData = CString(pPos, (int)Record.dwLength);
+			Batch.Insert(pWrite);
 
-	MemFree(m_pEntryTable);
-	m_pEntryTable = pNewEntryTable;
-	m_iEntryTableCount = iNewEntryTableCount;
-	m_fEntryTableModified = TRUE;
+			dwBatchChecksum = ((dwBatchChecksum << 5) | (dwBatchChecksum >> 27)) ^ Record.dwChecksum;
+			pPos += Record.dwLength;
+			}
+		else if (Record.dwType == JOURNAL_RECORD_COMMIT)
+			{
+			if (Record.dwPos != (DWORD)Batch.GetCount()
+					|| Record.dwChecksum != (CalcJournalChecksum(Record, NULL) ^ dwBatchChecksum))
+				break;
+
+			for (i = 0; i < Batch.GetCount(); i++)
+				retWrites->Insert(Batch[i]);
+
+			Batch.DeleteAll();
+			dwBatchChecksum = 0;
+			}
+		else
+			break;
+		}
+
+	for (i = 0; i < Batch.GetCount(); i++)
+		delete Batch[i];
 
 	return NOERROR;
 	}
@@ -670,24 +1075,52 @@ ALERROR CDataFile::Open (const CString &sFilename, DWORD dwFlags)
 	if (m_sFilename.IsBlank())
 		return ERR_NOTFOUND;
 
-	//	Open file either for read or read/write
+	//	If we're read-only, we map the file. Entries are read in no particular
+	//	order, so we tell the OS not to bother with read-ahead.
 
-	DWORD dwAccess;
-	DWORD dwShare;
 	if (dwFlags & DFOPEN_FLAG_READ_ONLY)
 		{
-		dwAccess = GENERIC_READ;
-		dwShare = FILE_SHARE_READ;
+		ASSERT(m_pFile == NULL);
+
+		m_pFile = new CMappedFileBlock(m_sFilename, CMappedFileBlock::FLAG_RANDOM);
+		if (error = m_pFile->Open())
+			{
+			delete m_pFile;
+			m_pFile = NULL;
+			return (error == ERR_NOTFOUND ? ERR_NOTFOUND : ERR_FILEOPEN);
+			}
+
 		m_fReadOnly = true;
+
+		//	If a journaled session ended before applying all its writes, we
+		//	can't apply them without write access, so we just load them to
+		//	patch our reads.
+
+		if (!(error = LoadJournal(&m_Journal)))
+			{
+			m_iJournalCommitted = m_Journal.GetCount();
+			error = OpenInt();
+			}
+
+		if (error)
+			{
+			CloseJournal();
+			m_pFile->Close();
+			delete m_pFile;
+			m_pFile = NULL;
+			return error;
+			}
+
+		return NOERROR;
 		}
-	else
-		{
-		dwAccess = GENERIC_READ | GENERIC_WRITE;
-		dwShare = FILE_SHARE_READ;
-		m_fReadOnly = false;
-		}
 
-	//	Open the file for reading and writing
+	//	Otherwise we need a file handle so we can write
+
+	DWORD dwAccess = GENERIC_READ | GENERIC_WRITE;
+	DWORD dwShare = FILE_SHARE_READ;
+	m_fReadOnly = false;
+
+	//	Open the file
 
 	ASSERT(m_hFile == INVALID_HANDLE_VALUE);
 	m_hFile = CreateFile(m_sFilename.GetASCIIZPointer(),
@@ -706,6 +1139,12 @@ ALERROR CDataFile::Open (const CString &sFilename, DWORD dwFlags)
 		goto Fail;
 		}
 
+	//	Replay anything left in the journal and start journaling, if
+	//	requested. This must happen before we read the header.
+
+	if (error = OpenJournal((dwFlags & DFOPEN_FLAG_JOURNAL) ? true : false))
+		goto Fail;
+
 	//	Continue opening
 
 	if (error = OpenInt())
@@ -715,6 +1154,8 @@ ALERROR CDataFile::Open (const CString &sFilename, DWORD dwFlags)
 
 Fail:
 
+	CloseJournal();
+
 	if (m_hFile != INVALID_HANDLE_VALUE)
 		{
 		CloseHandle(m_hFile);
@@ -857,6 +1298,10 @@ ALERROR CDataFile::OpenInt (void)
 		bEntryTableModified = true;
 		}
 
+	//	Build the in-memory indexes
+
+	InitFreeIndex();
+
 	//	Reset modification flags
 
 	m_fHeaderModified = (bHeaderModified ? TRUE : FALSE);
@@ -865,6 +1310,71 @@ ALERROR CDataFile::OpenInt (void)
 	return NOERROR;
 	}
 
+ALERROR CDataFile::OpenJournal (bool bJournal)
+
+//	OpenJournal
+//
+//	Applies any committed writes left in the journal by a previous session.
+//	Then, if bJournal is TRUE, we start a new journal.
+
+	{
+	ALERROR error;
+	int i;
+
+	//	Replay
+
+	TArray<SJournalWrite *> Replay;
+	if (error = LoadJournal(&Replay))
+		return error;
+
+	if (Replay.GetCount() > 0)
+		{
+		error = ApplyJournal(&Replay[0], Replay.GetCount());
+
+		for (i = 0; i < Replay.GetCount(); i++)
+			delete Replay[i];
+
+		if (error)
+			return error;
+		}
+
+	//	If we're not journaling, we don't need the journal anymore
+
+	if (!bJournal)
+		{
+		::DeleteFile(GetJournalFilename().GetASCIIZPointer());
+		return NOERROR;
+		}
+
+	//	Start a new journal
+
+	m_hJournal = ::CreateFile(GetJournalFilename().GetASCIIZPointer(),
+			GENERIC_WRITE,
+			0,
+			NULL,
+			CREATE_ALWAYS,
+			FILE_ATTRIBUTE_NORMAL,
+			NULL);
+	if (m_hJournal == INVALID_HANDLE_VALUE)
+		{
+		::kernelDebugLogPattern("I/O Error [%s]: Unable to create journal.", m_sFilename);
+		return ERR_FILEOPEN;
+		}
+
+	m_bJournalQuit = false;
+	m_hJournalWork = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (m_hJournalWork)
+		m_hJournalThread = ::kernelCreateThread(JournalThread, this);
+
+	if (m_hJournalThread == NULL)
+		{
+		CloseJournal();
+		return ERR_FAIL;
+		}
+
+	return NOERROR;
+	}
+
 ALERROR CDataFile::ReadBuffer (DWORD dwFilePos, DWORD dwLen, void *pBuffer)
 
 //	ReadBuffer
@@ -872,19 +1382,41 @@ ALERROR CDataFile::ReadBuffer (DWORD dwFilePos, DWORD dwLen, void *pBuffer)
 //	This is an internal function that reads from the database to a buffer
 
 	{
+	int i;
+	DWORD dwRead;
+
+	//	We hold the journal lock for the whole read so that the journal thread
+	//	cannot retire a write between our reading the file and patching it.
+
+	CSmartLock JournalLock(m_csJournal);
+	bool bPending = (m_Journal.GetCount() > 0);
+
 	if (m_pFile)
 		{
-		if (dwFilePos + dwLen > (DWORD)m_pFile->GetLength())
+		DWORDLONG dwFileLen = m_pFile->GetLength64();
+		dwRead = ((DWORDLONG)dwFilePos >= dwFileLen ? 0 : (DWORD)Min((DWORDLONG)dwLen, dwFileLen - dwFilePos));
+		if (dwRead < dwLen && !bPending)
 			{
 			::kernelDebugLogPattern("I/O Error [%s]: Not enough data in file.", m_sFilename);
 			return ERR_FAIL;
 			}
 
-		char *pPos = m_pFile->GetPointer(dwFilePos, dwLen);
-		utlMemCopy(pPos, (char *)pBuffer, dwLen);
+		if (dwRead > 0)
+			{
+			char *pPos = m_pFile->GetPointer64(dwFilePos, dwRead);
+			if (pPos == NULL)
+				{
+				::kernelDebugLogPattern("I/O Error [%s]: Cannot read %d bytes at %d.", m_sFilename, dwLen, dwFilePos);
+				return ERR_FAIL;
+				}
+
+			utlMemCopy(pPos, (char *)pBuffer, dwRead);
+			}
 		}
 	else if (m_hFile != INVALID_HANDLE_VALUE)
 		{
+		CSmartLock FileLock(m_csFile);
+
 		//	Set the proper position
 
 		if (::SetFilePointer(m_hFile, dwFilePos, NULL, FILE_BEGIN) == 0xFFFFFFFF)
@@ -895,15 +1427,35 @@ ALERROR CDataFile::ReadBuffer (DWORD dwFilePos, DWORD dwLen, void *pBuffer)
 
 		//	Read
 
-		DWORD dwRead;
-		if (!::ReadFile(m_hFile, pBuffer, dwLen, &dwRead, NULL) || dwRead != dwLen)
+		if (!::ReadFile(m_hFile, pBuffer, dwLen, &dwRead, NULL) || (dwRead != dwLen && !bPending))
 			{
 			::kernelDebugLogPattern("I/O Error [%s]: Cannot read %d bytes at %d.", m_sFilename, dwLen, dwFilePos);
 			return ERR_FAIL;
 			}
 		}
 	else
+		{
 		ASSERT(false);
+		return ERR_FAIL;
+		}
+
+	//	Blocks allocated at the end of the file may only be in the journal so
+	//	far; they are filled in below.
+
+	if (dwRead < dwLen)
+		utlMemSet((char *)pBuffer + dwRead, dwLen - dwRead, 0);
+
+	//	Apply the writes that have not reached the data file yet. We go in
+	//	order so that later writes win.
+
+	for (i = 0; i < m_Journal.GetCount(); i++)
+		{
+		SJournalWrite *pWrite = m_Journal[i];
+		DWORD dwStart = Max(dwFilePos, pWrite->dwPos);
+		DWORD dwEnd = Min(dwFilePos + dwLen, pWrite->dwPos + (DWORD)pWrite->sData.GetLength());
+		if (dwStart < dwEnd)
+			utlMemCopy(pWrite->sData.GetPointer() + (dwStart - pWrite->dwPos), (char *)pBuffer + (dwStart - dwFilePos), dwEnd - dwStart);
+		}
 
 	return NOERROR;
 	}
@@ -1052,6 +1604,21 @@ ALERROR CDataFile::ReadHistory (int iEntry, TArray<SVersionInfo> *retHistory)
 	return NOERROR;
 	}
 
+void CDataFile::RemoveFreeRun (int iEntry)
+
+//	RemoveFreeRun
+//
+//	Removes a free block entry from the free-space indexes. Must be called
+//	before the entry's block or block count changes.
+
+	{
+	const ENTRYSTRUCT &Entry = m_pEntryTable[iEntry];
+
+	m_FreeBySize.DeleteAt(((DWORDLONG)Entry.dwBlockCount << 32) | Entry.dwBlock);
+	m_FreeByStart.DeleteAt(Entry.dwBlock);
+	m_FreeByEnd.DeleteAt(Entry.dwBlock + Entry.dwBlockCount);
+	}
+
 ALERROR CDataFile::ResizeEntry (int iEntry, DWORD dwSize, DWORD *retdwBlockCount)
 
 //	ResizeEntry
@@ -1131,20 +1698,29 @@ void CDataFile::SetDefaultEntry (int iEntry)
 	m_fHeaderModified = TRUE;
 	}
 
-ALERROR CDataFile::WriteBlockChain (DWORD dwStartingBlock, char *pData, DWORD dwSize)
+ALERROR CDataFile::WriteAt (DWORD dwPos, char *pData, DWORD dwSize)
 
-//	WriteBlockChain
+//	WriteAt
 //
-//	Writes the data to the block chain. We assume that the block chain
-//	has been previously allocated to the correct size
+//	Writes to the data file. In journaled mode we just remember the write;
+//	it goes to the journal at the next Flush.
 
 	{
-	DWORD dwPos;
 	DWORD dwWritten;
 
-	//	Calculate the position
+	if (IsJournaled())
+		{
+		if (dwSize == 0)
+			return NOERROR;
 
-	dwPos = sizeof(HEADERSTRUCT) + dwStartingBlock * m_iBlockSize;
+		SJournalWrite *pWrite = new SJournalWrite;
+		pWrite->dwPos = dwPos;
+		pWrite->sData = CString(pData, (int)dwSize);
+
+		CSmartLock Lock(m_csJournal);
+		m_Journal.Insert(pWrite);
+		return NOERROR;
+		}
 
 	//	Position the file pointer
 
@@ -1159,6 +1735,17 @@ ALERROR CDataFile::WriteBlockChain (DWORD dwStartingBlock, char *pData, DWORD dw
 	return NOERROR;
 	}
 
+ALERROR CDataFile::WriteBlockChain (DWORD dwStartingBlock, char *pData, DWORD dwSize)
+
+//	WriteBlockChain
+//
+//	Writes the data to the block chain. We assume that the block chain
+//	has been previously allocated to the correct size
+
+	{
+	return WriteAt(sizeof(HEADERSTRUCT) + dwStartingBlock * m_iBlockSize, pData, dwSize);
+	}
+
 ALERROR CDataFile::WriteEntry (int iEntry, const CString &sData)
 
 //	WriteEntry
@@ -1191,12 +1778,103 @@ ALERROR CDataFile::WriteEntry (int iEntry, const CString &sData)
 
 	//	Flush
 
-	if (error = Flush())
+	if (error = WriteTables(false))
 		return error;
 
 	return NOERROR;
 	}
 
+ALERROR CDataFile::WriteTables (bool bCommit)
+
+//	WriteTables
+//
+//	Writes out the entry table and header, if they have changed. In journaled
+//	mode we only do this when committing, so that each batch is
+//	all-or-nothing and we don't journal the whole entry table for every
+//	entry we write.
+
+	{
+	ALERROR error;
+
+	if (IsJournaled() && !bCommit)
+		return NOERROR;
+
+	//	If we're already flushing, don't bother. This can happens since
+	//	We're using the normal WriteEntry call to write out the entry table.
+
+	if (m_fFlushing)
+		return NOERROR;
+
+	m_fFlushing = TRUE;
+
+	//	Write out the entry table, if necessary
+
+	if (m_fEntryTableModified)
+		{
+		int iEntryTableSize;
+
+		//	Make sure there's at least one free entry in the entry table
+		//	Otherwise we might have to grow the entry table while trying to
+		//	save it.
+
+		if (m_FreeEntries.GetCount() == 0)
+			if (error = GrowEntryTable(NULL))
+				goto Fail;
+
+		//	Figure out how many blocks we need to hold the entry
+
+		iEntryTableSize = m_iEntryTableCount * sizeof(ENTRYSTRUCT);
+
+		//	Write out the entry table. Note that the act of writing the
+		//	entry table may modify the entry table, so we first resize
+		//	the entry.
+
+		if (error = ResizeEntry(0, iEntryTableSize, NULL))
+			goto Fail;
+
+		//	Write the stuff
+
+		if (error = WriteBlockChain(m_pEntryTable[0].dwBlock, (char *)m_pEntryTable, iEntryTableSize))
+			goto Fail;
+
+		m_fEntryTableModified = FALSE;
+		m_fHeaderModified = TRUE;
+		}
+
+	//	Write out the header
+
+	if (m_fHeaderModified)
+		{
+		HEADERSTRUCT header;
+
+		utlMemSet(&header, sizeof(header), 0);
+		header.dwSignature = DATAFILE_SIGNATURE;
+		header.dwVersion = DATAFILE_VERSION;
+		header.dwBlockCount = (DWORD)m_iBlockCount;
+		header.dwBlockSize = (DWORD)m_iBlockSize;
+		header.dwEntryTableCount = (DWORD)m_iEntryTableCount;
+		header.dwEntryTablePos = sizeof(HEADERSTRUCT) + (m_pEntryTable[0].dwBlock * m_iBlockSize);
+		header.dwDefaultEntry = (DWORD)m_iDefaultEntry;
+
+		//	Write the header
+
+		if (error = WriteAt(0, (char *)&header, sizeof(header)))
+			goto Fail;
+
+		m_fHeaderModified = FALSE;
+		}
+
+	m_fFlushing = FALSE;
+
+	return NOERROR;
+
+Fail:
+
+	m_fFlushing = FALSE;
+
+	return error;
+	}
+
 ALERROR CDataFile::WriteVersion (int iEntry, const CString &sData, DWORD *retdwVersion)
 
 //	WriteVersion
@@ -1254,8 +1932,25 @@ ALERROR CDataFile::WriteVersion (int iEntry, const CString &sData, DWORD *retdwV
 
 	//	Flush
 
-	if (error = Flush())
+	if (error = WriteTables(false))
 		return error;
 
 	return NOERROR;
 	}
+
+//	Helpers --------------------------------------------------------------------
+
+static DWORD CalcJournalChecksum (const JOURNALRECORD &Record, BYTE *pData)
+
+//	CalcJournalChecksum
+//
+//	Returns a checksum of the record's fields (except the checksum) and data.
+
+	{
+	DWORD dwChecksum = (pData && Record.dwLength > 0 ? utlHashFunctionCase(pData, (int)Record.dwLength) : 0);
+
+	return dwChecksum
+			^ (Record.dwType * 0x9E3779B9)
+			^ (Record.dwPos * 0x85EBCA6B)
+			^ (Record.dwLength * 0xC2B2AE35);
+	}
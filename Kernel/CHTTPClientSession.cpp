@@ -373,7 +373,7 @@ EInetsErrors CHTTPClientSession::Send (const CHTTPMessage &Request, CHTTPMessage
 
 	//	Serialize the request
 
-	CMemoryWriteStream RequestBuff;
+	CSegmentedWriteStream RequestBuff;
 	if (RequestBuff.Create() != NOERROR)
 		{
 		::kernelDebugLogPattern("Out of memory: Unable to create request buffer.");
@@ -388,10 +388,16 @@ EInetsErrors CHTTPClientSession::Send (const CHTTPMessage &Request, CHTTPMessage
 		return m_iLastError;
 		}
 
-	//	Write it out
+	//	Write it out, one segment at a time
 
-	DWORD dwBytesWritten;
-	if (!WriteBuffer(RequestBuff.GetPointer(), RequestBuff.GetLength(), &dwBytesWritten))
+	TArray<CSegmentedWriteStream::SSegment> Segments;
+	RequestBuff.GetSegments(&Segments);
+
+	bool bSent = true;
+	for (int i = 0; i < Segments.GetCount() && bSent; i++)
+		bSent = WriteBuffer(Segments[i].pData, Segments[i].dwLength, NULL);
+
+	if (!bSent)
 		{
 		::kernelDebugLogPattern("Unable to send request to server.");
 		Disconnect();
@@ -160,7 +160,7 @@ ALERROR CHTTPMessage::InitFromStream (IReadStream &Stream, CString *retsError, b
 		{
 		//	Build up the body
 
-		CMemoryWriteStream Body;
+		CSegmentedWriteStream Body;
 		if (Body.Create() != NOERROR)
 			return ERR_MEMORY;
 
@@ -214,7 +214,7 @@ ALERROR CHTTPMessage::InitFromStream (IReadStream &Stream, CString *retsError, b
 			sMediaType = NULL_STR;
 
 		m_pBody = new CRawMediaType;
-		m_pBody->DecodeFromBuffer(sMediaType, CString(Body.GetPointer(), Body.GetLength()));
+		m_pBody->DecodeFromBuffer(sMediaType, Body.TakeAsString());
 		}
 
 	//	Otherwise, we have a set length (which must have been set by the
@@ -1,18 +1,17 @@
-//	CSymboTable.cpp
+//	CIDTable.cpp
 //
-//	Implementation of a symbol table
+//	Implementation of an ID table
 
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-static DATADESCSTRUCT g_DataDesc[] =
-	{	{ DATADESC_OPCODE_EMBED_OBJ,	1,	0 },		//	CDictionary
+//	NOTE: We have no data descriptor because TDictionary cannot be copied
+//	bitwise.
 
-		{ DATADESC_OPCODE_INT,			2,	0 },		//	m_bOwned, m_bNoReference
-		{ DATADESC_OPCODE_STOP,	0,	0 } };
-static CObjectClass<CIDTable>g_ClassData(OBJID_CIDTABLE, g_DataDesc);
+static CObjectClass<CIDTable>g_ClassData(OBJID_CIDTABLE, NULL);
 
-CIDTable::CIDTable (void) : CDictionary(&g_ClassData),
+CIDTable::CIDTable (void) : CObject(&g_ClassData),
+		m_Table(DictionarySorted),
 		m_bOwned(FALSE),
 		m_bNoReference(TRUE)
 
@@ -21,7 +20,8 @@ CIDTable::CIDTable (void) : CDictionary(&g_ClassData),
 	{
 	}
 
-CIDTable::CIDTable (BOOL bOwned, BOOL bNoReference) : CDictionary(&g_ClassData),
+CIDTable::CIDTable (BOOL bOwned, BOOL bNoReference) : CObject(&g_ClassData),
+		m_Table(DictionarySorted),
 		m_bOwned(bOwned),
 		m_bNoReference(bNoReference)
 
@@ -35,35 +35,23 @@ CIDTable::~CIDTable (void)
 //	CIDTable destructor
 
 	{
-	if (m_bOwned)
-		{
-		int i;
-
-		for (i = 0; i < CDictionary::GetCount(); i++)
-			{
-			int iKey;
-			CObject *pValue;
-
-			CDictionary::GetEntry(i, &iKey, (int *)&pValue);
-			delete pValue;
-			}
-		}
+	RemoveAll();
 	}
 
-int CIDTable::Compare (int iKey1, int iKey2) const
+ALERROR CIDTable::AddEntry (int iKey, CObject *pValue)
 
-//	Compare
+//	AddEntry
 //
-//	Compares the two keys and returns which is greater. If 0, both
-//	keys are equal. If 1, Key1 is greater. If -1, Key2 is greater
+//	Adds an entry. No duplicates are allowed.
 
 	{
-	if (iKey1 == iKey2)
-		return 0;
-	else if ((DWORD)iKey1 > (DWORD)iKey2)
-		return 1;
-	else
-		return -1;
+	bool bInserted;
+	CObject **ppValue = m_Table.SetAt((DWORD)iKey, &bInserted);
+	if (!bInserted)
+		return ERR_FAIL;
+
+	*ppValue = pValue;
+	return NOERROR;
 	}
 
 void CIDTable::CopyHandler (CObject *pOriginal)
@@ -80,33 +68,6 @@ void CIDTable::CopyHandler (CObject *pOriginal)
 #endif
 	}
 
-int CIDTable::GetKey (int iEntry) const
-
-//	GetKey
-//
-//	Returns the key of the nth entry
-
-	{
-	int iKey, iValue;
-
-	GetEntry(iEntry, &iKey, &iValue);
-
-	return iKey;
-	}
-
-CObject *CIDTable::GetValue (int iEntry) const
-
-//	GetValue
-//
-//	Returns the value of the nth entry
-
-	{
-	int iKey, iValue;
-
-	GetEntry(iEntry, &iKey, &iValue);
-	return (CObject *)iValue;
-	}
-
 ALERROR CIDTable::LoadHandler (CUnarchiver *pUnarchiver)
 
 //	LoadHandler
@@ -135,19 +96,18 @@ ALERROR CIDTable::LoadHandler (CUnarchiver *pUnarchiver)
 
 	//	Make sure that there's room for all the objects
 
-	if (error = CDictionary::ExpandArray(0, dwCount))
-		return error;
+	m_Table.GrowToFit((int)dwCount);
 
 	//	Read in the objects themselves
 
 	for (i = 0; i < (int)dwCount; i++)
 		{
 		CObject *pValue;
-		int iKey;
+		DWORD dwKey;
 
 		//	Read in the key
 
-		if (error = pUnarchiver->ReadData((char *)&iKey, sizeof(DWORD)))
+		if (error = pUnarchiver->ReadData((char *)&dwKey, sizeof(DWORD)))
 			return error;
 
 		//	If we own the object, read in the object
@@ -159,16 +119,31 @@ ALERROR CIDTable::LoadHandler (CUnarchiver *pUnarchiver)
 			}
 		else if (m_bNoReference)
 			{
-			if (error = pUnarchiver->ReadData((char *)&pValue, sizeof(DWORD)))
+			//	Raw values are always saved as 32-bits
+
+			DWORD dwValue;
+			if (error = pUnarchiver->ReadData((char *)&dwValue, sizeof(DWORD)))
 				return error;
+
+			pValue = (CObject *)(DWORD_PTR)dwValue;
 			}
 #ifndef LATER
 		//	We need to handle references here.
 		else
+			{
 			ASSERT(FALSE);
+			pValue = NULL;
+			}
 #endif
 
-		CDictionary::SetEntry(i, iKey, (int)pValue);
+		//	We saved in sorted order, so this always appends
+
+		if (error = AddEntry((int)dwKey, pValue))
+			{
+			if (m_bOwned && pValue)
+				delete pValue;
+			return error;
+			}
 		}
 
 	return NOERROR;
@@ -181,13 +156,9 @@ ALERROR CIDTable::Lookup (int iKey, CObject **retpValue) const
 //	Do a look up. If not found, returns ERR_NOTFOUND
 
 	{
-	ALERROR error;
-	int iValue;
+	if (!m_Table.Find((DWORD)iKey, retpValue))
+		return ERR_NOTFOUND;
 
-	if (error = CDictionary::Find(iKey, &iValue))
-		return error;
-
-	*retpValue = (CObject *)iValue;
 	return NOERROR;
 	}
 
@@ -198,10 +169,8 @@ ALERROR CIDTable::LookupEx (int iKey, int *retiEntry) const
 //	Do a look up and return the entry number
 
 	{
-	ALERROR error;
-
-	if (error = CDictionary::FindEx(iKey, retiEntry))
-		return error;
+	if (!m_Table.FindPos((DWORD)iKey, retiEntry))
+		return ERR_NOTFOUND;
 
 	return NOERROR;
 	}
@@ -227,7 +196,8 @@ ALERROR CIDTable::RemoveAll (void)
 
 	//	Done
 
-	return CDictionary::RemoveAll();
+	m_Table.DeleteAll();
+	return NOERROR;
 	}
 
 ALERROR CIDTable::RemoveEntry (int iKey, CObject **retpOldValue)
@@ -237,15 +207,13 @@ ALERROR CIDTable::RemoveEntry (int iKey, CObject **retpOldValue)
 //	Removes the given entry
 
 	{
-	ALERROR error;
-	int iOldValue;
+	int iEntry;
 
-	//	Let the dictionary do the removing
+	if (!m_Table.FindPos((DWORD)iKey, &iEntry))
+		return ERR_NOTFOUND;
 
-	if (error = CDictionary::RemoveEntry(iKey, &iOldValue))
-		return error;
-
-	CObject *pOldObj = (CObject *)iOldValue;
+	CObject *pOldObj = m_Table.GetValue(iEntry);
+	m_Table.Delete(iEntry);
 
 	//	If the caller wants us to return the old value, do it; otherwise,
 	//	we delete it, if necessary
@@ -266,22 +234,30 @@ ALERROR CIDTable::ReplaceEntry (int iKey, CObject *pValue, bool bAdd, CObject **
 //	with the given value. Otherwise, it returns GAERR_NOTFOUND
 
 	{
-	ALERROR error;
-	int iOldValue;
+	CObject **ppValue;
 	CObject *pOldObj;
-	bool  bAdded;
 
-	//	Let the dictionary code do the actual adding
+	//	Look for the key (adding it, if necessary)
 
-	if (error = CDictionary::ReplaceEntry(iKey, (int)pValue, bAdd, &bAdded, &iOldValue))
-		return error;
+	if (bAdd)
+		{
+		bool bInserted;
+		ppValue = m_Table.SetAt((DWORD)iKey, &bInserted);
 
-	//	If we added a new object, then there is no old value
+		//	If we added a new object, then there is no old value
 
-	if (bAdded)
-		pOldObj = NULL;
+		pOldObj = (bInserted ? NULL : *ppValue);
+		}
 	else
-		pOldObj = (CObject *)iOldValue;
+		{
+		ppValue = m_Table.GetAt((DWORD)iKey);
+		if (ppValue == NULL)
+			return ERR_NOTFOUND;
+
+		pOldObj = *ppValue;
+		}
+
+	*ppValue = pValue;
 
 	//	If the caller wants us to return the old value, do it; otherwise,
 	//	we delete it, if necessary
@@ -317,21 +293,20 @@ ALERROR CIDTable::SaveHandler (CArchiver *pArchiver)
 
 	//	Write out the number of entries that we've got
 
-	dwCount = (DWORD)CDictionary::GetCount();
+	dwCount = (DWORD)m_Table.GetCount();
 	if (error = pArchiver->WriteData((char *)&dwCount, sizeof(DWORD)))
 		return error;
 
 	//	Write out each object
 
-	for (i = 0; i < CDictionary::GetCount(); i++)
+	for (i = 0; i < m_Table.GetCount(); i++)
 		{
-		int iKey, iValue;
-
-		CDictionary::GetEntry(i, &iKey, &iValue);
+		DWORD dwKey = m_Table.GetKey(i);
+		CObject *pValue = m_Table.GetValue(i);
 
 		//	Write out the key
 
-		if (error = pArchiver->WriteData((char *)&iKey, sizeof(int)))
+		if (error = pArchiver->WriteData((char *)&dwKey, sizeof(DWORD)))
 			return error;
 
 		//	If we're owned, write out the value. If we're not a reference
@@ -339,20 +314,20 @@ ALERROR CIDTable::SaveHandler (CArchiver *pArchiver)
 
 		if (m_bOwned)
 			{
-			CObject *pValue = (CObject *)iValue;
-
 			if (error = pArchiver->SaveObject(pValue))
 				return error;
 			}
 		else if (m_bNoReference)
 			{
-			if (error = pArchiver->WriteData((char *)&iValue, sizeof(int)))
+			//	Raw values are always saved as 32-bits
+
+			DWORD dwValue = (DWORD)(DWORD_PTR)pValue;
+			if (error = pArchiver->WriteData((char *)&dwValue, sizeof(DWORD)))
 				return error;
 			}
 		else
 			{
 			int iID;
-			CObject *pValue = (CObject *)iValue;
 
 			if (error = pArchiver->Reference2ID(pValue, &iID))
 				return error;
@@ -372,12 +347,10 @@ void CIDTable::SetValue (int iEntry, CObject *pValue, CObject **retpOldValue)
 //	Sets the value
 
 	{
-	int iKey, iValue;
-
-	GetEntry(iEntry, &iKey, &iValue);
+	CObject *&pEntry = m_Table.GetValue(iEntry);
 
 	if (retpOldValue)
-		*retpOldValue = (CObject *)iValue;
+		*retpOldValue = pEntry;
 
-	CDictionary::SetEntry(iEntry, iKey, (int)pValue);
+	pEntry = pValue;
 	}
@@ -392,7 +392,7 @@ void CIntGraph::GenerateDelaunayConnections (void)
 
 	//	Keep track of which points we've already processed
 
-	CLargeSet Processed;
+	CLargeSet Processed(m_Nodes.GetCount());
 
 	//	Now loop over all points (sites) and add each neighbor.
 
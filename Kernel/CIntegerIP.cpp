@@ -108,20 +108,7 @@ CString CIntegerIP::AsBase64 (void) const
 //	The number as a base 64 string (big endian)
 
 	{
-	CMemoryWriteStream Buffer;
-	if (Buffer.Create() != NOERROR)
-		return NULL_STR;
-
-	CBase64Encoder Encoder(&Buffer);
-	if (Encoder.Create() != NOERROR)
-		return NULL_STR;
-
-	Encoder.Write((char *)GetBytes(), m_iCount);
-	Encoder.Close();
-
-	//	Done
-
-	return CString(Buffer.GetPointer(), Buffer.GetLength());
+	return base64Encode(GetBytes(), m_iCount);
 	}
 
 void CIntegerIP::CleanUp (void)
@@ -1,24 +1,101 @@
 //	CLargeSet.cpp
 //
 //	CLargeSet class
+//
+//	The set is an array of 64-bit words. All set algebra is done a word at a
+//	time in straight loops (which the compiler can vectorize) and iteration
+//	jumps from member to member with a bit scan instead of testing every bit.
+//
+//	Words past m_iWordCount are implicitly zero. Trailing words inside
+//	m_iWordCount may also be zero (e.g., after Clear), so comparisons and
+//	hashing only look at words up to the last non-zero one.
 
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-const int BITS_PER_DWORD =						32;
+CLargeSet::CLargeSet (int iSize) :
+		m_iWordCount(0),
+		m_iAlloc(INLINE_WORDS)
 
-CLargeSet::CLargeSet (int iSize)
+//	CLargeSet constructor
+//
+//	If iSize is specified, we preallocate enough storage for values in the
+//	range 0 to iSize-1.
+
+	{
+	if (iSize > 0)
+		GrowToFit(AlignUp(iSize, BITS_PER_WORD) / BITS_PER_WORD);
+	}
+
+CLargeSet::CLargeSet (const CLargeSet &Src) :
+		m_iWordCount(0),
+		m_iAlloc(INLINE_WORDS)
 
 //	CLargeSet constructor
 
 	{
-	if (iSize != -1)
-		{
-		int iCount = AlignUp(iSize, BITS_PER_DWORD) / BITS_PER_DWORD;
-		m_Set.InsertEmpty(iCount);
-		for (int i = 0; i < iCount; i++)
-			m_Set[i] = 0;
-		}
+	int iCount = Src.GetUsedWordCount();
+	GrowToFit(iCount);
+	utlMemCopy((char *)Src.GetWords(), (char *)GetWordsRW(), iCount * sizeof(DWORDLONG));
+	}
+
+CLargeSet::CLargeSet (CLargeSet &&Src) :
+		m_iWordCount(0),
+		m_iAlloc(INLINE_WORDS)
+
+//	CLargeSet move constructor
+
+	{
+	TakeHandoff(Src);
+	}
+
+CLargeSet &CLargeSet::operator= (const CLargeSet &Src)
+
+//	CLargeSet operator=
+
+	{
+	if (&Src == this)
+		return *this;
+
+	//	We keep our storage, so a set that is repeatedly assigned (as in the
+	//	regex matcher) does not reallocate.
+
+	int iCount = Src.GetUsedWordCount();
+	GrowToFit(iCount);
+
+	DWORDLONG *pWords = GetWordsRW();
+	utlMemCopy((char *)Src.GetWords(), (char *)pWords, iCount * sizeof(DWORDLONG));
+	for (int i = iCount; i < m_iWordCount; i++)
+		pWords[i] = 0;
+
+	return *this;
+	}
+
+CLargeSet &CLargeSet::operator= (CLargeSet &&Src)
+
+//	CLargeSet move operator=
+
+	{
+	if (&Src == this)
+		return *this;
+
+	CleanUp();
+	TakeHandoff(Src);
+	return *this;
+	}
+
+void CLargeSet::CleanUp (void)
+
+//	CleanUp
+//
+//	Frees heap storage and returns to the empty inline state.
+
+	{
+	if (!IsInline())
+		delete [] m_pHeap;
+
+	m_iWordCount = 0;
+	m_iAlloc = INLINE_WORDS;
 	}
 
 void CLargeSet::Clear (DWORD dwValue)
@@ -28,40 +105,140 @@ void CLargeSet::Clear (DWORD dwValue)
 //	Remove the value from the set
 
 	{
-	DWORD dwPos = dwValue / BITS_PER_DWORD;
-	DWORD dwBit = dwValue % BITS_PER_DWORD;
-
-	if (dwPos >= (DWORD)m_Set.GetCount())
+	DWORD dwPos = dwValue / BITS_PER_WORD;
+	if (dwPos >= (DWORD)m_iWordCount)
 		return;
 
-	m_Set[dwPos] = (m_Set[dwPos] & ~(1 << dwBit));
+	GetWordsRW()[dwPos] &= ~((DWORDLONG)1 << (dwValue % BITS_PER_WORD));
 	}
 
 void CLargeSet::ClearAll (void)
 
 //	ClearAll
 //
-//	Removes all bits
+//	Removes all bits. We keep our storage so that the set can be refilled
+//	without allocating.
+
+	{
+	DWORDLONG *pWords = GetWordsRW();
+	for (int i = 0; i < m_iWordCount; i++)
+		pWords[i] = 0;
+	}
+
+int CLargeSet::Compare (const CLargeSet &Src) const
+
+//	Compare
+//
+//	Returns 1 if we are greater than Src, -1 if we are less, and 0 if the two
+//	sets are equal. The ordering treats each set as a large binary number, so
+//	it is arbitrary, but consistent with Equals.
+
+	{
+	int iCount = GetUsedWordCount();
+	int iSrcCount = Src.GetUsedWordCount();
+
+	if (iCount != iSrcCount)
+		return (iCount > iSrcCount ? 1 : -1);
+
+	const DWORDLONG *pWords = GetWords();
+	const DWORDLONG *pSrc = Src.GetWords();
+	for (int i = iCount - 1; i >= 0; i--)
+		if (pWords[i] != pSrc[i])
+			return (pWords[i] > pSrc[i] ? 1 : -1);
+
+	return 0;
+	}
+
+int CLargeSet::Count (void) const
+
+//	Count
+//
+//	Returns the number of values in the set.
+
+	{
+	const DWORDLONG *pWords = GetWords();
+	int iCount = 0;
+
+	for (int i = 0; i < m_iWordCount; i++)
+		iCount += CountBits(pWords[i]);
+
+	return iCount;
+	}
+
+int CLargeSet::CountBits (DWORDLONG dwWord)
+
+//	CountBits
+//
+//	Returns the number of bits set in the word. We can't rely on the POPCNT
+//	instruction on the machines we support, so we count in parallel inside
+//	the word.
 
 	{
-	m_Set.DeleteAll();
+	dwWord = dwWord - ((dwWord >> 1) & 0x5555555555555555ULL);
+	dwWord = (dwWord & 0x3333333333333333ULL) + ((dwWord >> 2) & 0x3333333333333333ULL);
+	dwWord = (dwWord + (dwWord >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((dwWord * 0x0101010101010101ULL) >> 56);
 	}
 
-DWORD CLargeSet::GetBitFromMask (DWORD dwMask)
+void CLargeSet::Difference (const CLargeSet &Src)
 
-//	GetBitFromMask
+//	Difference
 //
-//	Converts from a mask to a bit.
+//	Removes all values in Src from our set.
 
 	{
-	DWORD dwBit = 0;
-	while (dwMask != 1)
+	int iCount = Min(m_iWordCount, Src.m_iWordCount);
+	DWORDLONG *pWords = GetWordsRW();
+	const DWORDLONG *pSrc = Src.GetWords();
+
+	for (int i = 0; i < iCount; i++)
+		pWords[i] &= ~pSrc[i];
+	}
+
+bool CLargeSet::Equals (const CLargeSet &Src) const
+
+//	Equals
+//
+//	Returns TRUE if both sets have the same members.
+
+	{
+	int iCount = GetUsedWordCount();
+	if (iCount != Src.GetUsedWordCount())
+		return false;
+
+	const DWORDLONG *pWords = GetWords();
+	const DWORDLONG *pSrc = Src.GetWords();
+	for (int i = 0; i < iCount; i++)
+		if (pWords[i] != pSrc[i])
+			return false;
+
+	return true;
+	}
+
+DWORD CLargeSet::GetHash (void) const
+
+//	GetHash
+//
+//	Returns a hash of the members of the set (FNV-1a over the used words). We
+//	never return 0.
+
+	{
+	const DWORDLONG *pWords = GetWords();
+	int iCount = GetUsedWordCount();
+	DWORD dwHash = 2166136261;
+
+	for (int i = 0; i < iCount; i++)
 		{
-		dwBit++;
-		dwMask = dwMask >> 1;
+		DWORDLONG dwWord = pWords[i];
+		for (int j = 0; j < 8; j++)
+			{
+			dwHash ^= (DWORD)(dwWord & 0xff);
+			dwHash *= 16777619;
+			dwWord >>= 8;
+			}
 		}
 
-	return dwBit;
+	return (dwHash ? dwHash : 1);
 	}
 
 DWORD CLargeSet::GetNextValue (DWORD dwStart) const
@@ -72,23 +249,70 @@ DWORD CLargeSet::GetNextValue (DWORD dwStart) const
 //	If there are no more values, we return INVALID_VALUE.
 
 	{
-	DWORD dwPos = dwStart / BITS_PER_DWORD;
-	DWORD dwMask = 1 << (dwStart % BITS_PER_DWORD);
+	DWORD dwPos = dwStart / BITS_PER_WORD;
+	if (dwPos >= (DWORD)m_iWordCount)
+		return INVALID_VALUE;
 
-	while (dwPos < (DWORD)m_Set.GetCount())
+	//	Mask out the bits below dwStart in the first word.
+
+	const DWORDLONG *pWords = GetWords();
+	DWORDLONG dwWord = pWords[dwPos] & (~(DWORDLONG)0 << (dwStart % BITS_PER_WORD));
+
+	while (true)
 		{
-		if (m_Set[dwPos] & dwMask)
-			return (dwPos * BITS_PER_DWORD) + GetBitFromMask(dwMask);
+		if (dwWord)
+			return (dwPos * BITS_PER_WORD) + LowestBit(dwWord);
 
-		dwMask = dwMask << 1;
-		if (dwMask == 0)
-			{
-			dwPos++;
-			dwMask = 1;
-			}
+		if (++dwPos >= (DWORD)m_iWordCount)
+			return INVALID_VALUE;
+
+		dwWord = pWords[dwPos];
+		}
+	}
+
+int CLargeSet::GetUsedWordCount (void) const
+
+//	GetUsedWordCount
+//
+//	Returns the number of words up to and including the last non-zero word.
+
+	{
+	const DWORDLONG *pWords = GetWords();
+	int iCount = m_iWordCount;
+	while (iCount > 0 && pWords[iCount - 1] == 0)
+		iCount--;
+
+	return iCount;
+	}
+
+void CLargeSet::GrowToFit (int iWordCount)
+
+//	GrowToFit
+//
+//	Makes sure that we have at least iWordCount words. New words are zero.
+
+	{
+	if (iWordCount <= m_iWordCount)
+		return;
+
+	if (iWordCount > m_iAlloc)
+		{
+		int iNewAlloc = Max(iWordCount, 2 * m_iAlloc);
+		DWORDLONG *pNewWords = new DWORDLONG [iNewAlloc];
+		utlMemCopy((char *)GetWords(), (char *)pNewWords, m_iWordCount * sizeof(DWORDLONG));
+
+		if (!IsInline())
+			delete [] m_pHeap;
+
+		m_pHeap = pNewWords;
+		m_iAlloc = iNewAlloc;
 		}
 
-	return INVALID_VALUE;
+	DWORDLONG *pWords = GetWordsRW();
+	for (int i = m_iWordCount; i < iWordCount; i++)
+		pWords[i] = 0;
+
+	m_iWordCount = iWordCount;
 	}
 
 bool CLargeSet::InitFromString (const CString &sValue, DWORD dwMaxValue, CString *retsError)
@@ -198,6 +422,25 @@ bool CLargeSet::InitFromString (const CString &sValue, DWORD dwMaxValue, CString
 	return true;
 	}
 
+void CLargeSet::Intersect (const CLargeSet &Src)
+
+//	Intersect
+//
+//	Removes all values that are not also in Src.
+
+	{
+	int iCount = Min(m_iWordCount, Src.m_iWordCount);
+	DWORDLONG *pWords = GetWordsRW();
+	const DWORDLONG *pSrc = Src.GetWords();
+	int i;
+
+	for (i = 0; i < iCount; i++)
+		pWords[i] &= pSrc[i];
+
+	for (; i < m_iWordCount; i++)
+		pWords[i] = 0;
+	}
+
 bool CLargeSet::IsEmpty (void) const
 
 //	IsEmpty
@@ -205,10 +448,9 @@ bool CLargeSet::IsEmpty (void) const
 //	Returns TRUE if empty
 
 	{
-	int i;
-
-	for (i = 0; i < m_Set.GetCount(); i++)
-		if (m_Set[i])
+	const DWORDLONG *pWords = GetWords();
+	for (int i = 0; i < m_iWordCount; i++)
+		if (pWords[i])
 			return false;
 
 	return true;
@@ -221,13 +463,11 @@ bool CLargeSet::IsSet (DWORD dwValue) const
 //	Returns TRUE if the value is in the set
 
 	{
-	DWORD dwPos = dwValue / BITS_PER_DWORD;
-	DWORD dwBit = dwValue % BITS_PER_DWORD;
-
-	if (dwPos >= (DWORD)m_Set.GetCount())
+	DWORD dwPos = dwValue / BITS_PER_WORD;
+	if (dwPos >= (DWORD)m_iWordCount)
 		return false;
 
-	return ((m_Set[dwPos] & (1 << dwBit)) ? true : false);
+	return ((GetWords()[dwPos] >> (dwValue % BITS_PER_WORD)) & 1) != 0;
 	}
 
 void CLargeSet::Set (DWORD dwValue)
@@ -240,16 +480,50 @@ void CLargeSet::Set (DWORD dwValue)
 	if (dwValue == INVALID_VALUE)
 		return;
 
-	DWORD dwPos = dwValue / BITS_PER_DWORD;
-	DWORD dwBit = dwValue % BITS_PER_DWORD;
-	
-	int iOldCount = m_Set.GetCount();
-	if (dwPos >= (DWORD)iOldCount)
+	DWORD dwPos = dwValue / BITS_PER_WORD;
+	if (dwPos >= (DWORD)m_iWordCount)
+		GrowToFit((int)dwPos + 1);
+
+	GetWordsRW()[dwPos] |= ((DWORDLONG)1 << (dwValue % BITS_PER_WORD));
+	}
+
+void CLargeSet::TakeHandoff (CLargeSet &Src)
+
+//	TakeHandoff
+//
+//	Takes Src's storage. We must be empty and inline; Src is left empty.
+
+	{
+	if (Src.IsInline())
 		{
-		m_Set.InsertEmpty(dwPos - iOldCount + 1);
-		for (int i = iOldCount; i < m_Set.GetCount(); i++)
-			m_Set[i] = 0;
+		m_iWordCount = Src.m_iWordCount;
+		for (int i = 0; i < m_iWordCount; i++)
+			m_Inline[i] = Src.m_Inline[i];
 		}
+	else
+		{
+		m_pHeap = Src.m_pHeap;
+		m_iWordCount = Src.m_iWordCount;
+		m_iAlloc = Src.m_iAlloc;
+
+		Src.m_iAlloc = INLINE_WORDS;
+		}
+
+	Src.m_iWordCount = 0;
+	}
+
+void CLargeSet::Union (const CLargeSet &Src)
+
+//	Union
+//
+//	Adds all values in Src to our set.
+
+	{
+	int iCount = Src.GetUsedWordCount();
+	GrowToFit(iCount);
 
-	m_Set[dwPos] = (m_Set[dwPos] | (1 << dwBit));
+	DWORDLONG *pWords = GetWordsRW();
+	const DWORDLONG *pSrc = Src.GetWords();
+	for (int i = 0; i < iCount; i++)
+		pWords[i] |= pSrc[i];
 	}
@@ -5,15 +5,32 @@
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-CMapBase::CMapBase (int iTableSize) : m_iTableSize(iTableSize), m_pTable(NULL), m_iCount(0)
+CMapBase::CMapBase (int iInitialCount) :
+		m_iCount(0),
+		m_pSlots(NULL),
+		m_iSlotCount(0),
+		m_dwMask(0),
+		m_iInitialCount(iInitialCount)
 
 //	CMapBase constructor
+//
+//	We don't allocate the slot table until the first insert, so empty maps are
+//	cheap.
+
+	{
+	}
+
+CMapBase::CMapBase (const CMapBase &Src) :
+		m_iCount(0),
+		m_pSlots(NULL),
+		m_iSlotCount(0),
+		m_dwMask(0),
+		m_iInitialCount(Src.m_iInitialCount)
+
+//	CMapBase copy constructor
 
 	{
-	typedef EntryBase *EntryBasePtr;
-	m_pTable = new EntryBasePtr [iTableSize];
-	for (int i = 0; i < iTableSize; i++)
-		m_pTable[i] = NULL;
+	*this = Src;
 	}
 
 CMapBase::~CMapBase (void)
@@ -21,185 +38,315 @@ CMapBase::~CMapBase (void)
 //	CMapBase destructor
 
 	{
-	delete [] m_pTable;
+	if (m_pSlots)
+		delete [] m_pSlots;
 	}
 
-CMapBase::EntryBase *CMapBase::DeleteEntry (void *pVoidKey, void *pKey, int iKeyLen)
+CMapBase &CMapBase::operator= (const CMapBase &Src)
 
-//	DeleteEntry
+//	CMapBase operator =
 //
-//	Removes the entry from the map and returns a pointer to
-//	the entry
+//	Copies the index. Since slots only hold hashes and entry indices, the
+//	derived class just needs to copy its entry array in the same order.
 
 	{
-	int iSlot;
-	EntryBase *pPrevEntry;
-	EntryBase *pEntryToDelete = FindEntry(pVoidKey, pKey, iKeyLen, &iSlot, &pPrevEntry);
-	if (pEntryToDelete)
-		{
-		if (pPrevEntry)
-			pPrevEntry->pNext = pEntryToDelete->pNext;
-		else
-			m_pTable[iSlot] = pEntryToDelete->pNext;
+	if (&Src == this)
+		return *this;
+
+	if (m_pSlots)
+		delete [] m_pSlots;
+
+	m_iCount = Src.m_iCount;
+	m_iSlotCount = Src.m_iSlotCount;
+	m_dwMask = Src.m_dwMask;
+	m_iInitialCount = Src.m_iInitialCount;
 
-		m_iCount--;
-		return pEntryToDelete;
+	if (Src.m_pSlots)
+		{
+		m_pSlots = new SSlot [m_iSlotCount];
+		utlMemCopy((char *)Src.m_pSlots, (char *)m_pSlots, m_iSlotCount * sizeof(SSlot));
 		}
 	else
-		return NULL;
+		m_pSlots = NULL;
+
+	return *this;
 	}
 
-CMapBase::EntryBase *CMapBase::FindEntry (void *pVoidKey, void *pKey, int iKeyLen, int *retiSlot, EntryBase **retpPrevEntry) const
+int CMapBase::CalcSlotCount (int iCount) const
 
-//	FindEntry
+//	CalcSlotCount
 //
-//	Find the entry with the given key
+//	Returns the smallest power-of-2 slot count that can hold iCount entries
+//	without exceeding our maximum load factor.
 
 	{
-	int iSlot = Hash(pKey, iKeyLen);
+	int iSlotCount = MIN_SLOT_COUNT;
+	while (iSlotCount * MAX_LOAD_NUM < iCount * MAX_LOAD_DEN)
+		iSlotCount *= 2;
 
-	EntryBase *pEntryFound = (EntryBase *)m_pTable[iSlot];
-	EntryBase *pPrevEntry = NULL;
-	while (pEntryFound && !KeyEquals(pVoidKey, pEntryFound))
+	return iSlotCount;
+	}
+
+int CMapBase::DeleteIndex (void *pVoidKey, DWORD dwHash)
+
+//	DeleteIndex
+//
+//	Removes the key from the index and returns the entry index that it pointed
+//	to (or -1 if the key was not found). The caller is responsible for removing
+//	the entry itself.
+
+	{
+	int iSlot = FindSlot(pVoidKey, dwHash);
+	if (iSlot == -1)
+		return -1;
+
+	int iEntry = m_pSlots[iSlot].iEntry;
+
+	//	Backward-shift deletion: pull every displaced slot after us back by
+	//	one until we hit an empty slot or a slot that is already at its home
+	//	position. This keeps probe sequences short without tombstones.
+
+	int iNext = (int)((iSlot + 1) & m_dwMask);
+	while (m_pSlots[iNext].dwHash != 0 && GetProbeDistance(m_pSlots[iNext].dwHash, iNext) > 0)
 		{
-		pPrevEntry = pEntryFound;
-		pEntryFound = pEntryFound->pNext;
+		m_pSlots[iSlot] = m_pSlots[iNext];
+		iSlot = iNext;
+		iNext = (int)((iNext + 1) & m_dwMask);
 		}
 
-	if (retiSlot)
-		*retiSlot = iSlot;
+	m_pSlots[iSlot].dwHash = 0;
+	m_iCount--;
+
+	return iEntry;
+	}
+
+void CMapBase::DeleteIndexAll (void)
 
-	if (retpPrevEntry)
-		*retpPrevEntry = pPrevEntry;
+//	DeleteIndexAll
+//
+//	Removes all entries from the index and frees the slot table.
 
-	return pEntryFound;
+	{
+	if (m_pSlots)
+		{
+		delete [] m_pSlots;
+		m_pSlots = NULL;
+		}
+
+	m_iSlotCount = 0;
+	m_dwMask = 0;
+	m_iCount = 0;
 	}
 
-CMapBase::EntryBase *CMapBase::GetNext (CMapIterator &Iterator) const
+int CMapBase::FindIndex (void *pVoidKey, DWORD dwHash) const
 
-//	GetNext
+//	FindIndex
 //
-//	Return the next entry in the iterator
+//	Returns the entry index for the given key (or -1 if not found).
 
 	{
-	//	If we have pPos then we check if we've got a next entry
+	int iSlot = FindSlot(pVoidKey, dwHash);
+	if (iSlot == -1)
+		return -1;
 
-	if (Iterator.m_pPos)
-		{
-		EntryBase *pEntry = (EntryBase *)Iterator.m_pPos;
-		if (pEntry->pNext)
-			{
-			Iterator.m_pPos = pEntry->pNext;
-			return pEntry->pNext;
-			}
+	return m_pSlots[iSlot].iEntry;
+	}
 
-		//	Start checking at the next slot
+int CMapBase::FindSlot (void *pVoidKey, DWORD dwHash) const
 
-		Iterator.m_iTableEntry++;
-		}
-	else
-		{
-		//	We start at the beginning of the list
+//	FindSlot
+//
+//	Returns the slot holding the given key (or -1 if not found).
 
-		Iterator.m_iTableEntry = 0;
-		}
+	{
+	if (m_pSlots == NULL)
+		return -1;
 
-	//	We get here if
+	int iSlot = (int)(dwHash & m_dwMask);
+	int iDistance = 0;
 
-	while (Iterator.m_iTableEntry < m_iTableSize)
+	while (true)
 		{
-		if (m_pTable[Iterator.m_iTableEntry])
-			{
-			Iterator.m_pPos = m_pTable[Iterator.m_iTableEntry];
-			return m_pTable[Iterator.m_iTableEntry];
-			}
+		const SSlot &Slot = m_pSlots[iSlot];
+
+		//	If we hit an empty slot, or a slot that is closer to its home than
+		//	we are to ours, then the key cannot be further along (that's the
+		//	Robin Hood invariant).
+
+		if (Slot.dwHash == 0 || GetProbeDistance(Slot.dwHash, iSlot) < iDistance)
+			return -1;
 
-		Iterator.m_iTableEntry++;
+		if (Slot.dwHash == dwHash && KeyEquals(pVoidKey, Slot.iEntry))
+			return iSlot;
+
+		iSlot = (int)((iSlot + 1) & m_dwMask);
+		iDistance++;
 		}
+	}
+
+void CMapBase::GrowIndexToFit (int iCount)
 
-	ASSERT(false);
-	return NULL;
+//	GrowIndexToFit
+//
+//	Makes sure we can hold iCount entries without rehashing.
+
+	{
+	int iSlotCount = CalcSlotCount(iCount);
+	if (iSlotCount > m_iSlotCount)
+		Rehash(iSlotCount);
 	}
 
-int CMapBase::Hash (void *pKey, int iKeyLen) const
+DWORD CMapBase::Hash (void *pKey, int iKeyLen)
 
 //	Hash
 //
-//	Hash the key
+//	Hash the key. We never return 0 because we use that to mark empty slots.
 
 	{
-	return (utlHashFunctionCase((BYTE *)pKey, iKeyLen) % m_iTableSize);
+	DWORD dwHash = utlHashFunctionCase((BYTE *)pKey, iKeyLen);
+	return (dwHash ? dwHash : 1);
 	}
 
-bool CMapBase::HasMore (CMapIterator &Iterator) const
+void CMapBase::InsertIndex (DWORD dwHash, int iEntry)
 
-//	HasMore
+//	InsertIndex
 //
-//	Returns TRUE if there are more entries in the iterator
+//	Adds the given entry to the index. We do not check for duplicate keys.
 
 	{
-	int iSlot;
+	ASSERT(dwHash != 0);
 
-	//	If we have pPos then we check if we've got a next entry
+	if (m_pSlots == NULL)
+		Rehash(CalcSlotCount(Max(m_iInitialCount, m_iCount + 1)));
+	else if ((m_iCount + 1) * MAX_LOAD_DEN > m_iSlotCount * MAX_LOAD_NUM)
+		Rehash(m_iSlotCount * 2);
 
-	if (Iterator.m_pPos)
-		{
-		EntryBase *pEntry = (EntryBase *)Iterator.m_pPos;
-		if (pEntry->pNext)
-			return true;
+	SSlot NewSlot;
+	NewSlot.dwHash = dwHash;
+	NewSlot.iEntry = iEntry;
+	InsertSlot(NewSlot);
 
-		//	Start checking at the next slot
+	m_iCount++;
+	}
 
-		iSlot = Iterator.m_iTableEntry + 1;
-		}
-	else
+void CMapBase::InsertSlot (SSlot NewSlot)
+
+//	InsertSlot
+//
+//	Places the slot in the table, displacing any slot that is closer to its
+//	home position than we are. The caller guarantees that there is room.
+
+	{
+	int iSlot = (int)(NewSlot.dwHash & m_dwMask);
+	int iDistance = 0;
+
+	while (true)
 		{
-		//	We start at the beginning of the list
+		SSlot &Slot = m_pSlots[iSlot];
+		if (Slot.dwHash == 0)
+			{
+			Slot = NewSlot;
+			return;
+			}
+
+		int iSlotDistance = GetProbeDistance(Slot.dwHash, iSlot);
+		if (iSlotDistance < iDistance)
+			{
+			Swap(Slot, NewSlot);
+			iDistance = iSlotDistance;
+			}
 
-		iSlot = 0;
+		iSlot = (int)((iSlot + 1) & m_dwMask);
+		iDistance++;
 		}
+	}
+
+void CMapBase::MoveIndex (DWORD dwHash, int iOldEntry, int iNewEntry)
 
-	//	We get here if
+//	MoveIndex
+//
+//	The derived class has moved an entry in its array; we update the slot that
+//	points to it.
+
+	{
+	ASSERT(m_pSlots);
 
-	while (iSlot < m_iTableSize)
+	int iSlot = (int)(dwHash & m_dwMask);
+	while (m_pSlots[iSlot].iEntry != iOldEntry || m_pSlots[iSlot].dwHash != dwHash)
 		{
-		if (m_pTable[iSlot])
-			return true;
-		iSlot++;
+		ASSERT(m_pSlots[iSlot].dwHash != 0);
+		iSlot = (int)((iSlot + 1) & m_dwMask);
 		}
 
-	return false;
+	m_pSlots[iSlot].iEntry = iNewEntry;
 	}
 
-void CMapBase::InsertEntry (void *pKey, int iKeyLen, EntryBase *pEntry)
+void CMapBase::Rehash (int iNewSlotCount)
 
-//	InsertEntry
+//	Rehash
 //
-//	Inserts an entry into the hash table
+//	Allocates a new slot table and re-inserts all slots. We store the full
+//	hash in each slot, so we never need to look at the keys.
 
 	{
-	int iSlot = Hash(pKey, iKeyLen);
-	InsertEntry(iSlot, pEntry);
+	int i;
+
+	SSlot *pOldSlots = m_pSlots;
+	int iOldSlotCount = m_iSlotCount;
+
+	m_pSlots = new SSlot [iNewSlotCount];
+	m_iSlotCount = iNewSlotCount;
+	m_dwMask = (DWORD)(iNewSlotCount - 1);
+	for (i = 0; i < iNewSlotCount; i++)
+		m_pSlots[i].dwHash = 0;
+
+	if (pOldSlots)
+		{
+		for (i = 0; i < iOldSlotCount; i++)
+			if (pOldSlots[i].dwHash != 0)
+				InsertSlot(pOldSlots[i]);
+
+		delete [] pOldSlots;
+		}
 	}
 
-void CMapBase::InsertEntry (int iSlot, EntryBase *pEntry)
+void CMapBase::ShiftIndex (int iStart, int iDelta)
+
+//	ShiftIndex
+//
+//	The derived class has inserted or removed entries in the middle of its
+//	array; we add iDelta to every slot that points at iStart or later.
+
 	{
-	if (m_pTable[iSlot])
-		pEntry->pNext = m_pTable[iSlot];
+	int i;
 
-	m_pTable[iSlot] = pEntry;
-	m_iCount++;
+	if (m_pSlots == NULL)
+		return;
+
+	for (i = 0; i < m_iSlotCount; i++)
+		if (m_pSlots[i].dwHash != 0 && m_pSlots[i].iEntry >= iStart)
+			m_pSlots[i].iEntry += iDelta;
 	}
 
-void CMapBase::Reset (CMapIterator &Iterator) const
+DWORD DictionaryKeyHash (const CString &sKey)
 
-//	Reset
+//	DictionaryKeyHash
 //
-//	Reset the iterator
+//	Case-insensitive hash that is consistent with strCompareAbsolute (which is
+//	what KeyCompare uses for strings). This is FNV-1a over the lowercase form.
 
 	{
-	Iterator.m_pPos = NULL;
-	Iterator.m_iTableEntry = 0;
+	char *pPos = sKey.GetASCIIZPointer();
+	char *pEndPos = pPos + sKey.GetLength();
+
+	DWORD dwHash = 2166136261;
+	while (pPos < pEndPos)
+		{
+		dwHash ^= (BYTE)strLowerCaseAbsolute(*pPos++);
+		dwHash *= 16777619;
+		}
+
+	return (dwHash ? dwHash : 1);
 	}
 
 bool MapKeyEquals (const CString &sKey1, const CString &sKey2)
@@ -0,0 +1,467 @@
+//	CMappedFileBlock.cpp
+//
+//	CMappedFileBlock class
+//
+//	A read-only memory-mapped file. Unlike CFileReadBlock, sizes are 64-bit:
+//	on 64-bit builds any file is mapped with a single view; on 32-bit builds
+//	files too big for the address space are accessed through a sliding
+//	window (or through slices, each of which maps its own view).
+
+#include "Kernel.h"
+
+#ifndef MEM_LARGE_PAGES
+#define MEM_LARGE_PAGES					0x20000000
+#endif
+
+#ifdef _WIN64
+const DWORDLONG MAX_SINGLE_VIEW =		0xFFFFFFFFFFFFFFFF;
+#else
+const DWORDLONG MAX_SINGLE_VIEW =		(512 * 1024 * 1024);	//	Leave room in a 2 GB address space
+#endif
+
+const DWORD READ_CHUNK_SIZE =			(16 * 1024 * 1024);
+
+//	PrefetchVirtualMemory and GetLargePageMinimum are not available on all
+//	the versions of Windows we support, so we look them up at runtime.
+
+struct SPrefetchRange
+	{
+	PVOID pAddress;
+	SIZE_T dwSize;
+	};
+
+typedef BOOL (WINAPI *PREFETCHVIRTUALMEMORYPROC)(HANDLE hProcess, ULONG_PTR dwCount, SPrefetchRange *pRanges, ULONG dwFlags);
+typedef SIZE_T (WINAPI *GETLARGEPAGEMINIMUMPROC)(void);
+
+static DWORD g_dwAllocGranularity = 0;
+static PREFETCHVIRTUALMEMORYPROC g_pfnPrefetchVirtualMemory = NULL;
+static GETLARGEPAGEMINIMUMPROC g_pfnGetLargePageMinimum = NULL;
+static volatile LONG g_iSystemInfoInit = 0;
+
+static void InitSystemInfo (void);
+
+IReadBlock *IReadBlock::CreateSlice (DWORDLONG dwOffset, DWORDLONG dwLength)
+
+//	CreateSlice
+//
+//	Default implementation: points into our own memory. Caller must delete
+//	the result.
+
+	{
+	DWORDLONG dwTotal = GetLength64();
+	if (dwOffset > dwTotal)
+		dwOffset = dwTotal;
+	if (dwLength > dwTotal - dwOffset)
+		dwLength = dwTotal - dwOffset;
+
+	return new CReadBlockSlice(GetPointer64(dwOffset, dwLength), dwLength);
+	}
+
+CReadBlockSlice::~CReadBlockSlice (void)
+
+//	CReadBlockSlice destructor
+
+	{
+	if (m_pView)
+		UnmapViewOfFile(m_pView);
+	}
+
+CMappedFileBlock::CMappedFileBlock (const CString &sFilename, DWORD dwFlags) :
+		m_sFilename(sFilename),
+		m_dwFlags(dwFlags),
+		m_hFile(INVALID_HANDLE_VALUE),
+		m_hFileMap(NULL),
+		m_dwFileSize(0),
+		m_pView(NULL),
+		m_bLargePages(false),
+		m_pWindow(NULL),
+		m_dwWindowPos(0),
+		m_dwWindowLen(0)
+
+//	CMappedFileBlock constructor
+
+	{
+	}
+
+CMappedFileBlock::~CMappedFileBlock (void)
+
+//	CMappedFileBlock destructor
+
+	{
+	Close();
+	}
+
+ALERROR CMappedFileBlock::Close (void)
+
+//	Close
+//
+//	Closes the file. Any slices must already have been deleted.
+
+	{
+	if (m_pWindow)
+		{
+		UnmapViewOfFile(m_pWindow);
+		m_pWindow = NULL;
+		m_dwWindowPos = 0;
+		m_dwWindowLen = 0;
+		}
+
+	if (m_pView)
+		{
+		if (m_bLargePages)
+			VirtualFree(m_pView, 0, MEM_RELEASE);
+		else
+			UnmapViewOfFile(m_pView);
+
+		m_pView = NULL;
+		m_bLargePages = false;
+		}
+
+	if (m_hFileMap)
+		{
+		CloseHandle(m_hFileMap);
+		m_hFileMap = NULL;
+		}
+
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		{
+		CloseHandle(m_hFile);
+		m_hFile = INVALID_HANDLE_VALUE;
+		}
+
+	m_dwFileSize = 0;
+	return NOERROR;
+	}
+
+IReadBlock *CMappedFileBlock::CreateSlice (DWORDLONG dwOffset, DWORDLONG dwLength)
+
+//	CreateSlice
+//
+//	Returns a block for the given range without copying. If the whole file
+//	is mapped we point into it; otherwise the slice maps its own view, so
+//	it stays valid while the window moves. Returns NULL if the range cannot
+//	be mapped.
+
+	{
+	if (dwOffset > m_dwFileSize)
+		dwOffset = m_dwFileSize;
+	if (dwLength > m_dwFileSize - dwOffset)
+		dwLength = m_dwFileSize - dwOffset;
+
+	if (m_pView || m_hFileMap == NULL)
+		return new CReadBlockSlice(m_pView + dwOffset, dwLength);
+
+	char *pView;
+	char *pData = MapWindow(dwOffset, dwLength, &pView);
+	if (pData == NULL)
+		return NULL;
+
+	return new CReadBlockSlice(pData, dwLength, pView);
+	}
+
+char *CMappedFileBlock::GetPointer64 (DWORDLONG dwOffset, DWORDLONG dwLength)
+
+//	GetPointer64
+//
+//	Returns a pointer to the given range. In windowed mode this may remap the
+//	window, which invalidates earlier pointers. Returns NULL if the range
+//	cannot be mapped.
+
+	{
+	if (m_pView)
+		return m_pView + dwOffset;
+
+	if (m_hFileMap == NULL)
+		return NULL;
+
+	//	If the range is inside the current window, we're done
+
+	if (m_pWindow
+			&& dwOffset >= m_dwWindowPos
+			&& dwOffset + dwLength <= m_dwWindowPos + m_dwWindowLen)
+		return m_pWindow + (DWORD)(dwOffset - m_dwWindowPos);
+
+	//	Otherwise, map a new window. We map at least WINDOW_SIZE so that
+	//	a run of small reads does not remap every time.
+
+	if (m_pWindow)
+		{
+		UnmapViewOfFile(m_pWindow);
+		m_pWindow = NULL;
+		}
+
+	DWORDLONG dwWindowLen = Max(dwLength, (DWORDLONG)WINDOW_SIZE);
+	if (dwWindowLen > m_dwFileSize - dwOffset)
+		dwWindowLen = m_dwFileSize - dwOffset;
+
+	char *pData = MapWindow(dwOffset, dwWindowLen, &m_pWindow);
+	if (pData == NULL)
+		return NULL;
+
+	m_dwWindowPos = dwOffset - (DWORD)(pData - m_pWindow);
+	m_dwWindowLen = dwWindowLen + (DWORD)(pData - m_pWindow);
+
+	return pData;
+	}
+
+bool CMappedFileBlock::LoadLargePages (void)
+
+//	LoadLargePages
+//
+//	Reads the whole file into large-page memory. Large pages are never paged
+//	out and need the SeLockMemoryPrivilege, so this fails (and we fall back
+//	to a normal mapping) for most processes.
+
+	{
+	if (g_pfnGetLargePageMinimum == NULL)
+		return false;
+
+	SIZE_T dwLargePage = g_pfnGetLargePageMinimum();
+	if (dwLargePage == 0)
+		return false;
+
+	SIZE_T dwAlloc = (SIZE_T)((m_dwFileSize + dwLargePage - 1) / dwLargePage * dwLargePage);
+	char *pData = (char *)VirtualAlloc(NULL, dwAlloc, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	if (pData == NULL)
+		return false;
+
+	//	Read the file
+
+	DWORDLONG dwPos = 0;
+	while (dwPos < m_dwFileSize)
+		{
+		DWORD dwToRead = (DWORD)Min(m_dwFileSize - dwPos, (DWORDLONG)READ_CHUNK_SIZE);
+		DWORD dwRead;
+		if (!::ReadFile(m_hFile, pData + dwPos, dwToRead, &dwRead, NULL) || dwRead != dwToRead)
+			{
+			VirtualFree(pData, 0, MEM_RELEASE);
+			return false;
+			}
+
+		dwPos += dwToRead;
+		}
+
+	m_pView = pData;
+	m_bLargePages = true;
+	return true;
+	}
+
+char *CMappedFileBlock::MapWindow (DWORDLONG dwOffset, DWORDLONG dwLength, char **retpView)
+
+//	MapWindow
+//
+//	Maps a view that covers the given range. Views must start on an
+//	allocation-granularity boundary, so we return the view base (which the
+//	caller must unmap) and a pointer to dwOffset inside it.
+
+	{
+	DWORDLONG dwBase = dwOffset - (dwOffset % g_dwAllocGranularity);
+	DWORDLONG dwViewLen = dwLength + (dwOffset - dwBase);
+
+	if (dwViewLen > MAX_SINGLE_VIEW || dwBase + dwViewLen > m_dwFileSize)
+		return NULL;
+
+	char *pView = (char *)MapViewOfFile(m_hFileMap,
+			FILE_MAP_READ,
+			(DWORD)(dwBase >> 32),
+			(DWORD)dwBase,
+			(SIZE_T)dwViewLen);
+	if (pView == NULL)
+		return NULL;
+
+	*retpView = pView;
+	return pView + (DWORD)(dwOffset - dwBase);
+	}
+
+ALERROR CMappedFileBlock::Open (void)
+
+//	Open
+//
+//	Opens the file and maps it.
+
+	{
+	if (m_hFile != INVALID_HANDLE_VALUE)
+		return NOERROR;
+
+	InitSystemInfo();
+
+	//	The scan hints only take effect when the file is opened
+
+	DWORD dwAttribs = FILE_ATTRIBUTE_NORMAL;
+	if (m_dwFlags & FLAG_SEQUENTIAL)
+		dwAttribs |= FILE_FLAG_SEQUENTIAL_SCAN;
+	else if (m_dwFlags & FLAG_RANDOM)
+		dwAttribs |= FILE_FLAG_RANDOM_ACCESS;
+
+	m_hFile = CreateFile(m_sFilename.GetASCIIZPointer(),
+			GENERIC_READ,
+			FILE_SHARE_READ,
+			NULL,
+			OPEN_EXISTING,
+			dwAttribs,
+			NULL);
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		{
+		switch (::GetLastError())
+			{
+			case ERROR_FILE_NOT_FOUND:
+			case ERROR_PATH_NOT_FOUND:
+				return ERR_NOTFOUND;
+
+			default:
+				return ERR_FAIL;
+			}
+		}
+
+	LARGE_INTEGER FileSize;
+	if (!::GetFileSizeEx(m_hFile, &FileSize))
+		{
+		Close();
+		return ERR_FAIL;
+		}
+
+	m_dwFileSize = (DWORDLONG)FileSize.QuadPart;
+
+	//	Empty files cannot be mapped; we leave the block open with no data.
+
+	if (m_dwFileSize == 0)
+		return NOERROR;
+
+	//	Try large pages first, if requested
+
+	if ((m_dwFlags & FLAG_LARGE_PAGES)
+			&& !(m_dwFlags & FLAG_WINDOWED)
+			&& m_dwFileSize <= MAX_SINGLE_VIEW
+			&& LoadLargePages())
+		return NOERROR;
+
+	//	Map the file
+
+	m_hFileMap = CreateFileMapping(m_hFile,
+			NULL,
+			PAGE_READONLY,
+			(DWORD)(m_dwFileSize >> 32),
+			(DWORD)m_dwFileSize,
+			NULL);
+	if (m_hFileMap == NULL)
+		{
+		Close();
+		return ERR_FAIL;
+		}
+
+	//	If the whole file fits, map a single view. Otherwise (or if the caller
+	//	wants to limit how much is mapped) we map windows on demand.
+
+	if (m_dwFileSize <= MAX_SINGLE_VIEW && !(m_dwFlags & FLAG_WINDOWED))
+		{
+		m_pView = (char *)MapViewOfFile(m_hFileMap, FILE_MAP_READ, 0, 0, (SIZE_T)m_dwFileSize);
+		if (m_pView == NULL)
+			{
+			Close();
+			return ERR_FAIL;
+			}
+		}
+
+	return NOERROR;
+	}
+
+void CMappedFileBlock::SetAccessHint (EAccessHints iHint, DWORDLONG dwOffset, DWORDLONG dwLength)
+
+//	SetAccessHint
+//
+//	Tells the OS how we are going to read. Before Open, sequential and random
+//	select the cache mode for the file handle. After Open, sequential and
+//	will-need ask the memory manager to start paging in the range (when the
+//	OS supports it). Random has no per-range equivalent on Windows, so it is
+//	only useful before Open.
+
+	{
+	//	Before we open, remember the hint
+
+	if (m_hFile == INVALID_HANDLE_VALUE)
+		{
+		switch (iHint)
+			{
+			case accessSequential:
+				m_dwFlags = (m_dwFlags & ~FLAG_RANDOM) | FLAG_SEQUENTIAL;
+				break;
+
+			case accessRandom:
+				m_dwFlags = (m_dwFlags & ~FLAG_SEQUENTIAL) | FLAG_RANDOM;
+				break;
+
+			case accessNormal:
+				m_dwFlags &= ~(FLAG_SEQUENTIAL | FLAG_RANDOM);
+				break;
+			}
+
+		return;
+		}
+
+	if (iHint != accessSequential && iHint != accessWillNeed)
+		return;
+
+	//	Large-page memory is already resident
+
+	if (m_bLargePages || g_pfnPrefetchVirtualMemory == NULL)
+		return;
+
+	//	Figure out the range that we have mapped
+
+	char *pBase;
+	DWORDLONG dwMapPos;
+	DWORDLONG dwMapLen;
+	if (m_pView)
+		{
+		pBase = m_pView;
+		dwMapPos = 0;
+		dwMapLen = m_dwFileSize;
+		}
+	else if (m_pWindow)
+		{
+		pBase = m_pWindow;
+		dwMapPos = m_dwWindowPos;
+		dwMapLen = m_dwWindowLen;
+		}
+	else
+		return;
+
+	if (dwLength == 0 || dwLength > m_dwFileSize - Min(dwOffset, m_dwFileSize))
+		dwLength = m_dwFileSize - Min(dwOffset, m_dwFileSize);
+
+	DWORDLONG dwStart = Max(dwOffset, dwMapPos);
+	DWORDLONG dwEnd = Min(dwOffset + dwLength, dwMapPos + dwMapLen);
+	if (dwStart >= dwEnd)
+		return;
+
+	SPrefetchRange Range;
+	Range.pAddress = pBase + (SIZE_T)(dwStart - dwMapPos);
+	Range.dwSize = (SIZE_T)(dwEnd - dwStart);
+	g_pfnPrefetchVirtualMemory(GetCurrentProcess(), 1, &Range, 0);
+	}
+
+//	Helpers --------------------------------------------------------------------
+
+void InitSystemInfo (void)
+
+//	InitSystemInfo
+//
+//	Initializes globals. This is idempotent, so racing threads are harmless.
+
+	{
+	if (g_iSystemInfoInit)
+		return;
+
+	SYSTEM_INFO Info;
+	::GetSystemInfo(&Info);
+	g_dwAllocGranularity = Info.dwAllocationGranularity;
+
+	HMODULE hKernel32 = ::GetModuleHandle("kernel32.dll");
+	if (hKernel32)
+		{
+		g_pfnPrefetchVirtualMemory = (PREFETCHVIRTUALMEMORYPROC)::GetProcAddress(hKernel32, "PrefetchVirtualMemory");
+		g_pfnGetLargePageMinimum = (GETLARGEPAGEMINIMUMPROC)::GetProcAddress(hKernel32, "GetLargePageMinimum");
+		}
+
+	InterlockedExchange(&g_iSystemInfoInit, 1);
+	}
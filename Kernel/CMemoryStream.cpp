@@ -263,3 +263,26 @@ ALERROR IWriteStream::WriteChar (char chChar, int iLength)
 
 	return NOERROR;
 	}
+
+ALERROR IWriteStream::WriteVarint (DWORDLONG dwValue)
+
+//	WriteVarint
+//
+//	Writes an unsigned integer 7 bits at a time, low bits first. The high bit
+//	is set on every byte but the last (so values below 128 take one byte).
+//	See CBufferedReadStream::ReadVarint.
+
+	{
+	BYTE Buffer[10];
+	int iLength = 0;
+
+	while (dwValue >= 0x80)
+		{
+		Buffer[iLength++] = (BYTE)(dwValue | 0x80);
+		dwValue >>= 7;
+		}
+
+	Buffer[iLength++] = (BYTE)dwValue;
+
+	return Write((char *)Buffer, iLength);
+	}
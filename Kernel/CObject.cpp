@@ -845,7 +845,7 @@ ALERROR CObject::Flatten (CObject *pObject, CString *retsData)
 
 	{
 	ALERROR error;
-	CMemoryWriteStream Stream(10000000);
+	CSegmentedWriteStream Stream;
 	CArchiver Archiver(&Stream);
 
 	if (error = Archiver.BeginArchive())
@@ -859,7 +859,7 @@ ALERROR CObject::Flatten (CObject *pObject, CString *retsData)
 
 	//	Store as a string
 
-	*retsData = CString(Stream.GetPointer(), Stream.GetLength());
+	*retsData = Stream.TakeAsString();
 
 	return NOERROR;
 	}
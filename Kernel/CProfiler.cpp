@@ -0,0 +1,452 @@
+//	CProfiler.cpp
+//
+//	CProfiler class
+//
+//	Each thread that records a zone gets its own ring buffer. Only the owning
+//	thread writes to it, so recording is just a few stores. Buffers are never
+//	freed (they stay on the global list so that we can dump zones from
+//	threads that have exited). Dumping while other threads are recording is
+//	allowed, but zones being written at that moment may be garbled.
+
+#include "Kernel.h"
+
+const int ZONES_PER_THREAD =			8192;	//	Must be a power of 2
+
+const DWORD BINARY_SIGNATURE =			0x464f5250;	//	'PROF'
+const DWORD BINARY_VERSION =			1;
+
+struct SThreadZones
+	{
+	SThreadZones *pNext;
+	DWORD dwThreadID;
+	volatile LONG iCount;						//	Total zones recorded
+	CProfiler::SZone Zones[ZONES_PER_THREAD];
+	};
+
+static DWORD g_dwProfilerTLS = TLS_OUT_OF_INDEXES;
+static CCriticalSection g_csProfiler;
+static SThreadZones *volatile g_pThreads = NULL;
+static volatile bool g_bEnabled = true;
+
+static int FindName (TArray<const char *> &Names, const char *pszName);
+static SThreadZones *GetThreadZones (void);
+static ALERROR WriteDecimal (IWriteStream &Stream, DWORDLONG dwTicks, DWORDLONG dwFrequency);
+static ALERROR WriteInteger (IWriteStream &Stream, DWORDLONG dwValue, const char *pszSuffix = NULL, int iSuffixLen = 0);
+static ALERROR WriteJSONString (IWriteStream &Stream, const char *pszString);
+
+void CProfiler::AddZone (const char *pszName, DWORDLONG dwStart, DWORDLONG dwEnd)
+
+//	AddZone
+//
+//	Records a zone for the current thread.
+
+	{
+	if (!g_bEnabled)
+		return;
+
+	SThreadZones *pThread = GetThreadZones();
+	if (pThread == NULL)
+		return;
+
+	LONG iPos = pThread->iCount;
+	SZone &Zone = pThread->Zones[iPos & (ZONES_PER_THREAD - 1)];
+	Zone.pszName = pszName;
+	Zone.dwStart = dwStart;
+	Zone.dwEnd = dwEnd;
+
+	//	Publish (volatile store has release semantics)
+
+	pThread->iCount = iPos + 1;
+	}
+
+bool CProfiler::IsEnabled (void)
+
+//	IsEnabled
+//
+//	Returns TRUE if we are recording zones.
+
+	{
+	return g_bEnabled;
+	}
+
+void CProfiler::Reset (void)
+
+//	Reset
+//
+//	Discards all recorded zones.
+
+	{
+	CSmartLock Lock(g_csProfiler);
+
+	SThreadZones *pThread = g_pThreads;
+	while (pThread)
+		{
+		pThread->iCount = 0;
+		pThread = pThread->pNext;
+		}
+	}
+
+void CProfiler::SetEnabled (bool bEnabled)
+
+//	SetEnabled
+//
+//	Starts or stops recording (zones are recorded by default).
+
+	{
+	g_bEnabled = bEnabled;
+	}
+
+ALERROR CProfiler::WriteBinary (IWriteStream &Stream)
+
+//	WriteBinary
+//
+//	Writes all zones in a compact binary format:
+//
+//	DWORD		BINARY_SIGNATURE
+//	DWORD		BINARY_VERSION
+//	DWORDLONG	Timestamp frequency (ticks per second)
+//	DWORD		Count of names
+//		DWORD		Length
+//		char[]		Name (no terminator)
+//	DWORD		Count of threads
+//		DWORD		Thread ID
+//		DWORD		Count of zones
+//			DWORD		Name index
+//			DWORDLONG	Start
+//			DWORDLONG	End
+
+	{
+	ALERROR error;
+	int i;
+
+	CSmartLock Lock(g_csProfiler);
+
+	LARGE_INTEGER Frequency;
+	::QueryPerformanceFrequency(&Frequency);
+
+	//	Collect names (there are usually only a few dozen).
+
+	TArray<const char *> Names;
+	int iThreadCount = 0;
+	SThreadZones *pThread;
+	for (pThread = g_pThreads; pThread; pThread = pThread->pNext)
+		{
+		int iEnd = pThread->iCount;
+		for (i = Max(0, iEnd - ZONES_PER_THREAD); i < iEnd; i++)
+			FindName(Names, pThread->Zones[i & (ZONES_PER_THREAD - 1)].pszName);
+
+		iThreadCount++;
+		}
+
+	//	Header
+
+	if (error = Stream.Write(BINARY_SIGNATURE))
+		return error;
+
+	if (error = Stream.Write(BINARY_VERSION))
+		return error;
+
+	if (error = Stream.Write((char *)&Frequency.QuadPart, sizeof(DWORDLONG)))
+		return error;
+
+	//	Names
+
+	if (error = Stream.Write(Names.GetCount()))
+		return error;
+
+	for (i = 0; i < Names.GetCount(); i++)
+		{
+		int iLen = lstrlen(Names[i]);
+		if (error = Stream.Write(iLen))
+			return error;
+
+		if (error = Stream.Write((char *)Names[i], iLen))
+			return error;
+		}
+
+	//	Zones
+
+	if (error = Stream.Write(iThreadCount))
+		return error;
+
+	for (pThread = g_pThreads; pThread; pThread = pThread->pNext)
+		{
+		int iEnd = pThread->iCount;
+		int iStart = Max(0, iEnd - ZONES_PER_THREAD);
+
+		if (error = Stream.Write(pThread->dwThreadID))
+			return error;
+
+		if (error = Stream.Write(iEnd - iStart))
+			return error;
+
+		for (i = iStart; i < iEnd; i++)
+			{
+			const SZone &Zone = pThread->Zones[i & (ZONES_PER_THREAD - 1)];
+
+			if (error = Stream.Write(FindName(Names, Zone.pszName)))
+				return error;
+
+			if (error = Stream.Write((char *)&Zone.dwStart, sizeof(DWORDLONG)))
+				return error;
+
+			if (error = Stream.Write((char *)&Zone.dwEnd, sizeof(DWORDLONG)))
+				return error;
+			}
+		}
+
+	return NOERROR;
+	}
+
+ALERROR CProfiler::WriteChromeTrace (IWriteStream &Stream)
+
+//	WriteChromeTrace
+//
+//	Writes all zones as a Chrome trace (JSON). Each zone is a complete ("X")
+//	event. Times are in microseconds from the earliest recorded zone.
+
+	{
+	ALERROR error;
+	int i;
+
+	CSmartLock Lock(g_csProfiler);
+
+	LARGE_INTEGER Frequency;
+	::QueryPerformanceFrequency(&Frequency);
+
+	//	Find the base time
+
+	DWORDLONG dwBase = 0;
+	bool bFirst = true;
+	SThreadZones *pThread;
+	for (pThread = g_pThreads; pThread; pThread = pThread->pNext)
+		{
+		int iEnd = pThread->iCount;
+		for (i = Max(0, iEnd - ZONES_PER_THREAD); i < iEnd; i++)
+			{
+			const SZone &Zone = pThread->Zones[i & (ZONES_PER_THREAD - 1)];
+			if (bFirst || Zone.dwStart < dwBase)
+				{
+				dwBase = Zone.dwStart;
+				bFirst = false;
+				}
+			}
+		}
+
+	//	Write
+
+	if (error = Stream.Write(CONSTLIT("{\"traceEvents\":[\n")))
+		return error;
+
+	bFirst = true;
+	DWORD dwProcessID = ::GetCurrentProcessId();
+	for (pThread = g_pThreads; pThread; pThread = pThread->pNext)
+		{
+		int iEnd = pThread->iCount;
+		for (i = Max(0, iEnd - ZONES_PER_THREAD); i < iEnd; i++)
+			{
+			const SZone &Zone = pThread->Zones[i & (ZONES_PER_THREAD - 1)];
+
+			if (!bFirst)
+				{
+				if (error = Stream.Write(CONSTLIT(",\n")))
+					return error;
+				}
+			bFirst = false;
+
+			if (error = Stream.Write(CONSTLIT("{\"name\":")))
+				return error;
+
+			if (error = WriteJSONString(Stream, Zone.pszName))
+				return error;
+
+			if (error = Stream.Write(CONSTLIT(",\"ph\":\"X\",\"pid\":")))
+				return error;
+
+			if (error = WriteInteger(Stream, dwProcessID))
+				return error;
+
+			if (error = Stream.Write(CONSTLIT(",\"tid\":")))
+				return error;
+
+			if (error = WriteInteger(Stream, pThread->dwThreadID))
+				return error;
+
+			if (error = Stream.Write(CONSTLIT(",\"ts\":")))
+				return error;
+
+			if (error = WriteDecimal(Stream, Zone.dwStart - dwBase, Frequency.QuadPart))
+				return error;
+
+			if (error = Stream.Write(CONSTLIT(",\"dur\":")))
+				return error;
+
+			if (error = WriteDecimal(Stream, (Zone.dwEnd >= Zone.dwStart ? Zone.dwEnd - Zone.dwStart : 0), Frequency.QuadPart))
+				return error;
+
+			if (error = Stream.Write('}'))
+				return error;
+			}
+		}
+
+	if (error = Stream.Write(CONSTLIT("\n]}\n")))
+		return error;
+
+	return NOERROR;
+	}
+
+//	Helpers --------------------------------------------------------------------
+
+int FindName (TArray<const char *> &Names, const char *pszName)
+
+//	FindName
+//
+//	Returns the index of the name, adding it if necessary. Names are literals,
+//	so we compare pointers.
+
+	{
+	int i;
+
+	for (i = Names.GetCount() - 1; i >= 0; i--)
+		if (Names[i] == pszName)
+			return i;
+
+	Names.Insert(pszName);
+	return Names.GetCount() - 1;
+	}
+
+SThreadZones *GetThreadZones (void)
+
+//	GetThreadZones
+//
+//	Returns the zone buffer for the current thread (allocating it, if
+//	necessary). Returns NULL if we're out of resources.
+
+	{
+	if (g_dwProfilerTLS == TLS_OUT_OF_INDEXES)
+		{
+		DWORD dwTLS = ::TlsAlloc();
+		if (dwTLS == TLS_OUT_OF_INDEXES)
+			return NULL;
+
+		if (::InterlockedCompareExchange((LONG volatile *)&g_dwProfilerTLS, (LONG)dwTLS, (LONG)TLS_OUT_OF_INDEXES) != (LONG)TLS_OUT_OF_INDEXES)
+			::TlsFree(dwTLS);
+		}
+
+	SThreadZones *pThread = (SThreadZones *)::TlsGetValue(g_dwProfilerTLS);
+	if (pThread)
+		return pThread;
+
+	pThread = (SThreadZones *)::HeapAlloc(::GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SThreadZones));
+	if (pThread == NULL)
+		return NULL;
+
+	pThread->dwThreadID = ::GetCurrentThreadId();
+	::TlsSetValue(g_dwProfilerTLS, pThread);
+
+	CSmartLock Lock(g_csProfiler);
+	pThread->pNext = g_pThreads;
+	g_pThreads = pThread;
+
+	return pThread;
+	}
+
+ALERROR WriteDecimal (IWriteStream &Stream, DWORDLONG dwTicks, DWORDLONG dwFrequency)
+
+//	WriteDecimal
+//
+//	Converts ticks to microseconds and writes them with three decimals (i.e.,
+//	nanosecond resolution).
+
+	{
+	//	Split so that we don't overflow for long sessions
+
+	DWORDLONG dwNS = (dwTicks / dwFrequency) * 1000000000 + ((dwTicks % dwFrequency) * 1000000000) / dwFrequency;
+	DWORD dwFraction = (DWORD)(dwNS % 1000);
+
+	char szFraction[4];
+	szFraction[0] = '.';
+	szFraction[1] = (char)('0' + dwFraction / 100);
+	szFraction[2] = (char)('0' + (dwFraction / 10) % 10);
+	szFraction[3] = (char)('0' + dwFraction % 10);
+
+	return WriteInteger(Stream, dwNS / 1000, szFraction, sizeof(szFraction));
+	}
+
+ALERROR WriteInteger (IWriteStream &Stream, DWORDLONG dwValue, const char *pszSuffix, int iSuffixLen)
+
+//	WriteInteger
+//
+//	Writes an unsigned integer in decimal, followed by an optional suffix.
+
+	{
+	char szBuffer[32];
+	char *pEnd = szBuffer + sizeof(szBuffer) - iSuffixLen;
+	char *pPos = pEnd;
+
+	ASSERT(iSuffixLen <= 8);
+	if (iSuffixLen)
+		utlMemCopy((char *)pszSuffix, pEnd, iSuffixLen);
+
+	do
+		{
+		*--pPos = (char)('0' + (int)(dwValue % 10));
+		dwValue /= 10;
+		}
+	while (dwValue);
+
+	return Stream.Write(pPos, (int)(pEnd - pPos) + iSuffixLen);
+	}
+
+ALERROR WriteJSONString (IWriteStream &Stream, const char *pszString)
+
+//	WriteJSONString
+//
+//	Writes a quoted JSON string.
+
+	{
+	ALERROR error;
+
+	if (error = Stream.Write('"'))
+		return error;
+
+	const char *pPos = pszString;
+	const char *pStart = pPos;
+	while (*pPos)
+		{
+		if (*pPos == '"' || *pPos == '\\' || (BYTE)*pPos < ' ')
+			{
+			if (pPos > pStart)
+				{
+				if (error = Stream.Write((char *)pStart, (int)(pPos - pStart)))
+					return error;
+				}
+
+			if (*pPos == '"' || *pPos == '\\')
+				{
+				if (error = Stream.Write('\\'))
+					return error;
+
+				if (error = Stream.Write(*pPos))
+					return error;
+				}
+			else
+				{
+				if (error = Stream.Write(' '))
+					return error;
+				}
+
+			pStart = pPos + 1;
+			}
+
+		pPos++;
+		}
+
+	if (pPos > pStart)
+		{
+		if (error = Stream.Write((char *)pStart, (int)(pPos - pStart)))
+			return error;
+		}
+
+	return Stream.Write('"');
+	}
@@ -0,0 +1,393 @@
+//	CRandomStream.cpp
+//
+//	CRandomStream class
+//
+//	Counter-based random numbers using Philox4x32-10. See:
+//	John K. Salmon, et al. Parallel Random Numbers: As Easy as 1, 2, 3.
+//	SC11 (2011).
+//
+//	If the CPU has SSE2, the batch functions generate four blocks at a time
+//	(one counter per 32-bit lane). Both paths produce the same values.
+
+#include "Kernel.h"
+#include <math.h>
+
+#include <immintrin.h>
+
+const DWORD PHILOX_M0 =					0xD2511F53;
+const DWORD PHILOX_M1 =					0xCD9E8D57;
+const DWORD PHILOX_W0 =					0x9E3779B9;
+const DWORD PHILOX_W1 =					0xBB67AE85;
+const int PHILOX_ROUNDS =				10;
+const int SSE2_BLOCKS =					4;		//	Blocks per GenerateBlocksSSE2 call
+
+const int BATCH_SIZE =					256;	//	DWORDs converted per pass by Fill*
+
+const double TWO_PI =					6.28318530717958647692;
+const double INV_2_32 =					1.0 / 4294967296.0;
+
+void CRandomStream::FillBuffer (void)
+
+//	FillBuffer
+//
+//	Generates the next block into the buffer.
+
+	{
+	GenerateBlock(m_dwKey, m_dwCounter / BLOCK_SIZE, m_Buffer);
+	m_dwCounter += BLOCK_SIZE;
+	m_iBufferPos = 0;
+	}
+
+void CRandomStream::FillGaussian (double *pDest, int iCount, double rMean, double rStdDev)
+
+//	FillGaussian
+//
+//	Fills the array with normally distributed values. We use the basic form of
+//	Box-Muller (no rejection), so every pair of values costs exactly two
+//	DWORDs and the inner loop has no data-dependent branches.
+
+	{
+	int i;
+	DWORD Raw[BATCH_SIZE];
+
+	int iPairsLeft = iCount / 2;
+	while (iPairsLeft > 0)
+		{
+		int iPairs = Min(iPairsLeft, BATCH_SIZE / 2);
+		FillRandom(Raw, iPairs * 2);
+
+		for (i = 0; i < iPairs; i++)
+			{
+			//	u1 is in (0, 1] so that the log is always defined.
+
+			double rRadius = rStdDev * sqrt(-2.0 * log((Raw[2 * i] + 1.0) * INV_2_32));
+			double rAngle = TWO_PI * (Raw[2 * i + 1] * INV_2_32);
+
+			pDest[2 * i] = rMean + rRadius * cos(rAngle);
+			pDest[2 * i + 1] = rMean + rRadius * sin(rAngle);
+			}
+
+		pDest += iPairs * 2;
+		iPairsLeft -= iPairs;
+		}
+
+	if (iCount % 2)
+		*pDest = rMean + rStdDev * GetRandomGaussian();
+	}
+
+void CRandomStream::FillRandom (DWORD *pDest, int iCount)
+
+//	FillRandom
+//
+//	Fills the array with random DWORDs. The result is the same as calling
+//	GetRandom iCount times, but whole blocks are generated straight into the
+//	destination.
+
+	{
+	int i;
+
+	//	Use up whatever is left in the buffer
+
+	while (iCount > 0 && m_iBufferPos < BLOCK_SIZE)
+		{
+		*pDest++ = m_Buffer[m_iBufferPos++];
+		iCount--;
+		}
+
+	//	Whole blocks, four at a time if we can
+
+	DWORDLONG dwBlock = m_dwCounter / BLOCK_SIZE;
+	int iBlocks = iCount / BLOCK_SIZE;
+	i = 0;
+
+	if (::sysGetCPUFeatures() & CPU_FEATURE_SSE2)
+		{
+		for (; i + SSE2_BLOCKS <= iBlocks; i += SSE2_BLOCKS)
+			{
+			GenerateBlocksSSE2(m_dwKey, dwBlock + i, pDest);
+			pDest += SSE2_BLOCKS * BLOCK_SIZE;
+			}
+		}
+
+	for (; i < iBlocks; i++)
+		{
+		GenerateBlock(m_dwKey, dwBlock + i, pDest);
+		pDest += BLOCK_SIZE;
+		}
+
+	m_dwCounter += (DWORDLONG)iBlocks * BLOCK_SIZE;
+	iCount -= iBlocks * BLOCK_SIZE;
+
+	//	Remainder
+
+	if (iCount > 0)
+		{
+		FillBuffer();
+		while (iCount-- > 0)
+			*pDest++ = m_Buffer[m_iBufferPos++];
+		}
+	}
+
+void CRandomStream::FillUniform (double *pDest, int iCount, double rMin, double rMax)
+
+//	FillUniform
+//
+//	Fills the array with values uniformly distributed in [rMin, rMax).
+
+	{
+	int i;
+	DWORD Raw[BATCH_SIZE];
+	bool bSSE2 = ((::sysGetCPUFeatures() & CPU_FEATURE_SSE2) != 0);
+
+	double rScale = (rMax - rMin) * INV_2_32;
+	while (iCount > 0)
+		{
+		int iBatch = Min(iCount, (int)BATCH_SIZE);
+		FillRandom(Raw, iBatch);
+
+		i = 0;
+
+		//	SSE2 only converts signed ints, so we flip the top bit and add
+		//	2^31 back (exactly) as a double. The result is the same as the
+		//	scalar loop.
+
+		if (bSSE2)
+			{
+			__m128i SignBit = _mm_set1_epi32(0x80000000);
+			__m128d Offset = _mm_set1_pd(2147483648.0);
+			__m128d Scale = _mm_set1_pd(rScale);
+			__m128d Base = _mm_set1_pd(rMin);
+
+			for (; i + 4 <= iBatch; i += 4)
+				{
+				__m128i Value = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&Raw[i]), SignBit);
+				__m128d Lo = _mm_add_pd(_mm_cvtepi32_pd(Value), Offset);
+				__m128d Hi = _mm_add_pd(_mm_cvtepi32_pd(_mm_srli_si128(Value, 8)), Offset);
+
+				_mm_storeu_pd(&pDest[i], _mm_add_pd(Base, _mm_mul_pd(Lo, Scale)));
+				_mm_storeu_pd(&pDest[i + 2], _mm_add_pd(Base, _mm_mul_pd(Hi, Scale)));
+				}
+			}
+
+		for (; i < iBatch; i++)
+			pDest[i] = rMin + Raw[i] * rScale;
+
+		pDest += iBatch;
+		iCount -= iBatch;
+		}
+	}
+
+DWORD CRandomStream::Generate (DWORD dwSeed, DWORD dwStream, DWORDLONG dwCounter)
+
+//	Generate
+//
+//	Returns the DWORD at the given position of the given stream without any
+//	state. This is the same value that GetRandom would return for a stream
+//	positioned at dwCounter.
+
+	{
+	DWORD Key[2] = { dwSeed, dwStream };
+	DWORD Result[BLOCK_SIZE];
+
+	GenerateBlock(Key, dwCounter / BLOCK_SIZE, Result);
+	return Result[dwCounter % BLOCK_SIZE];
+	}
+
+void CRandomStream::GenerateBlock (const DWORD *pKey, DWORDLONG dwBlock, DWORD *retResult)
+
+//	GenerateBlock
+//
+//	Runs Philox4x32-10 on the given block number.
+
+	{
+	int i;
+
+	DWORD c0 = (DWORD)dwBlock;
+	DWORD c1 = (DWORD)(dwBlock >> 32);
+	DWORD c2 = 0;
+	DWORD c3 = 0;
+
+	DWORD k0 = pKey[0];
+	DWORD k1 = pKey[1];
+
+	for (i = 0; i < PHILOX_ROUNDS; i++)
+		{
+		DWORDLONG dwProduct0 = (DWORDLONG)PHILOX_M0 * c0;
+		DWORDLONG dwProduct1 = (DWORDLONG)PHILOX_M1 * c2;
+
+		DWORD dwHi0 = (DWORD)(dwProduct0 >> 32);
+		DWORD dwHi1 = (DWORD)(dwProduct1 >> 32);
+
+		c0 = dwHi1 ^ c1 ^ k0;
+		c1 = (DWORD)dwProduct1;
+		c2 = dwHi0 ^ c3 ^ k1;
+		c3 = (DWORD)dwProduct0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+		}
+
+	retResult[0] = c0;
+	retResult[1] = c1;
+	retResult[2] = c2;
+	retResult[3] = c3;
+	}
+
+void CRandomStream::GenerateBlocksSSE2 (const DWORD *pKey, DWORDLONG dwBlock, DWORD *retResult)
+
+//	GenerateBlocksSSE2
+//
+//	Runs Philox4x32-10 on blocks dwBlock to dwBlock + 3 and stores them in
+//	order (16 DWORDs), the same as four calls to GenerateBlock. Each vector
+//	holds one word of the four blocks. _mm_mul_epu32 only multiplies the
+//	even lanes, so we do the odd lanes with a second multiply.
+
+	{
+	int i;
+
+	__m128i c0 = _mm_set_epi32((int)(DWORD)(dwBlock + 3), (int)(DWORD)(dwBlock + 2), (int)(DWORD)(dwBlock + 1), (int)(DWORD)dwBlock);
+	__m128i c1 = _mm_set_epi32((int)(DWORD)((dwBlock + 3) >> 32), (int)(DWORD)((dwBlock + 2) >> 32), (int)(DWORD)((dwBlock + 1) >> 32), (int)(DWORD)(dwBlock >> 32));
+	__m128i c2 = _mm_setzero_si128();
+	__m128i c3 = _mm_setzero_si128();
+
+	__m128i M0 = _mm_set1_epi32((int)PHILOX_M0);
+	__m128i M1 = _mm_set1_epi32((int)PHILOX_M1);
+	__m128i LoMask = _mm_set_epi32(0, -1, 0, -1);
+	__m128i HiMask = _mm_set_epi32(-1, 0, -1, 0);
+
+	DWORD k0 = pKey[0];
+	DWORD k1 = pKey[1];
+
+	for (i = 0; i < PHILOX_ROUNDS; i++)
+		{
+		//	64-bit products of lanes 0 and 2 (Even) and of lanes 1 and 3 (Odd)
+
+		__m128i Even0 = _mm_mul_epu32(c0, M0);
+		__m128i Odd0 = _mm_mul_epu32(_mm_srli_epi64(c0, 32), M0);
+		__m128i Even1 = _mm_mul_epu32(c2, M1);
+		__m128i Odd1 = _mm_mul_epu32(_mm_srli_epi64(c2, 32), M1);
+
+		__m128i Hi0 = _mm_or_si128(_mm_srli_epi64(Even0, 32), _mm_and_si128(Odd0, HiMask));
+		__m128i Lo0 = _mm_or_si128(_mm_and_si128(Even0, LoMask), _mm_slli_epi64(Odd0, 32));
+		__m128i Hi1 = _mm_or_si128(_mm_srli_epi64(Even1, 32), _mm_and_si128(Odd1, HiMask));
+		__m128i Lo1 = _mm_or_si128(_mm_and_si128(Even1, LoMask), _mm_slli_epi64(Odd1, 32));
+
+		c0 = _mm_xor_si128(_mm_xor_si128(Hi1, c1), _mm_set1_epi32((int)k0));
+		c1 = Lo1;
+		c2 = _mm_xor_si128(_mm_xor_si128(Hi0, c3), _mm_set1_epi32((int)k1));
+		c3 = Lo0;
+
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+		}
+
+	//	Transpose so that each block's four words are together
+
+	__m128i t0 = _mm_unpacklo_epi32(c0, c1);
+	__m128i t1 = _mm_unpacklo_epi32(c2, c3);
+	__m128i t2 = _mm_unpackhi_epi32(c0, c1);
+	__m128i t3 = _mm_unpackhi_epi32(c2, c3);
+
+	_mm_storeu_si128((__m128i *)&retResult[0], _mm_unpacklo_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)&retResult[4], _mm_unpackhi_epi64(t0, t1));
+	_mm_storeu_si128((__m128i *)&retResult[8], _mm_unpacklo_epi64(t2, t3));
+	_mm_storeu_si128((__m128i *)&retResult[12], _mm_unpackhi_epi64(t2, t3));
+	}
+
+DWORD CRandomStream::GetRandom (void)
+
+//	GetRandom
+//
+//	Returns the next 32-bit random value.
+
+	{
+	if (m_iBufferPos == BLOCK_SIZE)
+		FillBuffer();
+
+	return m_Buffer[m_iBufferPos++];
+	}
+
+int CRandomStream::GetRandom (int iFrom, int iTo)
+
+//	GetRandom
+//
+//	Returns a random number between iFrom and iTo (inclusive)
+
+	{
+	DWORD dwRange = (DWORD)Absolute(iTo - iFrom) + 1;
+
+	//	The full 32-bit range wraps to 0
+
+	if (dwRange == 0)
+		return (int)GetRandom();
+
+	//	Scale with a 64-bit multiply (no modulo bias worth mentioning and no
+	//	divide).
+
+	DWORD dwValue = (DWORD)(((DWORDLONG)GetRandom() * dwRange) >> 32);
+	return Min(iFrom, iTo) + (int)dwValue;
+	}
+
+double CRandomStream::GetRandomGaussian (void)
+
+//	GetRandomGaussian
+//
+//	Returns a random number with Gaussian distribution. The mean value is 0.0
+//	and the standard deviation is 1.0.
+
+	{
+	if (m_bHasSpare)
+		{
+		m_bHasSpare = false;
+		return m_rSpare;
+		}
+
+	DWORD dwU1 = GetRandom();
+	DWORD dwU2 = GetRandom();
+
+	double rRadius = sqrt(-2.0 * log((dwU1 + 1.0) * INV_2_32));
+	double rAngle = TWO_PI * (dwU2 * INV_2_32);
+
+	m_rSpare = rRadius * sin(rAngle);
+	m_bHasSpare = true;
+
+	return rRadius * cos(rAngle);
+	}
+
+void CRandomStream::SetCounter (DWORDLONG dwCounter)
+
+//	SetCounter
+//
+//	Positions the stream so that the next value returned is the one at
+//	dwCounter. This is O(1).
+
+	{
+	m_bHasSpare = false;
+
+	DWORD dwOffset = (DWORD)(dwCounter % BLOCK_SIZE);
+	if (dwOffset == 0)
+		{
+		m_dwCounter = dwCounter;
+		m_iBufferPos = BLOCK_SIZE;
+		}
+	else
+		{
+		m_dwCounter = dwCounter - dwOffset;
+		FillBuffer();
+		m_iBufferPos = (int)dwOffset;
+		}
+	}
+
+void CRandomStream::SetSeed (DWORD dwSeed, DWORD dwStream)
+
+//	SetSeed
+//
+//	Selects the stream and rewinds to the beginning.
+
+	{
+	m_dwKey[0] = dwSeed;
+	m_dwKey[1] = dwStream;
+	m_dwCounter = 0;
+	m_iBufferPos = BLOCK_SIZE;
+	m_bHasSpare = false;
+	}
@@ -0,0 +1,217 @@
+//	CSegmentedWriteStream.cpp
+//
+//	CSegmentedWriteStream class
+//
+//	A memory write stream that grows by appending segments, so data that has
+//	been written is never copied. Segments start small (so that short
+//	streams don't waste memory) and double up to the segment size.
+
+#include "Kernel.h"
+
+CSegmentedWriteStream::CSegmentedWriteStream (int iSegmentSize) :
+		m_iSegmentSize(Max((int)MIN_SEGMENT_SIZE, iSegmentSize)),
+		m_dwLength(0),
+		m_pPos(NULL),
+		m_pPosEnd(NULL)
+
+//	CSegmentedWriteStream constructor
+
+	{
+	}
+
+void CSegmentedWriteStream::AddSegment (int iMinSize)
+
+//	AddSegment
+//
+//	Adds a new segment of at least the given size. The previous segment must
+//	be full.
+
+	{
+	ASSERT(m_pPos == m_pPosEnd);
+
+	//	Each segment is as big as everything before it, up to the segment size
+	//	(unless we need more for a single write).
+
+	int iSize = (int)Min((DWORDLONG)m_iSegmentSize, Max((DWORDLONG)MIN_SEGMENT_SIZE, m_dwLength));
+	iSize = Max(iSize, iMinSize);
+
+	CString *pSegment = m_Segments.Insert();
+	m_pPos = pSegment->GetWritePointer(iSize);
+	m_pPosEnd = m_pPos + iSize;
+	}
+
+void CSegmentedWriteStream::CopyTo (char *pDest) const
+
+//	CopyTo
+//
+//	Copies the whole stream to the given buffer, which must be at least
+//	GetLength64() bytes.
+
+	{
+	int i;
+
+	for (i = 0; i < m_Segments.GetCount(); i++)
+		{
+		DWORD dwLength = GetSegmentLength(i);
+		utlMemCopy(m_Segments[i].GetPointer(), pDest, dwLength);
+		pDest += dwLength;
+		}
+	}
+
+ALERROR CSegmentedWriteStream::Create (void)
+
+//	Create
+//
+//	Discards anything written so far.
+
+	{
+	m_Segments.DeleteAll();
+	m_dwLength = 0;
+	m_pPos = NULL;
+	m_pPosEnd = NULL;
+
+	return NOERROR;
+	}
+
+DWORD CSegmentedWriteStream::GetSegmentLength (int iIndex) const
+
+//	GetSegmentLength
+//
+//	Returns the number of bytes written to the given segment.
+
+	{
+	if (iIndex == m_Segments.GetCount() - 1)
+		return (DWORD)(m_pPos - m_Segments[iIndex].GetPointer());
+	else
+		return (DWORD)m_Segments[iIndex].GetLength();
+	}
+
+void CSegmentedWriteStream::GetSegments (TArray<SSegment> *retSegments) const
+
+//	GetSegments
+//
+//	Returns a list of (pointer, length) pairs covering the stream, in order.
+//	The pointers are valid until the next call that changes the stream.
+
+	{
+	int i;
+
+	retSegments->DeleteAll();
+	retSegments->InsertEmpty(m_Segments.GetCount());
+
+	for (i = 0; i < m_Segments.GetCount(); i++)
+		{
+		SSegment &Segment = retSegments->GetAt(i);
+		Segment.pData = m_Segments[i].GetPointer();
+		Segment.dwLength = GetSegmentLength(i);
+		}
+	}
+
+CString CSegmentedWriteStream::TakeAsString (void)
+
+//	TakeAsString
+//
+//	Returns the stream as a string and resets the stream. If everything fits
+//	in a single segment, the string takes over the segment without copying
+//	(unless the data is so short that a copy is cheaper than holding on to
+//	a mostly empty segment).
+
+	{
+	CString sResult;
+
+	if (m_Segments.GetCount() == 1 && m_dwLength < SMALL_STRING_SIZE)
+		sResult = CString(m_Segments[0].GetPointer(), (int)m_dwLength);
+	else if (m_Segments.GetCount() == 1)
+		{
+		m_Segments[0].Truncate((int)GetSegmentLength(0));
+		sResult = m_Segments[0];
+		}
+	else if (m_Segments.GetCount() > 1)
+		{
+		if (m_dwLength > MAXLONG)
+			throw CException(ERR_MEMORY);
+
+		CopyTo(sResult.GetWritePointer((int)m_dwLength));
+		}
+
+	Create();
+	return sResult;
+	}
+
+ALERROR CSegmentedWriteStream::Write (char *pData, int iLength, int *retiBytesWritten)
+
+//	Write
+//
+//	Writes the given bytes to the stream. If this call returns NOERROR, it is
+//	guaranteed that the requested number of bytes were written.
+
+	{
+	ASSERT(iLength >= 0);
+
+	if (retiBytesWritten)
+		*retiBytesWritten = iLength;
+
+	m_dwLength += iLength;
+
+	//	Fill up the current segment
+
+	int iAvail = (int)(m_pPosEnd - m_pPos);
+	if (iLength <= iAvail)
+		{
+		utlMemCopy(pData, m_pPos, iLength);
+		m_pPos += iLength;
+		return NOERROR;
+		}
+
+	utlMemCopy(pData, m_pPos, iAvail);
+	m_pPos += iAvail;
+	pData += iAvail;
+	iLength -= iAvail;
+
+	//	The rest goes in a new segment
+
+	AddSegment(iLength);
+	utlMemCopy(pData, m_pPos, iLength);
+	m_pPos += iLength;
+
+	return NOERROR;
+	}
+
+ALERROR CSegmentedWriteStream::WriteToFile (HANDLE hFile) const
+
+//	WriteToFile
+//
+//	Writes the stream to the given file, one segment at a time.
+
+	{
+	int i;
+
+	for (i = 0; i < m_Segments.GetCount(); i++)
+		{
+		DWORD dwLength = GetSegmentLength(i);
+		DWORD dwWritten;
+
+		if (!::WriteFile(hFile, m_Segments[i].GetPointer(), dwLength, &dwWritten, NULL)
+				|| dwWritten != dwLength)
+			return ERR_FAIL;
+		}
+
+	return NOERROR;
+	}
+
+ALERROR CSegmentedWriteStream::WriteToStream (IWriteStream *pStream) const
+
+//	WriteToStream
+//
+//	Writes the stream to another stream, one segment at a time.
+
+	{
+	ALERROR error;
+	int i;
+
+	for (i = 0; i < m_Segments.GetCount(); i++)
+		if (error = pStream->Write(m_Segments[i].GetPointer(), (int)GetSegmentLength(i)))
+			return error;
+
+	return NOERROR;
+	}
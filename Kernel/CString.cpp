@@ -10,8 +10,36 @@
 #define STORE_SIZE_INCREMENT				256
 #define STORE_ALLOC_MAX						(64 * 1024 * 1024)
 
+//	Each thread keeps a magazine of free headers and of small character
+//	buffers so that most allocations don't need g_csStore. Headers and buffers
+//	may be freed on any thread; they just end up in that thread's magazine.
+
+#define STORE_MAGAZINE_MAX					64
+#define STORE_MAGAZINE_BATCH				32
+#define CHARS_CLASS_COUNT					5		//	16, 32, 64, 128, 256 bytes
+#define CHARS_CLASS_MIN_SHIFT				4
+#define CHARS_CLASS_MAX_SIZE				(1 << (CHARS_CLASS_MIN_SHIFT + CHARS_CLASS_COUNT - 1))
+#define CHARS_MAGAZINE_MAX					32
+
+struct CString::SThreadCache
+	{
+	PSTORESTRUCT pFreeStores;				//	Free headers (linked through pString)
+	int iFreeStores;
+	char *pFreeChars[CHARS_CLASS_COUNT];	//	Free buffers by size class (linked through first bytes)
+	int iFreeChars[CHARS_CLASS_COUNT];
+
+	DWORDLONG dwStoreAllocs;
+	DWORDLONG dwStoreFrees;
+	DWORDLONG dwCharAllocs;
+	DWORDLONG dwCharCacheHits;
+	DWORDLONG dwGlobalRefills;
+
+	SThreadCache *pPrev;					//	All live caches, for stats
+	SThreadCache *pNext;
+	};
+
 static DATADESCSTRUCT g_DataDesc[] =
-	{	{ DATADESC_OPCODE_REFERENCE,	1,	0 },		//	m_pStore
+	{	{ DATADESC_OPCODE_INT,	6,	0 },				//	m_pStore/m_Inline (INLINE_SIZE bytes)
 		{ DATADESC_OPCODE_STOP,	0,	0 } };
 static CObjectClass<CString>g_Class(OBJID_CSTRING, g_DataDesc);
 
@@ -21,8 +49,16 @@ CString::PSTORESTRUCT CString::g_pFreeStore;
 CRITICAL_SECTION g_csStore;
 const CString NULL_STR;
 
+CString::SThreadCache *CString::g_pThreadCaches = NULL;
+#ifdef STRING_SINGLE_THREADED
+CString::SThreadCache *CString::g_pSingleThreadCache = NULL;
+#else
+static DWORD g_dwStoreTLS = TLS_OUT_OF_INDEXES;
+#endif
+static CString::SStorageStats g_RetiredStats;		//	Counters from threads that have exited
+
 #ifdef DEBUG_STRING_LEAKS
-int g_iStoreCount = 0;
+volatile LONG g_iStoreCount = 0;
 #endif
 
 char g_LowerCaseAbsoluteTable[256];
@@ -56,7 +92,7 @@ static int TITLE_CAP_EXCEPTIONS_SHORT_COUNT = sizeof(TITLE_CAP_EXCEPTIONS_SHORT)
 
 CString::CString (void) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString constructor
 
@@ -65,7 +101,7 @@ CString::CString (void) :
 
 CString::CString (const char *pString) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString constructor
 
@@ -76,7 +112,7 @@ CString::CString (const char *pString) :
 
 CString::CString (char *pString, int iLength) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString constructor
 
@@ -87,7 +123,7 @@ CString::CString (char *pString, int iLength) :
 
 CString::CString (CharacterSets iCharSet, const char *pString) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString constructor
 
@@ -134,8 +170,8 @@ CString::CString (CharacterSets iCharSet, const char *pString) :
 
 			//	Now convert back to system code page
 
-			Size(iUnicodeLen);
-			iResult = ::WideCharToMultiByte(CP_ACP, 0, szUnicode, iUnicodeLen, m_pStore->pString, iUnicodeLen, NULL, NULL);
+			Size(iUnicodeLen + 1);
+			iResult = ::WideCharToMultiByte(CP_ACP, 0, szUnicode, iUnicodeLen, GetWriteBuffer(), iUnicodeLen, NULL, NULL);
 
 			//	Deal with failure
 
@@ -154,8 +190,8 @@ CString::CString (CharacterSets iCharSet, const char *pString) :
 						return;
 						}
 
-					Size(iSystemLen);
-					iResult = ::WideCharToMultiByte(CP_ACP, 0, szUnicode, iUnicodeLen, m_pStore->pString, iSystemLen, NULL, NULL);
+					Size(iSystemLen + 1);
+					iResult = ::WideCharToMultiByte(CP_ACP, 0, szUnicode, iUnicodeLen, GetWriteBuffer(), iSystemLen, NULL, NULL);
 					}
 				else
 					{
@@ -166,8 +202,7 @@ CString::CString (CharacterSets iCharSet, const char *pString) :
 				}
 
 			delete [] szUnicode;
-			m_pStore->iLength = iResult;
-			m_pStore->pString[m_pStore->iLength] = '\0';
+			SetLength(iResult);
 			break;
 			}
 
@@ -181,7 +216,7 @@ CString::CString (CharacterSets iCharSet, const char *pString) :
 
 CString::CString (const char *pString, int iLength, BOOL bExternal) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString constructor
 
@@ -193,19 +228,26 @@ CString::CString (const char *pString, int iLength, BOOL bExternal) :
 			if (iLength == -1)
 				iLength = lstrlen(pString);
 
+			//	Short strings are cheaper to copy inline than to wrap in a
+			//	store.
+
+			if (iLength <= INLINE_MAX)
+				Transcribe(pString, iLength);
+
 			//	Allocate a storage block (if necessary)
 
-			if (iLength > 0)
+			else
 				{
-				m_pStore = AllocStore(0, FALSE);
-				if (m_pStore)
+				PSTORESTRUCT pStore = AllocStore(0, FALSE);
+				if (pStore)
 					{
 					//	A negative value means that this is an external
 					//	read-only storage
 
-					m_pStore->iAllocSize = -iLength;
-					m_pStore->iLength = iLength;
-					m_pStore->pString = const_cast<char *>(pString);
+					pStore->iAllocSize = -iLength;
+					pStore->iLength = iLength;
+					pStore->pString = const_cast<char *>(pString);
+					SetStore(pStore);
 					}
 				}
 			}
@@ -222,28 +264,31 @@ CString::~CString (void)
 	DecRefCount();
 	}
 
-CString::CString (void *pStore, bool bDummy) : CObject(&g_Class), m_pStore((PSTORESTRUCT)pStore)
+CString::CString (void *pStore, bool bDummy) : CObject(&g_Class), m_Inline()
 
 //	CString private constructor
 
 	{
-	if (m_pStore)
-		m_pStore->iRefCount++;
+	if (pStore)
+		{
+		SetStore((PSTORESTRUCT)pStore);
+		AddRefStore(m_pStore);
+		}
 	}
 
 CString::CString (const CString &pString) :
 		CObject(&g_Class),
-		m_pStore(NULL)
+		m_Inline()
 
 //	CString copy constructor
 
 	{
-	m_pStore = pString.m_pStore;
+	memcpy(m_Inline, pString.m_Inline, INLINE_SIZE);
 
 	//	Up the ref count
 
-	if (m_pStore)
-		m_pStore->iRefCount++;
+	if (!IsInline())
+		AddRefStore(m_pStore);
 	}
 
 CString &CString::operator= (const CString &pString)
@@ -253,19 +298,22 @@ CString &CString::operator= (const CString &pString)
 //	Overrides the assignment operator
 
 	{
+	if (&pString == this)
+		return *this;
+
 	//	First bump up the new string's refcount, in case it happens to be the
-	//	exact same as ours.
+	//	same store as ours.
 
-	if (pString.m_pStore)
-		pString.m_pStore->iRefCount++;
+	if (!pString.IsInline())
+		AddRefStore(pString.m_pStore);
 
 	//	Now decrement our own.
 
 	DecRefCount();
 
-	//	Take it.
+	//	Take it (either the inline characters or the store pointer).
 
-	m_pStore = pString.m_pStore;
+	memcpy(m_Inline, pString.m_Inline, INLINE_SIZE);
 
 	return *this;
 	}
@@ -309,6 +357,48 @@ void CString::AddToFreeList (PSTORESTRUCT pStore, int iSize)
 		}
 	}
 
+char *CString::AllocChars (int iSize, int *retiAllocSize)
+
+//	AllocChars
+//
+//	Allocates a character buffer of at least iSize bytes. Small buffers are
+//	rounded up to a size class and come from the thread's magazine when
+//	possible. Returns NULL if out of memory.
+
+	{
+	SThreadCache *pCache = GetThreadCache();
+	if (pCache)
+		pCache->dwCharAllocs++;
+
+	if (iSize > CHARS_CLASS_MAX_SIZE)
+		{
+		*retiAllocSize = iSize;
+		return (char *)::HeapAlloc(::GetProcessHeap(), 0, iSize);
+		}
+
+	//	Figure out the size class
+
+	int iClass = 0;
+	while ((1 << (CHARS_CLASS_MIN_SHIFT + iClass)) < iSize)
+		iClass++;
+
+	int iClassSize = (1 << (CHARS_CLASS_MIN_SHIFT + iClass));
+	*retiAllocSize = iClassSize;
+
+	//	If we've got one cached, use it
+
+	char *pChars = (pCache ? pCache->pFreeChars[iClass] : NULL);
+	if (pChars)
+		{
+		pCache->pFreeChars[iClass] = *(char **)pChars;
+		pCache->iFreeChars[iClass]--;
+		pCache->dwCharCacheHits++;
+		return pChars;
+		}
+
+	return (char *)::HeapAlloc(::GetProcessHeap(), 0, iClassSize);
+	}
+
 CString::PSTORESTRUCT CString::AllocStore (int iSize, BOOL bAllocString)
 
 //	AllocStore
@@ -316,92 +406,129 @@ CString::PSTORESTRUCT CString::AllocStore (int iSize, BOOL bAllocString)
 //	Allocates a new string store of at least the given size
 
 	{
-	PSTORESTRUCT pStore;
-
-	//	Critical section
-
-	EnterCriticalSection(&g_csStore);
+	PSTORESTRUCT pStore = NULL;
+	SThreadCache *pCache = GetThreadCache();
 
-	//	If we haven't yet created the store array, do it now
+	//	If our magazine is empty, refill it from the global free list. Threads
+	//	without a magazine take a single block from the global list.
 
-	if (g_pStore == NULL)
+	if (pCache == NULL || pCache->pFreeStores == NULL)
 		{
-		//	Reserve a megabyte of virtual memory
+		EnterCriticalSection(&g_csStore);
+
+		//	If we haven't yet created the store array, do it now
 
-		g_pStore = (PSTORESTRUCT)VirtualAlloc(NULL, STORE_ALLOC_MAX, MEM_RESERVE, PAGE_NOACCESS);
 		if (g_pStore == NULL)
 			{
-			LeaveCriticalSection(&g_csStore);
-			ASSERT(false);
-			return NULL;
-			}
+			//	Reserve a megabyte of virtual memory
 
-		//	Commit a little bit of it
+			g_pStore = (PSTORESTRUCT)VirtualAlloc(NULL, STORE_ALLOC_MAX, MEM_RESERVE, PAGE_NOACCESS);
+			if (g_pStore == NULL)
+				{
+				LeaveCriticalSection(&g_csStore);
+				ASSERT(false);
+				return NULL;
+				}
 
-		if (VirtualAlloc(g_pStore,
-				STORE_SIZE_INIT * sizeof(STORESTRUCT),
-				MEM_COMMIT,
-				PAGE_READWRITE) == NULL)
-			{
-			LeaveCriticalSection(&g_csStore);
-			ASSERT(false);
-			return NULL;
-			}
+			//	Commit a little bit of it
 
-		//	Initialize the free list
+			if (VirtualAlloc(g_pStore,
+					STORE_SIZE_INIT * sizeof(STORESTRUCT),
+					MEM_COMMIT,
+					PAGE_READWRITE) == NULL)
+				{
+				LeaveCriticalSection(&g_csStore);
+				ASSERT(false);
+				return NULL;
+				}
 
-		AddToFreeList(g_pStore, STORE_SIZE_INIT);
+			//	Initialize the free list
 
-		g_iStoreSize = STORE_SIZE_INIT;
-		}
+			AddToFreeList(g_pStore, STORE_SIZE_INIT);
 
-	//	If there're no more free entries, re-alloc the store array
+			g_iStoreSize = STORE_SIZE_INIT;
+			}
 
-	if (g_pFreeStore == NULL)
-		{
-		if ((g_iStoreSize + STORE_SIZE_INCREMENT) * sizeof(STORESTRUCT) > STORE_ALLOC_MAX)
+		//	If there're no more free entries, re-alloc the store array
+
+		if (g_pFreeStore == NULL)
 			{
-			LeaveCriticalSection(&g_csStore);
-			ASSERT(false);
-			return NULL;
+			if ((g_iStoreSize + STORE_SIZE_INCREMENT) * sizeof(STORESTRUCT) > STORE_ALLOC_MAX)
+				{
+				LeaveCriticalSection(&g_csStore);
+				ASSERT(false);
+				return NULL;
+				}
+
+			if (VirtualAlloc(g_pStore + g_iStoreSize,
+					STORE_SIZE_INCREMENT * sizeof(STORESTRUCT),
+					MEM_COMMIT,
+					PAGE_READWRITE) == NULL)
+				{
+				LeaveCriticalSection(&g_csStore);
+				ASSERT(false);
+				return NULL;
+				}
+
+			//	Add the new storage blocks to the free list
+
+			AddToFreeList(g_pStore + g_iStoreSize, STORE_SIZE_INCREMENT);
+
+			g_iStoreSize += STORE_SIZE_INCREMENT;
 			}
 
-		if (VirtualAlloc(g_pStore + g_iStoreSize,
-				STORE_SIZE_INCREMENT * sizeof(STORESTRUCT),
-				MEM_COMMIT,
-				PAGE_READWRITE) == NULL)
+		//	Move a batch of blocks to our magazine
+
+		if (pCache)
 			{
-			LeaveCriticalSection(&g_csStore);
-			ASSERT(false);
-			return NULL;
-			}
+			while (g_pFreeStore && pCache->iFreeStores < STORE_MAGAZINE_BATCH)
+				{
+				pStore = g_pFreeStore;
+				g_pFreeStore = (PSTORESTRUCT)pStore->pString;
 
-		//	Add the new storage blocks to the free list
+				pStore->pString = (char *)pCache->pFreeStores;
+				pCache->pFreeStores = pStore;
+				pCache->iFreeStores++;
+				}
 
-		AddToFreeList(g_pStore + g_iStoreSize, STORE_SIZE_INCREMENT);
+			pCache->dwGlobalRefills++;
+			}
+		else
+			{
+			pStore = g_pFreeStore;
+			g_pFreeStore = (PSTORESTRUCT)pStore->pString;
+			}
 
-		g_iStoreSize += STORE_SIZE_INCREMENT;
+		LeaveCriticalSection(&g_csStore);
 		}
 
-	//	Pick a block off the free list
+	//	Pick a block off the magazine
 
-	pStore = g_pFreeStore;
-	g_pFreeStore = (PSTORESTRUCT)pStore->pString;
+	if (pCache)
+		{
+		pStore = pCache->pFreeStores;
+		pCache->pFreeStores = (PSTORESTRUCT)pStore->pString;
+		pCache->iFreeStores--;
+		pCache->dwStoreAllocs++;
+		}
 
 #ifdef DEBUG_STRING_LEAKS
-	g_iStoreCount++;
+	::InterlockedIncrement(&g_iStoreCount);
 #endif
 
-	LeaveCriticalSection(&g_csStore);
-
 	//	Initialize it
 
 	if (bAllocString)
 		{
 		pStore->iRefCount = 1;
-		pStore->iAllocSize = iSize;
 		pStore->iLength = 0;
-		pStore->pString = (char *)HeapAlloc(GetProcessHeap(), 0, iSize);
+		pStore->pString = AllocChars(iSize, &pStore->iAllocSize);
+		if (pStore->pString == NULL)
+			{
+			pStore->iAllocSize = 0;
+			FreeStore(pStore);
+			return NULL;
+			}
 		}
 	else
 		{
@@ -430,25 +557,29 @@ void CString::Append (LPCSTR pString, int iLength, DWORD dwFlags)
 	if (iLength == -1)
 		iLength = strlen(pString);
 
+	//	If we're appending part of our own inline buffer, copy it first
+	//	because Size may move us to the heap.
+
+	char szSelf[INLINE_SIZE];
+	if (IsInline() && pString >= m_Inline && pString < m_Inline + INLINE_SIZE)
+		{
+		memcpy(szSelf, pString, iLength);
+		pString = szSelf;
+		}
+
 	//	Resize allocation
 
 	DWORD dwSizeFlags = FLAG_PRESERVE_CONTENTS;
 	if (dwFlags & FLAG_ALLOC_EXTRA)
 		dwSizeFlags |= FLAG_GEOMETRIC_GROWTH;
 
-	Size(GetLength() + iLength + 1, dwSizeFlags);
-
-	//	Append
-
 	int iStart = GetLength();
-	for (int i = 0; i < iLength; i++)
-		m_pStore->pString[iStart + i] = pString[i];
-
-	m_pStore->iLength += iLength;
+	Size(iStart + iLength + 1, dwSizeFlags);
 
-	//	NULL terminate
+	//	Append
 
-	m_pStore->pString[GetLength()] = '\0';
+	memcpy(GetWriteBuffer() + iStart, pString, iLength);
+	SetLength(iStart + iLength);
 	}
 
 void CString::Capitalize (CapitalizeOptions iOption)
@@ -494,8 +625,8 @@ void CString::CopyHandler (CObject *pOriginal)
 	{
 	//	If we've got a store, up the refcount
 
-	if (m_pStore)
-		m_pStore->iRefCount++;
+	if (!IsInline())
+		AddRefStore(m_pStore);
 	}
 
 #ifndef INLINE_DECREF
@@ -508,25 +639,52 @@ void CString::DecRefCount (void)
 	{
 	//	If we've got a storage block, de-reference it
 
-	if (m_pStore)
+	if (!IsInline())
 		{
 		ASSERT(m_pStore->iRefCount > 0);
-		m_pStore->iRefCount--;
 
 		//	If we're done, free the block
 
-		if (m_pStore->iRefCount == 0)
-			{
-			EnterCriticalSection(&g_csStore);
-			if (!IsExternalStorage())
-				HeapFree(GetProcessHeap(), 0, m_pStore->pString);
-			AddToFreeList(m_pStore, 1);
-			LeaveCriticalSection(&g_csStore);
-			}
+		if (ReleaseStore(m_pStore) == 0)
+			FreeStore(m_pStore);
 		}
 	}
 #endif
 
+void CString::FreeChars (char *pChars, int iAllocSize)
+
+//	FreeChars
+//
+//	Frees a buffer allocated by AllocChars.
+
+	{
+	if (pChars == NULL)
+		return;
+
+	if (iAllocSize > CHARS_CLASS_MAX_SIZE)
+		{
+		::HeapFree(::GetProcessHeap(), 0, pChars);
+		return;
+		}
+
+	int iClass = 0;
+	while ((1 << (CHARS_CLASS_MIN_SHIFT + iClass)) < iAllocSize)
+		iClass++;
+
+	//	Keep it in our magazine unless it is full.
+
+	SThreadCache *pCache = GetThreadCache();
+	if (pCache == NULL || pCache->iFreeChars[iClass] >= CHARS_MAGAZINE_MAX)
+		{
+		::HeapFree(::GetProcessHeap(), 0, pChars);
+		return;
+		}
+
+	*(char **)pChars = pCache->pFreeChars[iClass];
+	pCache->pFreeChars[iClass] = pChars;
+	pCache->iFreeChars[iClass]++;
+	}
+
 void CString::FreeStore (PSTORESTRUCT pStore)
 
 //	FreeStore
@@ -534,16 +692,49 @@ void CString::FreeStore (PSTORESTRUCT pStore)
 //	Free the store
 
 	{
-	EnterCriticalSection(&g_csStore);
 	if (pStore->iAllocSize >= 0)	//	!IsExternalStorage()
-		HeapFree(GetProcessHeap(), 0, pStore->pString);
-	AddToFreeList(pStore, 1);
+		FreeChars(pStore->pString, pStore->iAllocSize);
+
+	//	Return the header to our magazine. If the magazine is too full, give
+	//	a batch back to the global list.
+
+	SThreadCache *pCache = GetThreadCache();
+	pStore->iRefCount = 0;
+	if (pCache == NULL)
+		{
+		EnterCriticalSection(&g_csStore);
+		pStore->pString = (char *)g_pFreeStore;
+		g_pFreeStore = pStore;
+		LeaveCriticalSection(&g_csStore);
+		}
+	else
+		{
+		pStore->pString = (char *)pCache->pFreeStores;
+		pCache->pFreeStores = pStore;
+		pCache->iFreeStores++;
+		pCache->dwStoreFrees++;
+		}
+
+	if (pCache && pCache->iFreeStores > STORE_MAGAZINE_MAX)
+		{
+		EnterCriticalSection(&g_csStore);
+
+		while (pCache->iFreeStores > STORE_MAGAZINE_MAX - STORE_MAGAZINE_BATCH)
+			{
+			PSTORESTRUCT pReturn = pCache->pFreeStores;
+			pCache->pFreeStores = (PSTORESTRUCT)pReturn->pString;
+			pCache->iFreeStores--;
+
+			pReturn->pString = (char *)g_pFreeStore;
+			g_pFreeStore = pReturn;
+			}
+
+		LeaveCriticalSection(&g_csStore);
+		}
 
 #ifdef DEBUG_STRING_LEAKS
-	g_iStoreCount--;
+	::InterlockedDecrement(&g_iStoreCount);
 #endif
-
-	LeaveCriticalSection(&g_csStore);
 	}
 
 char *CString::GetASCIIZPointer (void) const
@@ -565,10 +756,10 @@ int CString::GetLength (void) const
 //	Returns the number of characters in the string
 
 	{
-	if (m_pStore)
-		return m_pStore->iLength;
+	if (IsInline())
+		return (BYTE)m_Inline[INLINE_TAG];
 	else
-		return 0;
+		return m_pStore->iLength;
 	}
 
 int CString::GetMemoryUsage (void) const
@@ -578,10 +769,10 @@ int CString::GetMemoryUsage (void) const
 //	Returns the total memory used.
 
 	{
-	if (m_pStore == NULL || m_pStore->iAllocSize <= 0)
+	if (IsInline() || m_pStore->iAllocSize <= 0)
 		return 0;
 
-	return (sizeof STORESTRUCT) + m_pStore->iAllocSize;
+	return sizeof(STORESTRUCT) + m_pStore->iAllocSize;
 	}
 
 char *CString::GetPointer (void) const
@@ -592,10 +783,72 @@ char *CString::GetPointer (void) const
 //	access elements beyond the length of the string
 
 	{
-	if (m_pStore)
-		return m_pStore->pString;
+	if (IsInline())
+		return const_cast<char *>(m_Inline);
 	else
-		return "";
+		return m_pStore->pString;
+	}
+
+void CString::GetStorageStats (SStorageStats *retStats)
+
+//	GetStorageStats
+//
+//	Returns allocation counters for string storage. Counters owned by other
+//	threads are read without synchronization, so they are approximate.
+
+	{
+	int i;
+
+	EnterCriticalSection(&g_csStore);
+
+	*retStats = g_RetiredStats;
+	retStats->iStoresCommitted = g_iStoreSize;
+
+	int iFreeStores = 0;
+	for (PSTORESTRUCT pStore = g_pFreeStore; pStore; pStore = (PSTORESTRUCT)pStore->pString)
+		iFreeStores++;
+
+	for (SThreadCache *pCache = g_pThreadCaches; pCache; pCache = pCache->pNext)
+		{
+		iFreeStores += pCache->iFreeStores;
+		retStats->iCachedBytes += pCache->iFreeStores * (int)sizeof(STORESTRUCT);
+		for (i = 0; i < CHARS_CLASS_COUNT; i++)
+			retStats->iCachedBytes += pCache->iFreeChars[i] * (1 << (CHARS_CLASS_MIN_SHIFT + i));
+
+		retStats->dwStoreAllocs += pCache->dwStoreAllocs;
+		retStats->dwStoreFrees += pCache->dwStoreFrees;
+		retStats->dwCharAllocs += pCache->dwCharAllocs;
+		retStats->dwCharCacheHits += pCache->dwCharCacheHits;
+		retStats->dwGlobalRefills += pCache->dwGlobalRefills;
+		}
+
+	retStats->iStoresInUse = g_iStoreSize - iFreeStores;
+
+	LeaveCriticalSection(&g_csStore);
+	}
+
+CString::SThreadCache *CString::GetThreadCache (void)
+
+//	GetThreadCache
+//
+//	Returns the storage cache for the current thread. Only threads that called
+//	kernelInit have a cache (kernelCleanUp releases it); other threads (e.g.,
+//	threads created by the OS or by other libraries) get NULL and go straight
+//	to the global free list, since nothing would release their cache when they
+//	exit.
+
+	{
+#ifdef STRING_SINGLE_THREADED
+	if (g_pSingleThreadCache == NULL)
+		INTStringThreadInit();
+
+	return g_pSingleThreadCache;
+#else
+	if (g_dwStoreTLS == TLS_OUT_OF_INDEXES)
+		return NULL;
+
+	return (SThreadCache *)::TlsGetValue(g_dwStoreTLS);
+#endif
 	}
 
 char *CString::GetWritePointer (int iLength)
@@ -607,11 +860,9 @@ char *CString::GetWritePointer (int iLength)
 
 	{
 	Size(iLength + 1, FLAG_PRESERVE_CONTENTS);
+	SetLength(iLength);
 
-	m_pStore->iLength = iLength;
-	m_pStore->pString[iLength] = '\0';
-
-	return m_pStore->pString;
+	return GetWriteBuffer();
 	}
 
 void CString::GrowToFit (int iLength)
@@ -621,13 +872,7 @@ void CString::GrowToFit (int iLength)
 //	Makes sure the string is allocated to at least the given length.
 
 	{
-	bool bInit = (m_pStore == NULL);
 	Size(iLength + 1, FLAG_PRESERVE_CONTENTS);
-	if (bInit)
-		{
-		m_pStore->iLength = 0;
-		m_pStore->pString[0] = '\0';
-		}
 	}
 
 void CString::InitLowerCaseAbsoluteTable (void)
@@ -688,14 +933,10 @@ ALERROR CString::LoadHandler (CUnarchiver *pUnarchiver)
 
 	//	Load the string
 
-	if (error = pUnarchiver->ReadData(m_pStore->pString, dwLength))
+	if (error = pUnarchiver->ReadData(GetWriteBuffer(), dwLength))
 		return error;
 
-	m_pStore->iLength = (int)dwLength;
-
-	//	NULL terminate
-
-	m_pStore->pString[dwLength] = '\0';
+	SetLength((int)dwLength);
 
 	//	Skip beyond to pad to DWORD boundary
 
@@ -731,12 +972,8 @@ void CString::ReadFromStream (IReadStream *pStream)
 
 	//	Load the string
 
-	pStream->Read(m_pStore->pString, dwLength);
-	m_pStore->iLength = (int)dwLength;
-
-	//	NULL terminate
-
-	m_pStore->pString[dwLength] = '\0';
+	pStream->Read(GetWriteBuffer(), dwLength);
+	SetLength((int)dwLength);
 
 	//	Skip beyond to pad to DWORD boundary
 
@@ -782,6 +1019,26 @@ ALERROR CString::SaveHandler (CArchiver *pArchiver)
 	return NOERROR;
 	}
 
+void CString::SetLength (int iLength)
+
+//	SetLength
+//
+//	Sets the length of the string and NULL terminates it. The caller must
+//	have called Size with at least iLength + 1.
+
+	{
+	if (IsInline())
+		{
+		ASSERT(iLength <= INLINE_MAX);
+		SetInlineLength(iLength);
+		}
+	else
+		{
+		m_pStore->iLength = iLength;
+		m_pStore->pString[iLength] = '\0';
+		}
+	}
+
 void CString::Size (int iLength, DWORD dwFlags)
 
 //	Size
@@ -792,40 +1049,73 @@ void CString::Size (int iLength, DWORD dwFlags)
 //	Return FALSE if failed
 
 	{
-	//	If we don't have storage yet, allocate a new one
+	//	If we're inline, we're done if we still fit. Otherwise move to a
+	//	heap store.
 
-	if (m_pStore == NULL)
+	if (IsInline())
 		{
-		m_pStore = AllocStore(iLength, TRUE);
-		if (m_pStore == NULL)
+		if (iLength <= INLINE_MAX + 1)
+			return;
+
+		if (dwFlags & FLAG_GEOMETRIC_GROWTH)
+			iLength = Max(iLength, 2 * INLINE_SIZE);
+
+		PSTORESTRUCT pNewStore = AllocStore(iLength, TRUE);
+		if (pNewStore == NULL)
 			throw CException(ERR_MEMORY);
+
+		if (dwFlags & FLAG_PRESERVE_CONTENTS)
+			{
+			int iOldLength = (BYTE)m_Inline[INLINE_TAG];
+			memcpy(pNewStore->pString, m_Inline, iOldLength + 1);
+			pNewStore->iLength = iOldLength;
+			}
+
+		SetStore(pNewStore);
+		return;
 		}
 
 	//	If we're sharing the store with someone else, make our own copy
 
 	if (m_pStore->iRefCount > 1)
 		{
-		PSTORESTRUCT pNewStore;
+		PSTORESTRUCT pOldStore = m_pStore;
 
-		pNewStore = AllocStore(iLength, TRUE);
-		if (pNewStore == NULL)
-			throw CException(ERR_MEMORY);
+		//	If our copy fits inline, we don't need a new store.
 
-		//	If we're supposed to preserve contents, copy the content over
+		if (iLength <= INLINE_MAX + 1)
+			{
+			int iOldLength = pOldStore->iLength;
+			if (dwFlags & FLAG_PRESERVE_CONTENTS)
+				memcpy(m_Inline, pOldStore->pString, Min(iOldLength, iLength - 1));
 
-		if (dwFlags & FLAG_PRESERVE_CONTENTS)
+			SetInlineLength((dwFlags & FLAG_PRESERVE_CONTENTS) ? Min(iOldLength, iLength - 1) : 0);
+			}
+		else
 			{
-			int i;
-			int iCopyLen = Min(m_pStore->iLength+1, iLength);
+			PSTORESTRUCT pNewStore = AllocStore(iLength, TRUE);
+			if (pNewStore == NULL)
+				throw CException(ERR_MEMORY);
+
+			//	If we're supposed to preserve contents, copy the content over
 
-			for (i = 0; i < iCopyLen; i++)
-				pNewStore->pString[i] = m_pStore->pString[i];
+			if (dwFlags & FLAG_PRESERVE_CONTENTS)
+				{
+				memcpy(pNewStore->pString, pOldStore->pString, Min(pOldStore->iLength + 1, iLength));
+				pNewStore->iLength = pOldStore->iLength;
+				}
 
-			pNewStore->iLength = m_pStore->iLength;
+			SetStore(pNewStore);
 			}
 
-		m_pStore->iRefCount--;
-		m_pStore = pNewStore;
+		//	Another thread may have released its reference since we checked,
+		//	so we might be the last one out.
+
+		if (ReleaseStore(pOldStore) == 0)
+			FreeStore(pOldStore);
+
+		if (IsInline())
+			return;
 		}
 
 	//	If we're not big enough, re-allocate
@@ -842,25 +1132,19 @@ void CString::Size (int iLength, DWORD dwFlags)
 		else
 			iNewAlloc = iLength;
 
-		pNewString = (char *)HeapAlloc(GetProcessHeap(), 0, iNewAlloc);
+		pNewString = AllocChars(iNewAlloc, &iNewAlloc);
 		if (pNewString == NULL)
 			throw CException(ERR_MEMORY);
 
 		//	If we're supposed to preserve contents, copy the content over
 
 		if (dwFlags & FLAG_PRESERVE_CONTENTS)
-			{
-			int i;
-			int iCopyLen = Min(m_pStore->iLength, iLength);
-
-			for (i = 0; i < iCopyLen; i++)
-				pNewString[i] = m_pStore->pString[i];
-			}
+			memcpy(pNewString, m_pStore->pString, Min(m_pStore->iLength, iLength));
 
 		//	Only free if this is our storage
 
 		if (!IsExternalStorage())
-			HeapFree(GetProcessHeap(), 0, m_pStore->pString);
+			FreeChars(m_pStore->pString, m_pStore->iAllocSize);
 
 		m_pStore->pString = pNewString;
 		m_pStore->iAllocSize = iNewAlloc;
@@ -868,7 +1152,6 @@ void CString::Size (int iLength, DWORD dwFlags)
 
 	//	Done
 
-	ASSERT(m_pStore);
 	ASSERT(m_pStore->iRefCount == 1);
 	ASSERT(m_pStore->iAllocSize >= iLength);
 	}
@@ -881,14 +1164,12 @@ void CString::Transcribe (const char *pString, int iLen)
 //	If iLen is -1, we assume ASCIIZ
 
 	{
-	int i;
-
 	//	Handle NULL
 
 	if (pString == NULL)
 		{
 		DecRefCount();
-		m_pStore = NULL;
+		SetEmpty();
 		return;
 		}
 
@@ -897,27 +1178,24 @@ void CString::Transcribe (const char *pString, int iLen)
 	if (iLen == -1)
 		iLen = lstrlen(pString);
 
-	//	Handle 0 length
+	//	Short strings go inline
 
-	if (iLen == 0)
+	if (iLen <= INLINE_MAX)
 		{
+		char szBuffer[INLINE_SIZE];
+		memcpy(szBuffer, pString, iLen);
+
 		DecRefCount();
-		m_pStore = NULL;
+		memcpy(m_Inline, szBuffer, iLen);
+		SetInlineLength(iLen);
 		return;
 		}
 
 	//	Allocate size
 
 	Size(iLen+1);
-
-	for (i = 0; i < iLen; i++)
-		m_pStore->pString[i] = pString[i];
-
-	m_pStore->iLength = iLen;
-
-	//	NULL terminate
-
-	m_pStore->pString[iLen] = '\0';
+	memcpy(GetWriteBuffer(), pString, iLen);
+	SetLength(iLen);
 	}
 
 void CString::Truncate (int iLength)
@@ -933,7 +1211,7 @@ void CString::Truncate (int iLength)
 	if (iLength == 0)
 		{
 		DecRefCount();
-		m_pStore = NULL;
+		SetEmpty();
 		return;
 		}
 
@@ -943,8 +1221,7 @@ void CString::Truncate (int iLength)
 
 	//	Set the new length
 
-	m_pStore->iLength = iLength;
-	m_pStore->pString[iLength] = '\0';
+	SetLength(iLength);
 	}
 
 void CString::WriteToStream (IWriteStream *pStream) const
@@ -1768,10 +2045,117 @@ ALERROR CString::INTStringInit (void)
 
 	{
 	InitializeCriticalSection(&g_csStore);
+#ifndef STRING_SINGLE_THREADED
+	if (g_dwStoreTLS == TLS_OUT_OF_INDEXES)
+		{
+		g_dwStoreTLS = ::TlsAlloc();
+		if (g_dwStoreTLS == TLS_OUT_OF_INDEXES)
+			return ERR_FAIL;
+		}
+#endif
 	InitLowerCaseAbsoluteTable();
 	return NOERROR;
 	}
 
+void CString::INTStringThreadCleanUp (void)
+
+//	INTStringThreadCleanUp
+//
+//	Returns the current thread's cached storage to the global pool. This must
+//	be called before a thread that used strings exits (kernelCleanUp does it).
+
+	{
+	int i;
+
+#ifdef STRING_SINGLE_THREADED
+	SThreadCache *pCache = g_pSingleThreadCache;
+	g_pSingleThreadCache = NULL;
+#else
+	if (g_dwStoreTLS == TLS_OUT_OF_INDEXES)
+		return;
+
+	SThreadCache *pCache = (SThreadCache *)::TlsGetValue(g_dwStoreTLS);
+	::TlsSetValue(g_dwStoreTLS, NULL);
+#endif
+	if (pCache == NULL)
+		return;
+
+	//	Free cached buffers
+
+	for (i = 0; i < CHARS_CLASS_COUNT; i++)
+		while (pCache->pFreeChars[i])
+			{
+			char *pChars = pCache->pFreeChars[i];
+			pCache->pFreeChars[i] = *(char **)pChars;
+			::HeapFree(::GetProcessHeap(), 0, pChars);
+			}
+
+	//	Return headers to the global list, keep the counters and unlink.
+
+	EnterCriticalSection(&g_csStore);
+
+	while (pCache->pFreeStores)
+		{
+		PSTORESTRUCT pStore = pCache->pFreeStores;
+		pCache->pFreeStores = (PSTORESTRUCT)pStore->pString;
+
+		pStore->pString = (char *)g_pFreeStore;
+		g_pFreeStore = pStore;
+		}
+
+	g_RetiredStats.dwStoreAllocs += pCache->dwStoreAllocs;
+	g_RetiredStats.dwStoreFrees += pCache->dwStoreFrees;
+	g_RetiredStats.dwCharAllocs += pCache->dwCharAllocs;
+	g_RetiredStats.dwCharCacheHits += pCache->dwCharCacheHits;
+	g_RetiredStats.dwGlobalRefills += pCache->dwGlobalRefills;
+
+	if (pCache->pPrev)
+		pCache->pPrev->pNext = pCache->pNext;
+	else
+		g_pThreadCaches = pCache->pNext;
+
+	if (pCache->pNext)
+		pCache->pNext->pPrev = pCache->pPrev;
+
+	LeaveCriticalSection(&g_csStore);
+
+	::HeapFree(::GetProcessHeap(), 0, pCache);
+	}
+
+void CString::INTStringThreadInit (void)
+
+//	INTStringThreadInit
+//
+//	Creates a storage cache for the current thread (if it doesn't already have
+//	one). kernelInit calls this; kernelCleanUp calls INTStringThreadCleanUp.
+
+	{
+#ifdef STRING_SINGLE_THREADED
+	if (g_pSingleThreadCache)
+		return;
+#else
+	if (g_dwStoreTLS == TLS_OUT_OF_INDEXES || ::TlsGetValue(g_dwStoreTLS))
+		return;
+#endif
+
+	SThreadCache *pCache = (SThreadCache *)::HeapAlloc(::GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(SThreadCache));
+	if (pCache == NULL)
+		return;
+
+#ifdef STRING_SINGLE_THREADED
+	g_pSingleThreadCache = pCache;
+#else
+	::TlsSetValue(g_dwStoreTLS, pCache);
+#endif
+
+	EnterCriticalSection(&g_csStore);
+	pCache->pNext = g_pThreadCaches;
+	if (g_pThreadCaches)
+		g_pThreadCaches->pPrev = pCache;
+	g_pThreadCaches = pCache;
+	LeaveCriticalSection(&g_csStore);
+	}
+
 CString strCapitalize (const CString &sString, int iOffset)
 
 //	strCapitalize
@@ -3185,24 +3569,43 @@ void *CString::INTCopyStorage (void *pvStore)
 	PSTORESTRUCT pStore = (PSTORESTRUCT)pvStore;
 
 	if (pStore)
-		pStore->iRefCount++;
+		AddRefStore(pStore);
 
 	return pStore;
 	}
 
 void *CString::INTGetStorage (const CString &sString)
+
+//	INTGetStorage
+//
+//	Returns a referenced store for the string (or NULL if empty). Inline
+//	strings have no store, so we allocate one for the caller.
+
 	{
-	if (sString.m_pStore)
-		sString.m_pStore->iRefCount++;
+	if (!sString.IsInline())
+		{
+		AddRefStore(sString.m_pStore);
+		return sString.m_pStore;
+		}
+
+	int iLength = sString.GetLength();
+	if (iLength == 0)
+		return NULL;
 
-	return sString.m_pStore;
+	PSTORESTRUCT pStore = AllocStore(iLength + 1, TRUE);
+	if (pStore == NULL)
+		throw CException(ERR_MEMORY);
+
+	memcpy(pStore->pString, sString.m_Inline, iLength + 1);
+	pStore->iLength = iLength;
+	return pStore;
 	}
 
 void CString::INTFreeStorage (void *pvStore)
 	{
 	PSTORESTRUCT pStore = (PSTORESTRUCT)pvStore;
 
-	if (pStore && (--pStore->iRefCount) == 0)
+	if (pStore && ReleaseStore(pStore) == 0)
 		FreeStore(pStore);
 	}
 
@@ -3213,20 +3616,27 @@ CString CString::INTMakeString (void *pvStore)
 
 void CString::INTSetStorage (CString &sString, void *pvStore)
 	{
-	sString.DecRefCount();
+	//	Bump up the ref count first, in case it is our own store.
 
-	sString.m_pStore = (PSTORESTRUCT)pvStore;
+	if (pvStore)
+		AddRefStore((PSTORESTRUCT)pvStore);
 
-	//	If we've got a storage, bump up the ref count
+	sString.DecRefCount();
 
-	if (sString.m_pStore)
-		sString.m_pStore->iRefCount++;
+	if (pvStore)
+		sString.SetStore((PSTORESTRUCT)pvStore);
+	else
+		sString.SetEmpty();
 	}
 
 void CString::INTTakeStorage (void *pStore)
 	{
 	DecRefCount();
-	m_pStore = (PSTORESTRUCT)pStore;
+
+	if (pStore)
+		SetStore((PSTORESTRUCT)pStore);
+	else
+		SetEmpty();
 	}
 
 #ifdef DEBUG_STRING_LEAKS
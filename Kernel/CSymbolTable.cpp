@@ -1,31 +1,34 @@
 //	CSymboTable.cpp
 //
 //	Implementation of a symbol table
+//
+//	Keys are stored natively in a TDictionary, so lookups hash the key once
+//	instead of binary-searching with a virtual compare. Entries are kept
+//	sorted because callers (e.g., CCSymbolTable) hand out entry offsets and
+//	iterate in key order.
 
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-static DATADESCSTRUCT g_DataDesc[] =
-	{	{ DATADESC_OPCODE_EMBED_OBJ,	1,	0 },		//	CDictionary
+//	NOTE: We have no data descriptor because TDictionary cannot be copied
+//	bitwise. CopyHandler copies everything.
 
-		{ DATADESC_OPCODE_INT,			2,	0 },		//	m_bOwned, m_bNoReference
-		{ DATADESC_OPCODE_STOP,	0,	0 } };
-static CObjectClass<CSymbolTable>g_ClassData(OBJID_CSYMBOLTABLE, g_DataDesc);
+static CObjectClass<CSymbolTable>g_ClassData(OBJID_CSYMBOLTABLE, NULL);
 
 #define VERSION2HACK				0xffffffff
 
-CSymbolTable::CSymbolTable (void) : CDictionary(&g_ClassData),
+CSymbolTable::CSymbolTable (void) : CObject(&g_ClassData),
+		m_Table(DictionarySorted),
 		m_bOwned(FALSE),
 		m_bNoReference(TRUE)
 
 //	CSymbolTable constructor
-//	HACK: We need to default to these settings so that the CAtomTable
-//	object can allocate an array of CSymbolTables
 
 	{
 	}
 
-CSymbolTable::CSymbolTable (BOOL bOwned, BOOL bNoReference) : CDictionary(&g_ClassData),
+CSymbolTable::CSymbolTable (BOOL bOwned, BOOL bNoReference) : CObject(&g_ClassData),
+		m_Table(DictionarySorted),
 		m_bOwned(bOwned),
 		m_bNoReference(bNoReference)
 
@@ -39,23 +42,7 @@ CSymbolTable::~CSymbolTable (void)
 //	CSymbolTable destructor
 
 	{
-	int i;
-
-	for (i = 0; i < CDictionary::GetCount(); i++)
-		{
-		int iKey, iValue;
-		CString *pKey;
-
-		CDictionary::GetEntry(i, &iKey, &iValue);
-		pKey = (CString *)iKey;
-
-		delete pKey;
-		if (m_bOwned)
-			{
-			CObject *pValue = (CObject *)iValue;
-			delete pValue;
-			}
-		}
+	DeleteValues();
 	}
 
 CSymbolTable &CSymbolTable::operator= (const CSymbolTable &Obj)
@@ -63,12 +50,11 @@ CSymbolTable &CSymbolTable::operator= (const CSymbolTable &Obj)
 //	CSymbolTable operator=
 
 	{
-	m_bOwned = Obj.m_bOwned;
-	m_bNoReference = Obj.m_bNoReference;
-	m_Array = Obj.m_Array;
+	if (&Obj == this)
+		return *this;
 
-	if (m_bOwned)
-		CopyHandler((CSymbolTable *)&Obj);
+	DeleteValues();
+	CopyHandler(const_cast<CSymbolTable *>(&Obj));
 
 	return *this;
 	}
@@ -77,108 +63,62 @@ ALERROR CSymbolTable::AddEntry (const CString &sKey, CObject *pValue)
 
 //	AddEntry
 //
-//	Add an entry to the symbol table
+//	Add an entry to the symbol table. No duplicates are allowed.
 
 	{
-	ALERROR error;
-	CString *psKey;
-
-	psKey = new CString(sKey);
-	if (psKey == NULL)
-		return ERR_MEMORY;
-
-	//	Add key and value
-
-	if (error = CDictionary::AddEntry((int)psKey, (int)pValue))
-		{
-		delete psKey;
-		return error;
-		}
+	bool bInserted;
+	CObject **ppValue = m_Table.SetAt(sKey, &bInserted);
+	if (!bInserted)
+		return ERR_FAIL;
 
+	*ppValue = pValue;
 	return NOERROR;
 	}
 
-int CSymbolTable::Compare (int iKey1, int iKey2) const
-
-//	Compare
-//
-//	Compares two keys
-
-	{
-	CString *pKey1 = (CString *)iKey1;
-	CString *pKey2 = (CString *)iKey2;
-
-	return strCompareAbsolute(*pKey1, *pKey2);
-	}
-
 void CSymbolTable::CopyHandler (CObject *pOriginal)
 
 //	CopyHandler
 //
-//	If we own the objects in the array, we need to make copies
-//	of the objects also
+//	We have no data descriptor, so we copy everything here. If we own the
+//	objects in the table, we need to make copies of the objects also.
 
 	{
 	int i;
 
-	for (i = 0; i < GetCount(); i++)
-		{
-		//	Get the key and value
-
-		int iKey, iValue;
-		GetEntry(i, &iKey, &iValue);
-
-		//	Convert to the appropriate thing
+	CSymbolTable *pSrc = (CSymbolTable *)pOriginal;
+	m_bOwned = pSrc->m_bOwned;
+	m_bNoReference = pSrc->m_bNoReference;
+	m_Table = pSrc->m_Table;
 
-		CString *pKey = (CString *)iKey;
-		CObject *pValue = (CObject *)iValue;
-
-		//	Bump the ref-count on the string
-
-		CString *pNewKey = (CString *)pKey->Copy();
-
-		//	If we own the object then make a copy too
-
-		CObject *pNewValue;
-		if (m_bOwned)
-			pNewValue = pValue->Copy();
-		else
-			pNewValue = pValue;
-
-		//	Stuff the new values (we don't need to free the previous
-		//	values since they are kept by the original).
-
-		SetEntry(i, (int)pNewKey, (int)pNewValue);
+	if (m_bOwned)
+		{
+		for (i = 0; i < m_Table.GetCount(); i++)
+			{
+			CObject *&pValue = m_Table.GetValue(i);
+			if (pValue)
+				pValue = pValue->Copy();
+			}
 		}
 	}
 
-CString CSymbolTable::GetKey (int iEntry) const
+void CSymbolTable::DeleteValues (void)
 
-//	GetKey
+//	DeleteValues
 //
-//	Returns the key of the nth entry
+//	If we own the values, delete them (but leave the table alone).
 
 	{
-	int iKey, iValue;
-	CString *pKey;
-
-	GetEntry(iEntry, &iKey, &iValue);
-	pKey = (CString *)iKey;
-
-	return *pKey;
-	}
-
-CObject *CSymbolTable::GetValue (int iEntry) const
-
-//	GetValue
-//
-//	Returns the value of the nth entry
+	int i;
 
-	{
-	int iKey, iValue;
+	if (!m_bOwned)
+		return;
 
-	GetEntry(iEntry, &iKey, &iValue);
-	return (CObject *)iValue;
+	for (i = 0; i < m_Table.GetCount(); i++)
+		{
+		CObject *pValue = m_Table.GetValue(i);
+		if (pValue)
+			delete pValue;
+		}
 	}
 
 ALERROR CSymbolTable::LoadHandler (CUnarchiver *pUnarchiver)
@@ -208,128 +148,80 @@ ALERROR CSymbolTable::LoadHandler (CUnarchiver *pUnarchiver)
 		return error;
 
 	//	If count is -1, then this is a new version of the symbol table
+	//	(which is saved in sorted order). Older versions were saved in a
+	//	different sort order, but since we insert each key by value, both
+	//	versions load the same way.
 
 	if (dwCount == VERSION2HACK)
 		{
-		//	Read in a count of objects
-
 		if (error = pUnarchiver->ReadData((char *)&dwCount, sizeof(DWORD)))
 			return error;
+		}
 
-		//	Make sure that there's room for all the objects
-
-		if (error = CDictionary::ExpandArray(0, dwCount))
-			return error;
+	m_Table.GrowToFit((int)dwCount);
 
-		//	Read in the objects themselves
+	//	Read in the objects themselves
 
-		for (i = 0; i < (int)dwCount; i++)
-			{
-			CObject *pObject;
-			CObject *pValue;
-			CString *pKey;
+	for (i = 0; i < (int)dwCount; i++)
+		{
+		CObject *pObject;
+		CObject *pValue;
+		CString *pKey;
 
-			//	Read in the key
+		//	Read in the key
 
-			if (error = pUnarchiver->LoadObject(&pObject))
-				return error;
+		if (error = pUnarchiver->LoadObject(&pObject))
+			return error;
 
-			pKey = dynamic_cast<CString *>(pObject);
-			if (pKey == NULL)
-				{
-				delete pObject;
-				return ERR_FAIL;
-				}
+		pKey = dynamic_cast<CString *>(pObject);
+		if (pKey == NULL)
+			{
+			delete pObject;
+			return ERR_FAIL;
+			}
 
-			//	If we own the object, read in the object
+		//	If we own the object, read in the object
 
-			if (m_bOwned)
-				{
-				if (error = pUnarchiver->LoadObject(&pValue))
-					{
-					delete pKey;
-					return error;
-					}
-				}
-			else if (m_bNoReference)
+		if (m_bOwned)
+			{
+			if (error = pUnarchiver->LoadObject(&pValue))
 				{
-				if (error = pUnarchiver->ReadData((char *)&pValue, sizeof(DWORD)))
-					{
-					delete pKey;
-					return error;
-					}
+				delete pKey;
+				return error;
 				}
-#ifndef LATER
-			//	We need to handle references here.
-			else
-				ASSERT(FALSE);
-#endif
-
-			CDictionary::SetEntry(i, (int)pKey, (int)pValue);
 			}
-		}
-
-	//	Otherwise, continue loading the old version in compatibility mode
-
-	else
-		{
-		//	Read in the objects themselves
-
-		for (i = 0; i < (int)dwCount; i++)
+		else if (m_bNoReference)
 			{
-			CObject *pObject;
-			CObject *pValue;
-			CString *pKey;
-
-			//	Read in the key
-
-			if (error = pUnarchiver->LoadObject(&pObject))
-				return error;
+			//	Raw values are always saved as 32-bits
 
-			pKey = dynamic_cast<CString *>(pObject);
-			if (pKey == NULL)
+			DWORD dwValue;
+			if (error = pUnarchiver->ReadData((char *)&dwValue, sizeof(DWORD)))
 				{
-				delete pObject;
-				return ERR_FAIL;
+				delete pKey;
+				return error;
 				}
 
-			//	If we own the object, read in the object
-
-			if (m_bOwned)
-				{
-				if (error = pUnarchiver->LoadObject(&pValue))
-					{
-					delete pKey;
-					return error;
-					}
-				}
-			else if (m_bNoReference)
-				{
-				if (error = pUnarchiver->ReadData((char *)&pValue, sizeof(DWORD)))
-					{
-					delete pKey;
-					return error;
-					}
-				}
+			pValue = (CObject *)(DWORD_PTR)dwValue;
+			}
 #ifndef LATER
-			//	We need to handle references here.
-			else
-				{
-				ASSERT(FALSE);
-				pValue = NULL;
-				}
+		//	We need to handle references here.
+		else
+			{
+			ASSERT(FALSE);
+			pValue = NULL;
+			}
 #endif
 
-			//	For previous version we insert the objects in the table
-			//	although this is less efficient, it is required because the
-			//	sort order changed from version 1 to 2.
+		//	Add to the table. The table keeps its own copy of the key.
 
-			if (error = CDictionary::AddEntry((int)pKey, (int)pValue))
-				{
-				delete pKey;
+		error = AddEntry(*pKey, pValue);
+		delete pKey;
+
+		if (error)
+			{
+			if (m_bOwned && pValue)
 				delete pValue;
-				return error;
-				}
+			return error;
 			}
 		}
 
@@ -343,15 +235,12 @@ ALERROR CSymbolTable::Lookup (const CString &sKey, CObject **retpValue) const
 //	Do a look up. If not found, returns ERR_NOTFOUND
 
 	{
-	ALERROR error;
-	int iValue;
-	CString sKeyToFind(sKey);
-
-	if (error = CDictionary::Find((int)&sKeyToFind, &iValue))
-		return error;
+	CObject **ppValue = m_Table.GetAt(sKey);
+	if (ppValue == NULL)
+		return ERR_NOTFOUND;
 
 	if (retpValue)
-		*retpValue = (CObject *)iValue;
+		*retpValue = *ppValue;
 
 	return NOERROR;
 	}
@@ -363,11 +252,8 @@ ALERROR CSymbolTable::LookupEx (const CString &sKey, int *retiEntry) const
 //	Do a look up and return the entry number
 
 	{
-	ALERROR error;
-	CString sKeyToFind(sKey);
-
-	if (error = CDictionary::FindEx((int)&sKeyToFind, retiEntry))
-		return error;
+	if (!m_Table.FindPos(sKey, retiEntry))
+		return ERR_NOTFOUND;
 
 	return NOERROR;
 	}
@@ -379,25 +265,10 @@ ALERROR CSymbolTable::RemoveAll (void)
 //	Remove all entries in symbol table
 
 	{
-	int i;
-
-	for (i = 0; i < CDictionary::GetCount(); i++)
-		{
-		int iKey, iValue;
-		CString *pKey;
-
-		CDictionary::GetEntry(i, &iKey, &iValue);
-		pKey = (CString *)iKey;
+	DeleteValues();
+	m_Table.DeleteAll();
 
-		delete pKey;
-		if (m_bOwned)
-			{
-			CObject *pValue = (CObject *)iValue;
-			delete pValue;
-			}
-		}
-
-	return CDictionary::RemoveAll();
+	return NOERROR;
 	}
 
 ALERROR CSymbolTable::RemoveEntry (int iEntry, CObject **retpOldValue)
@@ -407,15 +278,11 @@ ALERROR CSymbolTable::RemoveEntry (int iEntry, CObject **retpOldValue)
 //	Removes the given entry
 
 	{
-	ALERROR error;
-	int iOldValue;
-
-	//	Let the dictionary do the removing
+	if (iEntry < 0 || iEntry >= m_Table.GetCount())
+		return ERR_NOTFOUND;
 
-	if (error = CDictionary::RemoveEntryByOrdinal(iEntry, &iOldValue))
-		return error;
-
-	CObject *pOldObj = (CObject *)iOldValue;
+	CObject *pOldObj = m_Table.GetValue(iEntry);
+	m_Table.Delete(iEntry);
 
 	//	If the caller wants us to return the old value, do it; otherwise,
 	//	we delete it, if necessary
@@ -435,25 +302,12 @@ ALERROR CSymbolTable::RemoveEntry (const CString &sKey, CObject **retpOldValue)
 //	Removes the given entry
 
 	{
-	ALERROR error;
-	int iOldValue;
+	int iEntry;
 
-	//	Let the dictionary do the removing
-
-	if (error = CDictionary::RemoveEntry((int)&sKey, &iOldValue))
-		return error;
-
-	CObject *pOldObj = (CObject *)iOldValue;
-
-	//	If the caller wants us to return the old value, do it; otherwise,
-	//	we delete it, if necessary
-
-	if (retpOldValue)
-		*retpOldValue = pOldObj;
-	else if (m_bOwned && pOldObj)
-		delete pOldObj;
+	if (!m_Table.FindPos(sKey, &iEntry))
+		return ERR_NOTFOUND;
 
-	return NOERROR;
+	return RemoveEntry(iEntry, retpOldValue);
 	}
 
 ALERROR CSymbolTable::ReplaceEntry (const CString &sKey, CObject *pValue, bool bAdd, CObject **retpOldValue)
@@ -464,40 +318,30 @@ ALERROR CSymbolTable::ReplaceEntry (const CString &sKey, CObject *pValue, bool b
 //	with the given value. Otherwise, it returns ERR_NOTFOUND
 
 	{
-	ALERROR error;
-	int iOldValue;
+	CObject **ppValue;
 	CObject *pOldObj;
-	CString *pKey;
-	bool bAdded;
 
-	//	We need to allocate a new string in case the key is added
+	//	Look for the key (adding it, if necessary)
 
 	if (bAdd)
 		{
-		pKey = new CString(sKey);
-		if (pKey == NULL)
-			return ERR_MEMORY;
-		}
-	else
-		pKey = const_cast<CString *>(&sKey);
-
-	//	Let the dictionary code do the actual adding
+		bool bInserted;
+		ppValue = m_Table.SetAt(sKey, &bInserted);
 
-	if (error = CDictionary::ReplaceEntry((int)pKey, (int)pValue, bAdd, &bAdded, &iOldValue))
-		return error;
+		//	If we added a new object, then there is no old value
 
-	//	If we didn't actually add a key, then we free the string
-	//	that we allocated
-
-	if (bAdd && !bAdded)
-		delete pKey;
+		pOldObj = (bInserted ? NULL : *ppValue);
+		}
+	else
+		{
+		ppValue = m_Table.GetAt(sKey);
+		if (ppValue == NULL)
+			return ERR_NOTFOUND;
 
-	//	If we added a new object, then there is no old value
+		pOldObj = *ppValue;
+		}
 
-	if (bAdded)
-		pOldObj = NULL;
-	else
-		pOldObj = (CObject *)iOldValue;
+	*ppValue = pValue;
 
 	//	If the caller wants us to return the old value, do it; otherwise,
 	//	we delete it, if necessary
@@ -539,23 +383,19 @@ ALERROR CSymbolTable::SaveHandler (CArchiver *pArchiver)
 
 	//	Write out the number of entries that we've got
 
-	dwCount = (DWORD)CDictionary::GetCount();
+	dwCount = (DWORD)m_Table.GetCount();
 	if (error = pArchiver->WriteData((char *)&dwCount, sizeof(DWORD)))
 		return error;
 
 	//	Write out each object
 
-	for (i = 0; i < CDictionary::GetCount(); i++)
+	for (i = 0; i < m_Table.GetCount(); i++)
 		{
-		int iKey, iValue;
-		CString *pKey;
-
-		CDictionary::GetEntry(i, &iKey, &iValue);
-		pKey = (CString *)iKey;
+		CObject *pValue = m_Table.GetValue(i);
 
 		//	Write out the key
 
-		if (error = pArchiver->SaveObject(pKey))
+		if (error = pArchiver->SaveObject(const_cast<CString *>(&m_Table.GetKey(i))))
 			return error;
 
 		//	If we're owned, write out the value. If we're not a reference
@@ -563,20 +403,20 @@ ALERROR CSymbolTable::SaveHandler (CArchiver *pArchiver)
 
 		if (m_bOwned)
 			{
-			CObject *pValue = (CObject *)iValue;
-
 			if (error = pArchiver->SaveObject(pValue))
 				return error;
 			}
 		else if (m_bNoReference)
 			{
-			if (error = pArchiver->WriteData((char *)&iValue, sizeof(int)))
+			//	Raw values are always saved as 32-bits
+
+			DWORD dwValue = (DWORD)(DWORD_PTR)pValue;
+			if (error = pArchiver->WriteData((char *)&dwValue, sizeof(DWORD)))
 				return error;
 			}
 		else
 			{
 			int iID;
-			CObject *pValue = (CObject *)iValue;
 
 			if (error = pArchiver->Reference2ID(pValue, &iID))
 				return error;
@@ -596,12 +436,10 @@ void CSymbolTable::SetValue (int iEntry, CObject *pValue, CObject **retpOldValue
 //	Sets the value
 
 	{
-	int iKey, iValue;
-
-	GetEntry(iEntry, &iKey, &iValue);
+	CObject *&pEntry = m_Table.GetValue(iEntry);
 
 	if (retpOldValue)
-		*retpOldValue = (CObject *)iValue;
+		*retpOldValue = pEntry;
 
-	CDictionary::SetEntry(iEntry, iKey, (int)pValue);
+	pEntry = pValue;
 	}
@@ -5,11 +5,22 @@
 #include "Kernel.h"
 #include "KernelObjID.h"
 
+#include <process.h>
+
 static CObjectClass<CTextFileLog>g_Class(OBJID_CTEXTFILELOG, NULL);
 
 CTextFileLog::CTextFileLog (void) : CObject(&g_Class),
 		m_hFile(NULL),
-		m_dwSessionStart(0)
+		m_dwSessionStart(0),
+		m_bAsync(false),
+		m_iOverflow(overflowDrop),
+		m_iMaxQueued(DEFAULT_MAX_QUEUED),
+		m_iQueued(0),
+		m_iDropped(0),
+		m_hWriter(NULL),
+		m_hWorkAvail(NULL),
+		m_bQuit(false),
+		m_pWriteBuffer(NULL)
 
 //	CTextFileLog constructor
 
@@ -18,7 +29,17 @@ CTextFileLog::CTextFileLog (void) : CObject(&g_Class),
 
 CTextFileLog::CTextFileLog (const CString &sFilename) : CObject(&g_Class),
 		m_sFilename(sFilename),
-		m_hFile(NULL)
+		m_hFile(NULL),
+		m_dwSessionStart(0),
+		m_bAsync(false),
+		m_iOverflow(overflowDrop),
+		m_iMaxQueued(DEFAULT_MAX_QUEUED),
+		m_iQueued(0),
+		m_iDropped(0),
+		m_hWriter(NULL),
+		m_hWorkAvail(NULL),
+		m_bQuit(false),
+		m_pWriteBuffer(NULL)
 
 //	CTextFileLog constructor
 
@@ -31,6 +52,9 @@ CTextFileLog::~CTextFileLog (void)
 
 	{
 	Close();
+
+	if (m_pWriteBuffer)
+		delete [] m_pWriteBuffer;
 	}
 
 ALERROR CTextFileLog::Close (void)
@@ -43,6 +67,11 @@ ALERROR CTextFileLog::Close (void)
 	if (m_hFile == NULL)
 		return NOERROR;
 
+	//	Stop the writer and write out anything left in the queue
+
+	StopWriter();
+	Flush();
+
 	CloseHandle(m_hFile);
 	m_hFile = NULL;
 
@@ -90,9 +119,121 @@ ALERROR CTextFileLog::Create (BOOL bAppend)
 		m_dwSessionStart = 0;
 		}
 
+	//	Start the writer thread, if necessary. If we can't, we just write
+	//	synchronously.
+	//
+	//	NOTE: We don't use kernelCreateThread because the writer would then
+	//	hold a kernelInit reference, and the last kernelCleanUp (which is what
+	//	closes the debug log) would never happen.
+
+	if (m_bAsync)
+		{
+		if (m_pWriteBuffer == NULL)
+			m_pWriteBuffer = new char [WRITE_BUFFER_SIZE];
+
+		m_bQuit = false;
+		m_hWorkAvail = ::CreateEvent(NULL, FALSE, FALSE, NULL);
+		if (m_hWorkAvail)
+			{
+			unsigned int dwThreadID;
+			m_hWriter = (HANDLE)_beginthreadex(NULL,
+					0,
+					(unsigned int (__stdcall *)(void *))WriterThread,
+					this,
+					0,
+					&dwThreadID);
+			}
+
+		if (m_hWriter == NULL)
+			{
+			if (m_hWorkAvail)
+				::CloseHandle(m_hWorkAvail);
+			m_hWorkAvail = NULL;
+			}
+		}
+
 	return NOERROR;
 	}
 
+void CTextFileLog::Flush (void)
+
+//	Flush
+//
+//	Writes out all queued lines on the calling thread. This is safe to call
+//	from any thread (including while handling a crash).
+
+	{
+	if (m_hFile == NULL)
+		return;
+
+	CSmartLock Lock(m_cs);
+	FlushQueue();
+	}
+
+void CTextFileLog::FlushQueue (void)
+
+//	FlushQueue
+//
+//	Writes out all queued lines, coalescing them into as few writes as we
+//	can. The caller must hold m_cs.
+
+	{
+	int iUsed = 0;
+	bool bWrote = false;
+
+	//	If we dropped lines, say so.
+
+	LONG iDropped = ::InterlockedExchange(&m_iDropped, 0);
+	if (iDropped)
+		{
+		CString sDropped = strPatternSubst(CONSTLIT("[%d log lines dropped]\r\n"), iDropped);
+		WriteBuffer(sDropped.GetASCIIZPointer(), sDropped.GetLength());
+		bWrote = true;
+		}
+
+	//	Write everything in the queue
+
+	SQueuedLine *pLine;
+	while (m_Queue.TryDequeue(&pLine))
+		{
+		int iLength = pLine->iLength;
+
+		if (m_pWriteBuffer && iLength <= WRITE_BUFFER_SIZE)
+			{
+			if (iUsed + iLength > WRITE_BUFFER_SIZE)
+				{
+				WriteBuffer(m_pWriteBuffer, iUsed);
+				iUsed = 0;
+				}
+
+			utlMemCopy(pLine->Text, m_pWriteBuffer + iUsed, iLength);
+			iUsed += iLength;
+			}
+		else
+			{
+			if (iUsed)
+				{
+				WriteBuffer(m_pWriteBuffer, iUsed);
+				iUsed = 0;
+				}
+
+			WriteBuffer(pLine->Text, iLength);
+			}
+
+		::InterlockedExchangeAdd(&m_iQueued, -iLength);
+		delete [] (char *)pLine;
+		bWrote = true;
+		}
+
+	if (iUsed)
+		WriteBuffer(m_pWriteBuffer, iUsed);
+
+	//	Flush once per batch so that we don't lose anything if we crash.
+
+	if (bWrote)
+		::FlushFileBuffers(m_hFile);
+	}
+
 CString CTextFileLog::GetSessionLog (void)
 
 //	GetSessionLog
@@ -102,6 +243,12 @@ CString CTextFileLog::GetSessionLog (void)
 	{
 	ASSERT(m_hFile);
 
+	//	Write out anything still queued so that we return everything. We keep
+	//	the lock so that the writer doesn't move the file pointer on us.
+
+	CSmartLock Lock(m_cs);
+	FlushQueue();
+
 	//	Figure out the current position of the file pointer
 
 	DWORD dwCurPos = ::SetFilePointer(m_hFile, 0, NULL, FILE_CURRENT);
@@ -141,40 +288,83 @@ void CTextFileLog::LogOutput (DWORD dwFlags, const CString &sLine)
 
 //	LogOutput
 //
-//	Output a line to the log
+//	Output a line to the log. In async mode we just format the line and queue
+//	it for the writer thread.
 
 	{
-	DWORD dwWritten;
-
 	ASSERT(m_hFile);
 
-	//	Write the time date
+	//	Format the time date
 
+	char szTimeDate[64];
+	int iTimeDateLen = 0;
 	if (dwFlags & ILOG_FLAG_TIMEDATE)
 		{
-		char szBuffer[1024];
 		SYSTEMTIME time;
 
 		GetLocalTime(&time);
-		int iLen = wsprintf(szBuffer, "%02d/%02d/%04d %02d:%02d:%02d\t",
+		iTimeDateLen = wsprintf(szTimeDate, "%02d/%02d/%04d %02d:%02d:%02d\t",
 				time.wMonth,
 				time.wDay,
 				time.wYear,
 				time.wHour,
 				time.wMinute,
 				time.wSecond);
+		}
+
+	//	Compose the whole line so that we can write it at once. The line and
+	//	its length share a single allocation, which the writer frees. (We
+	//	don't batch lines per thread because a crash flush must be able to
+	//	see every line that has been logged.)
+
+	int iLength = iTimeDateLen + sLine.GetLength() + 2;
+	SQueuedLine *pEntry = (SQueuedLine *)new char [sizeof(SQueuedLine) + iLength];
+	pEntry->iLength = iLength;
+	char *pPos = pEntry->Text;
+
+	utlMemCopy(szTimeDate, pPos, iTimeDateLen);
+	pPos += iTimeDateLen;
+	utlMemCopy(sLine.GetASCIIZPointer(), pPos, sLine.GetLength());
+	pPos += sLine.GetLength();
+	*pPos++ = '\r';
+	*pPos++ = '\n';
 
-		WriteFile(m_hFile, szBuffer, iLen, &dwWritten, NULL);
+	//	If we're synchronous, write it now. We flush now because we don't want
+	//	to lose any info if we crash.
+
+	if (m_hWriter == NULL)
+		{
+		CSmartLock Lock(m_cs);
+		FlushQueue();
+		WriteBuffer(pEntry->Text, iLength);
+		::FlushFileBuffers(m_hFile);
+
+		delete [] (char *)pEntry;
+		return;
 		}
 
-	//	Write out the line
+	//	If the writer is too far behind, either drop the line or write the
+	//	queue out ourselves.
 
-	WriteFile(m_hFile, sLine.GetASCIIZPointer(), sLine.GetLength(), &dwWritten, NULL);
-	WriteFile(m_hFile, "\r\n", 2, &dwWritten, NULL);
+	if (m_iQueued > 0 && m_iQueued + iLength > m_iMaxQueued)
+		{
+		if (m_iOverflow == overflowDrop)
+			{
+			::InterlockedIncrement(&m_iDropped);
+			delete [] (char *)pEntry;
+			return;
+			}
+
+		Flush();
+		}
 
-	//	Flush now because we don't want to lose any info if we crash
+	//	Queue it and wake the writer. We signal every time: if we only signaled
+	//	when the queue was empty, a line queued while the writer was finishing
+	//	a batch could wait for the idle timeout.
 
-	FlushFileBuffers(m_hFile);
+	::InterlockedExchangeAdd(&m_iQueued, iLength);
+	m_Queue.Enqueue(pEntry);
+	::SetEvent(m_hWorkAvail);
 	}
 
 void CTextFileLog::LogOutput (DWORD dwFlags, char *pszLine, ...)
@@ -192,6 +382,22 @@ void CTextFileLog::LogOutput (DWORD dwFlags, char *pszLine, ...)
 	LogOutput(dwFlags, sParsedLine);
 	}
 
+void CTextFileLog::SetAsync (bool bAsync, int iMaxQueued, EOverflowPolicies iOverflow)
+
+//	SetAsync
+//
+//	In async mode, LogOutput queues lines and a background thread writes
+//	them. iMaxQueued is the number of bytes we allow to wait in the queue;
+//	iOverflow says what to do when we hit that. Must be called before Create.
+
+	{
+	ASSERT(m_hFile == NULL);
+
+	m_bAsync = bAsync;
+	m_iMaxQueued = Max(0, iMaxQueued);
+	m_iOverflow = iOverflow;
+	}
+
 void CTextFileLog::SetFilename (const CString &sFilename)
 
 //	SetFilename
@@ -212,9 +418,65 @@ void CTextFileLog::SetSessionStart (void)
 	{
 	ASSERT(m_hFile);
 
+	CSmartLock Lock(m_cs);
+	FlushQueue();
+
 	DWORD dwCurPos = ::SetFilePointer(m_hFile, 0, NULL, FILE_CURRENT);
 	if (dwCurPos == INVALID_SET_FILE_POINTER)
 		return;
 
 	m_dwSessionStart = dwCurPos;
 	}
+
+void CTextFileLog::StopWriter (void)
+
+//	StopWriter
+//
+//	Stops the writer thread (if it is running).
+
+	{
+	if (m_hWriter == NULL)
+		return;
+
+	m_bQuit = true;
+	::SetEvent(m_hWorkAvail);
+	::WaitForSingleObject(m_hWriter, INFINITE);
+
+	::CloseHandle(m_hWriter);
+	m_hWriter = NULL;
+
+	::CloseHandle(m_hWorkAvail);
+	m_hWorkAvail = NULL;
+	}
+
+void CTextFileLog::WriteBuffer (const char *pData, int iLength)
+
+//	WriteBuffer
+//
+//	Writes to the file. The caller must hold m_cs.
+
+	{
+	DWORD dwWritten;
+
+	::WriteFile(m_hFile, pData, iLength, &dwWritten, NULL);
+	}
+
+DWORD WINAPI CTextFileLog::WriterThread (LPVOID pData)
+
+//	WriterThread
+//
+//	Writes out queued lines until we're asked to quit.
+
+	{
+	CTextFileLog *pLog = (CTextFileLog *)pData;
+
+	while (!pLog->m_bQuit)
+		{
+		::WaitForSingleObject(pLog->m_hWorkAvail, WRITER_IDLE_TIMEOUT);
+
+		CSmartLock Lock(pLog->m_cs);
+		pLog->FlushQueue();
+		}
+
+	return 0;
+	}
@@ -2,51 +2,240 @@
 //
 //	CThreadPool class
 //	Copyright (c) 2015 by Kronosaur Productions, LLC. All Rights Reserved.
+//
+//	Each pool thread owns a Chase-Lev work-stealing deque (see "Dynamic
+//	Circular Work-Stealing Deque", Chase & Lev, 2005). The owner pushes and
+//	pops at the bottom without locking; idle threads steal from the top with a
+//	single compare-exchange. Threads that are not part of the pool add tasks to
+//	a lock-free injection queue.
+//
+//	When a thread runs out of work it spins for a little while, then yields,
+//	and finally sleeps on m_hWorkAvail. Anyone who adds a task wakes one
+//	sleeper. To avoid lost wake-ups, a sleeper increments m_iSleeping and then
+//	checks for work; a producer publishes the task and then checks
+//	m_iSleeping. Both sides go through a full barrier in between.
 
 #include "Kernel.h"
 #include "KernelObjID.h"
 
-void CThreadPool::AddTask (IThreadPoolTask *pTask)
+const LONG MAX_WAKE_TOKENS =					0x7fff;
+
+static DWORD g_dwWorkerTLS = TLS_OUT_OF_INDEXES;
+
+//	CThreadPoolLatch -----------------------------------------------------------
+
+void CThreadPoolLatch::Add (int iCount)
+
+//	Add
+//
+//	Adds to the count. While the latch might be waited on, this should only be
+//	called when the count is already above zero (e.g., by a task in the group
+//	adding a child task).
+
+	{
+	::InterlockedExchangeAdd(&m_iCount, (LONG)iCount);
+	}
+
+void CThreadPoolLatch::CountDown (void)
+
+//	CountDown
+//
+//	Decrements the count and releases any waiters when it hits zero.
+
+	{
+	LONG iCount = ::InterlockedDecrement(&m_iCount);
+	ASSERT(iCount >= 0);
+
+	//	The decrement is a full barrier, so if a waiter created the event
+	//	before it checked the count, we see it here.
+
+	if (iCount == 0)
+		{
+		HANDLE hEvent = m_hEvent;
+		if (hEvent)
+			::SetEvent(hEvent);
+		}
+	}
+
+HANDLE CThreadPoolLatch::GetWaitEvent (void)
+
+//	GetWaitEvent
+//
+//	Returns the event that is set when the count reaches zero. We create it
+//	the first time someone needs to block.
+
+	{
+	if (m_hEvent == NULL)
+		{
+		HANDLE hEvent = ::CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (hEvent == NULL)
+			throw CException(ERR_MEMORY);
+
+		if (::InterlockedCompareExchangePointer((PVOID volatile *)&m_hEvent, hEvent, NULL) != NULL)
+			::CloseHandle(hEvent);
+		}
+
+	return m_hEvent;
+	}
+
+void CThreadPoolLatch::Wait (void)
+
+//	Wait
+//
+//	Blocks until the count reaches zero. This does not help with any work, so
+//	pool threads should call CThreadPool::Wait instead.
+
+	{
+	while (!IsDone())
+		{
+		HANDLE hEvent = GetWaitEvent();
+		if (IsDone())
+			break;
+
+		::WaitForSingleObject(hEvent, INFINITE);
+
+		//	The event might be left over from an earlier time that the count
+		//	hit zero. If so, reset it and check again.
+
+		if (!IsDone())
+			::ResetEvent(hEvent);
+		}
+	}
+
+//	CThreadPool ----------------------------------------------------------------
+
+CThreadPool::CThreadPool (void) :
+		m_pWorkers(NULL),
+		m_iWorkerCount(0),
+		m_dwHostThreadID(0),
+		m_hWorkAvail(NULL),
+		m_iSleeping(0),
+		m_bQuit(FALSE)
+
+//	CThreadPool constructor
+
+	{
+	}
+
+void CThreadPool::AddTask (IThreadPoolTask *pTask, CThreadPoolLatch *pLatch)
 
 //	AddTask
 //
-//	Adds a task to the thread pool. We take ownership of the object.
+//	Adds a task to the thread pool. We take ownership of the object and delete
+//	it as soon as it has run. If pLatch is not NULL, we count it down when the
+//	task is done.
 //
-//	NOTE: This should only be called from the same thread as Run. That is, we 
-//	should not call this method while the worker threads are running.
+//	This may be called from any thread at any time, including from inside
+//	another task. The task may start running before we return.
 
 	{
-	m_Tasks.Enqueue(pTask);
-	m_iTasksRemaining++;
+	ASSERT(pTask);
+
+	pTask->m_pLatch = pLatch;
+	if (pLatch)
+		pLatch->Add();
+
+	m_AllTasks.Add();
+
+	//	If we're on a pool thread, push on our own deque. Otherwise, add to
+	//	the injection queue.
+
+	SWorker *pWorker = GetCurrentWorker();
+	if (pWorker)
+		DequePush(pWorker->Deque, pTask);
+	else
+		m_Inject.Enqueue(pTask);
+
+	WakeWorker();
+	}
+
+CThreadPool::SDequeArray *CThreadPool::AllocDequeArray (int iSize)
+
+//	AllocDequeArray
+//
+//	Allocates a deque array. iSize must be a power of 2.
+
+	{
+	SDequeArray *pArray = (SDequeArray *)new char [sizeof(SDequeArray) + (iSize - 1) * sizeof(IThreadPoolTask *)];
+	pArray->dwMask = (DWORD)(iSize - 1);
+	pArray->pRetired = NULL;
+
+	return pArray;
+	}
+
+int CThreadPool::CalcChunkCount (int iCount, int iGrain) const
+
+//	CalcChunkCount
+//
+//	Returns the number of chunks to split a ParallelFor range into. Each chunk
+//	has at least iGrain elements. If iGrain <= 0 we aim for a few chunks per
+//	thread so that threads that finish early can steal the rest.
+
+	{
+	int iThreads = GetThreadCount();
+	if (iThreads < 2 || iCount < 2)
+		return 1;
+
+	if (iGrain <= 0)
+		iGrain = Max(1, iCount / (iThreads * CHUNKS_PER_THREAD));
+
+	return Max(1, iCount / iGrain);
 	}
 
 bool CThreadPool::Boot (int iThreadCount)
 
 //	Boot
 //
-//	Start the thread pool.
+//	Start the thread pool. The calling thread counts as one of the threads, so
+//	we create iThreadCount - 1 new threads.
 
 	{
 	int i;
 
 	ASSERT(iThreadCount > 0);
+	ASSERT(m_pWorkers == NULL);
 
-	//	Create all our events
+	//	We use a single TLS slot (for all pools) to find the current worker.
 
-	m_WorkAvail.Create();
+	if (g_dwWorkerTLS == TLS_OUT_OF_INDEXES)
+		{
+		DWORD dwTLS = ::TlsAlloc();
+		if (dwTLS == TLS_OUT_OF_INDEXES)
+			return false;
 
-	m_WorkCompleted.Create();
-	m_WorkCompleted.Set();
+		if (::InterlockedCompareExchange((LONG volatile *)&g_dwWorkerTLS, (LONG)dwTLS, (LONG)TLS_OUT_OF_INDEXES) != (LONG)TLS_OUT_OF_INDEXES)
+			::TlsFree(dwTLS);
+		}
 
-	m_Quit.Create();
+	m_hWorkAvail = ::CreateSemaphore(NULL, 0, MAX_WAKE_TOKENS, NULL);
+	if (m_hWorkAvail == NULL)
+		return false;
 
-	//	Start all the threads
+	m_bQuit = FALSE;
+	m_iSleeping = 0;
+	m_dwHostThreadID = ::GetCurrentThreadId();
 
-	m_Threads.InsertEmpty(iThreadCount - 1);
-	for (i = 0; i < m_Threads.GetCount(); i++)
-		m_Threads[i].hThread = ::kernelCreateThread(WorkerThreadStub, this);
+	//	Initialize all workers before we start any thread, since threads steal
+	//	from each other.
 
-	m_iTasksRemaining = 0;
+	m_iWorkerCount = iThreadCount;
+	m_pWorkers = new SWorker [iThreadCount];
+	for (i = 0; i < iThreadCount; i++)
+		{
+		SWorker &Worker = m_pWorkers[i];
+		Worker.pPool = this;
+		Worker.iIndex = i;
+		Worker.hThread = NULL;
+		Worker.dwRandom = 2654435761U * (DWORD)(i + 1);
+		Worker.Deque.iTop = 0;
+		Worker.Deque.iBottom = 0;
+		Worker.Deque.pArray = AllocDequeArray(INITIAL_DEQUE_SIZE);
+		}
+
+	//	Start all the threads
+
+	for (i = 1; i < iThreadCount; i++)
+		m_pWorkers[i].hThread = ::kernelCreateThread(WorkerThreadStub, &m_pWorkers[i]);
 
 	//	Done
 
@@ -58,153 +247,310 @@ void CThreadPool::CleanUp (void)
 //	CleanUp
 //
 //	Free up resources. We assume that this is only called from the same thread
-//	that calls Run.
+//	that called Boot. Any tasks that have not run are deleted (and their
+//	latches are counted down).
 
 	{
 	int i;
 
-	//	Ask all the threads to quit
+	if (m_pWorkers)
+		{
+		//	Ask all the threads to quit and wait for them
 
-	m_Quit.Set();
+		m_bQuit = TRUE;
+		for (i = 1; i < m_iWorkerCount; i++)
+			::ReleaseSemaphore(m_hWorkAvail, 1, NULL);
 
-	//	Wait for all
+		for (i = 1; i < m_iWorkerCount; i++)
+			if (m_pWorkers[i].hThread)
+				{
+				::WaitForSingleObject(m_pWorkers[i].hThread, 5000);
+				::CloseHandle(m_pWorkers[i].hThread);
+				}
 
-	if (m_Threads.GetCount() > 0)
-		{
-		HANDLE *pThreads = new HANDLE [m_Threads.GetCount()];
-		for (i = 0; i < m_Threads.GetCount(); i++)
-			pThreads[i] = m_Threads[i].hThread;
+		//	Free up any tasks left on the deques (no one else is running now)
 
-		::WaitForMultipleObjects(m_Threads.GetCount(), pThreads, TRUE, 5000);
+		for (i = 0; i < m_iWorkerCount; i++)
+			{
+			IThreadPoolTask *pTask;
+			while (pTask = DequePop(m_pWorkers[i].Deque))
+				CompleteTask(pTask);
 
-		delete [] pThreads;
+			DequeFree(m_pWorkers[i].Deque);
+			}
 
-		//	Close all the handles
+		delete [] m_pWorkers;
+		m_pWorkers = NULL;
+		m_iWorkerCount = 0;
+		}
 
-		for (i = 0; i < m_Threads.GetCount(); i++)
-			::CloseHandle(m_Threads[i].hThread);
+	//	Free up any tasks on the injection queue
 
-		m_Threads.DeleteAll();
+	IThreadPoolTask *pTask;
+	while (m_Inject.TryDequeue(&pTask))
+		CompleteTask(pTask);
+
+	if (m_hWorkAvail)
+		{
+		::CloseHandle(m_hWorkAvail);
+		m_hWorkAvail = NULL;
 		}
+	}
 
-	//	Free up any tasks
+void CThreadPool::CompleteTask (IThreadPoolTask *pTask)
 
-	for (i = 0; i < m_Tasks.GetCount(); i++)
-		delete m_Tasks[i];
+//	CompleteTask
+//
+//	Deletes the task and counts down its latch. We delete first so that by the
+//	time a waiter wakes up, the task no longer refers to anything.
 
-	m_Tasks.DeleteAll();
+	{
+	CThreadPoolLatch *pLatch = pTask->m_pLatch;
+	delete pTask;
 
-	for (i = 0; i < m_Completed.GetCount(); i++)
-		delete m_Completed[i];
+	if (pLatch)
+		pLatch->CountDown();
 
-	m_Completed.DeleteAll();
-	m_iTasksRemaining = 0;
+	m_AllTasks.CountDown();
 	}
 
-IThreadPoolTask *CThreadPool::GetTaskToRun (void)
+void CThreadPool::DequeFree (SDeque &Deque)
 
-//	GetTaskToRun
+//	DequeFree
 //
-//	Pull task off the queueu
+//	Frees the deque array and all retired arrays.
 
 	{
-	IThreadPoolTask *pTask;
+	SDequeArray *pArray = Deque.pArray;
+	while (pArray)
+		{
+		SDequeArray *pRetired = pArray->pRetired;
+		delete [] (char *)pArray;
+		pArray = pRetired;
+		}
+
+	Deque.pArray = NULL;
+	}
+
+IThreadPoolTask *CThreadPool::DequePop (SDeque &Deque)
+
+//	DequePop
+//
+//	Pops a task from the bottom of the deque. This must only be called by the
+//	owner. Returns NULL if the deque is empty.
+
+	{
+	LONG iBottom = (LONG)((DWORD)Deque.iBottom - 1);
+	SDequeArray *pArray = Deque.pArray;
+
+	//	Claim the bottom slot. We need a full barrier here so that we read
+	//	iTop after stealers can see the new iBottom.
 
-	m_cs.Lock();
+	::InterlockedExchange(&Deque.iBottom, iBottom);
+	LONG iTop = Deque.iTop;
 
-	if (m_Tasks.GetCount() > 0)
+	LONG iSize = (LONG)((DWORD)iBottom - (DWORD)iTop);
+	if (iSize < 0)
 		{
-		pTask = m_Tasks.Head();
-		m_Tasks.Dequeue();
-		if (m_Tasks.GetCount() == 0)
-			m_WorkAvail.Reset();
+		//	Empty
+
+		Deque.iBottom = (LONG)((DWORD)iBottom + 1);
+		return NULL;
 		}
-	else
+
+	IThreadPoolTask *pTask = pArray->Tasks[(DWORD)iBottom & pArray->dwMask];
+	if (iSize > 0)
+		return pTask;
+
+	//	This was the last task, so we race with stealers for it.
+
+	if (::InterlockedCompareExchange(&Deque.iTop, (LONG)((DWORD)iTop + 1), iTop) != iTop)
 		pTask = NULL;
 
-	m_cs.Unlock();
+	Deque.iBottom = (LONG)((DWORD)iTop + 1);
+	return pTask;
+	}
+
+void CThreadPool::DequePush (SDeque &Deque, IThreadPoolTask *pTask)
+
+//	DequePush
+//
+//	Pushes a task on the bottom of the deque. This must only be called by the
+//	owner.
+
+	{
+	LONG iBottom = Deque.iBottom;
+	LONG iTop = Deque.iTop;
+	SDequeArray *pArray = Deque.pArray;
+
+	//	If we're full, double the array. Stealers might still be reading the
+	//	old array, so we keep it around until CleanUp.
+
+	if ((LONG)((DWORD)iBottom - (DWORD)iTop) > (LONG)pArray->dwMask)
+		{
+		SDequeArray *pNewArray = AllocDequeArray(2 * (int)(pArray->dwMask + 1));
+		for (DWORD i = (DWORD)iTop; i != (DWORD)iBottom; i++)
+			pNewArray->Tasks[i & pNewArray->dwMask] = pArray->Tasks[i & pArray->dwMask];
+
+		pNewArray->pRetired = pArray;
+		Deque.pArray = pNewArray;
+		pArray = pNewArray;
+		}
+
+	pArray->Tasks[(DWORD)iBottom & pArray->dwMask] = pTask;
+
+	//	Publish. Volatile stores have release semantics, so stealers see the
+	//	task before they see the new bottom.
+
+	Deque.iBottom = (LONG)((DWORD)iBottom + 1);
+	}
+
+IThreadPoolTask *CThreadPool::DequeSteal (SDeque &Deque)
+
+//	DequeSteal
+//
+//	Steals a task from the top of the deque. Returns NULL if the deque is
+//	empty or if we lost a race with another thread.
+
+	{
+	LONG iTop = Deque.iTop;
+	::MemoryBarrier();
+	LONG iBottom = Deque.iBottom;
+
+	if ((LONG)((DWORD)iBottom - (DWORD)iTop) <= 0)
+		return NULL;
+
+	SDequeArray *pArray = Deque.pArray;
+	IThreadPoolTask *pTask = pArray->Tasks[(DWORD)iTop & pArray->dwMask];
+
+	if (::InterlockedCompareExchange(&Deque.iTop, (LONG)((DWORD)iTop + 1), iTop) != iTop)
+		return NULL;
 
 	return pTask;
 	}
 
-void CThreadPool::Run (void)
+IThreadPoolTask *CThreadPool::FindTask (SWorker *pWorker)
 
-//	Run
+//	FindTask
 //
-//	Runs until all the tasks are completed. This should only ever be run from
-//	a single thread.
+//	Looks for a task to run: first our own deque, then the injection queue,
+//	then other threads' deques. pWorker may be NULL if this is not a pool
+//	thread. Returns NULL if we found nothing.
 
 	{
 	int i;
-	IThreadPoolTask *pTask = NULL;
+	IThreadPoolTask *pTask;
+
+	if (pWorker && (pTask = DequePop(pWorker->Deque)))
+		return pTask;
 
-	//	If we have no threads then we just run all the tasks
+	if (m_Inject.TryDequeue(&pTask))
+		return pTask;
 
-	if (m_Threads.GetCount() == 0)
+	if (m_iWorkerCount < 2)
+		return NULL;
+
+	//	Start at a random victim so that thieves spread out
+
+	int iStart = 0;
+	if (pWorker)
 		{
-		while (m_Tasks.GetCount() > 0)
-			{
-			pTask = m_Tasks.Head();
-			m_Tasks.Dequeue();
+		DWORD dwRandom = pWorker->dwRandom;
+		dwRandom ^= dwRandom << 13;
+		dwRandom ^= dwRandom >> 17;
+		dwRandom ^= dwRandom << 5;
+		pWorker->dwRandom = dwRandom;
 
-			RunTask(pTask);
-			}
+		iStart = (int)(dwRandom % (DWORD)m_iWorkerCount);
 		}
 
-	//	Otherwise, we let the threads do stuff
-
-	else
+	for (i = 0; i < m_iWorkerCount; i++)
 		{
-		bool bWorkLeft = false;
+		SWorker *pVictim = &m_pWorkers[(iStart + i) % m_iWorkerCount];
+		if (pVictim != pWorker && (pTask = DequeSteal(pVictim->Deque)))
+			return pTask;
+		}
 
-		//	Signal the threads to start
+	return NULL;
+	}
 
-		m_cs.Lock();
-		if (m_Tasks.GetCount() == 0)
-			{
-			m_cs.Unlock();
-			return;
-			}
+CThreadPool::SWorker *CThreadPool::GetCurrentWorker (void) const
+
+//	GetCurrentWorker
+//
+//	Returns the worker for the current thread, or NULL if the current thread
+//	is not part of this pool.
 
-		//	Pull a task for us to run
+	{
+	if (m_pWorkers == NULL)
+		return NULL;
 
-		pTask = m_Tasks.Head();
-		m_Tasks.Dequeue();
-		bWorkLeft = (m_Tasks.GetCount() > 0);
-		m_WorkCompleted.Reset();
+	SWorker *pWorker = (SWorker *)::TlsGetValue(g_dwWorkerTLS);
+	if (pWorker && pWorker->pPool == this)
+		return pWorker;
 
-		m_cs.Unlock();
+	if (::GetCurrentThreadId() == m_dwHostThreadID)
+		return &m_pWorkers[0];
 
-		//	Let the other threads go
+	return NULL;
+	}
 
-		if (bWorkLeft)
-			m_WorkAvail.Set();
+bool CThreadPool::HasWork (void) const
 
-		//	Do our own task
+//	HasWork
+//
+//	Returns TRUE if there might be a task to run.
 
-		if (pTask)
-			RunTask(pTask);
+	{
+	int i;
 
-		//	Wait until we're done with all tasks
+	if (!m_Inject.IsEmpty())
+		return true;
 
-		::WaitForSingleObject(m_WorkCompleted.GetWaitObject(), INFINITE);
+	for (i = 0; i < m_iWorkerCount; i++)
+		{
+		const SDeque &Deque = m_pWorkers[i].Deque;
+		if ((LONG)((DWORD)Deque.iBottom - (DWORD)Deque.iTop) > 0)
+			return true;
 		}
 
-	//	Clean up all tasks
+	return false;
+	}
+
+bool CThreadPool::IsPoolThread (void) const
 
-	for (i = 0; i < m_Completed.GetCount(); i++)
-		delete m_Completed[i];
+//	IsPoolThread
+//
+//	Returns TRUE if the current thread is one of our threads (including the
+//	thread that called Boot).
 
-	m_Completed.DeleteAll();
+	{
+	return (GetCurrentWorker() != NULL);
+	}
+
+void CThreadPool::Run (void)
+
+//	Run
+//
+//	Runs until all the tasks are completed (including any tasks that they
+//	add). The calling thread helps with the work.
+//
+//	NOTE: This must not be called from inside a task, since that task would
+//	never complete. Use a CThreadPoolLatch to wait for a subset of tasks.
+
+	{
+	Wait(m_AllTasks);
 	}
 
 void CThreadPool::RunTask (IThreadPoolTask *pTask)
 
 //	RunTask
 //
-//	Get a task off the queue and run it.
+//	Runs the task and then deletes it.
 
 	{
+	PROFILE_ZONE("CThreadPool::RunTask");
+
 	//	Do the task
 
 	try
@@ -217,37 +563,122 @@ void CThreadPool::RunTask (IThreadPoolTask *pTask)
 
 	//	Done with task
 
-	m_cs.Lock();
-	m_Completed.Insert(pTask);
-	m_iTasksRemaining--;
-	if (m_iTasksRemaining <= 0)
-		m_WorkCompleted.Set();
-	m_cs.Unlock();
+	CompleteTask(pTask);
+	}
+
+void CThreadPool::Wait (CThreadPoolLatch &Latch)
+
+//	Wait
+//
+//	Runs tasks until the latch reaches zero. This is safe to call from inside
+//	a task, since we keep doing work while we wait.
+
+	{
+	SWorker *pWorker = GetCurrentWorker();
+	int iIdle = 0;
+
+	while (!Latch.IsDone())
+		{
+		IThreadPoolTask *pTask = FindTask(pWorker);
+		if (pTask)
+			{
+			RunTask(pTask);
+			iIdle = 0;
+			}
+
+		//	If there's nothing to do, the remaining tasks are running on
+		//	other threads. Spin for a little while, then give up our time
+		//	slice, and finally block until the latch is done or there's more
+		//	work.
+
+		else if (iIdle < SPIN_COUNT)
+			{
+			::YieldProcessor();
+			iIdle++;
+			}
+		else if (iIdle < SPIN_COUNT + YIELD_COUNT)
+			{
+			::SwitchToThread();
+			iIdle++;
+			}
+		else
+			{
+			HANDLE Events[2];
+			Events[0] = Latch.GetWaitEvent();
+			Events[1] = m_hWorkAvail;
+
+			::InterlockedIncrement(&m_iSleeping);
+			if (!Latch.IsDone() && !HasWork())
+				::WaitForMultipleObjects((m_hWorkAvail ? 2 : 1), Events, FALSE, INFINITE);
+			::InterlockedDecrement(&m_iSleeping);
+
+			//	The latch event might be left over from an earlier time that
+			//	the count hit zero.
+
+			if (!Latch.IsDone())
+				::ResetEvent(Events[0]);
+
+			iIdle = 0;
+			}
+		}
+
+	//	If we took a wake-up meant for a worker, pass it on.
+
+	if (HasWork())
+		WakeWorker();
+	}
+
+void CThreadPool::WakeWorker (void)
+
+//	WakeWorker
+//
+//	Wakes up one sleeping thread, if any. This must be called after the new
+//	work has been published.
+
+	{
+	::MemoryBarrier();
+	if (m_iSleeping > 0 && m_hWorkAvail)
+		::ReleaseSemaphore(m_hWorkAvail, 1, NULL);
 	}
 
-void CThreadPool::WorkerThread (void)
+void CThreadPool::WorkerThread (SWorker *pWorker)
 
 //	WorkerThread
 //
 //	Do the work.
 
 	{
-	HANDLE Events[2];
-	Events[0] = m_WorkAvail.GetWaitObject();
-	Events[1] = m_Quit.GetWaitObject();
+	::TlsSetValue(g_dwWorkerTLS, pWorker);
 
-	while (true)
+	int iIdle = 0;
+	while (!m_bQuit)
 		{
-		DWORD dwWait = ::WaitForMultipleObjects(2, Events, FALSE, INFINITE);
-
-		if (dwWait == WAIT_OBJECT_0 + 0)
+		IThreadPoolTask *pTask = FindTask(pWorker);
+		if (pTask)
 			{
-			IThreadPoolTask *pTask = GetTaskToRun();
-			if (pTask)
-				RunTask(pTask);
+			RunTask(pTask);
+			iIdle = 0;
 			}
+		else if (iIdle < SPIN_COUNT)
+			{
+			::YieldProcessor();
+			iIdle++;
+			}
+		else if (iIdle < SPIN_COUNT + YIELD_COUNT)
+			{
+			::SwitchToThread();
+			iIdle++;
+			}
+		else
+			{
+			::InterlockedIncrement(&m_iSleeping);
+			if (!HasWork() && !m_bQuit)
+				::WaitForSingleObject(m_hWorkAvail, INFINITE);
+			::InterlockedDecrement(&m_iSleeping);
 
-		else if (dwWait == WAIT_OBJECT_0 + 1)
-			return;
+			iIdle = 0;
+			}
 		}
+
+	::TlsSetValue(g_dwWorkerTLS, NULL);
 	}
@@ -0,0 +1,612 @@
+//	CZipArchive.cpp
+//
+//	CZipArchive class
+//
+//	We map the archive and parse the central directory once (at Open). Each
+//	extraction reads the entry's local header (only to find where its data
+//	starts) and then inflates straight out of the mapped file. Nothing is
+//	modified after Open, so extraction is safe from many threads at once.
+//
+//	If the archive is too big to map as a single view we map each entry with
+//	its own slice, since moving the shared window is not thread-safe.
+
+#include "Kernel.h"
+#include "Zip.h"
+
+#define ZLIB_WINAPI
+#include "..\zlib-1.2.7\zlib.h"
+
+const DWORD SIG_LOCAL_HEADER =				0x04034b50;
+const DWORD SIG_CENTRAL_HEADER =			0x02014b50;
+const DWORD SIG_END_OF_DIR =				0x06054b50;
+const DWORD SIG_ZIP64_END_OF_DIR =			0x06064b50;
+const DWORD SIG_ZIP64_LOCATOR =				0x07064b50;
+
+const int LOCAL_HEADER_SIZE =				30;
+const int CENTRAL_HEADER_SIZE =				46;
+const int END_OF_DIR_SIZE =					22;
+const int ZIP64_END_OF_DIR_SIZE =			56;
+const int ZIP64_LOCATOR_SIZE =				20;
+const int MAX_COMMENT_SIZE =				0xffff;
+const int MAX_LOCAL_EXTRA_SIZE =			0xffff + 0xffff;	//	Filename + extra field
+
+const WORD EXTRA_ZIP64 =					0x0001;
+const DWORD FLAG_ENCRYPTED =				0x0001;
+
+const int OUTPUT_BUFFER_SIZE =				64 * 1024;
+const DWORD INPUT_CHUNK_SIZE =				64 * 1024 * 1024;
+
+static inline WORD ReadLE16 (const BYTE *pPos) { return (WORD)(pPos[0] | (pPos[1] << 8)); }
+static inline DWORD ReadLE32 (const BYTE *pPos) { return (DWORD)pPos[0] | ((DWORD)pPos[1] << 8) | ((DWORD)pPos[2] << 16) | ((DWORD)pPos[3] << 24); }
+static inline DWORDLONG ReadLE64 (const BYTE *pPos) { return (DWORDLONG)ReadLE32(pPos) | ((DWORDLONG)ReadLE32(pPos + 4) << 32); }
+
+static void ReadZip64Extra (const BYTE *pExtra, int iExtraLen, DWORDLONG *iodwSize, DWORDLONG *iodwCompressedSize, DWORDLONG *iodwHeaderPos);
+
+CZipArchive::CZipArchive (void) :
+		m_pFile(NULL)
+
+//	CZipArchive constructor
+
+	{
+	}
+
+bool CZipArchive::CanExtract (const SEntry &Entry, CString *retsError) const
+
+//	CanExtract
+//
+//	Returns TRUE if we know how to extract the entry.
+
+	{
+	if (Entry.dwFlags & FLAG_ENCRYPTED)
+		{
+		if (retsError) *retsError = CONSTLIT("Encrypted files are not supported.");
+		return false;
+		}
+
+	if (Entry.dwMethod != METHOD_STORED && Entry.dwMethod != METHOD_DEFLATED)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Unsupported compression method: %d."), Entry.dwMethod);
+		return false;
+		}
+
+	if (Entry.dwMethod == METHOD_STORED && Entry.dwSize != Entry.dwCompressedSize)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	return true;
+	}
+
+void CZipArchive::Close (void)
+
+//	Close
+//
+//	Closes the archive
+
+	{
+	if (m_pFile)
+		{
+		delete m_pFile;
+		m_pFile = NULL;
+		}
+
+	m_Entries.DeleteAll();
+	m_Index.DeleteAll();
+	m_sFilename = NULL_STR;
+	}
+
+bool CZipArchive::Decompress (int iEntry, IWriteStream &Output, CString *retsError) const
+
+//	Decompress
+//
+//	Writes the uncompressed contents of the entry to the stream. We inflate
+//	into a small buffer, so this works for entries of any size.
+
+	{
+	ASSERT(iEntry >= 0 && iEntry < m_Entries.GetCount());
+	const SEntry &Entry = m_Entries[iEntry];
+	if (!CanExtract(Entry, retsError))
+		return false;
+
+	BYTE *pData;
+	IReadBlock *pSlice;
+	if (!LocateData(Entry, &pData, &pSlice, retsError))
+		return false;
+
+	DWORD dwCRC = crc32(0, Z_NULL, 0);
+	bool bOK = true;
+
+	//	Stored entries are written straight from the mapped file. We go a
+	//	chunk at a time because the stream takes an int length.
+
+	if (Entry.dwMethod == METHOD_STORED)
+		{
+		DWORDLONG dwPos = 0;
+		while (dwPos < Entry.dwSize)
+			{
+			DWORD dwChunk = (DWORD)Min(Entry.dwSize - dwPos, (DWORDLONG)INPUT_CHUNK_SIZE);
+			dwCRC = crc32(dwCRC, pData + dwPos, dwChunk);
+
+			if (Output.Write((char *)pData + dwPos, (int)dwChunk) != NOERROR)
+				{
+				if (retsError) *retsError = CONSTLIT("Unable to write to output.");
+				bOK = false;
+				break;
+				}
+
+			dwPos += dwChunk;
+			}
+		}
+
+	//	Otherwise we inflate
+
+	else
+		{
+		z_stream zcpr;
+		utlMemSet(&zcpr, sizeof(zcpr), '\0');
+		inflateInit2(&zcpr, -15);
+
+		BYTE *pBuffer = new BYTE [OUTPUT_BUFFER_SIZE];
+		DWORDLONG dwInputLeft = Entry.dwCompressedSize;
+		DWORDLONG dwOutputTotal = 0;
+
+		while (true)
+			{
+			if (zcpr.avail_in == 0 && dwInputLeft > 0)
+				{
+				DWORD dwChunk = (DWORD)Min(dwInputLeft, (DWORDLONG)INPUT_CHUNK_SIZE);
+				zcpr.next_in = pData + (Entry.dwCompressedSize - dwInputLeft);
+				zcpr.avail_in = dwChunk;
+				dwInputLeft -= dwChunk;
+				}
+
+			zcpr.next_out = pBuffer;
+			zcpr.avail_out = OUTPUT_BUFFER_SIZE;
+
+			int ret = inflate(&zcpr, Z_NO_FLUSH);
+			if (ret != Z_OK && ret != Z_STREAM_END)
+				{
+				if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+				bOK = false;
+				break;
+				}
+
+			int iChunk = OUTPUT_BUFFER_SIZE - (int)zcpr.avail_out;
+			dwCRC = crc32(dwCRC, pBuffer, iChunk);
+			dwOutputTotal += iChunk;
+
+			if (Output.Write((char *)pBuffer, iChunk) != NOERROR)
+				{
+				if (retsError) *retsError = CONSTLIT("Unable to write to output.");
+				bOK = false;
+				break;
+				}
+
+			if (ret == Z_STREAM_END)
+				break;
+
+			//	If we're out of input and inflate still wants more, the
+			//	data is truncated.
+
+			if (zcpr.avail_in == 0 && dwInputLeft == 0 && zcpr.avail_out != 0)
+				{
+				if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+				bOK = false;
+				break;
+				}
+			}
+
+		if (bOK && dwOutputTotal != Entry.dwSize)
+			{
+			if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+			bOK = false;
+			}
+
+		inflateEnd(&zcpr);
+		delete [] pBuffer;
+		}
+
+	if (pSlice)
+		delete pSlice;
+
+	//	Check the CRC
+
+	if (bOK && dwCRC != Entry.dwCRC)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	return bOK;
+	}
+
+bool CZipArchive::Decompress (int iEntry, CString *retsData, CString *retsError) const
+
+//	Decompress
+//
+//	Returns the uncompressed contents of the entry as a string. Since we know
+//	the size up front, we inflate directly into the string in one call.
+
+	{
+	ASSERT(iEntry >= 0 && iEntry < m_Entries.GetCount());
+	const SEntry &Entry = m_Entries[iEntry];
+	if (!CanExtract(Entry, retsError))
+		return false;
+
+	if (Entry.dwSize > (DWORDLONG)(MAXLONG - 1) || Entry.dwCompressedSize > (DWORDLONG)MAXDWORD)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive too large: %s."), Entry.sName);
+		return false;
+		}
+
+	BYTE *pData;
+	IReadBlock *pSlice;
+	if (!LocateData(Entry, &pData, &pSlice, retsError))
+		return false;
+
+	bool bOK = true;
+	int iSize = (int)Entry.dwSize;
+
+	if (Entry.dwMethod == METHOD_STORED)
+		*retsData = CString((char *)pData, iSize);
+	else
+		{
+		z_stream zcpr;
+		utlMemSet(&zcpr, sizeof(zcpr), '\0');
+		inflateInit2(&zcpr, -15);
+
+		zcpr.next_in = pData;
+		zcpr.avail_in = (DWORD)Entry.dwCompressedSize;
+		zcpr.next_out = (BYTE *)retsData->GetWritePointer(iSize);
+		zcpr.avail_out = iSize;
+
+		//	We need Z_STREAM_END with exactly the expected size
+
+		int ret = inflate(&zcpr, Z_FINISH);
+		if (ret != Z_STREAM_END || zcpr.total_out != (uLong)iSize)
+			{
+			if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+			bOK = false;
+			}
+
+		inflateEnd(&zcpr);
+		}
+
+	if (pSlice)
+		delete pSlice;
+
+	//	Check the CRC
+
+	if (bOK && crc32(crc32(0, Z_NULL, 0), (BYTE *)retsData->GetASCIIZPointer(), iSize) != Entry.dwCRC)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+		bOK = false;
+		}
+
+	if (!bOK)
+		*retsData = NULL_STR;
+
+	return bOK;
+	}
+
+int CZipArchive::FindEntry (const CString &sFilename) const
+
+//	FindEntry
+//
+//	Returns the index of the entry with the given filename (or -1 if not
+//	found).
+
+	{
+	int iEntry;
+	if (!m_Index.Find(sFilename, &iEntry))
+		return -1;
+
+	return iEntry;
+	}
+
+char *CZipArchive::GetEntryData (int iEntry, DWORDLONG *retdwLength) const
+
+//	GetEntryData
+//
+//	Returns a pointer to the contents of a stored (uncompressed) entry,
+//	inside the mapped file. The pointer is valid until the archive is closed.
+//	We do not check the CRC.
+//
+//	Returns NULL if the entry is compressed (or if the archive is too large
+//	to keep mapped).
+
+	{
+	ASSERT(iEntry >= 0 && iEntry < m_Entries.GetCount());
+	const SEntry &Entry = m_Entries[iEntry];
+	if (Entry.dwMethod != METHOD_STORED
+			|| !CanExtract(Entry, NULL)
+			|| m_pFile->IsWindowed())
+		return NULL;
+
+	BYTE *pData;
+	IReadBlock *pSlice;
+	if (!LocateData(Entry, &pData, &pSlice, NULL))
+		return NULL;
+
+	if (retdwLength)
+		*retdwLength = Entry.dwSize;
+
+	return (char *)pData;
+	}
+
+bool CZipArchive::LocateData (const SEntry &Entry, BYTE **retpData, IReadBlock **retpSlice, CString *retsError) const
+
+//	LocateData
+//
+//	Returns a pointer to the entry's (compressed) data. The local header has
+//	its own filename and extra field lengths, so we have to read it to find
+//	where the data starts.
+//
+//	If the file is windowed, we return a slice (which the caller must free)
+//	that holds the data.
+
+	{
+	DWORDLONG dwFileSize = m_pFile->GetLength64();
+	BYTE *pHeader;
+
+	*retpSlice = NULL;
+
+	if (Entry.dwHeaderPos + LOCAL_HEADER_SIZE > dwFileSize)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	if (m_pFile->IsWindowed())
+		{
+		*retpSlice = m_pFile->CreateSlice(Entry.dwHeaderPos, LOCAL_HEADER_SIZE + MAX_LOCAL_EXTRA_SIZE + Entry.dwCompressedSize);
+		if (*retpSlice == NULL)
+			{
+			if (retsError) *retsError = strPatternSubst(CONSTLIT("Unable to map file in archive: %s."), m_sFilename);
+			return false;
+			}
+
+		pHeader = (BYTE *)(*retpSlice)->GetPointer64(0, (*retpSlice)->GetLength64());
+		}
+	else
+		pHeader = (BYTE *)m_pFile->GetPointer64(Entry.dwHeaderPos, LOCAL_HEADER_SIZE);
+
+	//	Find the data
+
+	DWORDLONG dwDataPos = Entry.dwHeaderPos + LOCAL_HEADER_SIZE + ReadLE16(pHeader + 26) + ReadLE16(pHeader + 28);
+	if (ReadLE32(pHeader) != SIG_LOCAL_HEADER
+			|| dwDataPos + Entry.dwCompressedSize > dwFileSize)
+		{
+		if (*retpSlice)
+			{
+			delete *retpSlice;
+			*retpSlice = NULL;
+			}
+
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("File in archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	*retpData = pHeader + (DWORD)(dwDataPos - Entry.dwHeaderPos);
+	return true;
+	}
+
+bool CZipArchive::Open (const CString &sFilename, CString *retsError)
+
+//	Open
+//
+//	Opens the archive and reads its directory.
+
+	{
+	Close();
+
+	m_pFile = new CMappedFileBlock(sFilename, CMappedFileBlock::FLAG_RANDOM);
+	if (m_pFile->Open() != NOERROR)
+		{
+		Close();
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Unable to open file: %s."), sFilename);
+		return false;
+		}
+
+	m_sFilename = sFilename;
+
+	if (!ReadDirectory(retsError))
+		{
+		Close();
+		return false;
+		}
+
+	return true;
+	}
+
+bool CZipArchive::ReadDirectory (CString *retsError)
+
+//	ReadDirectory
+//
+//	Finds the central directory (from the end of directory record at the end
+//	of the file) and indexes every entry.
+
+	{
+	DWORDLONG dwFileSize = m_pFile->GetLength64();
+	if (dwFileSize < END_OF_DIR_SIZE)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Not a zip archive: %s."), m_sFilename);
+		return false;
+		}
+
+	//	The end of directory record is followed by a comment of up to 64 KB,
+	//	so we search backwards for its signature.
+
+	DWORD dwTail = (DWORD)Min(dwFileSize, (DWORDLONG)(END_OF_DIR_SIZE + MAX_COMMENT_SIZE));
+	BYTE *pTail = (BYTE *)m_pFile->GetPointer64(dwFileSize - dwTail, dwTail);
+	if (pTail == NULL)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Unable to read file: %s."), m_sFilename);
+		return false;
+		}
+
+	int iEnd = (int)dwTail - END_OF_DIR_SIZE;
+	while (iEnd >= 0 && ReadLE32(pTail + iEnd) != SIG_END_OF_DIR)
+		iEnd--;
+
+	if (iEnd < 0)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Not a zip archive: %s."), m_sFilename);
+		return false;
+		}
+
+	BYTE *pEnd = pTail + iEnd;
+	DWORDLONG dwEndPos = (dwFileSize - dwTail) + iEnd;
+	DWORDLONG dwEntries = ReadLE16(pEnd + 10);
+	DWORDLONG dwDirSize = ReadLE32(pEnd + 12);
+	DWORDLONG dwDirPos = ReadLE32(pEnd + 16);
+	DWORDLONG dwDirEnd = dwEndPos;
+
+	//	If any of the values overflowed, the real ones are in the Zip64 end of
+	//	directory record (found through a locator just before this record).
+
+	if ((dwEntries == 0xffff || dwDirSize == 0xffffffff || dwDirPos == 0xffffffff)
+			&& dwEndPos >= ZIP64_LOCATOR_SIZE)
+		{
+		BYTE *pLocator = (BYTE *)m_pFile->GetPointer64(dwEndPos - ZIP64_LOCATOR_SIZE, ZIP64_LOCATOR_SIZE);
+		if (pLocator && ReadLE32(pLocator) == SIG_ZIP64_LOCATOR)
+			{
+			DWORDLONG dwEnd64Pos = ReadLE64(pLocator + 8);
+			BYTE *pEnd64 = (dwEnd64Pos + ZIP64_END_OF_DIR_SIZE <= dwEndPos ? (BYTE *)m_pFile->GetPointer64(dwEnd64Pos, ZIP64_END_OF_DIR_SIZE) : NULL);
+			if (pEnd64 == NULL || ReadLE32(pEnd64) != SIG_ZIP64_END_OF_DIR)
+				{
+				if (retsError) *retsError = strPatternSubst(CONSTLIT("Zip archive corrupted: %s."), m_sFilename);
+				return false;
+				}
+
+			dwEntries = ReadLE64(pEnd64 + 32);
+			dwDirSize = ReadLE64(pEnd64 + 40);
+			dwDirPos = ReadLE64(pEnd64 + 48);
+			dwDirEnd = dwEnd64Pos;
+			}
+		}
+
+	//	The directory ends right before the end record, unless there is data
+	//	in front of the archive (e.g., a self-extractor). In that case all the
+	//	offsets in the archive are off by the size of that data.
+
+	if (dwDirSize > dwDirEnd || dwDirPos > dwDirEnd - dwDirSize || dwDirSize > (DWORDLONG)MAXLONG)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Zip archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	DWORDLONG dwBias = dwDirEnd - (dwDirPos + dwDirSize);
+	dwDirPos += dwBias;
+
+	BYTE *pDir = (BYTE *)m_pFile->GetPointer64(dwDirPos, dwDirSize);
+	if (pDir == NULL && dwDirSize > 0)
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Unable to read file: %s."), m_sFilename);
+		return false;
+		}
+
+	//	Index all entries
+
+	int iExpected = (int)Min(dwEntries, dwDirSize / CENTRAL_HEADER_SIZE);
+	m_Entries.GrowToFit(iExpected);
+	m_Index.GrowToFit(iExpected);
+
+	BYTE *pPos = pDir;
+	BYTE *pDirEnd = pDir + (DWORD)dwDirSize;
+	DWORDLONG dwFound = 0;
+	while (pPos + CENTRAL_HEADER_SIZE <= pDirEnd && ReadLE32(pPos) == SIG_CENTRAL_HEADER)
+		{
+		int iNameLen = ReadLE16(pPos + 28);
+		int iExtraLen = ReadLE16(pPos + 30);
+		int iCommentLen = ReadLE16(pPos + 32);
+		BYTE *pName = pPos + CENTRAL_HEADER_SIZE;
+		BYTE *pExtra = pName + iNameLen;
+		BYTE *pNext = pExtra + iExtraLen + iCommentLen;
+		if (pNext > pDirEnd)
+			break;
+
+		DWORDLONG dwCompressedSize = ReadLE32(pPos + 20);
+		DWORDLONG dwSize = ReadLE32(pPos + 24);
+		DWORDLONG dwHeaderPos = ReadLE32(pPos + 42);
+		ReadZip64Extra(pExtra, iExtraLen, &dwSize, &dwCompressedSize, &dwHeaderPos);
+
+		SEntry *pEntry = m_Entries.Insert();
+		pEntry->sName = CString((char *)pName, iNameLen);
+		pEntry->dwMethod = ReadLE16(pPos + 10);
+		pEntry->dwFlags = ReadLE16(pPos + 8);
+		pEntry->dwCRC = ReadLE32(pPos + 16);
+		pEntry->dwCompressedSize = dwCompressedSize;
+		pEntry->dwSize = dwSize;
+		pEntry->dwHeaderPos = dwHeaderPos + dwBias;
+
+		//	If a name appears more than once, we find the first one (as
+		//	minizip does), but we keep all of them in the list.
+
+		if (!m_Index.FindPos(pEntry->sName))
+			m_Index.Insert(pEntry->sName, m_Entries.GetCount() - 1);
+
+		dwFound++;
+		pPos = pNext;
+		}
+
+	//	Old archives may have a wrapped (16-bit) count, so we only check the
+	//	count when it is not saturated.
+
+	if (dwFound != dwEntries && (dwEntries != 0xffff || dwFound < dwEntries))
+		{
+		if (retsError) *retsError = strPatternSubst(CONSTLIT("Zip archive corrupted: %s."), m_sFilename);
+		return false;
+		}
+
+	return true;
+	}
+
+//	Helpers --------------------------------------------------------------------
+
+void ReadZip64Extra (const BYTE *pExtra, int iExtraLen, DWORDLONG *iodwSize, DWORDLONG *iodwCompressedSize, DWORDLONG *iodwHeaderPos)
+
+//	ReadZip64Extra
+//
+//	If any of the values are saturated (0xffffffff), the real values are in
+//	the Zip64 extra field, in order, but only for the saturated values.
+
+	{
+	if (*iodwSize != 0xffffffff && *iodwCompressedSize != 0xffffffff && *iodwHeaderPos != 0xffffffff)
+		return;
+
+	const BYTE *pPos = pExtra;
+	const BYTE *pPosEnd = pExtra + iExtraLen;
+	while (pPos + 4 <= pPosEnd)
+		{
+		WORD wID = ReadLE16(pPos);
+		int iLen = ReadLE16(pPos + 2);
+		const BYTE *pData = pPos + 4;
+		const BYTE *pDataEnd = pData + iLen;
+		if (pDataEnd > pPosEnd)
+			return;
+
+		if (wID == EXTRA_ZIP64)
+			{
+			if (*iodwSize == 0xffffffff && pData + 8 <= pDataEnd)
+				{
+				*iodwSize = ReadLE64(pData);
+				pData += 8;
+				}
+
+			if (*iodwCompressedSize == 0xffffffff && pData + 8 <= pDataEnd)
+				{
+				*iodwCompressedSize = ReadLE64(pData);
+				pData += 8;
+				}
+
+			if (*iodwHeaderPos == 0xffffffff && pData + 8 <= pDataEnd)
+				*iodwHeaderPos = ReadLE64(pData);
+
+			return;
+			}
+
+		pPos = pDataEnd;
+		}
+	}
@@ -0,0 +1,1363 @@
+//	CryptoDigest.cpp
+//
+//	Implements CDigestContext and file digests
+//	Copyright 2012 by Kronosaur Productions, LLC. All Rights Reserved.
+//
+//	We have three ways to compute a digest, fastest first:
+//
+//	1.	The SHA extensions (SHA-NI), one message at a time.
+//	2.	SSE2, four messages at a time (one per 32-bit lane). This is only used
+//		for batches of files (fileCreateDigests) on CPUs without SHA-NI.
+//	3.	Portable C, one message at a time. SHA-1 is in SecureHashAlgorithm.cpp.
+//
+//	All paths produce the same digest; we pick the best one the first time
+//	it is needed.
+
+#include "Kernel.h"
+#include "KernelObjID.h"
+
+#include "Crypto.h"
+
+#include <immintrin.h>
+
+const int BLOCK_SIZE =						64;
+const int MULTI_BUFFER_LANES =				4;
+const int FILES_PER_BATCH =					16;
+const DWORDLONG LANE_CHUNK_SIZE =			16 * 1024 * 1024;
+const DWORD READ_CHUNK_SIZE =				64 * 1024 * 1024;
+
+typedef DWORD LANESTATE[MULTI_BUFFER_LANES];
+
+typedef void (*DIGESTBLOCKSPROC) (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
+typedef void (*DIGESTBLOCK4PROC) (LANESTATE *pState, const BYTE **pBlocks);
+
+struct SDigestFunctions
+	{
+	DIGESTBLOCKSPROC pfnBlocks;				//	Single message
+	DIGESTBLOCK4PROC pfnBlocks4;			//	Four messages in lock-step (may be NULL)
+	bool bHardware;							//	pfnBlocks uses the SHA extensions
+	};
+
+struct SDigestLane
+	{
+	int iMessage;							//	Message index (-1 if idle)
+	IReadBlock *pChunk;						//	Mapped piece of the message (or NULL)
+	DWORDLONG dwNextChunk;					//	Offset of the next piece to map
+	DWORDLONG dwBodyEnd;					//	End of the whole blocks
+	const BYTE *pPos;						//	Next whole block of the message
+	DWORDLONG dwBlocks;						//	Whole blocks left in pChunk
+	int iTailPos;							//	Next padded block
+	int iTailBlocks;						//	Total padded blocks (1 or 2)
+	BYTE Tail[2 * BLOCK_SIZE];				//	Last partial block plus padding
+	};
+
+static const DWORD SHA1_INIT[5] =
+	{
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+	};
+
+static const DWORD SHA256_INIT[8] =
+	{
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+static const DWORD SHA256_K[64] =
+	{
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+	};
+
+#define ROTR32(x, n)						(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROTL4(x, n)							_mm_or_si128(_mm_slli_epi32((x), (n)), _mm_srli_epi32((x), 32 - (n)))
+#define ROTR4(x, n)							_mm_or_si128(_mm_srli_epi32((x), (n)), _mm_slli_epi32((x), 32 - (n)))
+
+static SDigestFunctions g_DigestFunctions[2];
+static volatile LONG g_bDigestFunctionsInit = FALSE;
+
+void SHA1CompressScalar (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
+static void SHA1CompressSHA (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
+static void SHA1Compress4 (LANESTATE *pState, const BYTE **pBlocks);
+static void SHA256CompressScalar (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
+static void SHA256CompressSHA (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
+static void SHA256Compress4 (LANESTATE *pState, const BYTE **pBlocks);
+
+static int BuildFinalBlocks (const BYTE *pTail, int iTailLength, DWORDLONG dwTotalLength, BYTE *retBlocks);
+static void DigestFiles (const TArray<CString> &Files, int iStart, int iEnd, EDigestAlgorithms iAlgorithm, TArray<CIntegerIP> &Digests, TArray<ALERROR> &Errors);
+static void DigestMultiBuffer (EDigestAlgorithms iAlgorithm, int iCount, IReadBlock **pData, BYTE *retDigests, ALERROR *retErrors);
+static const SDigestFunctions &GetDigestFunctions (EDigestAlgorithms iAlgorithm);
+static const DWORD *GetInitialState (EDigestAlgorithms iAlgorithm);
+static bool MapNextChunk (IReadBlock *pData, SDigestLane &Lane);
+static bool StartLane (IReadBlock *pData, SDigestLane &Lane);
+static void StoreDigest (const DWORD *pState, int iLength, BYTE *retDigest);
+
+//	CDigestContext -------------------------------------------------------------
+
+CDigestContext::CDigestContext (EDigestAlgorithms iAlgorithm) :
+		m_iAlgorithm(iAlgorithm)
+
+//	CDigestContext constructor
+
+	{
+	Reset();
+	}
+
+void CDigestContext::Add (const void *pData, DWORDLONG dwLength)
+
+//	Add
+//
+//	Adds data to the digest. Whole blocks are hashed straight from the
+//	caller's buffer.
+
+	{
+	DIGESTBLOCKSPROC pfnBlocks = GetDigestFunctions(m_iAlgorithm).pfnBlocks;
+	const BYTE *pPos = (const BYTE *)pData;
+	int iBuffered = (int)(m_dwLength % BLOCK_SIZE);
+
+	m_dwLength += dwLength;
+
+	//	Finish the partial block first
+
+	if (iBuffered)
+		{
+		int iFill = (int)Min((DWORDLONG)(BLOCK_SIZE - iBuffered), dwLength);
+		memcpy(m_Buffer + iBuffered, pPos, iFill);
+		pPos += iFill;
+		dwLength -= iFill;
+
+		if (iBuffered + iFill < BLOCK_SIZE)
+			return;
+
+		pfnBlocks(m_State, m_Buffer, 1);
+		}
+
+	//	Whole blocks
+
+	DWORDLONG dwBlocks = dwLength / BLOCK_SIZE;
+	if (dwBlocks)
+		{
+		pfnBlocks(m_State, pPos, dwBlocks);
+		pPos += dwBlocks * BLOCK_SIZE;
+		dwLength -= dwBlocks * BLOCK_SIZE;
+		}
+
+	//	Keep the rest for later
+
+	if (dwLength)
+		memcpy(m_Buffer, pPos, (size_t)dwLength);
+	}
+
+ALERROR CDigestContext::Add (IReadBlock &Data)
+
+//	Add
+//
+//	Adds the whole block. We go a chunk at a time so that mapped files larger
+//	than the address space still work. Returns ERR_MEMORY if we could not map
+//	a chunk; the digest is then incomplete and the caller must not use it.
+
+	{
+	DWORDLONG dwLength = Data.GetLength64();
+	DWORDLONG dwPos = 0;
+
+	Data.SetAccessHint(IReadBlock::accessSequential);
+
+	while (dwPos < dwLength)
+		{
+		DWORDLONG dwChunk = Min(dwLength - dwPos, (DWORDLONG)READ_CHUNK_SIZE);
+		char *pChunk = Data.GetPointer64(dwPos, dwChunk);
+		if (pChunk == NULL)
+			return ERR_MEMORY;
+
+		Add(pChunk, dwChunk);
+		dwPos += dwChunk;
+		}
+
+	return NOERROR;
+	}
+
+void CDigestContext::Final (BYTE *retDigest)
+
+//	Final
+//
+//	Pads the message and returns the digest (GetDigestLength() bytes). The
+//	context is reset afterwards.
+
+	{
+	BYTE Blocks[2 * BLOCK_SIZE];
+	int iBlocks = BuildFinalBlocks(m_Buffer, (int)(m_dwLength % BLOCK_SIZE), m_dwLength, Blocks);
+	GetDigestFunctions(m_iAlgorithm).pfnBlocks(m_State, Blocks, iBlocks);
+
+	StoreDigest(m_State, GetDigestLength(), retDigest);
+	Reset();
+	}
+
+void CDigestContext::Final (CIntegerIP *retDigest)
+
+//	Final
+//
+//	Returns the digest
+
+	{
+	BYTE Digest[4 * MAX_STATE];
+	Final(Digest);
+	*retDigest = CIntegerIP(GetDigestLength(), Digest);
+	}
+
+int CDigestContext::GetDigestLength (EDigestAlgorithms iAlgorithm)
+
+//	GetDigestLength
+//
+//	Returns the length of the digest in bytes
+
+	{
+	switch (iAlgorithm)
+		{
+		case digestSHA1:
+			return 20;
+
+		case digestSHA256:
+			return 32;
+
+		default:
+			ASSERT(false);
+			return 0;
+		}
+	}
+
+void CDigestContext::Reset (void)
+
+//	Reset
+//
+//	Starts a new message
+
+	{
+	const DWORD *pInit = GetInitialState(m_iAlgorithm);
+	memcpy(m_State, pInit, GetDigestLength());
+	m_dwLength = 0;
+	}
+
+//	Functions ------------------------------------------------------------------
+
+int BuildFinalBlocks (const BYTE *pTail, int iTailLength, DWORDLONG dwTotalLength, BYTE *retBlocks)
+
+//	BuildFinalBlocks
+//
+//	Pads the last partial block (iTailLength < BLOCK_SIZE bytes) with 0x80,
+//	zeros, and the big-endian bit length. retBlocks must hold two blocks.
+//	Returns the number of blocks written (1 or 2).
+
+	{
+	int i;
+
+	if (iTailLength)
+		memcpy(retBlocks, pTail, iTailLength);
+	retBlocks[iTailLength] = 0x80;
+
+	int iBlocks = (iTailLength + 9 <= BLOCK_SIZE ? 1 : 2);
+	int iLengthPos = iBlocks * BLOCK_SIZE - 8;
+	memset(retBlocks + iTailLength + 1, 0, iLengthPos - (iTailLength + 1));
+
+	DWORDLONG dwBits = dwTotalLength * 8;
+	for (i = 0; i < 8; i++)
+		retBlocks[iLengthPos + i] = (BYTE)(dwBits >> (56 - 8 * i));
+
+	return iBlocks;
+	}
+
+static inline __m128i ByteSwap4 (__m128i x)
+
+//	ByteSwap4
+//
+//	Reverses the bytes of each 32-bit lane
+
+	{
+	x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+	return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+	}
+
+void DigestFiles (const TArray<CString> &Files, int iStart, int iEnd, EDigestAlgorithms iAlgorithm, TArray<CIntegerIP> &Digests, TArray<ALERROR> &Errors)
+
+//	DigestFiles
+//
+//	Digests files iStart to iEnd - 1, hashing straight from the mapping. We
+//	open the files windowed, so nothing is mapped until we hash it. If we can
+//	hash several messages at once, each lane maps its file a piece at a time
+//	(see DigestMultiBuffer); otherwise we stream each file through a context.
+//	Either way we only have a few pieces mapped at once, so many of these can
+//	run in parallel, even in a 32-bit address space.
+
+	{
+	int i;
+	const SDigestFunctions &Functions = GetDigestFunctions(iAlgorithm);
+	bool bMultiBuffer = (Functions.pfnBlocks4 && !Functions.bHardware && iEnd - iStart > 1);
+	int iDigestLength = CDigestContext::GetDigestLength(iAlgorithm);
+
+	TArray<IReadBlock *> Opened;
+	TArray<int> Index;
+
+	for (i = iStart; i < iEnd; i++)
+		{
+		CMappedFileBlock *pFile = new CMappedFileBlock(Files[i], CMappedFileBlock::FLAG_SEQUENTIAL | CMappedFileBlock::FLAG_WINDOWED);
+		if (Errors[i] = pFile->Open())
+			{
+			delete pFile;
+			continue;
+			}
+
+		if (!bMultiBuffer)
+			{
+			CDigestContext Context(iAlgorithm);
+			if ((Errors[i] = Context.Add(*pFile)) == NOERROR)
+				Context.Final(&Digests[i]);
+			delete pFile;
+			continue;
+			}
+
+		Opened.Insert(pFile);
+		Index.Insert(i);
+		}
+
+	//	Hash the files together
+
+	if (Index.GetCount() > 0)
+		{
+		BYTE *pDigests = new BYTE [Index.GetCount() * iDigestLength];
+		TArray<ALERROR> MapErrors;
+		MapErrors.InsertEmpty(Index.GetCount());
+
+		DigestMultiBuffer(iAlgorithm, Index.GetCount(), &Opened[0], pDigests, &MapErrors[0]);
+
+		for (i = 0; i < Index.GetCount(); i++)
+			{
+			if (Errors[Index[i]] = MapErrors[i])
+				continue;
+
+			Digests[Index[i]] = CIntegerIP(iDigestLength, pDigests + i * iDigestLength);
+			}
+
+		delete [] pDigests;
+		}
+
+	for (i = 0; i < Opened.GetCount(); i++)
+		delete Opened[i];
+	}
+
+void DigestMultiBuffer (EDigestAlgorithms iAlgorithm, int iCount, IReadBlock **pData, BYTE *retDigests, ALERROR *retErrors)
+
+//	DigestMultiBuffer
+//
+//	Digests iCount messages, four at a time. Each lane takes the next message
+//	as soon as it finishes one, so messages of different lengths still keep
+//	the lanes busy. Each lane maps its message LANE_CHUNK_SIZE bytes at a
+//	time, so we never have more than a few pieces mapped. retDigests gets
+//	iCount digests, back to back; retErrors gets an error for each message
+//	(NOERROR or ERR_MEMORY if we could not map it).
+
+	{
+	int i;
+	const SDigestFunctions &Functions = GetDigestFunctions(iAlgorithm);
+	const DWORD *pInit = GetInitialState(iAlgorithm);
+	int iDigestLength = CDigestContext::GetDigestLength(iAlgorithm);
+	int iStateWords = iDigestLength / 4;
+
+	SDigestLane Lanes[MULTI_BUFFER_LANES];
+	LANESTATE State[8];
+	BYTE Idle[BLOCK_SIZE];
+	int iNext = 0;
+
+	utlMemSet(Idle, sizeof(Idle), 0);
+	for (i = 0; i < MULTI_BUFFER_LANES; i++)
+		{
+		Lanes[i].iMessage = -1;
+		Lanes[i].pChunk = NULL;
+		}
+
+	for (i = 0; i < iCount; i++)
+		retErrors[i] = NOERROR;
+
+	while (true)
+		{
+		int iActive = 0;
+
+		//	Start new messages on idle lanes
+
+		for (i = 0; i < MULTI_BUFFER_LANES; i++)
+			{
+			SDigestLane &Lane = Lanes[i];
+			while (Lane.iMessage == -1 && iNext < iCount)
+				{
+				if (!StartLane(pData[iNext], Lane))
+					{
+					retErrors[iNext++] = ERR_MEMORY;
+					continue;
+					}
+
+				Lane.iMessage = iNext;
+				for (int j = 0; j < iStateWords; j++)
+					State[j][i] = pInit[j];
+
+				iNext++;
+				}
+
+			if (Lane.iMessage != -1)
+				iActive++;
+			}
+
+		if (iActive == 0)
+			break;
+
+		//	If only one message is left, we finish it on its own; the single
+		//	message function is faster than one busy lane.
+
+		if (iActive == 1 && iNext == iCount)
+			{
+			for (i = 0; i < MULTI_BUFFER_LANES; i++)
+				{
+				SDigestLane &Lane = Lanes[i];
+				if (Lane.iMessage == -1)
+					continue;
+
+				DWORD LaneState[8];
+				for (int j = 0; j < iStateWords; j++)
+					LaneState[j] = State[j][i];
+
+				bool bMapped = true;
+				while (Lane.dwBlocks && bMapped)
+					{
+					Functions.pfnBlocks(LaneState, Lane.pPos, Lane.dwBlocks);
+					bMapped = MapNextChunk(pData[Lane.iMessage], Lane);
+					}
+
+				if (bMapped)
+					{
+					Functions.pfnBlocks(LaneState, Lane.Tail + Lane.iTailPos * BLOCK_SIZE, Lane.iTailBlocks - Lane.iTailPos);
+					StoreDigest(LaneState, iDigestLength, retDigests + Lane.iMessage * iDigestLength);
+					}
+				else
+					retErrors[Lane.iMessage] = ERR_MEMORY;
+
+				delete Lane.pChunk;
+				Lane.pChunk = NULL;
+				Lane.iMessage = -1;
+				}
+			break;
+			}
+
+		//	Hash one block on every lane (idle lanes hash zeros)
+
+		const BYTE *pBlocks[MULTI_BUFFER_LANES];
+		for (i = 0; i < MULTI_BUFFER_LANES; i++)
+			{
+			SDigestLane &Lane = Lanes[i];
+			if (Lane.iMessage == -1)
+				pBlocks[i] = Idle;
+			else if (Lane.dwBlocks)
+				pBlocks[i] = Lane.pPos;
+			else
+				pBlocks[i] = Lane.Tail + Lane.iTailPos * BLOCK_SIZE;
+			}
+
+		Functions.pfnBlocks4(State, pBlocks);
+
+		//	Advance
+
+		for (i = 0; i < MULTI_BUFFER_LANES; i++)
+			{
+			SDigestLane &Lane = Lanes[i];
+			if (Lane.iMessage == -1)
+				continue;
+
+			if (Lane.dwBlocks)
+				{
+				Lane.pPos += BLOCK_SIZE;
+
+				//	At the end of the piece, map the next one (if any).
+
+				if (--Lane.dwBlocks == 0 && !MapNextChunk(pData[Lane.iMessage], Lane))
+					{
+					retErrors[Lane.iMessage] = ERR_MEMORY;
+					Lane.iMessage = -1;
+					}
+				}
+			else if (++Lane.iTailPos == Lane.iTailBlocks)
+				{
+				DWORD LaneState[8];
+				for (int j = 0; j < iStateWords; j++)
+					LaneState[j] = State[j][i];
+
+				StoreDigest(LaneState, iDigestLength, retDigests + Lane.iMessage * iDigestLength);
+
+				delete Lane.pChunk;
+				Lane.pChunk = NULL;
+				Lane.iMessage = -1;
+				}
+			}
+		}
+	}
+
+ALERROR fileCreateDigest (const CString &sFilespec, CIntegerIP *retDigest)
+
+//	fileCreateDigest
+//
+//	Creates a SHA-1 digest of the file
+
+	{
+	return fileCreateDigest(sFilespec, digestSHA1, retDigest);
+	}
+
+ALERROR fileCreateDigest (const CString &sFilespec, EDigestAlgorithms iAlgorithm, CIntegerIP *retDigest)
+
+//	fileCreateDigest
+//
+//	Creates a digest of the file. We map the file instead of reading it.
+
+	{
+	ALERROR error;
+
+	CMappedFileBlock File(sFilespec, CMappedFileBlock::FLAG_SEQUENTIAL);
+	if (error = File.Open())
+		return error;
+
+	CDigestContext Context(iAlgorithm);
+	if (error = Context.Add(File))
+		return error;
+
+	Context.Final(retDigest);
+
+	File.Close();
+
+	return NOERROR;
+	}
+
+ALERROR fileCreateDigests (const TArray<CString> &Files, EDigestAlgorithms iAlgorithm, TArray<CIntegerIP> *retDigests, TArray<ALERROR> *retErrors, CThreadPool *pPool)
+
+//	fileCreateDigests
+//
+//	Creates a digest of each file, in parallel. We use the caller's pool, if
+//	any; otherwise we start one for the call. retDigests (and retErrors, if
+//	not NULL) get one entry per file, in order. If any file fails we return
+//	the first error (the other digests are still valid).
+
+	{
+	int i;
+	int iCount = Files.GetCount();
+
+	TArray<ALERROR> Errors;
+	Errors.InsertEmpty(iCount);
+
+	retDigests->DeleteAll();
+	retDigests->InsertEmpty(iCount);
+
+	//	With the SHA extensions each file is a task. Otherwise we hand out
+	//	batches of files so that each task can hash four at a time.
+
+	const SDigestFunctions &Functions = GetDigestFunctions(iAlgorithm);
+	int iBatchSize = (Functions.pfnBlocks4 && !Functions.bHardware ? FILES_PER_BATCH : 1);
+	int iBatches = (iCount + iBatchSize - 1) / iBatchSize;
+
+	auto DigestBatch = [&](int iBatch)
+		{
+		int iStart = iBatch * iBatchSize;
+		DigestFiles(Files, iStart, Min(iStart + iBatchSize, iCount), iAlgorithm, *retDigests, Errors);
+		};
+
+	if (pPool && pPool->GetThreadCount() > 1)
+		pPool->ParallelFor(0, iBatches, 1, DigestBatch);
+	else
+		{
+		CThreadPool Pool;
+		int iThreads = Min(::sysGetProcessorCount(), iBatches);
+
+		if (pPool == NULL && iThreads > 1 && Pool.Boot(iThreads))
+			Pool.ParallelFor(0, iBatches, 1, DigestBatch);
+		else
+			{
+			for (i = 0; i < iBatches; i++)
+				DigestBatch(i);
+			}
+		}
+
+	//	Done
+
+	ALERROR error = NOERROR;
+	for (i = 0; i < iCount; i++)
+		if (Errors[i])
+			{
+			error = Errors[i];
+			break;
+			}
+
+	if (retErrors)
+		*retErrors = Errors;
+
+	return error;
+	}
+
+const SDigestFunctions &GetDigestFunctions (EDigestAlgorithms iAlgorithm)
+
+//	GetDigestFunctions
+//
+//	Returns the block functions for the algorithm, based on the CPU. If two
+//	threads race here they compute the same table, so we only need the flag to
+//	be set after the table is.
+
+	{
+	if (!g_bDigestFunctionsInit)
+		{
+		DWORD dwFeatures = ::sysGetCPUFeatures();
+		bool bSSE2 = ((dwFeatures & CPU_FEATURE_SSE2) != 0);
+		bool bSHA = ((dwFeatures & (CPU_FEATURE_SHA | CPU_FEATURE_SSSE3 | CPU_FEATURE_SSE41)) == (CPU_FEATURE_SHA | CPU_FEATURE_SSSE3 | CPU_FEATURE_SSE41));
+
+		g_DigestFunctions[digestSHA1].pfnBlocks = (bSHA ? SHA1CompressSHA : SHA1CompressScalar);
+		g_DigestFunctions[digestSHA1].pfnBlocks4 = (bSSE2 ? SHA1Compress4 : NULL);
+		g_DigestFunctions[digestSHA1].bHardware = bSHA;
+
+		g_DigestFunctions[digestSHA256].pfnBlocks = (bSHA ? SHA256CompressSHA : SHA256CompressScalar);
+		g_DigestFunctions[digestSHA256].pfnBlocks4 = (bSSE2 ? SHA256Compress4 : NULL);
+		g_DigestFunctions[digestSHA256].bHardware = bSHA;
+
+		::InterlockedExchange(&g_bDigestFunctionsInit, TRUE);
+		}
+
+	return g_DigestFunctions[iAlgorithm];
+	}
+
+const DWORD *GetInitialState (EDigestAlgorithms iAlgorithm)
+
+//	GetInitialState
+//
+//	Returns the initial hash value
+
+	{
+	return (iAlgorithm == digestSHA256 ? SHA256_INIT : SHA1_INIT);
+	}
+
+static inline void LoadBlocks4 (const BYTE **pBlocks, __m128i *retW)
+
+//	LoadBlocks4
+//
+//	Loads the 16 big-endian words of four blocks so that retW[i] has word i
+//	of each block (block n in lane n).
+
+	{
+	for (int i = 0; i < 4; i++)
+		{
+		__m128i R0 = _mm_loadu_si128((const __m128i *)(pBlocks[0] + 16 * i));
+		__m128i R1 = _mm_loadu_si128((const __m128i *)(pBlocks[1] + 16 * i));
+		__m128i R2 = _mm_loadu_si128((const __m128i *)(pBlocks[2] + 16 * i));
+		__m128i R3 = _mm_loadu_si128((const __m128i *)(pBlocks[3] + 16 * i));
+
+		__m128i T0 = _mm_unpacklo_epi32(R0, R1);
+		__m128i T1 = _mm_unpacklo_epi32(R2, R3);
+		__m128i T2 = _mm_unpackhi_epi32(R0, R1);
+		__m128i T3 = _mm_unpackhi_epi32(R2, R3);
+
+		retW[4 * i + 0] = ByteSwap4(_mm_unpacklo_epi64(T0, T1));
+		retW[4 * i + 1] = ByteSwap4(_mm_unpackhi_epi64(T0, T1));
+		retW[4 * i + 2] = ByteSwap4(_mm_unpacklo_epi64(T2, T3));
+		retW[4 * i + 3] = ByteSwap4(_mm_unpackhi_epi64(T2, T3));
+		}
+	}
+
+bool MapNextChunk (IReadBlock *pData, SDigestLane &Lane)
+
+//	MapNextChunk
+//
+//	Unmaps the lane's current piece of the message and maps the next one (if
+//	there are whole blocks left). Returns FALSE if we could not map it.
+
+	{
+	delete Lane.pChunk;
+	Lane.pChunk = NULL;
+	Lane.dwBlocks = 0;
+
+	if (Lane.dwNextChunk >= Lane.dwBodyEnd)
+		return true;
+
+	DWORDLONG dwLength = Min(Lane.dwBodyEnd - Lane.dwNextChunk, LANE_CHUNK_SIZE);
+	Lane.pChunk = pData->CreateSlice(Lane.dwNextChunk, dwLength);
+	Lane.pPos = (Lane.pChunk ? (const BYTE *)Lane.pChunk->GetPointer64(0, dwLength) : NULL);
+	if (Lane.pPos == NULL)
+		return false;
+
+	Lane.dwBlocks = dwLength / BLOCK_SIZE;
+	Lane.dwNextChunk += dwLength;
+	return true;
+	}
+
+void SHA1Compress4 (LANESTATE *pState, const BYTE **pBlocks)
+
+//	SHA1Compress4
+//
+//	Processes one block of each of four messages with SSE2
+
+	{
+	int t;
+	__m128i W[16];
+	LoadBlocks4(pBlocks, W);
+
+	__m128i A = _mm_loadu_si128((const __m128i *)pState[0]);
+	__m128i B = _mm_loadu_si128((const __m128i *)pState[1]);
+	__m128i C = _mm_loadu_si128((const __m128i *)pState[2]);
+	__m128i D = _mm_loadu_si128((const __m128i *)pState[3]);
+	__m128i E = _mm_loadu_si128((const __m128i *)pState[4]);
+
+	for (t = 0; t < 80; t++)
+		{
+		__m128i F;
+		__m128i K;
+
+		if (t >= 16)
+			{
+			__m128i X = _mm_xor_si128(_mm_xor_si128(W[(t - 3) & 15], W[(t - 8) & 15]), _mm_xor_si128(W[(t - 14) & 15], W[t & 15]));
+			W[t & 15] = ROTL4(X, 1);
+			}
+
+		if (t < 20)
+			{
+			F = _mm_xor_si128(D, _mm_and_si128(B, _mm_xor_si128(C, D)));
+			K = _mm_set1_epi32(0x5a827999);
+			}
+		else if (t < 40)
+			{
+			F = _mm_xor_si128(_mm_xor_si128(B, C), D);
+			K = _mm_set1_epi32(0x6ed9eba1);
+			}
+		else if (t < 60)
+			{
+			F = _mm_or_si128(_mm_and_si128(B, C), _mm_and_si128(D, _mm_or_si128(B, C)));
+			K = _mm_set1_epi32(0x8f1bbcdc);
+			}
+		else
+			{
+			F = _mm_xor_si128(_mm_xor_si128(B, C), D);
+			K = _mm_set1_epi32(0xca62c1d6);
+			}
+
+		__m128i Temp = _mm_add_epi32(_mm_add_epi32(ROTL4(A, 5), F), _mm_add_epi32(_mm_add_epi32(E, K), W[t & 15]));
+		E = D;
+		D = C;
+		C = ROTL4(B, 30);
+		B = A;
+		A = Temp;
+		}
+
+	_mm_storeu_si128((__m128i *)pState[0], _mm_add_epi32(A, _mm_loadu_si128((const __m128i *)pState[0])));
+	_mm_storeu_si128((__m128i *)pState[1], _mm_add_epi32(B, _mm_loadu_si128((const __m128i *)pState[1])));
+	_mm_storeu_si128((__m128i *)pState[2], _mm_add_epi32(C, _mm_loadu_si128((const __m128i *)pState[2])));
+	_mm_storeu_si128((__m128i *)pState[3], _mm_add_epi32(D, _mm_loadu_si128((const __m128i *)pState[3])));
+	_mm_storeu_si128((__m128i *)pState[4], _mm_add_epi32(E, _mm_loadu_si128((const __m128i *)pState[4])));
+	}
+
+void SHA1CompressSHA (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks)
+
+//	SHA1CompressSHA
+//
+//	Processes whole blocks with the SHA extensions. The state is kept as ABCD
+//	(A in the high lane) plus E in the high lane of a second register.
+
+	{
+	const __m128i Mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)pState), 0x1b);
+	__m128i E0 = _mm_set_epi32(pState[4], 0, 0, 0);
+	__m128i E1;
+	__m128i MSG0, MSG1, MSG2, MSG3;
+
+	while (dwBlocks-- > 0)
+		{
+		__m128i ABCDSave = ABCD;
+		__m128i E0Save = E0;
+
+		//	Rounds 0-3
+
+		MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 0)), Mask);
+		E0 = _mm_add_epi32(E0, MSG0);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+		//	Rounds 4-7
+
+		MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 16)), Mask);
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+
+		//	Rounds 8-11
+
+		MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 32)), Mask);
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		//	Rounds 12-15
+
+		MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 48)), Mask);
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 0);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		//	Rounds 16-19
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		//	Rounds 20-23
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		//	Rounds 24-27
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		//	Rounds 28-31
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		//	Rounds 32-35
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 1);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		//	Rounds 36-39
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 1);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		//	Rounds 40-43
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		//	Rounds 44-47
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		//	Rounds 48-51
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		//	Rounds 52-55
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 2);
+		MSG0 = _mm_sha1msg1_epu32(MSG0, MSG1);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		//	Rounds 56-59
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 2);
+		MSG1 = _mm_sha1msg1_epu32(MSG1, MSG2);
+		MSG0 = _mm_xor_si128(MSG0, MSG2);
+
+		//	Rounds 60-63
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		MSG0 = _mm_sha1msg2_epu32(MSG0, MSG3);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+		MSG2 = _mm_sha1msg1_epu32(MSG2, MSG3);
+		MSG1 = _mm_xor_si128(MSG1, MSG3);
+
+		//	Rounds 64-67
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG0);
+		E1 = ABCD;
+		MSG1 = _mm_sha1msg2_epu32(MSG1, MSG0);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+		MSG3 = _mm_sha1msg1_epu32(MSG3, MSG0);
+		MSG2 = _mm_xor_si128(MSG2, MSG0);
+
+		//	Rounds 68-71
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG1);
+		E0 = ABCD;
+		MSG2 = _mm_sha1msg2_epu32(MSG2, MSG1);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+		MSG3 = _mm_xor_si128(MSG3, MSG1);
+
+		//	Rounds 72-75
+
+		E0 = _mm_sha1nexte_epu32(E0, MSG2);
+		E1 = ABCD;
+		MSG3 = _mm_sha1msg2_epu32(MSG3, MSG2);
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 3);
+
+		//	Rounds 76-79
+
+		E1 = _mm_sha1nexte_epu32(E1, MSG3);
+		E0 = ABCD;
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, 3);
+
+		//	Add this block to the state
+
+		E0 = _mm_sha1nexte_epu32(E0, E0Save);
+		ABCD = _mm_add_epi32(ABCD, ABCDSave);
+
+		pData += BLOCK_SIZE;
+		}
+
+	_mm_storeu_si128((__m128i *)pState, _mm_shuffle_epi32(ABCD, 0x1b));
+	pState[4] = (DWORD)_mm_extract_epi32(E0, 3);
+	}
+
+void SHA256Compress4 (LANESTATE *pState, const BYTE **pBlocks)
+
+//	SHA256Compress4
+//
+//	Processes one block of each of four messages with SSE2
+
+	{
+	int t;
+	__m128i W[16];
+	LoadBlocks4(pBlocks, W);
+
+	__m128i A = _mm_loadu_si128((const __m128i *)pState[0]);
+	__m128i B = _mm_loadu_si128((const __m128i *)pState[1]);
+	__m128i C = _mm_loadu_si128((const __m128i *)pState[2]);
+	__m128i D = _mm_loadu_si128((const __m128i *)pState[3]);
+	__m128i E = _mm_loadu_si128((const __m128i *)pState[4]);
+	__m128i F = _mm_loadu_si128((const __m128i *)pState[5]);
+	__m128i G = _mm_loadu_si128((const __m128i *)pState[6]);
+	__m128i H = _mm_loadu_si128((const __m128i *)pState[7]);
+
+	for (t = 0; t < 64; t++)
+		{
+		if (t >= 16)
+			{
+			__m128i W15 = W[(t - 15) & 15];
+			__m128i W2 = W[(t - 2) & 15];
+			__m128i S0 = _mm_xor_si128(_mm_xor_si128(ROTR4(W15, 7), ROTR4(W15, 18)), _mm_srli_epi32(W15, 3));
+			__m128i S1 = _mm_xor_si128(_mm_xor_si128(ROTR4(W2, 17), ROTR4(W2, 19)), _mm_srli_epi32(W2, 10));
+			W[t & 15] = _mm_add_epi32(_mm_add_epi32(W[t & 15], S0), _mm_add_epi32(W[(t - 7) & 15], S1));
+			}
+
+		__m128i S1 = _mm_xor_si128(_mm_xor_si128(ROTR4(E, 6), ROTR4(E, 11)), ROTR4(E, 25));
+		__m128i Ch = _mm_xor_si128(_mm_and_si128(E, F), _mm_andnot_si128(E, G));
+		__m128i T1 = _mm_add_epi32(_mm_add_epi32(H, S1), _mm_add_epi32(_mm_add_epi32(Ch, _mm_set1_epi32(SHA256_K[t])), W[t & 15]));
+		__m128i S0 = _mm_xor_si128(_mm_xor_si128(ROTR4(A, 2), ROTR4(A, 13)), ROTR4(A, 22));
+		__m128i Maj = _mm_or_si128(_mm_and_si128(A, _mm_or_si128(B, C)), _mm_and_si128(B, C));
+
+		H = G;
+		G = F;
+		F = E;
+		E = _mm_add_epi32(D, T1);
+		D = C;
+		C = B;
+		B = A;
+		A = _mm_add_epi32(T1, _mm_add_epi32(S0, Maj));
+		}
+
+	_mm_storeu_si128((__m128i *)pState[0], _mm_add_epi32(A, _mm_loadu_si128((const __m128i *)pState[0])));
+	_mm_storeu_si128((__m128i *)pState[1], _mm_add_epi32(B, _mm_loadu_si128((const __m128i *)pState[1])));
+	_mm_storeu_si128((__m128i *)pState[2], _mm_add_epi32(C, _mm_loadu_si128((const __m128i *)pState[2])));
+	_mm_storeu_si128((__m128i *)pState[3], _mm_add_epi32(D, _mm_loadu_si128((const __m128i *)pState[3])));
+	_mm_storeu_si128((__m128i *)pState[4], _mm_add_epi32(E, _mm_loadu_si128((const __m128i *)pState[4])));
+	_mm_storeu_si128((__m128i *)pState[5], _mm_add_epi32(F, _mm_loadu_si128((const __m128i *)pState[5])));
+	_mm_storeu_si128((__m128i *)pState[6], _mm_add_epi32(G, _mm_loadu_si128((const __m128i *)pState[6])));
+	_mm_storeu_si128((__m128i *)pState[7], _mm_add_epi32(H, _mm_loadu_si128((const __m128i *)pState[7])));
+	}
+
+void SHA256CompressScalar (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks)
+
+//	SHA256CompressScalar
+//
+//	Processes whole blocks
+
+	{
+	int t;
+	DWORD W[64];
+
+	while (dwBlocks-- > 0)
+		{
+		for (t = 0; t < 16; t++)
+			W[t] = ((DWORD)pData[4 * t] << 24) | ((DWORD)pData[4 * t + 1] << 16) | ((DWORD)pData[4 * t + 2] << 8) | (DWORD)pData[4 * t + 3];
+
+		for (t = 16; t < 64; t++)
+			{
+			DWORD S0 = ROTR32(W[t - 15], 7) ^ ROTR32(W[t - 15], 18) ^ (W[t - 15] >> 3);
+			DWORD S1 = ROTR32(W[t - 2], 17) ^ ROTR32(W[t - 2], 19) ^ (W[t - 2] >> 10);
+			W[t] = W[t - 16] + S0 + W[t - 7] + S1;
+			}
+
+		DWORD A = pState[0];
+		DWORD B = pState[1];
+		DWORD C = pState[2];
+		DWORD D = pState[3];
+		DWORD E = pState[4];
+		DWORD F = pState[5];
+		DWORD G = pState[6];
+		DWORD H = pState[7];
+
+		for (t = 0; t < 64; t++)
+			{
+			DWORD T1 = H + (ROTR32(E, 6) ^ ROTR32(E, 11) ^ ROTR32(E, 25)) + ((E & F) ^ (~E & G)) + SHA256_K[t] + W[t];
+			DWORD T2 = (ROTR32(A, 2) ^ ROTR32(A, 13) ^ ROTR32(A, 22)) + ((A & B) ^ (A & C) ^ (B & C));
+
+			H = G;
+			G = F;
+			F = E;
+			E = D + T1;
+			D = C;
+			C = B;
+			B = A;
+			A = T1 + T2;
+			}
+
+		pState[0] += A;
+		pState[1] += B;
+		pState[2] += C;
+		pState[3] += D;
+		pState[4] += E;
+		pState[5] += F;
+		pState[6] += G;
+		pState[7] += H;
+
+		pData += BLOCK_SIZE;
+		}
+	}
+
+void SHA256CompressSHA (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks)
+
+//	SHA256CompressSHA
+//
+//	Processes whole blocks with the SHA extensions. The instructions want the
+//	state as ABEF and CDGH.
+
+	{
+	const __m128i Mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&pState[0]), 0xb1);
+	__m128i STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&pState[4]), 0x1b);
+	__m128i STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xf0);
+
+	__m128i MSG;
+	__m128i MSG0, MSG1, MSG2, MSG3;
+
+	while (dwBlocks-- > 0)
+		{
+		__m128i State0Save = STATE0;
+		__m128i State1Save = STATE1;
+
+		//	Rounds 0-3
+
+		MSG0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 0)), Mask);
+		MSG = _mm_add_epi32(MSG0, _mm_loadu_si128((const __m128i *)&SHA256_K[0]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+		//	Rounds 4-7
+
+		MSG1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 16)), Mask);
+		MSG = _mm_add_epi32(MSG1, _mm_loadu_si128((const __m128i *)&SHA256_K[4]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG0 = _mm_sha256msg1_epu32(MSG0, MSG1);
+
+		//	Rounds 8-11
+
+		MSG2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 32)), Mask);
+		MSG = _mm_add_epi32(MSG2, _mm_loadu_si128((const __m128i *)&SHA256_K[8]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG1 = _mm_sha256msg1_epu32(MSG1, MSG2);
+
+		//	Rounds 12-15
+
+		MSG3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(pData + 48)), Mask);
+		MSG = _mm_add_epi32(MSG3, _mm_loadu_si128((const __m128i *)&SHA256_K[12]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG3, MSG2, 4);
+		MSG0 = _mm_add_epi32(MSG0, TMP);
+		MSG0 = _mm_sha256msg2_epu32(MSG0, MSG3);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG2 = _mm_sha256msg1_epu32(MSG2, MSG3);
+
+		//	Rounds 16-19
+
+		MSG = _mm_add_epi32(MSG0, _mm_loadu_si128((const __m128i *)&SHA256_K[16]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG0, MSG3, 4);
+		MSG1 = _mm_add_epi32(MSG1, TMP);
+		MSG1 = _mm_sha256msg2_epu32(MSG1, MSG0);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG3 = _mm_sha256msg1_epu32(MSG3, MSG0);
+
+		//	Rounds 20-23
+
+		MSG = _mm_add_epi32(MSG1, _mm_loadu_si128((const __m128i *)&SHA256_K[20]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG1, MSG0, 4);
+		MSG2 = _mm_add_epi32(MSG2, TMP);
+		MSG2 = _mm_sha256msg2_epu32(MSG2, MSG1);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG0 = _mm_sha256msg1_epu32(MSG0, MSG1);
+
+		//	Rounds 24-27
+
+		MSG = _mm_add_epi32(MSG2, _mm_loadu_si128((const __m128i *)&SHA256_K[24]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG2, MSG1, 4);
+		MSG3 = _mm_add_epi32(MSG3, TMP);
+		MSG3 = _mm_sha256msg2_epu32(MSG3, MSG2);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG1 = _mm_sha256msg1_epu32(MSG1, MSG2);
+
+		//	Rounds 28-31
+
+		MSG = _mm_add_epi32(MSG3, _mm_loadu_si128((const __m128i *)&SHA256_K[28]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG3, MSG2, 4);
+		MSG0 = _mm_add_epi32(MSG0, TMP);
+		MSG0 = _mm_sha256msg2_epu32(MSG0, MSG3);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG2 = _mm_sha256msg1_epu32(MSG2, MSG3);
+
+		//	Rounds 32-35
+
+		MSG = _mm_add_epi32(MSG0, _mm_loadu_si128((const __m128i *)&SHA256_K[32]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG0, MSG3, 4);
+		MSG1 = _mm_add_epi32(MSG1, TMP);
+		MSG1 = _mm_sha256msg2_epu32(MSG1, MSG0);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG3 = _mm_sha256msg1_epu32(MSG3, MSG0);
+
+		//	Rounds 36-39
+
+		MSG = _mm_add_epi32(MSG1, _mm_loadu_si128((const __m128i *)&SHA256_K[36]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG1, MSG0, 4);
+		MSG2 = _mm_add_epi32(MSG2, TMP);
+		MSG2 = _mm_sha256msg2_epu32(MSG2, MSG1);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG0 = _mm_sha256msg1_epu32(MSG0, MSG1);
+
+		//	Rounds 40-43
+
+		MSG = _mm_add_epi32(MSG2, _mm_loadu_si128((const __m128i *)&SHA256_K[40]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG2, MSG1, 4);
+		MSG3 = _mm_add_epi32(MSG3, TMP);
+		MSG3 = _mm_sha256msg2_epu32(MSG3, MSG2);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG1 = _mm_sha256msg1_epu32(MSG1, MSG2);
+
+		//	Rounds 44-47
+
+		MSG = _mm_add_epi32(MSG3, _mm_loadu_si128((const __m128i *)&SHA256_K[44]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG3, MSG2, 4);
+		MSG0 = _mm_add_epi32(MSG0, TMP);
+		MSG0 = _mm_sha256msg2_epu32(MSG0, MSG3);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG2 = _mm_sha256msg1_epu32(MSG2, MSG3);
+
+		//	Rounds 48-51
+
+		MSG = _mm_add_epi32(MSG0, _mm_loadu_si128((const __m128i *)&SHA256_K[48]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG0, MSG3, 4);
+		MSG1 = _mm_add_epi32(MSG1, TMP);
+		MSG1 = _mm_sha256msg2_epu32(MSG1, MSG0);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+		MSG3 = _mm_sha256msg1_epu32(MSG3, MSG0);
+
+		//	Rounds 52-55
+
+		MSG = _mm_add_epi32(MSG1, _mm_loadu_si128((const __m128i *)&SHA256_K[52]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG1, MSG0, 4);
+		MSG2 = _mm_add_epi32(MSG2, TMP);
+		MSG2 = _mm_sha256msg2_epu32(MSG2, MSG1);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+		//	Rounds 56-59
+
+		MSG = _mm_add_epi32(MSG2, _mm_loadu_si128((const __m128i *)&SHA256_K[56]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		TMP = _mm_alignr_epi8(MSG2, MSG1, 4);
+		MSG3 = _mm_add_epi32(MSG3, TMP);
+		MSG3 = _mm_sha256msg2_epu32(MSG3, MSG2);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+		//	Rounds 60-63
+
+		MSG = _mm_add_epi32(MSG3, _mm_loadu_si128((const __m128i *)&SHA256_K[60]));
+		STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);
+		MSG = _mm_shuffle_epi32(MSG, 0x0e);
+		STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG);
+
+		//	Add this block to the state
+
+		STATE0 = _mm_add_epi32(STATE0, State0Save);
+		STATE1 = _mm_add_epi32(STATE1, State1Save);
+
+		pData += BLOCK_SIZE;
+		}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1b);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xb1);
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xf0);
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+
+	_mm_storeu_si128((__m128i *)&pState[0], STATE0);
+	_mm_storeu_si128((__m128i *)&pState[4], STATE1);
+	}
+
+bool StartLane (IReadBlock *pData, SDigestLane &Lane)
+
+//	StartLane
+//
+//	Sets up the lane for a new message: builds the padded final blocks and
+//	maps the first piece. If the whole message fits in one piece we map it
+//	all at once; otherwise we map the tail separately just long enough to
+//	copy it. Returns FALSE if we could not map the message.
+
+	{
+	DWORDLONG dwLength = pData->GetLength64();
+	int iTail = (int)(dwLength % BLOCK_SIZE);
+
+	Lane.pChunk = NULL;
+	Lane.dwNextChunk = 0;
+	Lane.dwBodyEnd = dwLength - iTail;
+	Lane.pPos = NULL;
+	Lane.dwBlocks = 0;
+	Lane.iTailPos = 0;
+
+	const BYTE *pTail = NULL;
+	IReadBlock *pTailSlice = NULL;
+
+	if (dwLength == 0)
+		;
+
+	else if (dwLength <= LANE_CHUNK_SIZE)
+		{
+		Lane.pChunk = pData->CreateSlice(0, dwLength);
+		Lane.pPos = (Lane.pChunk ? (const BYTE *)Lane.pChunk->GetPointer64(0, dwLength) : NULL);
+		if (Lane.pPos == NULL)
+			{
+			delete Lane.pChunk;
+			Lane.pChunk = NULL;
+			return false;
+			}
+
+		Lane.dwBlocks = Lane.dwBodyEnd / BLOCK_SIZE;
+		Lane.dwNextChunk = Lane.dwBodyEnd;
+		pTail = Lane.pPos + Lane.dwBodyEnd;
+		}
+
+	else
+		{
+		if (iTail)
+			{
+			pTailSlice = pData->CreateSlice(Lane.dwBodyEnd, iTail);
+			pTail = (pTailSlice ? (const BYTE *)pTailSlice->GetPointer64(0, iTail) : NULL);
+			if (pTail == NULL)
+				{
+				delete pTailSlice;
+				return false;
+				}
+			}
+
+		if (!MapNextChunk(pData, Lane))
+			{
+			delete pTailSlice;
+			delete Lane.pChunk;
+			Lane.pChunk = NULL;
+			return false;
+			}
+		}
+
+	Lane.iTailBlocks = BuildFinalBlocks((iTail ? pTail : NULL), iTail, dwLength, Lane.Tail);
+
+	delete pTailSlice;
+	return true;
+	}
+
+void StoreDigest (const DWORD *pState, int iLength, BYTE *retDigest)
+
+//	StoreDigest
+//
+//	Writes the state as big-endian words
+
+	{
+	for (int i = 0; i < iLength / 4; i++)
+		{
+		retDigest[4 * i + 0] = (BYTE)(pState[i] >> 24);
+		retDigest[4 * i + 1] = (BYTE)(pState[i] >> 16);
+		retDigest[4 * i + 2] = (BYTE)(pState[i] >> 8);
+		retDigest[4 * i + 3] = (BYTE)pState[i];
+		}
+	}
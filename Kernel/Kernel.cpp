@@ -72,6 +72,11 @@ BOOL kernelInit (DWORD dwFlags)
 			}
 		}
 
+	//	Give this thread its own string storage cache (kernelCleanUp releases
+	//	it).
+
+	CString::INTStringThreadInit();
+
 	//	Install a Win32 exception handler
 
 	_set_se_translator(kernelHandleWin32Exception);
@@ -93,8 +98,17 @@ void kernelCleanUp (void)
 //	Must be called for each thread to clean up
 
 	{
+	//	Return this thread's cached string storage
+
+	CString::INTStringThreadCleanUp();
+
 	if (InterlockedDecrement(&g_iGlobalInit) == 0)
 		{
+		//	Done logging. We do this first because closing the log stops its
+		//	writer thread and writes out queued lines, which needs strings.
+
+		kernelSetDebugLog(NULL, FALSE);
+
 		if (g_dwKernelFlags & KERNEL_FLAG_INTERNETS)
 			::WSACleanup();
 
@@ -102,10 +116,6 @@ void kernelCleanUp (void)
 
 		CString::INTStringCleanUp();
 
-		//	Done logging
-
-		kernelSetDebugLog(NULL, FALSE);
-
 		//	Clean up critical section
 
 		DeleteCriticalSection(&g_csKernel);
@@ -199,6 +209,12 @@ ALERROR kernelSetDebugLog (const CString &sFilespec, bool bAppend)
 
 	{
 	CTextFileLog *pLog = new CTextFileLog(sFilespec);
+
+	//	Write from a background thread so that heavy logging doesn't stall the
+	//	caller on disk I/O. We flush on crash (see DEBUG_CATCH).
+
+	pLog->SetAsync();
+
 	return kernelSetDebugLog(pLog, bAppend, true);
 	}
 
@@ -256,6 +272,22 @@ ALERROR kernelSetDebugLog (CTextFileLog *pLog, bool bAppend, bool bFreeLog)
 	return NOERROR;
 	}
 
+void kernelDebugLogFlush (void)
+
+//	kernelDebugLogFlush
+//
+//	Makes sure that everything logged so far is on disk. DEBUG_CATCH calls
+//	this so that we don't lose the end of the log when we crash.
+
+	{
+	EnterCriticalSection(&g_csKernel);
+
+	if (g_pDebugLog)
+		g_pDebugLog->Flush();
+
+	LeaveCriticalSection(&g_csKernel);
+	}
+
 void kernelDebugLogPattern (char *pszLine, ...)
 
 //	kernelDebugLogPattern
@@ -414,5 +446,6 @@ DWORD sysGetVersion (void)
 
 void kernelHandleWin32Exception (unsigned code, EXCEPTION_POINTERS* info)
 	{
+	kernelDebugLogFlush();
 	throw CException(ERR_WIN32_EXCEPTION);
 	}
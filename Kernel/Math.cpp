@@ -5,7 +5,25 @@
 #include "Kernel.h"
 #include <math.h>
 
-DWORD g_Seed = 0;
+//	Each thread has its own Park-Miller state (so the sequence for a given
+//	seed is the same as it always was). The state lives in a TLS slot; a
+//	second slot remembers the seed epoch that the state was derived from.
+//	When mathSetSeed changes the epoch, other threads derive a new state
+//	from the master seed and a stream ID. The stream ID is the one passed to
+//	mathSetThreadStream, if any; otherwise we hand out IDs (with the top bit
+//	set, so they never match a caller's ID) in the order that threads ask.
+
+static DWORD g_dwSeedTLS = TLS_OUT_OF_INDEXES;
+static DWORD g_dwEpochTLS = TLS_OUT_OF_INDEXES;
+static DWORD g_dwStreamTLS = TLS_OUT_OF_INDEXES;	//	Stream ID + 1 (0 = none)
+static volatile LONG g_iMasterSeed = 0;				//	Last value passed to mathSetSeed (0 = none)
+static volatile LONG g_iSeedEpoch = 1;				//	Incremented by mathSetSeed
+static volatile LONG g_iNextStream = 0;				//	Stream IDs handed out in this epoch
+static DWORD g_dwSharedSeed = 0;					//	Only used if we can't get TLS slots
+
+static bool InitSeedSlot (DWORD *pdwSlot);
+static DWORD GetThreadSeed (void);
+static void SetThreadSeed (DWORD dwSeed, LONG iEpoch = 0);
 
 int mathAdjust (int iValue, int iPercent)
 
@@ -39,7 +57,7 @@ DWORD mathGetSeed (void)
 //	Returns the current seed value.
 
 	{
-	return g_Seed;
+	return GetThreadSeed();
 	}
 
 DWORD mathMakeSeed (DWORD dwValue)
@@ -129,31 +147,28 @@ DWORD mathRandom (void)
 	const DWORD a = (DWORD)48271;
 	const DWORD r = (DWORD)3399;
 
-	//	Seed it
+	//	Get this thread's state (seeding it, if necessary)
 
-	if (g_Seed == 0)
-		{
-		g_Seed = MAKELONG(rand() % 0x10000, rand() % 0x10000);
-		g_Seed *= ::GetTickCount();
-		}
+	DWORD dwSeed = GetThreadSeed();
 
 	//	Random
 
 	int lo, hi, test;
 
-	hi = g_Seed / q;
-	lo = g_Seed % q;
+	hi = dwSeed / q;
+	lo = dwSeed % q;
 
 	test = a * lo - r * hi;
 
 	if (test > 0)
-		g_Seed = test;
+		dwSeed = test;
 	else
-		g_Seed = test + m;
+		dwSeed = test + m;
 
 	//	Done
 
-	return g_Seed;
+	SetThreadSeed(dwSeed);
+	return dwSeed;
 	}
 
 int mathRandom (int iFrom, int iTo)
@@ -295,7 +310,39 @@ void mathSetSeed (DWORD dwSeed)
 	{
 	//	Must be a 31-bit number
 
-	g_Seed = (dwSeed &= 0x7fffffff);
+	dwSeed &= 0x7fffffff;
+
+	//	Other threads will derive their state from this seed the next time
+	//	they need a random number. A seed of 0 means that we seed from the
+	//	clock.
+
+	g_iMasterSeed = (LONG)dwSeed;
+	g_iNextStream = 0;
+	LONG iEpoch = ::InterlockedIncrement(&g_iSeedEpoch);
+
+	if (dwSeed)
+		SetThreadSeed(dwSeed, iEpoch);
+	}
+
+void mathSetThreadStream (DWORD dwStream)
+
+//	mathSetThreadStream
+//
+//	Sets the stream ID that the current thread uses to derive its state from
+//	the master seed. Threads with the same seed and stream ID get the same
+//	sequence, no matter when they run. The ID must be a 31-bit number.
+
+	{
+	if (!InitSeedSlot(&g_dwStreamTLS))
+		return;
+
+	dwStream &= 0x7fffffff;
+	::TlsSetValue(g_dwStreamTLS, (LPVOID)(DWORD_PTR)(dwStream + 1));
+
+	//	Derive a new state the next time we need one
+
+	if (g_dwEpochTLS != TLS_OUT_OF_INDEXES)
+		::TlsSetValue(g_dwEpochTLS, (LPVOID)0);
 	}
 
 int mathSqrt (int x)
@@ -310,3 +357,90 @@ int mathSqrt (int x)
 	return (int)sqrt((double)x);
 #endif
 	}
+
+//	Per-thread seeds -----------------------------------------------------------
+
+bool InitSeedSlot (DWORD *pdwSlot)
+
+//	InitSeedSlot
+//
+//	Allocates a TLS slot (if not already allocated). Returns FALSE if we could
+//	not allocate a slot.
+
+	{
+	if (*pdwSlot != TLS_OUT_OF_INDEXES)
+		return true;
+
+	DWORD dwTLS = ::TlsAlloc();
+	if (dwTLS == TLS_OUT_OF_INDEXES)
+		return false;
+
+	if (::InterlockedCompareExchange((LONG volatile *)pdwSlot, (LONG)dwTLS, (LONG)TLS_OUT_OF_INDEXES) != (LONG)TLS_OUT_OF_INDEXES)
+		::TlsFree(dwTLS);
+
+	return true;
+	}
+
+DWORD GetThreadSeed (void)
+
+//	GetThreadSeed
+//
+//	Returns the Park-Miller state for the current thread. If the thread does
+//	not yet have a state for the current epoch, we derive one.
+
+	{
+	if (!InitSeedSlot(&g_dwSeedTLS) || !InitSeedSlot(&g_dwEpochTLS))
+		{
+		if (g_dwSharedSeed == 0)
+			g_dwSharedSeed = (DWORD)MAKELONG(rand() % 0x10000, rand() % 0x10000) * ::GetTickCount();
+
+		return g_dwSharedSeed;
+		}
+
+	LONG iEpoch = g_iSeedEpoch;
+	if ((LONG)(DWORD_PTR)::TlsGetValue(g_dwEpochTLS) == iEpoch)
+		return (DWORD)(DWORD_PTR)::TlsGetValue(g_dwSeedTLS);
+
+	//	Derive a state from the master seed and the thread's stream ID (or a
+	//	new one, if the thread did not set one). If no one has set a seed, we
+	//	start from the clock (as we always have).
+
+	DWORD dwMaster = (DWORD)g_iMasterSeed;
+	DWORD dwStream = (g_dwStreamTLS != TLS_OUT_OF_INDEXES ? (DWORD)(DWORD_PTR)::TlsGetValue(g_dwStreamTLS) : 0);
+	if (dwStream)
+		dwStream--;
+	else
+		dwStream = 0x80000000 | (DWORD)::InterlockedIncrement(&g_iNextStream);
+
+	if (dwMaster == 0)
+		dwMaster = (DWORD)MAKELONG(rand() % 0x10000, rand() % 0x10000) * ::GetTickCount();
+
+	//	Park-Miller state must be in [1, 2^31 - 2]
+
+	DWORD dwSeed = (CRandomStream::Generate(dwMaster, dwStream, 0) % 0x7ffffffe) + 1;
+
+	SetThreadSeed(dwSeed, iEpoch);
+	return dwSeed;
+	}
+
+void SetThreadSeed (DWORD dwSeed, LONG iEpoch)
+
+//	SetThreadSeed
+//
+//	Sets the Park-Miller state for the current thread. If iEpoch is 0 we leave
+//	the thread's epoch alone.
+
+	{
+	if (g_dwSeedTLS == TLS_OUT_OF_INDEXES || g_dwEpochTLS == TLS_OUT_OF_INDEXES)
+		{
+		if (!InitSeedSlot(&g_dwSeedTLS) || !InitSeedSlot(&g_dwEpochTLS))
+			{
+			g_dwSharedSeed = dwSeed;
+			return;
+			}
+		}
+
+	::TlsSetValue(g_dwSeedTLS, (LPVOID)(DWORD_PTR)dwSeed);
+	if (iEpoch)
+		::TlsSetValue(g_dwEpochTLS, (LPVOID)(DWORD_PTR)iEpoch);
+	}
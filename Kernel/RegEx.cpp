@@ -156,18 +156,19 @@ bool strRegEx (char *pStart, const CString &sPattern, TArray<SRegExMatch> *retMa
 
 	//	Initial state
 
-	CLargeSet Start;
+	CLargeSet Start(N.GetStateCount());
 	Start.Set(N.GetStartState());
 
-	CLargeSet S;
+	CLargeSet S(N.GetStateCount());
 	N.CalcEClosure(Start, pStart, &S);
 
-	//	Walk the input string
+	//	Walk the input string. We reuse the same sets for every character so
+	//	that we don't allocate inside the loop.
 
+	CLargeSet M(N.GetStateCount());
 	char *pPos = pStart;
 	while (*pPos != '\0')
 		{
-		CLargeSet M;
 		N.CalcMove(S, pPos, &M);
 		N.CalcEClosure(M, pPos + 1, &S);
 
@@ -243,17 +244,17 @@ bool CNFA::CalcEClosure (const CLargeSet &In, char *pPos, CLargeSet *retOut)
 	//	Push all input states in the stack
 
 	TStack<int> Stack;
-	for (i = 0; i < GetStateCount(); i++)
-		if (In.IsSet(i))
-			{
-			Stack.Push(i);
-			bFound = true;
+	DWORD dwState;
+	for (dwState = In.GetNextValue(); dwState != CLargeSet::INVALID_VALUE; dwState = In.GetNextValue(dwState + 1))
+		{
+		Stack.Push((int)dwState);
+		bFound = true;
 
-			//	Initialize sub expressions, if necessary
+		//	Initialize sub expressions, if necessary
 
-			if (iSubExpCount)
-				SetSubExpState(GetState(i), pPos);
-			}
+		if (iSubExpCount)
+			SetSubExpState(GetState((int)dwState), pPos);
+		}
 
 	//	Result is initializes to input
 
@@ -289,13 +290,12 @@ bool CNFA::CalcEClosure (const CLargeSet &In, char *pPos, CLargeSet *retOut)
 
 	//	We keep track of string position for any resulting state
 
-	for (i = 0; i < GetStateCount(); i++)
-		if (retOut->IsSet(i))
-			{
-			SState *pState = GetState(i);
-			if (pState->iEndSubExpID != -1 || pState->iStartSubExpID != -1)
-				pState->pMatch = pPos;
-			}
+	for (dwState = retOut->GetNextValue(); dwState != CLargeSet::INVALID_VALUE; dwState = retOut->GetNextValue(dwState + 1))
+		{
+		SState *pState = GetState((int)dwState);
+		if (pState->iEndSubExpID != -1 || pState->iStartSubExpID != -1)
+			pState->pMatch = pPos;
+		}
 
 	return bFound;
 	}
@@ -308,34 +308,37 @@ bool CNFA::CalcMove (const CLargeSet &In, char *pPos, CLargeSet *retOut)
 //	input character.
 
 	{
-	int i, j;
+	int j;
 	bool bFound = false;
 	int iSubExpCount = GetSubExpressionCount();
 
 	retOut->ClearAll();
 
-	for (i = 0; i < GetStateCount(); i++)
-		if (In.IsSet(i))
-			{
-			SState *pState = GetState(i);
+	//	Only visit the states in the input set (we skip whole words of
+	//	inactive states at a time).
+
+	DWORD dwState;
+	for (dwState = In.GetNextValue(); dwState != CLargeSet::INVALID_VALUE; dwState = In.GetNextValue(dwState + 1))
+		{
+		SState *pState = GetState((int)dwState);
 
-			for (j = 0; j < pState->Transitions.GetCount(); j++)
+		for (j = 0; j < pState->Transitions.GetCount(); j++)
+			{
+			if (Matches(&pState->Transitions[j], *pPos))
 				{
-				if (Matches(&pState->Transitions[j], *pPos))
-					{
-					//	Add the new state as a valid transition
+				//	Add the new state as a valid transition
 
-					retOut->Set(pState->Transitions[j].pNewState->iID);
-					bFound = true;
+				retOut->Set(pState->Transitions[j].pNewState->iID);
+				bFound = true;
 
-					//	We've reached a new state, so take the sub expression state from
-					//	the source state
+				//	We've reached a new state, so take the sub expression state from
+				//	the source state
 
-					if (iSubExpCount)
-						pState->Transitions[j].pNewState->MatchState = pState->MatchState;
-					}
+				if (iSubExpCount)
+					pState->Transitions[j].pNewState->MatchState = pState->MatchState;
 				}
 			}
+		}
 
 	return bFound;
 	}
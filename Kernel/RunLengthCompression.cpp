@@ -1,14 +1,66 @@
 //	RunLengthCompression.cpp
 //
 //	Run-Length Compression functions
+//
+//	We look for runs 16 bytes at a time with SSE2 compares, and we build the
+//	output in a buffer that we write to the stream in large pieces.
 
 #include "Kernel.h"
 
+#include <emmintrin.h>
+
 const int MIN_LONG_RUN =						3;
 const int MAX_RUN_LENGTH_BYTE =					254;
 const BYTE RUN_CODE_MIXED =						255;
 const BYTE RUN_CODE_END =						0;
 
+const int OUTPUT_BUFFER_SIZE =					16 * 1024;
+
+class CRunLengthOutput
+	{
+	public:
+		CRunLengthOutput (IWriteStream *pOutput) : m_pOutput(pOutput), m_iLength(0) { }
+		~CRunLengthOutput (void) { Flush(); }
+
+		void Flush (void);
+		inline BYTE *GetSpace (int iLength)
+			{
+			if (m_iLength + iLength > OUTPUT_BUFFER_SIZE)
+				Flush();
+
+			BYTE *pSpace = m_Buffer + m_iLength;
+			m_iLength += iLength;
+			return pSpace;
+			}
+
+	private:
+		IWriteStream *m_pOutput;
+		int m_iLength;
+		BYTE m_Buffer[OUTPUT_BUFFER_SIZE];
+	};
+
+static int FindRun (const BYTE *pData, int iPos, int iLength);
+static int FindRunEnd (const BYTE *pData, int iPos, int iLength);
+static void WriteMixedRuns (CRunLengthOutput &Output, const BYTE *pData, int iLength);
+
+//	CRunLengthOutput -----------------------------------------------------------
+
+void CRunLengthOutput::Flush (void)
+
+//	Flush
+//
+//	Writes out the buffer
+
+	{
+	if (m_iLength)
+		{
+		m_pOutput->Write((char *)m_Buffer, m_iLength);
+		m_iLength = 0;
+		}
+	}
+
+//	Functions ------------------------------------------------------------------
+
 void CompressRunLengthByte (IWriteStream *pOutput, IReadBlock *pInput)
 
 //	CompressRunLengthByte
@@ -31,140 +83,190 @@ void CompressRunLengthByte (IWriteStream *pOutput, IReadBlock *pInput)
 //	BYTE			0 (end-code)
 
 	{
-	enum RunTypes
-		{
-		typeUnknown,
-		typeMixed,
-		typeLong,
-		};
-
-	BYTE byCode;
-	BYTE byValue;
+	CRunLengthOutput Output(pOutput);
 
 	//	Write the length of the uncompressed block
 
 	DWORD dwLen = pInput->GetLength();
-	pOutput->Write((char *)&dwLen, sizeof(DWORD));
-
-	//	Process the block
+	memcpy(Output.GetSpace(sizeof(DWORD)), &dwLen, sizeof(DWORD));
 
-	char *pPos = pInput->GetPointer(0, dwLen);
-	char *pEndPos = pPos + dwLen;
+	//	Process the block. Bytes that are not part of a long run are collected
+	//	into mixed runs.
 
-	RunTypes iRunType = typeMixed;
-	char *pStart = pPos;
-	char *pMixedEnd = pPos;
+	const BYTE *pData = (const BYTE *)pInput->GetPointer(0, dwLen);
+	int iLength = (int)dwLen;
+	int iPos = 0;
+	int iMixedStart = 0;
 
-	while (pPos < pEndPos)
+	while (true)
 		{
-		//	Advance the position
+		int iRunStart = FindRun(pData, iPos, iLength);
+		WriteMixedRuns(Output, pData + iMixedStart, iRunStart - iMixedStart);
+		if (iRunStart == iLength)
+			break;
 
-		pPos++;
+		//	Write the long run (in pieces, if necessary). If there are a few
+		//	bytes left over, they start the next mixed run.
 
-		//	We can advance pMixedEnd if this byte is different.
-		//	Or if we've reached the end of the buffer and we don't
-		//	have enough to create an independent run, then advance
-		//	pMixedEnd
+		int iRunEnd = FindRunEnd(pData, iRunStart, iLength);
+		int iRunLeft = iRunEnd - iRunStart;
 
-		if ((*pPos != *pMixedEnd)
-				|| (pPos == pEndPos && (pPos - pMixedEnd) < MIN_LONG_RUN))
+		while (iRunLeft >= MIN_LONG_RUN)
 			{
-			if (pPos <=	pStart + MAX_RUN_LENGTH_BYTE)
-				pMixedEnd = pPos;
-			else
-				pMixedEnd = pStart + MAX_RUN_LENGTH_BYTE;
+			int iRunLen = Min(iRunLeft, MAX_RUN_LENGTH_BYTE);
+			BYTE *pDest = Output.GetSpace(2);
+			pDest[0] = (BYTE)iRunLen;
+			pDest[1] = pData[iRunStart];
+
+			iRunLeft -= iRunLen;
 			}
 
-		//	See if we've reached the end of the run
+		iMixedStart = iRunEnd - iRunLeft;
+		iPos = iRunEnd;
+		}
 
-		if (iRunType == typeMixed)
-			{
-			if (pPos == pEndPos 
-					|| (pPos - pMixedEnd) == MIN_LONG_RUN 
-					|| (pMixedEnd - pStart) == MAX_RUN_LENGTH_BYTE)
-				{
-				int iRunLen = (pMixedEnd - pStart);
+	//	Done
 
-				byValue = RUN_CODE_MIXED;
-				pOutput->Write((char *)&byValue, 1);
+	*Output.GetSpace(1) = RUN_CODE_END;
+	}
+
+int FindRun (const BYTE *pData, int iPos, int iLength)
 
-				byValue = (BYTE)iRunLen;
-				pOutput->Write((char *)&byValue, 1);
+//	FindRun
+//
+//	Returns the position of the first long run at or after iPos (or iLength
+//	if there are none).
 
-				pOutput->Write(pStart, iRunLen);
+	{
+	//	Byte i starts a run if it matches the next two. We check 16 positions
+	//	at a time.
 
-				//	Set up the next run
+	while (iPos + 16 + (MIN_LONG_RUN - 1) <= iLength)
+		{
+		__m128i Cur = _mm_loadu_si128((const __m128i *)(pData + iPos));
+		__m128i Next1 = _mm_loadu_si128((const __m128i *)(pData + iPos + 1));
+		__m128i Next2 = _mm_loadu_si128((const __m128i *)(pData + iPos + 2));
 
-				iRunType = typeMixed;
-				pPos = pMixedEnd;
-				pStart = pPos;
-				}
+		DWORD dwMask = (DWORD)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(Cur, Next1), _mm_cmpeq_epi8(Cur, Next2)));
+		if (dwMask)
+			{
+			unsigned long dwBit;
+			_BitScanForward(&dwBit, dwMask);
+			return iPos + (int)dwBit;
 			}
-		else if (iRunType == typeLong)
+
+		iPos += 16;
+		}
+
+	//	The rest one at a time
+
+	while (iPos + MIN_LONG_RUN <= iLength)
+		{
+		if (pData[iPos] == pData[iPos + 1] && pData[iPos] == pData[iPos + 2])
+			return iPos;
+
+		iPos++;
+		}
+
+	return iLength;
+	}
+
+int FindRunEnd (const BYTE *pData, int iPos, int iLength)
+
+//	FindRunEnd
+//
+//	Returns the position of the first byte after iPos that differs from the
+//	byte at iPos (or iLength).
+
+	{
+	BYTE byValue = pData[iPos];
+	__m128i Value = _mm_set1_epi8((char)byValue);
+
+	while (iPos + 16 <= iLength)
+		{
+		DWORD dwMask = (DWORD)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(pData + iPos)), Value)) ^ 0xffff;
+		if (dwMask)
 			{
-			if (pPos == pEndPos
-					|| (*pPos != *pStart)
-					|| (pPos - pStart) == MAX_RUN_LENGTH_BYTE)
-				{
-				int iRunLen = (pPos - pStart);
-
-				byValue = (BYTE)iRunLen;
-				pOutput->Write((char *)&byValue, 1);
-
-				byValue = (BYTE)(*pStart);
-				pOutput->Write((char *)&byValue, 1);
-
-				iRunType = typeMixed;
-				pStart = pPos;
-				pMixedEnd = pPos;
-				}
+			unsigned long dwBit;
+			_BitScanForward(&dwBit, dwMask);
+			return iPos + (int)dwBit;
 			}
+
+		iPos += 16;
 		}
 
-	//	Done
+	while (iPos < iLength && pData[iPos] == byValue)
+		iPos++;
 
-	byCode = RUN_CODE_END;
-	pOutput->Write((char *)&byCode, 1);
+	return iPos;
 	}
 
 void UncompressRunLengthByte (IWriteStream *pOutput, IReadBlock *pInput)
 
 //	UncompressRunLengthByte
 //
-//	Expands the input block
+//	Expands the input block. We stop at the end-code (or at the end of the
+//	block, if it is truncated).
 
 	{
-	char *pPos = pInput->GetPointer(0, pInput->GetLength());
+	int iLength = pInput->GetLength();
+	if (iLength < (int)sizeof(DWORD))
+		return;
 
-	//	Read the total size of the uncompressed buffer
+	const BYTE *pPos = (const BYTE *)pInput->GetPointer(0, iLength);
+	const BYTE *pEndPos = pPos + iLength;
+
+	//	Skip the total size of the uncompressed buffer (we don't need it)
 
-	DWORD dwBufferSize = *(DWORD *)pPos;
 	pPos += sizeof(DWORD);
 
 	//	Loop over all the runs
 
-	BYTE byCode = (BYTE)*pPos;
-	while (byCode != RUN_CODE_END)
+	CRunLengthOutput Output(pOutput);
+	while (pEndPos - pPos >= 2 && *pPos != RUN_CODE_END)
 		{
+		int iLen = pPos[1];
+
 		//	Mixed run
 
-		if (byCode == RUN_CODE_MIXED)
+		if (*pPos == RUN_CODE_MIXED)
 			{
-			pPos++;
-
-			int iLen = (BYTE)*pPos++;
-			pOutput->Write(pPos, iLen);
+			pPos += 2;
+			if (pEndPos - pPos < iLen)
+				break;
 
+			memcpy(Output.GetSpace(iLen), pPos, iLen);
 			pPos += iLen;
 			}
-		
-		//	Otherwise, it is a long run and the byte code is the 
+
+		//	Otherwise, it is a long run and the byte code is the
 		//	length of the run.
 
 		else
 			{
-			int iLen = (BYTE)*pPos++;
-			pOutput->WriteChar(*pPos++, iLen);
+			iLen = pPos[0];
+			memset(Output.GetSpace(iLen), pPos[1], iLen);
+			pPos += 2;
 			}
 		}
 	}
+
+void WriteMixedRuns (CRunLengthOutput &Output, const BYTE *pData, int iLength)
+
+//	WriteMixedRuns
+//
+//	Writes the bytes as mixed runs
+
+	{
+	while (iLength > 0)
+		{
+		int iRunLen = Min(iLength, MAX_RUN_LENGTH_BYTE);
+		BYTE *pDest = Output.GetSpace(2 + iRunLen);
+		pDest[0] = RUN_CODE_MIXED;
+		pDest[1] = (BYTE)iRunLen;
+		memcpy(pDest + 2, pData, iRunLen);
+
+		pData += iRunLen;
+		iLength -= iRunLen;
+		}
+	}
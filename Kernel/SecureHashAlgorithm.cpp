@@ -38,34 +38,17 @@
 //	Some basic defines needed by the implementation
 
 typedef unsigned char *POINTER;
-typedef unsigned long int UINT4;
-typedef unsigned char BYTE;
+typedef DWORD UINT4;
 
 //	NOTE: size of digest is based on SHA algorithm. See: SecureHashAlgorithm.cpp
 
 typedef BYTE DIGEST [20];
 
-//	Context block for SHS info
+//	This file has the portable SHA-1 block function. The accelerated ones
+//	(and SHA-256) are in CryptoDigest.cpp, which picks the best one for the
+//	CPU. All hashing goes through CDigestContext.
 
-struct SHA_CTX
-	{
-	UINT4 digest[5];			//	Message digest
-	UINT4 countLo;				//	64-bit count
-	UINT4 countHi;
-	UINT4 data[16];             //	SHS data buffer
-
-	bool bBigEndian;
-	};
-
-/* Message digest functions */
-
-void SHAInit(SHA_CTX *);
-void SHAUpdate(SHA_CTX *, BYTE *buffer, int count);
-void SHAFinal(BYTE *output, SHA_CTX *);
-
-/* sha.c */
-
-static void SHAtoByte(BYTE *output, UINT4 *input, unsigned int len);
+void SHA1CompressScalar (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks);
 
 /* The SHS block size and message digest sizes, in bytes */
 
@@ -138,34 +121,18 @@ static void SHAtoByte(BYTE *output, UINT4 *input, unsigned int len);
 #define subRound(a, b, c, d, e, f, k, data) \
     ( e += ROTL( 5, a ) + f( b, c, d ) + k + data, b = ROTL( 30, b ) )
 
-/* Initialize the SHS values */
-
-void SHAInit(SHA_CTX *shsInfo)
-{
-    shsInfo->bBigEndian = sysIsBigEndian();
-    /* Set the h-vars to their initial values */
-    shsInfo->digest[ 0 ] = h0init;
-    shsInfo->digest[ 1 ] = h1init;
-    shsInfo->digest[ 2 ] = h2init;
-    shsInfo->digest[ 3 ] = h3init;
-    shsInfo->digest[ 4 ] = h4init;
-
-    /* Initialise bit count */
-    shsInfo->countLo = shsInfo->countHi = 0;
-}
-
-
 /* Perform the SHS transformation.  Note that this code, like MD5, seems to
    break some optimizing compilers due to the complexity of the expressions
    and the size of the basic block.  It may be necessary to split it into
    sections, e.g. based on the four subrounds
 
-   Note that this corrupts the shsInfo->data area */
+   The data is a 64-byte block of big-endian words */
 
-static void SHSTransform( UINT4 *digest, UINT4 *data )
+static void SHSTransform( UINT4 *digest, const BYTE *data )
     {
     UINT4 A, B, C, D, E;     /* Local vars */
     UINT4 eData[ 16 ];       /* Expanded data */
+    int i;
 
     /* Set up first buffer and local data buffer */
     A = digest[ 0 ];
@@ -173,7 +140,9 @@ static void SHSTransform( UINT4 *digest, UINT4 *data )
     C = digest[ 2 ];
     D = digest[ 3 ];
     E = digest[ 4 ];
-    memcpy( (POINTER)eData, (POINTER)data, SHS_DATASIZE );
+    for( i = 0; i < 16; i++, data += 4 )
+        eData[ i ] = ( ( UINT4 ) data[ 0 ] << 24 ) | ( ( UINT4 ) data[ 1 ] << 16 ) |
+                     ( ( UINT4 ) data[ 2 ] << 8 ) | ( UINT4 ) data[ 3 ];
 
     /* Heavy mangling, in 4 sub-rounds of 20 interations each. */
     subRound( A, B, C, D, E, f1, K1, eData[  0 ] );
@@ -268,145 +237,34 @@ static void SHSTransform( UINT4 *digest, UINT4 *data )
     digest[ 4 ] += E;
     }
 
-/* When run on a little-endian CPU we need to perform byte reversal on an
-   array of long words. */
-
-static void longReverse(UINT4 *buffer, int byteCount, bool bBigEndian)
-{
-    UINT4 value;
-
-    if (bBigEndian) return;
-    byteCount /= sizeof( UINT4 );
-    while( byteCount-- )
-        {
-        value = *buffer;
-        value = ( ( value & 0xFF00FF00L ) >> 8  ) | \
-                ( ( value & 0x00FF00FFL ) << 8 );
-        *buffer++ = ( value << 16 ) | ( value >> 16 );
-        }
-}
-
-/* Update SHS for a block of data */
-
-void SHAUpdate(SHA_CTX *shsInfo, BYTE *buffer, int count)
-{
-    UINT4 tmp;
-    int dataCount;
-
-    /* Update bitcount */
-    tmp = shsInfo->countLo;
-    if ( ( shsInfo->countLo = tmp + ( ( UINT4 ) count << 3 ) ) < tmp )
-        shsInfo->countHi++;             /* Carry from low to high */
-    shsInfo->countHi += count >> 29;
-
-    /* Get count of bytes already in data */
-    dataCount = ( int ) ( tmp >> 3 ) & 0x3F;
-
-    /* Handle any leading odd-sized chunks */
-    if( dataCount )
-        {
-        BYTE *p = ( BYTE * ) shsInfo->data + dataCount;
-
-        dataCount = SHS_DATASIZE - dataCount;
-        if( count < dataCount )
-            {
-            memcpy( p, buffer, count );
-            return;
-            }
-        memcpy( p, buffer, dataCount );
-        longReverse( shsInfo->data, SHS_DATASIZE, shsInfo->bBigEndian);
-        SHSTransform( shsInfo->digest, shsInfo->data );
-        buffer += dataCount;
-        count -= dataCount;
-        }
-
-    /* Process data in SHS_DATASIZE chunks */
-    while( count >= SHS_DATASIZE )
-        {
-        memcpy( (POINTER)shsInfo->data, (POINTER)buffer, SHS_DATASIZE );
-        longReverse( shsInfo->data, SHS_DATASIZE, shsInfo->bBigEndian );
-        SHSTransform( shsInfo->digest, shsInfo->data );
-        buffer += SHS_DATASIZE;
-        count -= SHS_DATASIZE;
-        }
-
-    /* Handle any remaining bytes of data. */
-    memcpy( (POINTER)shsInfo->data, (POINTER)buffer, count );
-    }
-
-/* Final wrapup - pad to SHS_DATASIZE-byte boundary with the bit pattern
-   1 0* (64-bit count of bits processed, MSB-first) */
-
-void SHAFinal(BYTE *output, SHA_CTX *shsInfo)
-{
-    int count;
-    BYTE *dataPtr;
+void SHA1CompressScalar (DWORD *pState, const BYTE *pData, DWORDLONG dwBlocks)
 
-    /* Compute number of bytes mod 64 */
-    count = ( int ) shsInfo->countLo;
-    count = ( count >> 3 ) & 0x3F;
-
-    /* Set the first char of padding to 0x80.  This is safe since there is
-       always at least one byte free */
-    dataPtr = ( BYTE * ) shsInfo->data + count;
-    *dataPtr++ = 0x80;
-
-    /* Bytes of padding needed to make 64 bytes */
-    count = SHS_DATASIZE - 1 - count;
-
-    /* Pad out to 56 mod 64 */
-    if( count < 8 )
-        {
-        /* Two lots of padding:  Pad the first block to 64 bytes */
-        memset( dataPtr, 0, count );
-        longReverse( shsInfo->data, SHS_DATASIZE, shsInfo->bBigEndian );
-        SHSTransform( shsInfo->digest, shsInfo->data );
-
-        /* Now fill the next block with 56 bytes */
-        memset( (POINTER)shsInfo->data, 0, SHS_DATASIZE - 8 );
-        }
-    else
-        /* Pad block to 56 bytes */
-        memset( dataPtr, 0, count - 8 );
-
-    /* Append length in bits and transform */
-    shsInfo->data[ 14 ] = shsInfo->countHi;
-    shsInfo->data[ 15 ] = shsInfo->countLo;
-
-    longReverse( shsInfo->data, SHS_DATASIZE - 8, shsInfo->bBigEndian );
-    SHSTransform( shsInfo->digest, shsInfo->data );
-
-	/* Output to an array of bytes */
-	SHAtoByte(output, shsInfo->digest, SHS_DIGESTSIZE);
-
-	/* Zeroise sensitive stuff */
-	memset((POINTER)shsInfo, 0, sizeof(shsInfo));
-}
-
-static void SHAtoByte(BYTE *output, UINT4 *input, unsigned int len)
-{	/* Output SHA digest in byte array */
-	unsigned int i, j;
+//	SHA1CompressScalar
+//
+//	Processes whole blocks
 
-	for(i = 0, j = 0; j < len; i++, j += 4) 
 	{
-        output[j+3] = (BYTE)( input[i]        & 0xff);
-        output[j+2] = (BYTE)((input[i] >> 8 ) & 0xff);
-        output[j+1] = (BYTE)((input[i] >> 16) & 0xff);
-        output[j  ] = (BYTE)((input[i] >> 24) & 0xff);
+	while (dwBlocks-- > 0)
+		{
+		SHSTransform(pState, pData);
+		pData += SHS_DATASIZE;
+		}
 	}
-}
 
 //	CDigest ---------------------------------------------------------------------
 
 CDigest::CDigest (IReadBlock &Data) : CIntegerIP(digestLength)
 
 //	CDigest constructor
+//
+//	Throws CException(ERR_MEMORY) if we could not read all of the data.
 
 	{
-	SHA_CTX ctx;
-	SHAInit(&ctx);
-	SHAUpdate(&ctx, (BYTE *)Data.GetPointer(0), Data.GetLength());
-	SHAFinal(GetBytes(), &ctx);
+	CDigestContext Context(digestSHA1);
+	if (Context.Add(Data))
+		throw CException(ERR_MEMORY);
+
+	Context.Final(GetBytes());
 	}
 
 CDigest::CDigest (BYTE *pBytes) : CIntegerIP(digestLength)
@@ -424,12 +282,30 @@ CDigest::CDigest (BYTE *pBytes) : CIntegerIP(digestLength)
 		*pA++ = *pB++;
 	}
 
-void cryptoCreateDigest (IReadBlock &Data, CIntegerIP *retDigest)
+ALERROR cryptoCreateDigest (IReadBlock &Data, CIntegerIP *retDigest)
 	{
-	*retDigest = CDigest(Data);
+	return cryptoCreateDigest(Data, digestSHA1, retDigest);
+	}
+
+ALERROR cryptoCreateDigest (IReadBlock &Data, EDigestAlgorithms iAlgorithm, CIntegerIP *retDigest)
+
+//	cryptoCreateDigest
+//
+//	Creates a digest with the given algorithm. Returns ERR_MEMORY if we could
+//	not read all of the data.
+
+	{
+	ALERROR error;
+
+	CDigestContext Context(iAlgorithm);
+	if (error = Context.Add(Data))
+		return error;
+
+	Context.Final(retDigest);
+	return NOERROR;
 	}
 
-void cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMAC)
+ALERROR cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMAC)
 
 //	cryptoCreateMAC
 //
@@ -439,6 +315,7 @@ void cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMA
 //	See: http://tools.ietf.org/html/rfc2104
 
 	{
+	ALERROR error;
 	int i;
 
 	//	First we need to convert the key to one suitable for the MAC. If the key
@@ -449,10 +326,9 @@ void cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMA
 
 	if (Key.GetLength() > SHS_DATASIZE)
 		{
-		SHA_CTX ctx;
-		SHAInit(&ctx);
-		SHAUpdate(&ctx, (BYTE *)Key.GetBytes(), Key.GetLength());
-		SHAFinal((BYTE *)MACKey, &ctx);
+		CDigestContext KeyContext(digestSHA1);
+		KeyContext.Add(Key.GetBytes(), Key.GetLength());
+		KeyContext.Final(MACKey);
 
 		BYTE *pDest = MACKey + SHS_DIGESTSIZE;
 		BYTE *pDestEnd = MACKey + SHS_DATASIZE;
@@ -487,37 +363,24 @@ void cryptoCreateMAC (IReadBlock &Data, const CIntegerIP &Key, CIntegerIP *retMA
 
 	DIGEST InnerDigest;
 
-	SHA_CTX ctx;
-	SHAInit(&ctx);
-	SHAUpdate(&ctx, InnerPad, SHS_DATASIZE);
-	SHAUpdate(&ctx, (BYTE *)Data.GetPointer(0), Data.GetLength());
-	SHAFinal((BYTE *)InnerDigest, &ctx);
+	CDigestContext Inner(digestSHA1);
+	Inner.Add(InnerPad, SHS_DATASIZE);
+	if (error = Inner.Add(Data))
+		return error;
+
+	Inner.Final(InnerDigest);
 
 	//	Hash outer
 
 	DIGEST MAC;
 
-	SHAInit(&ctx);
-	SHAUpdate(&ctx, OuterPad, SHS_DATASIZE);
-	SHAUpdate(&ctx, InnerDigest, SHS_DIGESTSIZE);
-	SHAFinal((BYTE *)MAC, &ctx);
+	CDigestContext Outer(digestSHA1);
+	Outer.Add(OuterPad, SHS_DATASIZE);
+	Outer.Add(InnerDigest, SHS_DIGESTSIZE);
+	Outer.Final(MAC);
 
 	//	Return
 
 	*retMAC = CIntegerIP(sizeof(MAC), MAC);
-	}
-
-ALERROR fileCreateDigest (const CString &sFilespec, CIntegerIP *retDigest)
-	{
-	ALERROR error;
-
-	CFileReadBlock File(sFilespec);
-	if (error = File.Open())
-		return error;
-
-	cryptoCreateDigest(File, retDigest);
-
-	File.Close();
-
 	return NOERROR;
 	}
@@ -4,6 +4,7 @@
 
 #include "Kernel.h"
 #include <cstring>
+#include <intrin.h>
 
 DWORD sysGetTicksElapsed (DWORD dwTick, DWORD *retdwNow)
 
@@ -22,6 +23,49 @@ DWORD sysGetTicksElapsed (DWORD dwTick, DWORD *retdwNow)
 		return dwNow - dwTick;
 	}
 
+DWORD sysGetCPUFeatures (void)
+
+//	sysGetCPUFeatures
+//
+//	Returns CPU_FEATURE_* flags for the instruction set extensions that we can
+//	use. This may be called before kernelInit; if two threads race on the first
+//	call they compute the same value.
+
+	{
+	static volatile LONG dwFeatures = -1;
+
+	if (dwFeatures == -1)
+		{
+		int Info[4];
+		DWORD dwResult = 0;
+
+		__cpuid(Info, 0);
+		int iMaxLeaf = Info[0];
+
+		if (iMaxLeaf >= 1)
+			{
+			__cpuid(Info, 1);
+			if (Info[3] & (1 << 26))
+				dwResult |= CPU_FEATURE_SSE2;
+			if (Info[2] & (1 << 9))
+				dwResult |= CPU_FEATURE_SSSE3;
+			if (Info[2] & (1 << 19))
+				dwResult |= CPU_FEATURE_SSE41;
+			}
+
+		if (iMaxLeaf >= 7)
+			{
+			__cpuidex(Info, 7, 0);
+			if (Info[1] & (1 << 29))
+				dwResult |= CPU_FEATURE_SHA;
+			}
+
+		::InterlockedExchange(&dwFeatures, (LONG)dwResult);
+		}
+
+	return (DWORD)dwFeatures;
+	}
+
 int sysGetProcessorCount (void)
 
 //	sysGetProcessorCount
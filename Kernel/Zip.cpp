@@ -10,18 +10,61 @@
 #define ZLIB_WINAPI
 #include "..\zlib-1.2.7\zlib.h"
 
-#ifdef ZLIB_H
-//	unzip.h needs _ZLIB_H defined (not ZLIB_H, for some reason)
-#define _ZLIB_H
-#endif
+const int BUFFER_SIZE = 1024 * 1024;
+const DWORD INPUT_CHUNK_SIZE = 64 * 1024 * 1024;
 
-#include "..\zlib-1.2.7\contrib\minizip\unzip.h"
+const DWORD DEFAULT_BLOCK_SIZE = 256 * 1024;
+const DWORD MIN_BLOCK_SIZE = 64 * 1024;
+const DWORD MAX_BLOCK_SIZE = 16 * 1024 * 1024;
+const DWORD DICTIONARY_SIZE = 32 * 1024;
+const int BLOCKS_PER_THREAD = 4;
 
-const int BUFFER_SIZE = 1024 * 1024;
+const BYTE GZIP_OS_CODE = 0x0b;				//	Same as zlib on Win32
 
-bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError);
+struct SDeflateBlock
+	{
+	SDeflateBlock (void) :
+			pInput(NULL),
+			dwLength(0),
+			pDict(NULL),
+			dwDictLength(0),
+			bLast(false),
+			bGzip(false),
+			pOutput(NULL),
+			dwOutputAlloc(0),
+			dwOutput(0),
+			dwCheck(0),
+			bError(false),
+			bInit(false)
+		{ }
+
+	BYTE *pInput;						//	Data to compress
+	DWORD dwLength;
+	BYTE *pDict;						//	Preceding data (may be NULL)
+	DWORD dwDictLength;
+	bool bLast;							//	TRUE if this ends the stream
+	bool bGzip;							//	TRUE if we need a CRC (else Adler)
+
+	BYTE *pOutput;						//	Compressed data (raw deflate)
+	DWORD dwOutputAlloc;
+	DWORD dwOutput;
+	DWORD dwCheck;						//	Checksum of pInput
+	bool bError;
+
+	z_stream zcpr;						//	Reused for every block in this slot
+	bool bInit;
+
+	CThreadPoolLatch Done;
+	};
+
+bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, int iLevel, IWriteStream &Output, CString *retsError);
+bool DeflateParallel (IReadBlock &Data, ECompressionTypes iFormat, const SZipCompressOptions &Options, CThreadPool &Pool, IWriteStream &Output, CString *retsError);
 bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError);
 bool NullCopy (IReadBlock &Data, IWriteStream &Output, CString *retsError);
+static void DeflateBlock (SDeflateBlock &Block);
+static bool FeedInput (IReadBlock &Data, DWORDLONG dwTotal, DWORDLONG &dwPos, z_stream &zcpr);
+static bool WriteDeflateBlock (SDeflateBlock &Block, IWriteStream &Output, DWORD &dwCheck, CString *retsError);
+static bool WriteDeflateHeader (ECompressionTypes iFormat, int iLevel, IWriteStream &Output);
 
 bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError)
 
@@ -30,6 +73,26 @@ bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Out
 //	Compresses a block
 
 	{
+	return zipCompress(Data, iFormat, Output, SZipCompressOptions(), retsError);
+	}
+
+bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, const SZipCompressOptions &Options, CString *retsError)
+
+//	zipCompress
+//
+//	Compresses a block. If we have more than one thread (or the caller gives
+//	us a pool) we compress blocks of the input in parallel and write them out
+//	(in order) as they finish. Either way the result is a single standard
+//	stream that any inflater can read.
+
+	{
+	if (Options.iLevel < -1 || Options.iLevel > 9)
+		{
+		if (retsError)
+			*retsError = CONSTLIT("Invalid compression level.");
+		return false;
+		}
+
 	switch (iFormat)
 		{
 		case compressionNone:
@@ -39,9 +102,41 @@ bool zipCompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Out
 
 		case compressionGzip:
 		case compressionZlib:
-			if (!Deflate(Data, iFormat, Output, retsError))
+			{
+			//	Small blocks aren't worth splitting
+
+			DWORD dwBlockSize = (Options.dwBlockSize ? Max(MIN_BLOCK_SIZE, Min(Options.dwBlockSize, MAX_BLOCK_SIZE)) : DEFAULT_BLOCK_SIZE);
+			bool bParallel = (Data.GetLength64() > (DWORDLONG)dwBlockSize);
+
+			//	Use the caller's pool, if any
+
+			if (bParallel && Options.pPool && Options.pPool->GetThreadCount() > 1)
+				{
+				if (!DeflateParallel(Data, iFormat, Options, *Options.pPool, Output, retsError))
+					return false;
+				break;
+				}
+
+			//	Otherwise, start our own
+
+			int iThreads = (Options.iThreads > 0 ? Options.iThreads : ::sysGetProcessorCount());
+			if (bParallel && Options.pPool == NULL && iThreads > 1)
+				{
+				CThreadPool Pool;
+				if (Pool.Boot(iThreads))
+					{
+					if (!DeflateParallel(Data, iFormat, Options, Pool, Output, retsError))
+						return false;
+					break;
+					}
+				}
+
+			//	Single-threaded
+
+			if (!Deflate(Data, iFormat, Options.iLevel, Output, retsError))
 				return false;
 			break;
+			}
 
 		default:
 			ASSERT(false);
@@ -89,7 +184,7 @@ bool zipDecompress (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &O
 		}
 	}
 
-bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError)
+bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, int iLevel, IWriteStream &Output, CString *retsError)
 	{
 	//	Initialize library
 
@@ -97,10 +192,10 @@ bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 	utlMemSet(&zcpr, sizeof(zcpr), '\0');
 
 	if (iFormat == compressionZlib)
-		deflateInit(&zcpr, Z_DEFAULT_COMPRESSION);
+		deflateInit(&zcpr, iLevel);
 	else if (iFormat == compressionGzip)
 		deflateInit2(&zcpr,
-				Z_DEFAULT_COMPRESSION,
+				iLevel,
 				Z_DEFLATED,
 				0x1f,		//	Bit 0x10 means gzip header
 				8,
@@ -117,24 +212,31 @@ bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 
 	BYTE *pBuffer = new BYTE [BUFFER_SIZE];
 
-	//	Compress
-
-	DWORD dwSourceLeft = Data.GetLength();
-	BYTE *pSource = (BYTE *)Data.GetPointer(0);
+	//	We read the source front to back in chunks, so blocks larger than
+	//	4 GB (and windowed mappings) work.
 
-	//	The entire source is available
+	DWORDLONG dwTotal = Data.GetLength64();
+	DWORDLONG dwPos = 0;
+	Data.SetAccessHint(IReadBlock::accessSequential);
 
-	zcpr.next_in = pSource;
-	zcpr.avail_in = dwSourceLeft;
-
-	int iWritten = 0;
 	int ret;
 	while (true)
 		{
+		if (zcpr.avail_in == 0 && !FeedInput(Data, dwTotal, dwPos, zcpr))
+			{
+			deflateEnd(&zcpr);
+			delete [] pBuffer;
+			if (retsError)
+				*retsError = CONSTLIT("Unable to read input.");
+			return false;
+			}
+
+		int iFlush = (dwPos < dwTotal ? Z_NO_FLUSH : Z_FINISH);
+
 		zcpr.next_out = pBuffer;
 		zcpr.avail_out = BUFFER_SIZE;
 
-		ret = deflate(&zcpr, Z_FINISH);
+		ret = deflate(&zcpr, iFlush);
 
 		//	If error, then fail
 
@@ -151,8 +253,7 @@ bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 
 		//	Write out the compressed data
 
-		int iChunk = zcpr.total_out - iWritten;
-		iWritten += iChunk;
+		int iChunk = BUFFER_SIZE - (int)zcpr.avail_out;
 
 		if (Output.Write((char *)pBuffer, iChunk) != NOERROR)
 			{
@@ -163,6 +264,11 @@ bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 			return false;
 			}
 
+		//	If we have more input, then continue
+
+		if (iFlush == Z_NO_FLUSH && ret != Z_STREAM_END)
+			continue;
+
 		//	If we need more output buffer, then continue
 
 		if (ret == Z_BUF_ERROR
@@ -181,6 +287,211 @@ bool Deflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 	return true;
 	}
 
+bool DeflateParallel (IReadBlock &Data, ECompressionTypes iFormat, const SZipCompressOptions &Options, CThreadPool &Pool, IWriteStream &Output, CString *retsError)
+
+//	DeflateParallel
+//
+//	Compresses independent blocks on the pool (as pigz does). Each block is a
+//	raw deflate stream primed with the last 32 KB of the block before it (so
+//	we lose very little compression) and ended with a sync flush, which leaves
+//	it on a byte boundary. Concatenated, the blocks are a single deflate
+//	stream. We add the header and the trailer ourselves; the checksum of the
+//	whole input is combined from the checksums of the blocks.
+//
+//	We keep only a few blocks per thread in flight and write each one out as
+//	soon as it (and all blocks before it) are done.
+
+	{
+	int i;
+
+	bool bGzip = (iFormat == compressionGzip);
+	DWORD dwBlockSize = (Options.dwBlockSize ? Max(MIN_BLOCK_SIZE, Min(Options.dwBlockSize, MAX_BLOCK_SIZE)) : DEFAULT_BLOCK_SIZE);
+	DWORDLONG dwTotal = Data.GetLength64();
+	Data.SetAccessHint(IReadBlock::accessSequential);
+
+	//	Allocate the slots. Each slot keeps its deflate state and output
+	//	buffer from block to block. The output buffer is big enough for an
+	//	incompressible block plus the flush marker.
+
+	int iSlots = BLOCKS_PER_THREAD * Pool.GetThreadCount();
+	SDeflateBlock *pSlots = new SDeflateBlock [iSlots];
+	BYTE *pDictBuffer = new BYTE [DICTIONARY_SIZE];
+
+	CString sError;
+	bool bOK = true;
+	for (i = 0; i < iSlots; i++)
+		{
+		SDeflateBlock &Slot = pSlots[i];
+		utlMemSet(&Slot.zcpr, sizeof(Slot.zcpr), '\0');
+		if (deflateInit2(&Slot.zcpr, Options.iLevel, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			{
+			bOK = false;
+			break;
+			}
+
+		Slot.bInit = true;
+		Slot.bGzip = bGzip;
+		Slot.dwOutputAlloc = dwBlockSize + (dwBlockSize >> 10) + 256;
+		Slot.pOutput = new BYTE [Slot.dwOutputAlloc];
+		}
+
+	if (bOK && !WriteDeflateHeader(iFormat, Options.iLevel, Output))
+		{
+		sError = CONSTLIT("Unable to write to output.");
+		bOK = false;
+		}
+
+	//	Blocks are numbered in the order we submit them; slot = block % iSlots.
+
+	int iSubmitted = 0;
+	int iWritten = 0;
+	DWORD dwCheck = (bGzip ? crc32(0, Z_NULL, 0) : adler32(0, Z_NULL, 0));
+
+	//	We work a chunk of the input at a time (so windowed mappings work). We
+	//	have to finish every block in a chunk before we ask for the next one,
+	//	since that might unmap this one.
+
+	DWORDLONG dwPos = 0;
+	while (bOK && dwPos < dwTotal)
+		{
+		DWORD dwChunk = (DWORD)Min(dwTotal - dwPos, (DWORDLONG)INPUT_CHUNK_SIZE);
+		BYTE *pChunk = (BYTE *)Data.GetPointer64(dwPos, dwChunk);
+		if (pChunk == NULL)
+			{
+			sError = CONSTLIT("Unable to read input.");
+			bOK = false;
+			break;
+			}
+
+		DWORD dwOffset = 0;
+		while (bOK && dwOffset < dwChunk)
+			{
+			//	Write out finished blocks (in order). If all slots are busy, we
+			//	wait for the oldest one.
+
+			while (iSubmitted - iWritten >= iSlots || (iSubmitted > iWritten && pSlots[iWritten % iSlots].Done.IsDone()))
+				{
+				SDeflateBlock &Oldest = pSlots[iWritten % iSlots];
+				Pool.Wait(Oldest.Done);
+				iWritten++;
+
+				if (!WriteDeflateBlock(Oldest, Output, dwCheck, &sError))
+					{
+					bOK = false;
+					break;
+					}
+				}
+
+			if (!bOK)
+				break;
+
+			//	Set up the next block
+
+			SDeflateBlock &Block = pSlots[iSubmitted % iSlots];
+			Block.pInput = pChunk + dwOffset;
+			Block.dwLength = Min(dwBlockSize, dwChunk - dwOffset);
+			Block.bLast = (dwPos + dwOffset + Block.dwLength == dwTotal);
+
+			if (dwOffset > 0)
+				{
+				Block.dwDictLength = Min(dwOffset, DICTIONARY_SIZE);
+				Block.pDict = Block.pInput - Block.dwDictLength;
+				}
+			else if (dwPos > 0)
+				{
+				Block.dwDictLength = DICTIONARY_SIZE;
+				Block.pDict = pDictBuffer;
+				}
+			else
+				{
+				Block.dwDictLength = 0;
+				Block.pDict = NULL;
+				}
+
+			SDeflateBlock *pBlock = &Block;
+			Pool.AddFunction([pBlock]() { DeflateBlock(*pBlock); }, &Block.Done);
+			iSubmitted++;
+
+			dwOffset += Block.dwLength;
+			}
+
+		//	Finish the chunk
+
+		while (iWritten < iSubmitted)
+			{
+			SDeflateBlock &Oldest = pSlots[iWritten % iSlots];
+			Pool.Wait(Oldest.Done);
+			iWritten++;
+
+			if (bOK && !WriteDeflateBlock(Oldest, Output, dwCheck, &sError))
+				bOK = false;
+			}
+
+		//	Remember the end of this chunk to prime the next one
+
+		if (bOK && dwChunk >= DICTIONARY_SIZE)
+			utlMemCopy((char *)pChunk + dwChunk - DICTIONARY_SIZE, (char *)pDictBuffer, DICTIONARY_SIZE);
+
+		dwPos += dwChunk;
+		}
+
+	//	Write the trailer
+
+	if (bOK)
+		{
+		BYTE Trailer[8];
+		int iTrailer;
+
+		//	Gzip: CRC-32 and the length mod 2^32 (both little-endian)
+
+		if (bGzip)
+			{
+			DWORD dwSize = (DWORD)dwTotal;
+			for (i = 0; i < 4; i++)
+				{
+				Trailer[i] = (BYTE)(dwCheck >> (8 * i));
+				Trailer[4 + i] = (BYTE)(dwSize >> (8 * i));
+				}
+			iTrailer = 8;
+			}
+
+		//	Zlib: Adler-32 (big-endian)
+
+		else
+			{
+			for (i = 0; i < 4; i++)
+				Trailer[i] = (BYTE)(dwCheck >> (24 - 8 * i));
+			iTrailer = 4;
+			}
+
+		if (Output.Write((char *)Trailer, iTrailer) != NOERROR)
+			{
+			sError = CONSTLIT("Unable to write to output.");
+			bOK = false;
+			}
+		}
+	else if (sError.IsBlank())
+		sError = CONSTLIT("Unable to initialize deflate.");
+
+	//	Done
+
+	for (i = 0; i < iSlots; i++)
+		{
+		if (pSlots[i].bInit)
+			deflateEnd(&pSlots[i].zcpr);
+		if (pSlots[i].pOutput)
+			delete [] pSlots[i].pOutput;
+		}
+
+	delete [] pSlots;
+	delete [] pDictBuffer;
+
+	if (!bOK && retsError)
+		*retsError = sError;
+
+	return bOK;
+	}
+
 bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output, CString *retsError)
 	{
 	//	Initialize library
@@ -205,25 +516,31 @@ bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 
 	BYTE *pBuffer = new BYTE [BUFFER_SIZE];
 
-	//	Compress
+	//	We read the source front to back in chunks, so blocks larger than
+	//	4 GB (and windowed mappings) work.
 
-	DWORD dwSourceLeft = Data.GetLength();
-	BYTE *pSource = (BYTE *)Data.GetPointer(0);
-
-	//	The entire source is available
-
-	zcpr.next_in = pSource;
-	zcpr.avail_in = dwSourceLeft;
+	DWORDLONG dwTotal = Data.GetLength64();
+	DWORDLONG dwPos = 0;
+	Data.SetAccessHint(IReadBlock::accessSequential);
 
 	int ret;
-	int iWritten = 0;
-
 	while (true)
 		{
+		if (zcpr.avail_in == 0 && !FeedInput(Data, dwTotal, dwPos, zcpr))
+			{
+			inflateEnd(&zcpr);
+			delete [] pBuffer;
+			if (retsError)
+				*retsError = CONSTLIT("Unable to read input.");
+			return false;
+			}
+
+		int iFlush = (dwPos < dwTotal ? Z_NO_FLUSH : Z_FINISH);
+
 		zcpr.next_out = pBuffer;
 		zcpr.avail_out = BUFFER_SIZE;
 
-		ret = inflate(&zcpr, Z_FINISH);
+		ret = inflate(&zcpr, iFlush);
 
 		//	If error, then fail
 
@@ -240,8 +557,7 @@ bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 
 		//	Write out the compressed data
 
-		int iChunk = zcpr.total_out - iWritten;
-		iWritten += iChunk;
+		int iChunk = BUFFER_SIZE - (int)zcpr.avail_out;
 
 		if (Output.Write((char *)pBuffer, iChunk) != NOERROR)
 			{
@@ -252,6 +568,11 @@ bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 			return false;
 			}
 
+		//	If we have more input, then continue
+
+		if (iFlush == Z_NO_FLUSH && ret != Z_STREAM_END)
+			continue;
+
 		//	If we need more output buffer, then continue
 
 		if (ret == Z_BUF_ERROR
@@ -272,12 +593,172 @@ bool Inflate (IReadBlock &Data, ECompressionTypes iFormat, IWriteStream &Output,
 
 bool NullCopy (IReadBlock &Data, IWriteStream &Output, CString *retsError)
 	{
-	if (Output.Write(Data.GetPointer(0), Data.GetLength()) != NOERROR)
+	DWORDLONG dwTotal = Data.GetLength64();
+	DWORDLONG dwPos = 0;
+	Data.SetAccessHint(IReadBlock::accessSequential);
+
+	while (dwPos < dwTotal)
+		{
+		DWORD dwChunk = (DWORD)Min(dwTotal - dwPos, (DWORDLONG)INPUT_CHUNK_SIZE);
+		char *pSource = Data.GetPointer64(dwPos, dwChunk);
+		if (pSource == NULL
+				|| Output.Write(pSource, (int)dwChunk) != NOERROR)
+			{
+			if (retsError)
+				*retsError = CONSTLIT("Unable to copy data to output.");
+			return false;
+			}
+
+		dwPos += dwChunk;
+		}
+
+	return true;
+	}
+
+void DeflateBlock (SDeflateBlock &Block)
+
+//	DeflateBlock
+//
+//	Compresses one block (on a pool thread). All blocks except the last end
+//	with a sync flush; the last one ends the deflate stream.
+
+	{
+	z_stream &zcpr = Block.zcpr;
+
+	Block.bError = false;
+	Block.dwOutput = 0;
+	Block.dwCheck = (Block.bGzip ? crc32(0, Z_NULL, 0) : adler32(0, Z_NULL, 0));
+
+	if (deflateReset(&zcpr) != Z_OK
+			|| (Block.pDict && deflateSetDictionary(&zcpr, Block.pDict, Block.dwDictLength) != Z_OK))
+		{
+		Block.bError = true;
+		return;
+		}
+
+	zcpr.next_in = Block.pInput;
+	zcpr.avail_in = Block.dwLength;
+	zcpr.next_out = Block.pOutput;
+	zcpr.avail_out = Block.dwOutputAlloc;
+
+	//	The output buffer is big enough for the whole block, so if we still
+	//	have output pending, something went wrong.
+
+	int ret = deflate(&zcpr, (Block.bLast ? Z_FINISH : Z_SYNC_FLUSH));
+	if (Block.bLast ? (ret != Z_STREAM_END) : (ret != Z_OK || zcpr.avail_in != 0 || zcpr.avail_out == 0))
+		{
+		Block.bError = true;
+		return;
+		}
+
+	Block.dwOutput = Block.dwOutputAlloc - zcpr.avail_out;
+
+	//	Checksum
+
+	if (Block.bGzip)
+		Block.dwCheck = crc32(Block.dwCheck, Block.pInput, Block.dwLength);
+	else
+		Block.dwCheck = adler32(Block.dwCheck, Block.pInput, Block.dwLength);
+	}
+
+bool FeedInput (IReadBlock &Data, DWORDLONG dwTotal, DWORDLONG &dwPos, z_stream &zcpr)
+
+//	FeedInput
+//
+//	Points the stream at the next chunk of input (if any). We keep chunks
+//	well under 4 GB because zlib's counts are 32-bit. Returns false if the
+//	block cannot give us a pointer to the chunk.
+
+	{
+	if (dwPos >= dwTotal)
+		return true;
+
+	DWORD dwChunk = (DWORD)Min(dwTotal - dwPos, (DWORDLONG)INPUT_CHUNK_SIZE);
+	BYTE *pSource = (BYTE *)Data.GetPointer64(dwPos, dwChunk);
+	if (pSource == NULL)
+		return false;
+
+	zcpr.next_in = pSource;
+	zcpr.avail_in = dwChunk;
+	dwPos += dwChunk;
+
+	return true;
+	}
+
+bool WriteDeflateBlock (SDeflateBlock &Block, IWriteStream &Output, DWORD &dwCheck, CString *retsError)
+
+//	WriteDeflateBlock
+//
+//	Writes out a finished block and adds its checksum to dwCheck.
+
+	{
+	if (Block.bError)
+		{
+		if (retsError)
+			*retsError = CONSTLIT("Error in deflate.");
+		return false;
+		}
+
+	if (Output.Write((char *)Block.pOutput, (int)Block.dwOutput) != NOERROR)
 		{
 		if (retsError)
-			*retsError = CONSTLIT("Unable to copy data to output.");
+			*retsError = CONSTLIT("Unable to write to output.");
 		return false;
 		}
 
+	if (Block.bGzip)
+		dwCheck = crc32_combine(dwCheck, Block.dwCheck, Block.dwLength);
+	else
+		dwCheck = adler32_combine(dwCheck, Block.dwCheck, Block.dwLength);
+
 	return true;
 	}
+
+bool WriteDeflateHeader (ECompressionTypes iFormat, int iLevel, IWriteStream &Output)
+
+//	WriteDeflateHeader
+//
+//	Writes the same header that zlib would for the given format and level.
+
+	{
+	if (iFormat == compressionGzip)
+		{
+		BYTE Header[10];
+		Header[0] = 0x1f;				//	Magic
+		Header[1] = 0x8b;
+		Header[2] = Z_DEFLATED;			//	Method
+		Header[3] = 0;					//	Flags
+		Header[4] = 0;					//	Modification time (none)
+		Header[5] = 0;
+		Header[6] = 0;
+		Header[7] = 0;
+		Header[8] = (BYTE)(iLevel == 9 ? 2 : (iLevel >= 0 && iLevel < 2 ? 4 : 0));
+		Header[9] = GZIP_OS_CODE;
+
+		return (Output.Write((char *)Header, sizeof(Header)) == NOERROR);
+		}
+	else
+		{
+		//	32 KB window, deflate; the level bits are only informational.
+		//	The check bits make the header a multiple of 31.
+
+		DWORD dwLevelFlags;
+		if (iLevel >= 0 && iLevel < 2)
+			dwLevelFlags = 0;
+		else if (iLevel >= 2 && iLevel < 6)
+			dwLevelFlags = 1;
+		else if (iLevel == 6 || iLevel == -1)
+			dwLevelFlags = 2;
+		else
+			dwLevelFlags = 3;
+
+		DWORD dwHeader = (0x78 << 8) | (dwLevelFlags << 6);
+		dwHeader += 31 - (dwHeader % 31);
+
+		BYTE Header[2];
+		Header[0] = (BYTE)(dwHeader >> 8);
+		Header[1] = (BYTE)dwHeader;
+
+		return (Output.Write((char *)Header, sizeof(Header)) == NOERROR);
+		}
+	}
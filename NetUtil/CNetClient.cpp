@@ -55,6 +55,7 @@ ALERROR CNetClient::Connect (const CString &sHost, const CString &sService, cons
 	m_hQuit = CreateEvent(NULL, TRUE, FALSE, NULL);
 	m_hReadDone = CreateEvent(NULL, TRUE, FALSE, NULL);
 	m_hWriteDone = CreateEvent(NULL, TRUE, FALSE, NULL);
+	m_hSendData = CreateEvent(NULL, TRUE, FALSE, NULL);
 
 	//	Start our thread running.
 
@@ -90,8 +91,15 @@ void CNetClient::Disconnect (void)
 		CloseHandle(m_hThread);
 		CloseHandle(m_hReadDone);
 		CloseHandle(m_hWriteDone);
+		CloseHandle(m_hSendData);
 		CloseHandle(m_hQuit);
 
+		//	Free any work that we never got to
+
+		WorkStruct *pWork;
+		while (m_Queue.TryDequeue(&pWork))
+			delete pWork;
+
 		m_pNotify = NULL;
 		}
 	}
@@ -104,17 +112,16 @@ ALERROR CNetClient::SendData (const CString &sMessage)
 //	the data has been successfully sent.
 
 	{
-	ALERROR error;
 	WorkStruct *pWork = new WorkStruct;
 
 	pWork->Type = workSend;
 	pWork->sData = sMessage;
 
-	if (error = m_Queue.EnqueueObject((CObject *)pWork))
-		{
-		delete pWork;
-		return error;
-		}
+	//	The queue does not lock, so we can be called from any thread. The
+	//	event wakes up the client thread.
+
+	m_Queue.Enqueue(pWork);
+	SetEvent(m_hSendData);
 
 	return NOERROR;
 	}
@@ -247,7 +254,7 @@ DWORD CNetClient::ClientThread (void)
 	const int EVENT_WRITEDONE = 3;			//	Write complete
 
 	hEvents[EVENT_QUIT] = m_hQuit;
-	hEvents[EVENT_SENDDATA] = m_Queue.GetQueueEvent();
+	hEvents[EVENT_SENDDATA] = m_hSendData;
 	hEvents[EVENT_READDONE] = m_hReadDone;
 	hEvents[EVENT_WRITEDONE] = m_hWriteDone;
 
@@ -294,10 +301,20 @@ DWORD CNetClient::ClientThread (void)
 				//	If we're not currently writing data and we've
 				//	got stuff to write out then begin an overlapped I/O
 
-				CObject *pObj;
-				if (!bWritingData && (pObj = m_Queue.DequeueObject()))
+				//	If the queue is empty, reset the event and check again
+				//	(in case SendData added something in between).
+
+				WorkStruct *pWork = NULL;
+				if (!bWritingData 
+						&& !m_Queue.TryDequeue(&pWork))
+					{
+					ResetEvent(m_hSendData);
+					if (!m_Queue.TryDequeue(&pWork))
+						pWork = NULL;
+					}
+
+				if (pWork)
 					{
-					WorkStruct *pWork = (WorkStruct *)pObj;
 					sWriteBuffer = pWork->sData;
 					delete pWork;
 
@@ -316,13 +333,13 @@ DWORD CNetClient::ClientThread (void)
 					bWritingData = true;
 					}
 
-				//	HACK: If we're busy writing data then we need
-				//	to reset the SENDDATA event because we don't want
-				//	to handle it until were done writing
+				//	If we're busy writing data then we reset the SENDDATA
+				//	event because we don't want to handle it until we're
+				//	done writing. WRITEDONE will bring us back here.
 
 				else if (bWritingData)
 					{
-					ResetEvent(m_Queue.GetQueueEvent());
+					ResetEvent(m_hSendData);
 					}
 
 				break;
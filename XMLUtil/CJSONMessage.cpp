@@ -48,8 +48,7 @@ ALERROR CJSONMessage::EncodeToBuffer (IWriteStream *pOutput) const
 
 	{
 	Serialize();
-	pOutput->Write(m_Serialized.GetPointer(), m_Serialized.GetLength());
-	return NOERROR;
+	return m_Serialized.WriteToStream(pOutput);
 	}
 
 DWORD CJSONMessage::GetMediaLength (void) const
@@ -80,7 +80,7 @@ CJSONValue::CJSONValue (const CString &sValue, bool bToUTF8)
 			{
 			//	Otherwise, we encode
 
-			CMemoryWriteStream Output;
+			CSegmentedWriteStream Output;
 			if (Output.Create() != NOERROR)
 				m_pValue = CString::INTGetStorage(CONSTLIT("Out of memory"));
 			else
@@ -100,7 +100,7 @@ CJSONValue::CJSONValue (const CString &sValue, bool bToUTF8)
 					pPos++;
 					}
 
-				m_pValue = CString::INTGetStorage(CString(Output.GetPointer(), Output.GetLength()));
+				m_pValue = CString::INTGetStorage(Output.TakeAsString());
 				}
 			}
 		}
@@ -167,7 +167,7 @@ CString CJSONValue::AsCP1252 (void) const
 
 	//	Convert
 
-	CMemoryWriteStream Output;
+	CSegmentedWriteStream Output;
 	if (Output.Create() != NOERROR)
 		return CONSTLIT("Out of memory");
 	else
@@ -376,7 +376,7 @@ CString CJSONValue::AsCP1252 (void) const
 			pPos++;
 			}
 
-		return CString(Output.GetPointer(), Output.GetLength());
+		return Output.TakeAsString();
 		}
 	}
 
@@ -172,13 +172,10 @@ CString CXMLElement::ConvertToString (void)
 //	Convert to a string.
 
 	{
-	CMemoryWriteStream Stream;
-	if (Stream.Create() != NOERROR)
-		return NULL_STR;
-
+	CSegmentedWriteStream Stream;
 	WriteToStream(&Stream);
 
-	return CString(Stream.GetPointer(), Stream.GetLength());
+	return Stream.TakeAsString();
 	}
 
 ALERROR CXMLElement::DeleteSubElement (int iIndex)
@@ -449,7 +449,7 @@ CJSONParser::ETokens CJSONParser::ParseString (CJSONValue *retValue)
 //	Parse a JSON string
 
 	{
-	CMemoryWriteStream Stream(4096);
+	CSegmentedWriteStream Stream;
 	if (Stream.Create() != NOERROR)
 		{
 		m_sError = CONSTLIT("Out of memory.");
@@ -540,7 +540,7 @@ CJSONParser::ETokens CJSONParser::ParseString (CJSONValue *retValue)
 
 	//	Done
 
-	retValue->TakeHandoff(CJSONValue(strUTF8ToANSI(CString(Stream.GetPointer(), Stream.GetLength()))));
+	retValue->TakeHandoff(CJSONValue(strUTF8ToANSI(Stream.TakeAsString())));
 	return tkValue;
 	}
 
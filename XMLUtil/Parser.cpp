@@ -49,6 +49,8 @@ enum StateTypes
 
 #define STR_DOCTYPE								CONSTLIT("DOCTYPE")
 
+const int COPY_CHUNK_SIZE =						16 * 1024 * 1024;
+
 static TStaticStringTable<TStaticStringEntry<SConstString>, 27> STD_ENTITY_TABLE = {
 	"Aacute",		CONSTDEFS(""),
 	"Eacute",		CONSTDEFS(""),
@@ -99,6 +101,7 @@ struct ParserCtx
 
 		char *pPos;
 		char *pEndPos;
+		CString m_sCopy;				//	Our copy of the stream, if we couldn't point into it
 
 		CSymbolTable EntityTable;
 
@@ -128,8 +131,39 @@ ParserCtx::ParserCtx (IReadBlock *pStream, IXMLParserController *pController) :
 		m_bParseRootTag(false),
 		m_bNoTagCharCheck(false)
 	{
-	pPos = pStream->GetPointer(0, pStream->GetLength());
-	pEndPos = pPos + pStream->GetLength();
+	//	We scan the whole stream once, front to back.
+
+	pStream->SetAccessHint(IReadBlock::accessSequential);
+	int iLength = pStream->GetLength();
+	pPos = pStream->GetPointer(0, iLength);
+
+	//	If the block cannot give us a contiguous pointer (e.g., a windowed
+	//	mapping of a large file on 32-bit builds) we copy it in pieces.
+
+	if (pPos == NULL && iLength > 0)
+		{
+		pPos = m_sCopy.GetWritePointer(iLength);
+
+		int iOffset = 0;
+		while (iOffset < iLength)
+			{
+			int iChunk = Min(iLength - iOffset, COPY_CHUNK_SIZE);
+			char *pSrc = pStream->GetPointer(iOffset, iChunk);
+			if (pSrc == NULL)
+				{
+				//	Treat it as empty; the parse fails.
+
+				m_sCopy = NULL_STR;
+				pPos = NULL;
+				break;
+				}
+
+			utlMemCopy(pSrc, pPos + iOffset, iChunk);
+			iOffset += iChunk;
+			}
+		}
+
+	pEndPos = (pPos ? pPos + iLength : NULL);
 	pElement = NULL;
 	iToken = tkEOF;
 	iLine = 1;
@@ -193,6 +227,8 @@ ALERROR CXMLElement::ParseXML (IReadBlock &Stream, const SParseOptions &Options,
 //	Parses the block and returns an allocated XML element.
 
 	{
+	PROFILE_ZONE("CXMLElement::ParseXML");
+
 	ALERROR error;
 
 	//	Open the stream